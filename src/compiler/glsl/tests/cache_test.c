@@ -34,9 +34,14 @@
 #include <limits.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "util/mesa-sha1.h"
 #include "util/disk_cache.h"
+#include "util/disk_cache_pack.h"
+#include "util/macros.h"
 
 bool error = false;
 
@@ -493,6 +498,266 @@ test_put_key_and_get_key(void)
 
    disk_cache_destroy(cache);
 }
+
+static void
+test_compression(void)
+{
+   static const char *modes[] = { "fast", "lz4", "best" };
+   struct disk_cache *cache;
+   char *data, *result;
+   uint8_t key[20];
+   size_t size;
+
+   data = malloc(64 * 1024);
+   for (unsigned i = 0; i < 64 * 1024; i++)
+      data[i] = i % 251 + i / 4096;
+
+   for (unsigned i = 0; i < ARRAY_SIZE(modes); i++) {
+      setenv("MESA_GLSL_CACHE_COMPRESSION", modes[i], 1);
+      cache = disk_cache_create("test", "make_check", 0);
+
+      data[0] = i;
+      disk_cache_compute_key(cache, data, 64 * 1024, key);
+      disk_cache_put(cache, key, data, 64 * 1024, NULL);
+
+      wait_until_file_written(cache, key);
+
+      result = disk_cache_get(cache, key, &size);
+      expect_equal(size, 64 * 1024, "disk_cache_get with each codec (size)");
+      expect_true(result && memcmp(result, data, size) == 0,
+                  "disk_cache_get with each codec (data)");
+      free(result);
+
+      disk_cache_destroy(cache);
+   }
+
+   unsetenv("MESA_GLSL_CACHE_COMPRESSION");
+   free(data);
+}
+
+static void
+test_memory_cache(void)
+{
+   struct disk_cache *cache;
+   struct disk_cache_stats stats;
+   char blob[] = "This is a blob of thirty-seven bytes";
+   uint8_t blob_key[20];
+   uint8_t *one_KB;
+   uint8_t one_KB_key[20];
+   char *result;
+   size_t size;
+
+   setenv("MESA_GLSL_CACHE_MEMORY_SIZE", "1K", 1);
+   cache = disk_cache_create("test", "make_check", 0);
+
+   disk_cache_compute_key(cache, blob, sizeof(blob), blob_key);
+   disk_cache_put(cache, blob_key, blob, sizeof(blob), NULL);
+
+   /* Served from memory, without waiting for the put thread. */
+   result = disk_cache_get(cache, blob_key, &size);
+   expect_equal_str(blob, result, "disk_cache_get from memory (pointer)");
+   expect_equal(size, sizeof(blob), "disk_cache_get from memory (size)");
+   free(result);
+
+   disk_cache_get_stats(cache, &stats);
+   expect_equal(stats.mem_hits, 1, "memory cache hits");
+   expect_equal(stats.mem_hit_bytes, sizeof(blob), "memory cache hit bytes");
+   expect_equal(stats.mem_misses, 0, "memory cache misses");
+   expect_equal(stats.mem_size, sizeof(blob), "memory cache size");
+
+   /* A 1K item takes all the room, the blob then comes from disk. */
+   one_KB = calloc(1, 1024);
+   disk_cache_compute_key(cache, one_KB, 1024, one_KB_key);
+   disk_cache_put(cache, one_KB_key, one_KB, 1024, NULL);
+   free(one_KB);
+
+   disk_cache_get_stats(cache, &stats);
+   expect_equal(stats.mem_size, 1024, "memory cache size after eviction");
+
+   wait_until_file_written(cache, blob_key);
+
+   disk_cache_get_stats(cache, &stats);
+   expect_true(stats.mem_misses > 0, "memory cache miss after eviction");
+   expect_equal(stats.disk_hits, 1, "disk hit after memory cache eviction");
+   expect_equal(stats.mem_size, sizeof(blob),
+                "memory cache size after disk hit");
+
+   disk_cache_destroy(cache);
+
+   unsetenv("MESA_GLSL_CACHE_MEMORY_SIZE");
+}
+
+#define PACK_TEST_DIR CACHE_TEST_TMP "/pack"
+#define PACK_TEST_MAX_SIZE (64 * 1024)
+#define PACK_TEST_ITEM_SIZE 1000
+
+static void
+pack_test_item(unsigned i, cache_key key, uint8_t *data)
+{
+   memset(key, 0, CACHE_KEY_SIZE);
+   memcpy(key, &i, sizeof(i));
+   memset(data, i & 0xff, PACK_TEST_ITEM_SIZE);
+}
+
+/* Returns whether the pack holds the data of item i. */
+static bool
+pack_has_item(struct disk_cache_pack *pack, unsigned i)
+{
+   uint8_t data[PACK_TEST_ITEM_SIZE];
+   const void *entry;
+   cache_key key;
+   size_t size;
+   bool found;
+
+   pack_test_item(i, key, data);
+   entry = disk_cache_pack_get(pack, key, &size);
+   if (!entry)
+      return false;
+
+   found = size == sizeof(data) && memcmp(entry, data, size) == 0;
+   disk_cache_pack_release(pack);
+   return found;
+}
+
+static void
+pack_put_item(struct disk_cache_pack *pack, unsigned i)
+{
+   uint8_t data[PACK_TEST_ITEM_SIZE];
+   cache_key key;
+
+   pack_test_item(i, key, data);
+   disk_cache_pack_put(pack, key, data, sizeof(data));
+}
+
+/* Files of another version of the pack, which processes running it may
+ * still be reading, are replaced and left alone.
+ */
+static void
+test_pack_other_version(void)
+{
+   static const uint32_t header[4] = { 0x4b41504d, 0xdead };
+   struct disk_cache_pack *pack;
+   uint32_t version = 0;
+   struct stat sb;
+   int idx_fd, pack_fd;
+
+   mkdir(PACK_TEST_DIR, 0755);
+
+   idx_fd = open(PACK_TEST_DIR "/pack.idx", O_RDWR | O_CREAT | O_TRUNC, 0644);
+   pack_fd = open(PACK_TEST_DIR "/pack", O_RDWR | O_CREAT | O_TRUNC, 0644);
+   expect_true(idx_fd != -1 && pack_fd != -1, "create other version pack");
+   expect_true(pwrite(idx_fd, header, sizeof(header), 0) == sizeof(header) &&
+               ftruncate(idx_fd, 4096) == 0 &&
+               pwrite(pack_fd, header, sizeof(header), 0) == sizeof(header) &&
+               ftruncate(pack_fd, 4096) == 0,
+               "write other version pack");
+
+   pack = disk_cache_pack_open(PACK_TEST_DIR, PACK_TEST_MAX_SIZE);
+   expect_non_null(pack, "disk_cache_pack_open over another version");
+   if (pack) {
+      pack_put_item(pack, 0);
+      expect_true(pack_has_item(pack, 0), "pack over another version works");
+      disk_cache_pack_close(pack);
+   }
+
+   expect_true(pread(idx_fd, &version, sizeof(version), 4) == sizeof(version) &&
+               version == 0xdead, "other version index left alone");
+   expect_true(fstat(pack_fd, &sb) == 0 && sb.st_size == 4096,
+               "other version pack left alone");
+
+   close(idx_fd);
+   close(pack_fd);
+   rmrf_local(PACK_TEST_DIR);
+}
+
+static void
+test_pack(void)
+{
+   struct disk_cache_pack *pack, *other;
+   uint8_t data[PACK_TEST_ITEM_SIZE];
+   const void *held = NULL;
+   unsigned held_item = 7;
+   cache_key key;
+   size_t size;
+   pid_t pid;
+   int status;
+
+   mkdir(CACHE_TEST_TMP, 0755);
+   mkdir(PACK_TEST_DIR, 0755);
+
+   pack = disk_cache_pack_open(PACK_TEST_DIR, PACK_TEST_MAX_SIZE);
+   expect_non_null(pack, "disk_cache_pack_open");
+   if (!pack)
+      return;
+
+   /* Four times what fits, so puts compact several times. Item 0 is used
+    * all along and must survive, the oldest others must not.
+    */
+   pack_put_item(pack, 0);
+   for (unsigned i = 1; i < 4 * PACK_TEST_MAX_SIZE / PACK_TEST_ITEM_SIZE; i++) {
+      pack_put_item(pack, i);
+      pack_has_item(pack, 0);
+
+      /* Hold a pointer through the compactions that follow. */
+      if (i == held_item) {
+         pack_test_item(i, key, data);
+         held = disk_cache_pack_get(pack, key, &size);
+         expect_non_null((void *) held, "disk_cache_pack_get of held item");
+      }
+   }
+
+   expect_true(disk_cache_pack_size(pack) <= PACK_TEST_MAX_SIZE,
+               "pack size stays within the maximum");
+   expect_true(pack_has_item(pack, 0), "recently used item survives compaction");
+   expect_true(!pack_has_item(pack, 1), "old item is compacted away");
+   expect_true(held && memcmp(held, data, sizeof(data)) == 0,
+               "held pointer stays valid across compactions");
+   if (held)
+      disk_cache_pack_release(pack);
+
+   /* Evict all but about one item's worth, the most recently used one. */
+   pack_has_item(pack, 0);
+   disk_cache_pack_evict(pack, PACK_TEST_MAX_SIZE - 2 * PACK_TEST_ITEM_SIZE);
+   expect_true(disk_cache_pack_size(pack) <= 2 * PACK_TEST_ITEM_SIZE,
+               "disk_cache_pack_evict frees the space asked for");
+   expect_true(pack_has_item(pack, 0), "disk_cache_pack_evict keeps recent items");
+
+   /* Another process sees what this one wrote, and this one sees what the
+    * other wrote and the compaction it did.
+    */
+   pid = fork();
+   if (pid == 0) {
+      other = disk_cache_pack_open(PACK_TEST_DIR, PACK_TEST_MAX_SIZE);
+      if (!other || !pack_has_item(other, 0))
+         _exit(1);
+
+      pack_put_item(other, 1000);
+      disk_cache_pack_evict(other, 0);
+      pack_put_item(other, 1001);
+      disk_cache_pack_close(other);
+      _exit(0);
+   }
+
+   expect_true(pid != -1 && waitpid(pid, &status, 0) == pid &&
+               WIFEXITED(status) && WEXITSTATUS(status) == 0,
+               "second process reads the pack");
+   expect_true(pack_has_item(pack, 1000) && pack_has_item(pack, 1001),
+               "entries of the second process are seen");
+
+   disk_cache_pack_close(pack);
+
+   pack = disk_cache_pack_open(PACK_TEST_DIR, PACK_TEST_MAX_SIZE);
+   expect_non_null(pack, "disk_cache_pack_open of an existing pack");
+   if (pack) {
+      expect_true(pack_has_item(pack, 0) && pack_has_item(pack, 1001),
+                  "entries survive reopening the pack");
+      disk_cache_pack_close(pack);
+   }
+
+   rmrf_local(PACK_TEST_DIR);
+
+   test_pack_other_version();
+}
 #endif /* ENABLE_SHADER_CACHE */
 
 int
@@ -501,12 +766,31 @@ main(void)
 #ifdef ENABLE_SHADER_CACHE
    int err;
 
+   /* The tests below are about what's on disk, keep the in-memory cache
+    * out of the way until test_memory_cache().
+    */
+   setenv("MESA_GLSL_CACHE_MEMORY_SIZE", "0", 1);
+
    test_disk_cache_create();
 
    test_put_and_get();
 
    test_put_key_and_get_key();
 
+   /* Same again with the single-file backend. */
+   setenv("MESA_GLSL_CACHE_PACK", "true", 1);
+   unsetenv("MESA_GLSL_CACHE_MAX_SIZE");
+
+   test_put_and_get();
+
+   unsetenv("MESA_GLSL_CACHE_PACK");
+
+   test_pack();
+
+   test_compression();
+
+   test_memory_cache();
+
    err = rmrf_local(CACHE_TEST_TMP);
    expect_equal(err, 0, "Removing " CACHE_TEST_TMP " again");
 #endif /* ENABLE_SHADER_CACHE */
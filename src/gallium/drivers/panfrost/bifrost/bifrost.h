@@ -72,6 +72,17 @@ struct bifrost_header {
         unsigned unk4 : 1; // part of nextClauseType?
 };
 
+/* Register block of an instruction, 35 bits. Packed, since ctrl straddles
+ * the first 32 bits */
+struct bifrost_regs {
+        unsigned uniform_const : 8;
+        unsigned reg2 : 6;
+        unsigned reg3 : 6;
+        unsigned reg0 : 5;
+        unsigned reg1 : 6;
+        unsigned ctrl : 4;
+} __attribute__((packed));
+
 struct bifrost_fma_inst {
         unsigned src0 : 3;
         unsigned op : 20;
@@ -86,13 +97,34 @@ struct bifrost_add_inst {
  * FMA ops
  */
 enum bifrost_fma_ops {
-        bifrost_fma_op_fma_f32 = 0,
+        bifrost_fma_op_fma_f32  = 0x00000,
+        bifrost_fma_op_fmax_f32 = 0x40000,
+        bifrost_fma_op_fmin_f32 = 0x44000,
+        bifrost_fma_op_iadd_i32 = 0x4ff98,
+        bifrost_fma_op_isub_i32 = 0x4ffd8,
+        bifrost_fma_op_fadd_f32 = 0x58000,
+        bifrost_fma_op_f2i_i32  = 0xe0136,
+        bifrost_fma_op_f2u_u32  = 0xe0137,
+        bifrost_fma_op_i2f_f32  = 0xe0178,
+        bifrost_fma_op_u2f_f32  = 0xe0179,
+        bifrost_fma_op_nop      = 0xe032c,
+        bifrost_fma_op_mov      = 0xe032d,
 };
 
 /*
  * ADD ops
  */
 enum bifrost_add_ops {
+        bifrost_add_op_fmax_f32 = 0x00000,
+        bifrost_add_op_fmin_f32 = 0x02000,
+        bifrost_add_op_fadd_f32 = 0x04000,
+        bifrost_add_op_f2i_i32  = 0x07936,
+        bifrost_add_op_f2u_u32  = 0x07937,
+        bifrost_add_op_i2f_f32  = 0x07978,
+        bifrost_add_op_u2f_f32  = 0x07979,
+        bifrost_add_op_nop      = 0x07b2c,
+        bifrost_add_op_mov      = 0x07b2d,
+
         bifrost_add_op_ld_attr_i32   = 0x08800,
         bifrost_add_op_ld_attr_v4i32 = 0x08b00,
         bifrost_add_op_ld_ubo_i32    = 0x0c1a0,
@@ -100,12 +132,21 @@ enum bifrost_add_ops {
         bifrost_add_op_ld_ubo_v4i32  = 0x0c220,
         bifrost_add_op_ld_ubo_v3i32  = 0x0caa0,
 
+        bifrost_add_op_iadd_i32 = 0x178c0,
+        bifrost_add_op_isub_i32 = 0x17ac0,
+        bifrost_add_op_ior_i32  = 0x1dd18,
+        bifrost_add_op_iand_i32 = 0x1dd20,
+        bifrost_add_op_ixor_i32 = 0x1dd50,
+
         bifrost_add_op_st_vary_v1 = 0x19300,
         bifrost_add_op_st_vary_v2 = 0x19340,
         bifrost_add_op_st_vary_v3 = 0x19380,
         bifrost_add_op_st_vary_v4 = 0x193c0,
 };
 
+/* Output modifiers of the floating point ops */
+#define BIFROST_OUTMOD_CLAMP_0_1 3
+
 enum bifrost_clause_types {
         bifrost_clause_type_zero_latency = 0,
         bifrost_clause_type_load         = 5,
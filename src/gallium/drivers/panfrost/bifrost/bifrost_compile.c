@@ -86,8 +86,9 @@ optimize_nir(nir_shader *nir)
 
         NIR_PASS(progress, nir, nir_opt_algebraic_late);
 
-        /* Lower mods */
-        NIR_PASS(progress, nir, nir_lower_to_source_mods, nir_lower_all_source_mods);
+        /* Lower mods. Only the float ops take source modifiers; integer
+         * negation stays an op of its own */
+        NIR_PASS(progress, nir, nir_lower_to_source_mods, nir_lower_float_source_mods);
         NIR_PASS(progress, nir, nir_copy_prop);
         NIR_PASS(progress, nir, nir_opt_dce);
 }
@@ -125,12 +126,6 @@ mir_alloc_ins(struct bifrost_instruction ins)
         return heap_ins;
 }
 
-static struct bifrost_instruction*
-mir_next_op(struct bifrost_instruction *ins)
-{
-        return list_first_entry(&(ins->link), struct bifrost_instruction, link);
-}
-
 static void
 emit_mir_instruction(struct compiler_context *ctx, struct bifrost_instruction ins)
 {
@@ -143,6 +138,103 @@ bifrost_pin_output(struct compiler_context *ctx, int index, int reg)
         _mesa_hash_table_u64_insert(ctx->ssa_to_register, index + 1, (void *) ((uintptr_t) reg + 1));
 }
 
+/* Returns an inline source for a 32-bit constant, sharing pool entries
+ * between equal values */
+
+static unsigned
+bifrost_constant(struct compiler_context *ctx, uint32_t value)
+{
+        unsigned count = util_dynarray_num_elements(&ctx->constants, uint32_t);
+
+        for (unsigned i = 0; i < count; ++i) {
+                if (*util_dynarray_element(&ctx->constants, uint32_t, i) == value)
+                        return SSA_CONSTANT(i);
+        }
+
+        util_dynarray_append(&ctx->constants, uint32_t, value);
+        return SSA_CONSTANT(count);
+}
+
+/* Translates a NIR index to a MIR source: loaded uniforms and constants are
+ * read inline, through the uniform/const port, rather than from a register */
+
+static unsigned
+bifrost_src(struct compiler_context *ctx, unsigned index, unsigned component)
+{
+        void *uniform = _mesa_hash_table_u64_search(ctx->ssa_uniforms, index + 1);
+
+        if (uniform) {
+                unsigned u = ((uintptr_t) uniform - 1) * 4 + component;
+                assert(u < 256 && "Uniform past the uniform port");
+                return SSA_UNIFORM(u);
+        }
+
+        uint32_t *constant = _mesa_hash_table_u64_search(ctx->ssa_constants, index + 1);
+
+        if (constant)
+                return bifrost_constant(ctx, *constant);
+
+        return index;
+}
+
+/* Copies a value into a fresh register */
+
+static unsigned
+bifrost_move(struct compiler_context *ctx, unsigned src)
+{
+        unsigned dest = SSA_GENERATED_MINIMUM + ctx->generated_count++;
+
+        struct bifrost_instruction ins = {
+                .type = TAG_ALU_OP,
+                .args = {
+                        .dest = dest,
+                        .src0 = src,
+                        .src1 = ~0U,
+                        .src2 = ~0U,
+                },
+                .fma = {
+                        .op = bifrost_fma_op_mov,
+                },
+                .add = {
+                        .op = bifrost_add_op_mov,
+                }
+        };
+
+        emit_mir_instruction(ctx, ins);
+
+        return dest;
+}
+
+/* Inline sources can only feed the ALUs. Anywhere else, and when two inline
+ * sources of one instruction can't share a slot, copy into a register */
+
+static unsigned
+bifrost_materialize(struct compiler_context *ctx, unsigned src)
+{
+        if (src < SSA_UNIFORM_MINIMUM)
+                return src;
+
+        return bifrost_move(ctx, src);
+}
+
+/* Either a pair of uniforms or up to two constants fit in the slot a tuple
+ * reads inline */
+
+static bool
+bifrost_inline_compatible(unsigned a, unsigned b)
+{
+        if (a < SSA_UNIFORM_MINIMUM || b < SSA_UNIFORM_MINIMUM)
+                return true;
+
+        bool a_constant = a >= SSA_CONSTANT_MINIMUM;
+        bool b_constant = b >= SSA_CONSTANT_MINIMUM;
+
+        if (a_constant || b_constant)
+                return a_constant && b_constant;
+
+        return ((a - SSA_UNIFORM_MINIMUM) >> 1) == ((b - SSA_UNIFORM_MINIMUM) >> 1);
+}
+
 #define M_LOAD_UBO(_tag, name, rname, uname) \
 	static struct bifrost_instruction m_##name(unsigned ssa, unsigned location, unsigned binding) { \
 		struct bifrost_instruction i = { \
@@ -161,14 +253,17 @@ bifrost_pin_output(struct compiler_context *ctx, int index, int reg)
 		return i; \
 	}
 
+/* Attributes are indexed by the vertex and instance ID, preloaded to r61 and
+ * r62 */
+
 #define M_LOAD_ATTR(name, rname, uname) \
 	static struct bifrost_instruction m_##name(unsigned ssa, unsigned location) { \
 		struct bifrost_instruction i = { \
 			.type = TAG_LOAD_STORE_UBO_4, \
 			.args = { \
 				.rname = ssa, \
-				.uname = ~0U, \
-                                .src1 = ~0U, \
+				.uname = SSA_FIXED_REGISTER(61), \
+                                .src1 = SSA_FIXED_REGISTER(62), \
                                 .src2 = ~0U \
 			}, \
 			.add = { \
@@ -215,7 +310,8 @@ bifrost_pin_output(struct compiler_context *ctx, int index, int reg)
 		return i; \
 	}
 //M_ALU_OP(fma_f32, dest, src0)
-M_LOAD_UBO(1, ld_ubo_i32, dest, src0)
+// Uniforms are read through the uniform port instead
+//M_LOAD_UBO(1, ld_ubo_i32, dest, src0)
 //M_LOAD_UBO(2, ld_ubo_v2i32, dest, src0)
 //M_LOAD_UBO(3, ld_ubo_v3i32, dest, src0)
 //M_LOAD_UBO(4, ld_ubo_v4i32, dest, src0)
@@ -231,8 +327,8 @@ emit_load_const(struct compiler_context *ctx, nir_load_const_instr *instr)
 {
         nir_ssa_def def = instr->def;
 
-        float *v = ralloc_array(NULL, float, 1);
-        memcpy(v, &instr->value.f32[0], sizeof(float));
+        uint32_t *v = ralloc_array(NULL, uint32_t, 1);
+        memcpy(v, &instr->value.u32[0], sizeof(uint32_t));
         _mesa_hash_table_u64_insert(ctx->ssa_constants, def.index + 1, v);
 }
 
@@ -250,7 +346,6 @@ emit_intrinsic(struct compiler_context *ctx, nir_intrinsic_instr *instr)
                 offset = nir_intrinsic_base(instr) + const_offset->u32[0];
 
                 reg = nir_dest_index(&instr->dest);
-                unsigned uniform_offset = 0;
 
                 void *entry = _mesa_hash_table_u64_search(ctx->uniform_nir_to_bi, offset + 1);
 
@@ -260,12 +355,8 @@ emit_intrinsic(struct compiler_context *ctx, nir_intrinsic_instr *instr)
                         break;
                 }
 
-                uniform_offset = (uintptr_t) (entry) - 1;
-
-                // XXX
-                struct bifrost_instruction ins = m_ld_ubo_i32(reg, uniform_offset, ~0U);
-
-                emit_mir_instruction(ctx, ins);
+                /* Nothing to emit: users read the uniform inline */
+                _mesa_hash_table_u64_insert(ctx->ssa_uniforms, reg + 1, entry);
 
                 break;
         case nir_intrinsic_store_output:
@@ -277,8 +368,14 @@ emit_intrinsic(struct compiler_context *ctx, nir_intrinsic_instr *instr)
 
                 if (ctx->stage == MESA_SHADER_FRAGMENT) {
                         /* Source color preloaded to r0 */
-                        reg = nir_src_index(&instr->src[0]);
-                        bifrost_pin_output(ctx, reg, 0);
+                        reg = bifrost_src(ctx, nir_src_index(&instr->src[0]), 0);
+
+                        /* Inline values need a register, and a value can
+                         * only be pinned once */
+                        if (reg >= SSA_UNIFORM_MINIMUM || _mesa_hash_table_u64_search(ctx->ssa_to_register, reg + 1))
+                                reg = bifrost_move(ctx, reg);
+
+                        bifrost_pin_output(ctx, reg, nir_intrinsic_component(instr));
                 }
                 else if (ctx->stage == MESA_SHADER_VERTEX) {
                         int comp = nir_intrinsic_component(instr);
@@ -292,8 +389,13 @@ emit_intrinsic(struct compiler_context *ctx, nir_intrinsic_instr *instr)
 
                         offset = (uintptr_t) (entry) - 1;
 
-                        reg = nir_src_index(&instr->src[0]);
-                        struct bifrost_instruction ins = m_st_vary_v1(offset, reg);
+                        reg = bifrost_materialize(ctx, bifrost_src(ctx, nir_src_index(&instr->src[0]), 0));
+
+                        /* XXX: The address should come from LD_VAR_ADDR,
+                         * which isn't wired up yet; pass the location in its
+                         * place */
+                        struct bifrost_instruction ins = m_st_vary_v1(reg, bifrost_constant(ctx, offset));
+                        ins.args.src2 = bifrost_constant(ctx, 0);
                         emit_mir_instruction(ctx, ins);
 
                 } else {
@@ -325,10 +427,28 @@ emit_intrinsic(struct compiler_context *ctx, nir_intrinsic_instr *instr)
         }
 }
 
+/* Ops issuing only on the FMA unit, only on the ADD unit, and on either */
+
 #define ALU_FMA_CASE(_arguments, nir, name) \
 	case nir_op_##nir: \
+                type = TAG_FMA_OP; \
+                arguments = _arguments; \
+		fma_op = bifrost_fma_op_##name; \
+		break;
+
+#define ALU_ADD_CASE(_arguments, nir, name) \
+	case nir_op_##nir: \
+                type = TAG_ADD_OP; \
+                arguments = _arguments; \
+		add_op = bifrost_add_op_##name; \
+		break;
+
+#define ALU_CASE(_arguments, nir, name) \
+	case nir_op_##nir: \
+                type = TAG_ALU_OP; \
                 arguments = _arguments; \
-		op = bifrost_fma_op_##name; \
+		fma_op = bifrost_fma_op_##name; \
+		add_op = bifrost_add_op_##name; \
 		break;
 
 static void
@@ -336,28 +456,69 @@ emit_alu(struct compiler_context *ctx, nir_alu_instr *instr)
 {
         unsigned dest = nir_dest_index(&instr->dest.dest);
 
-        unsigned op = ~0U, arguments;
+        unsigned type, arguments, fma_op = 0, add_op = 0;
         switch (instr->op) {
         ALU_FMA_CASE(2, fmul, fma_f32)
+        ALU_CASE(2, fadd, fadd_f32)
+        ALU_CASE(2, fmax, fmax_f32)
+        ALU_CASE(2, fmin, fmin_f32)
+        ALU_CASE(1, fmov, mov)
+        ALU_CASE(1, imov, mov)
+        ALU_CASE(2, iadd, iadd_i32)
+        ALU_CASE(2, isub, isub_i32)
+        ALU_CASE(1, ineg, isub_i32)
+        ALU_ADD_CASE(2, iand, iand_i32)
+        ALU_ADD_CASE(2, ior, ior_i32)
+        ALU_ADD_CASE(2, ixor, ixor_i32)
+        ALU_CASE(1, f2i32, f2i_i32)
+        ALU_CASE(1, f2u32, f2u_u32)
+        ALU_CASE(1, i2f32, i2f_f32)
+        ALU_CASE(1, u2f32, u2f_f32)
         default:
                 printf("Unhandled ALU op %s\n", nir_op_infos[instr->op].name);
                 assert(0);
                 return;
         }
 
-        if (op == ~0U) return;
+        unsigned src0 = bifrost_src(ctx, nir_alu_src_index(&instr->src[0]), instr->src[0].swizzle[0]);
+        unsigned src1 = arguments == 2 ? bifrost_src(ctx, nir_alu_src_index(&instr->src[1]), instr->src[1].swizzle[0]) : ~0U;
+
+        bool float_mods = instr->op == nir_op_fmul || instr->op == nir_op_fadd ||
+                          instr->op == nir_op_fmax || instr->op == nir_op_fmin;
 
+        /* A move with modifiers is an add to -0 */
+        if (instr->op == nir_op_fmov && (instr->src[0].negate || instr->src[0].abs || instr->dest.saturate)) {
+                type = TAG_FMA_OP;
+                fma_op = bifrost_fma_op_fadd_f32;
+                float_mods = true;
+        }
+
+        /* Negation is a subtraction from zero */
+        if (instr->op == nir_op_ineg) {
+                src1 = src0;
+                src0 = bifrost_constant(ctx, 0);
+        }
 
-        unsigned src0 = nir_alu_src_index(&instr->src[0]);
-        unsigned src1 = arguments == 2 ? nir_alu_src_index(&instr->src[1]) : ~0;
+        if (!bifrost_inline_compatible(src0, src1))
+                src1 = bifrost_materialize(ctx, src1);
 
         struct bifrost_instruction ins = {
-                .type = TAG_FMA_OP,
+                .type = type,
+                .float_mods = float_mods,
+                .src_neg = { instr->src[0].negate, arguments == 2 && instr->src[1].negate },
+                .src_abs = { instr->src[0].abs, arguments == 2 && instr->src[1].abs },
+                .outmod = instr->dest.saturate ? BIFROST_OUTMOD_CLAMP_0_1 : 0,
                 .args = {
                         .src0 = src0,
                         .src1 = src1,
                         .src2 = ~0U,
                         .dest = dest,
+                },
+                .fma = {
+                        .op = fma_op,
+                },
+                .add = {
+                        .op = add_op,
                 }
         };
 
@@ -482,27 +643,26 @@ find_or_allocate_temp(struct compiler_context *ctx, unsigned hash)
         return temp;
 }
 
-static void
-allocate_registers(struct compiler_context *ctx)
-{
-        /* First, initialize the RA */
-        struct ra_regs *regs = ra_alloc_reg_set(NULL, 64, true);
-
-        /* Create a primary (general purpose) class, as well as special purpose
-         * pipeline register classes */
-
-        int primary_class = ra_alloc_reg_class(regs);
 
-        /* Add the full set of work registers */
-        for (int i = 0; i < 64; ++i)
-                ra_class_add_reg(regs, primary_class, i);
+/* Transforms the MIR into squeezed index form, and records for each temp its
+ * producer, its users and the register it's pinned to, if any */
 
-        /* We're done setting up */
-        ra_set_finalize(regs, NULL);
+static void
+index_temps(struct compiler_context *ctx)
+{
+        struct util_dynarray pins;
+        util_dynarray_init(&pins, NULL);
 
-        /* Transform the MIR into squeezed index form */
         mir_foreach_block(ctx, block) {
                 mir_foreach_instr_in_block(block, ins) {
+                        if (ins->args.dest != ~0U) {
+                                unsigned reg = (uintptr_t) _mesa_hash_table_u64_search(ctx->ssa_to_register, ins->args.dest + 1);
+
+                                if (reg) {
+                                        util_dynarray_append(&pins, unsigned, find_or_allocate_temp(ctx, ins->args.dest));
+                                        util_dynarray_append(&pins, unsigned, reg);
+                                }
+                        }
 
                         ins->args.src0 = find_or_allocate_temp(ctx, ins->args.src0);
                         ins->args.src1 = find_or_allocate_temp(ctx, ins->args.src1);
@@ -513,144 +673,1460 @@ allocate_registers(struct compiler_context *ctx)
                 print_mir_block(block);
         }
 
+        unsigned nodes = ctx->temp_count;
+
+        ctx->producers = calloc(nodes, sizeof(ctx->producers[0]));
+        ctx->users = calloc(nodes, sizeof(ctx->users[0]));
+        ctx->pinned = calloc(nodes, sizeof(ctx->pinned[0]));
+        ctx->needs_register = calloc(nodes, sizeof(ctx->needs_register[0]));
+        ctx->retire = calloc(nodes, sizeof(ctx->retire[0]));
+
+        for (unsigned i = 0; i < nodes; ++i)
+                util_dynarray_init(&ctx->users[i], NULL);
+
+        for (unsigned i = 0; i < util_dynarray_num_elements(&pins, unsigned); i += 2) {
+                unsigned temp = *util_dynarray_element(&pins, unsigned, i);
+                ctx->pinned[temp] = *util_dynarray_element(&pins, unsigned, i + 1);
+        }
+
+        util_dynarray_fini(&pins);
+
+        mir_foreach_block(ctx, block) {
+                mir_foreach_instr_in_block(block, ins) {
+                        unsigned args[3] = { ins->args.src0, ins->args.src1, ins->args.src2 };
+
+                        for (unsigned i = 0; i < 3; ++i) {
+                                if (args[i] >= SSA_FIXED_MINIMUM)
+                                        continue;
+
+                                /* Record each user once */
+                                if ((i > 0 && args[i] == args[0]) || (i > 1 && args[i] == args[1]))
+                                        continue;
+
+                                util_dynarray_append(&ctx->users[args[i]], struct bifrost_instruction *, ins);
+                        }
+
+                        if (ins->args.dest < SSA_FIXED_MINIMUM)
+                                ctx->producers[ins->args.dest] = ins;
+                }
+        }
+}
+
+static bool
+bi_can_fma(struct bifrost_instruction *ins)
+{
+        return ins->type == TAG_FMA_OP || ins->type == TAG_ALU_OP;
+}
+
+static bool
+bi_can_add(struct bifrost_instruction *ins)
+{
+        return ins->type != TAG_FMA_OP;
 }
 
-/* Schedules, but does not emit, a single basic block. After scheduling, the
- * final tag and size of the block are known, which are necessary for branching
- * */
+static bool
+bi_is_message(struct bifrost_instruction *ins)
+{
+        return ins->type <= TAG_LOAD_STORE_UBO_4;
+}
 
-static struct bifrost_clause
-schedule_clause(struct compiler_context *ctx, struct bifrost_block *block, struct bifrost_instruction *ins, int *skip) {
-        int instructions_emitted = 0, instructions_consumed = -1;
-        struct bifrost_clause clause = {};
+static bool
+bi_is_store(struct bifrost_instruction *ins)
+{
+        return bi_is_message(ins) && ins->args.dest == ~0U;
+}
 
-        /* Copy the instructions into the clause */
-        clause.instruction_count = instructions_emitted + 1;
+static bool
+bi_is_inline(unsigned src)
+{
+        return src != ~0U && src >= SSA_UNIFORM_MINIMUM;
+}
+
+static uint32_t
+bi_constant_value(struct compiler_context *ctx, unsigned src)
+{
+        return *util_dynarray_element(&ctx->constants, uint32_t, src - SSA_CONSTANT_MINIMUM);
+}
+
+/* The sources as the hardware sees them. The data of a store goes through the
+ * data register instead, and its address is repeated in the third source */
 
-        struct bifrost_instruction *uins = ins;
-        util_dynarray_init(&clause.instructions, NULL);
-        for (int i = 0; i < clause.instruction_count; ++i) {
-                util_dynarray_append(&clause.instructions, struct bifrost_instruction, *uins);
-                uins = mir_next_op(uins);
+static unsigned
+bi_hw_sources(struct bifrost_instruction *ins, unsigned *srcs)
+{
+        if (bi_is_store(ins)) {
+                srcs[0] = ins->args.src1;
+                srcs[1] = ins->args.src2;
+                srcs[2] = ins->args.src2;
+                return 3;
         }
 
-        *skip = (instructions_consumed == -1) ? instructions_emitted : instructions_consumed;
+        unsigned args[3] = { ins->args.src0, ins->args.src1, ins->args.src2 };
+        unsigned count = 0;
 
-        // XXX: Fill out the header with register information
+        for (unsigned i = 0; i < 3; ++i) {
+                if (args[i] != ~0U)
+                        srcs[count++] = args[i];
+        }
 
-        return clause;
+        return count;
 }
 
-static void
-schedule_block(struct compiler_context *ctx, struct bifrost_block *block)
+/* Within a clause, results can skip the register file: the ADD unit reads the
+ * FMA result of its own tuple, and either unit the results of the previous
+ * tuple */
+
+enum bi_forward {
+        BI_FORWARD_NONE,
+        BI_FORWARD_T,
+        BI_FORWARD_T0,
+        BI_FORWARD_T1,
+};
+
+static enum bi_forward
+bi_forward(struct compiler_context *ctx, struct bifrost_instruction *ins, unsigned src)
 {
-        util_dynarray_init(&block->clauses, NULL);
+        if (src >= SSA_FIXED_MINIMUM)
+                return BI_FORWARD_NONE;
 
-        mir_foreach_instr_in_block(block, ins) {
-                int skip;
-                struct bifrost_clause clause = schedule_clause(ctx, block, ins, &skip);
-                util_dynarray_append(&block->clauses, struct bifrost_clause, clause);
+        struct bifrost_instruction *producer = ctx->producers[src];
 
-                while(skip--)
-                        ins = mir_next_op(ins);
+        if (!producer || !producer->scheduled || bi_is_message(producer) || producer->clause != ins->clause)
+                return BI_FORWARD_NONE;
+
+        if (producer->tuple == ins->tuple) {
+                assert(!producer->add_unit && ins->add_unit);
+                return BI_FORWARD_T;
         }
+
+        if (producer->tuple + 1 == ins->tuple)
+                return producer->add_unit ? BI_FORWARD_T1 : BI_FORWARD_T0;
+
+        return BI_FORWARD_NONE;
 }
 
-static void
-schedule_program(struct compiler_context *ctx)
+/* Whether an ALU result has to be written back to a register. While any user
+ * is unscheduled, assume so, which keeps the answer monotonic as scheduling
+ * goes on. Messages write the data register, handled separately */
+
+static bool
+bi_writes_register(struct compiler_context *ctx, struct bifrost_instruction *ins)
 {
-        allocate_registers(ctx);
+        unsigned dest = ins->args.dest;
 
-        mir_foreach_block(ctx, block) {
-                schedule_block(ctx, block);
+        if (bi_is_message(ins) || dest >= SSA_FIXED_MINIMUM)
+                return false;
+
+        if (ctx->pinned[dest])
+                return true;
+
+        util_dynarray_foreach(&ctx->users[dest], struct bifrost_instruction *, user) {
+                struct bifrost_instruction *u = *user;
+
+                if (!u->scheduled)
+                        return true;
+
+                if (bi_is_store(u) && u->args.src0 == dest)
+                        return true;
+
+                unsigned srcs[3];
+                unsigned count = bi_hw_sources(u, srcs);
+
+                for (unsigned i = 0; i < count; ++i) {
+                        if (srcs[i] == dest && bi_forward(ctx, u, dest) == BI_FORWARD_NONE)
+                                return true;
+                }
         }
+
+        return false;
 }
 
+static void
+bi_tuple_writes(struct compiler_context *ctx, struct bifrost_tuple *tuple, bool *fma, bool *add)
+{
+        *fma = tuple->fma && bi_writes_register(ctx, tuple->fma);
+        *add = tuple->add && bi_writes_register(ctx, tuple->add);
+}
 
-int
-bifrost_compile_shader_nir(nir_shader *nir, struct bifrost_program *program) {
-        struct compiler_context ictx = {
-                .nir = nir,
-                .stage = nir->info.stage,
-        };
+/* Collects the distinct registers a tuple reads, at most six */
 
-        struct compiler_context *ctx = &ictx;
+static unsigned
+bi_tuple_reads(struct compiler_context *ctx, struct bifrost_tuple *tuple, unsigned *reads)
+{
+        struct bifrost_instruction *units[2] = { tuple->fma, tuple->add };
+        unsigned count = 0;
 
-        /* Assign var locations early, so the epilogue can use them if necessary */
+        for (unsigned u = 0; u < 2; ++u) {
+                if (!units[u])
+                        continue;
 
-        nir_assign_var_locations(&nir->outputs, &nir->num_outputs, glsl_type_size);
-        nir_assign_var_locations(&nir->inputs, &nir->num_inputs, glsl_type_size);
-        nir_assign_var_locations(&nir->uniforms, &nir->num_uniforms, glsl_type_size);
+                unsigned srcs[3];
+                unsigned src_count = bi_hw_sources(units[u], srcs);
 
-        /* Initialize at a global (not block) level hash tables */
-        ctx->ssa_constants = _mesa_hash_table_u64_create(NULL);
-        ctx->ssa_to_register = _mesa_hash_table_u64_create(NULL);
-        ctx->hash_to_temp = _mesa_hash_table_u64_create(NULL);
+                for (unsigned i = 0; i < src_count; ++i) {
+                        if (bi_is_inline(srcs[i]) || bi_forward(ctx, units[u], srcs[i]) != BI_FORWARD_NONE)
+                                continue;
 
-        /* Assign actual uniform location, skipping over samplers */
-        ctx->uniform_nir_to_bi  = _mesa_hash_table_u64_create(NULL);
+                        bool seen = false;
 
-        nir_foreach_variable(var, &nir->uniforms) {
-                if (glsl_get_base_type(var->type) == GLSL_TYPE_SAMPLER) continue;
+                        for (unsigned j = 0; j < count; ++j)
+                                seen |= reads[j] == srcs[i];
 
-                for (int col = 0; col < glsl_get_matrix_columns(var->type); ++col) {
-                        int id = ctx->uniform_count++;
-                        _mesa_hash_table_u64_insert(ctx->uniform_nir_to_bi, var->data.driver_location + col + 1, (void *) ((uintptr_t) (id + 1)));
+                        if (!seen)
+                                reads[count++] = srcs[i];
                 }
         }
 
-        if (ctx->stage == MESA_SHADER_VERTEX) {
-                ctx->varying_nir_to_bi = _mesa_hash_table_u64_create(NULL);
+        return count;
+}
 
-                nir_foreach_variable(var, &nir->outputs) {
-                        if (var->data.location < VARYING_SLOT_VAR0) {
-                                if (var->data.location == VARYING_SLOT_POS)
-                                        _mesa_hash_table_u64_insert(ctx->varying_nir_to_bi, var->data.driver_location + 1, (void *) ((uintptr_t) (1)));
+/* A tuple's register block carries its own reads and the writes of the
+ * previous tuple, over three read ports and two write ports shared between
+ * them. The first tuple's block carries the writes of the last tuple, with
+ * fewer combinations available */
+
+static bool
+bi_registers_fit(unsigned reads, bool fma_write, bool add_write, bool first)
+{
+        unsigned writes = fma_write + add_write;
+
+        if (first)
+                return writes == 0 ? reads <= 3 : (writes == 1 && reads <= 2);
+
+        return writes == 2 ? reads <= 2 : reads <= 3;
+}
 
+/* Each tuple reads a single 64-bit slot through the uniform/const port:
+ * either a pair of uniforms, or up to two constants */
+
+static bool
+bi_tuple_inline_fits(struct compiler_context *ctx, struct bifrost_tuple *tuple)
+{
+        struct bifrost_instruction *units[2] = { tuple->fma, tuple->add };
+        int uniform_pair = -1;
+        uint32_t constants[2];
+        unsigned constant_count = 0;
+
+        for (unsigned u = 0; u < 2; ++u) {
+                if (!units[u])
+                        continue;
+
+                unsigned srcs[3];
+                unsigned src_count = bi_hw_sources(units[u], srcs);
+
+                for (unsigned i = 0; i < src_count; ++i) {
+                        if (!bi_is_inline(srcs[i]))
                                 continue;
-                        }
 
-                        for (int col = 0; col < glsl_get_matrix_columns(var->type); ++col) {
-                                for (int comp = 0; comp < 4; ++comp) {
-                                        int id = comp + ctx->varying_count++;
-                                        _mesa_hash_table_u64_insert(ctx->varying_nir_to_bi, var->data.driver_location + col + comp + 1, (void *) ((uintptr_t) (id + 1)));
-                                }
+                        if (srcs[i] < SSA_CONSTANT_MINIMUM) {
+                                int pair = (srcs[i] - SSA_UNIFORM_MINIMUM) >> 1;
+
+                                if (uniform_pair >= 0 && uniform_pair != pair)
+                                        return false;
+
+                                uniform_pair = pair;
+                                continue;
                         }
+
+                        uint32_t value = bi_constant_value(ctx, srcs[i]);
+                        bool seen = false;
+
+                        for (unsigned j = 0; j < constant_count; ++j)
+                                seen |= constants[j] == value;
+
+                        if (seen)
+                                continue;
+
+                        if (constant_count == 2)
+                                return false;
+
+                        constants[constant_count++] = value;
                 }
         }
 
-        /* Lower vars -- not I/O -- before epilogue */
+        return uniform_pair < 0 || constant_count == 0;
+}
 
-        NIR_PASS_V(nir, nir_lower_var_copies);
-        NIR_PASS_V(nir, nir_lower_vars_to_ssa);
-        NIR_PASS_V(nir, nir_split_var_copies);
-        NIR_PASS_V(nir, nir_lower_var_copies);
-        NIR_PASS_V(nir, nir_lower_global_vars_to_local);
-        NIR_PASS_V(nir, nir_lower_var_copies);
-        NIR_PASS_V(nir, nir_lower_vars_to_ssa);
-        NIR_PASS_V(nir, nir_lower_io, nir_var_all, glsl_type_size, 0);
+static unsigned
+bi_tuple_constants(struct compiler_context *ctx, struct bifrost_tuple *tuple, uint32_t *values)
+{
+        struct bifrost_instruction *units[2] = { tuple->fma, tuple->add };
+        unsigned count = 0;
 
-        /* Optimisation passes */
-        optimize_nir(nir);
+        for (unsigned u = 0; u < 2; ++u) {
+                if (!units[u])
+                        continue;
 
-        nir_print_shader(nir, stdout);
+                unsigned srcs[3];
+                unsigned src_count = bi_hw_sources(units[u], srcs);
 
-        nir_foreach_function(func, nir) {
-                if (!func->impl)
+                for (unsigned i = 0; i < src_count; ++i) {
+                        if (!bi_is_inline(srcs[i]) || srcs[i] < SSA_CONSTANT_MINIMUM)
+                                continue;
+
+                        uint32_t value = bi_constant_value(ctx, srcs[i]);
+                        bool seen = false;
+
+                        for (unsigned j = 0; j < count; ++j)
+                                seen |= values[j] == value;
+
+                        if (!seen)
+                                values[count++] = value;
+                }
+        }
+
+        assert(count <= 2);
+        return count;
+}
+
+/* Packs the constants read by each tuple into the clause's 64-bit slots,
+ * sharing slots between tuples where the values allow. Returns the number of
+ * slots needed, which may exceed what the clause can hold */
+
+static unsigned
+bi_assign_constants(struct compiler_context *ctx, struct bifrost_clause *clause)
+{
+        uint64_t slots[8];
+        bool high_used[8];
+        unsigned count = 0;
+
+        for (unsigned t = 0; t < clause->tuple_count; ++t) {
+                struct bifrost_tuple *tuple = &clause->tuples[t];
+                uint32_t values[2];
+                unsigned n = bi_tuple_constants(ctx, tuple, values);
+
+                tuple->constant_slot = -1;
+
+                if (!n)
                         continue;
 
-                list_inithead(&ctx->blocks);
-                ctx->block_count = 0;
-                ctx->func = func;
+                for (unsigned s = 0; s < count && tuple->constant_slot < 0; ++s) {
+                        bool found = true;
 
-                emit_cf_list(ctx, &func->impl->body);
-                emit_block(ctx, func->impl->end_block);
+                        for (unsigned i = 0; i < n; ++i) {
+                                found &= (uint32_t) slots[s] == values[i] ||
+                                         (high_used[s] && (uint32_t) (slots[s] >> 32) == values[i]);
+                        }
+
+                        if (found)
+                                tuple->constant_slot = s;
+                }
+
+                /* Fill a free high half */
+                for (unsigned s = 0; s < count && tuple->constant_slot < 0; ++s) {
+                        if (high_used[s])
+                                continue;
 
-                break; /* TODO: Multi-function shaders */
+                        uint32_t low = slots[s];
+
+                        if (n == 2 && low != values[0] && low != values[1])
+                                continue;
+
+                        uint32_t high = (n == 2 && low == values[0]) ? values[1] : values[0];
+
+                        slots[s] |= (uint64_t) high << 32;
+                        high_used[s] = true;
+                        tuple->constant_slot = s;
+                }
+
+                if (tuple->constant_slot < 0) {
+                        assert(count < ARRAY_SIZE(slots));
+
+                        slots[count] = values[0] | (n == 2 ? (uint64_t) values[1] << 32 : 0);
+                        high_used[count] = n == 2;
+                        tuple->constant_slot = count++;
+                }
         }
 
-        /* Schedule! */
-        schedule_program(ctx);
+        memcpy(clause->constants, slots, MIN2(count, ARRAY_SIZE(clause->constants)) * sizeof(uint64_t));
+        clause->constant_count = count;
+
+        return count;
+}
+
+/* Where a clause's constant quadwords go, by tuple count: the position field
+ * of each quadword. Some tuple counts also leave room for one constant among
+ * the instruction quadwords */
+
+static const unsigned bifrost_constant_pos[8][3] = {
+        { 0 }, { 1 }, { 3 }, { 2, 5 }, { 4, 8 }, { 7, 11 }, { 6, 10, 13 }, { 9, 12 },
+};
+
+static const unsigned bifrost_constant_quads[8] = { 1, 1, 1, 2, 2, 2, 3, 2 };
+static const bool bifrost_embedded_constant[8] = { false, false, true, false, true, true, false, true };
+
+static unsigned
+bi_constant_capacity(unsigned tuple_count)
+{
+        unsigned i = tuple_count - 1;
+        return MIN2(bifrost_embedded_constant[i] + 2 * bifrost_constant_quads[i], 6);
+}
+
+/* Whether an instruction may go in the given tuple of the clause being built,
+ * as far as its sources go. Within a tuple, only the ADD unit sees the FMA
+ * result. Message results are only known to be there from the next clause,
+ * and a store's data has to be in its register before the clause starts */
+
+static bool
+bi_ready(struct compiler_context *ctx, struct bifrost_instruction *ins, struct bifrost_clause *clause, unsigned t, bool add_unit)
+{
+        unsigned args[3] = { ins->args.src0, ins->args.src1, ins->args.src2 };
+
+        for (unsigned i = 0; i < 3; ++i) {
+                if (args[i] >= SSA_FIXED_MINIMUM)
+                        continue;
+
+                struct bifrost_instruction *producer = ctx->producers[args[i]];
+
+                if (!producer)
+                        continue;
+
+                if (!producer->scheduled)
+                        return false;
+
+                if (producer->clause != ctx->clause_count)
+                        continue;
+
+                if (bi_is_message(producer) || (bi_is_store(ins) && i == 0))
+                        return false;
+
+                if (producer->tuple == clause->first_tuple + t && (producer->add_unit || !add_unit))
+                        return false;
+        }
+
+        return true;
+}
+
+static bool
+bi_tuple_valid(struct compiler_context *ctx, struct bifrost_clause *clause, unsigned t)
+{
+        struct bifrost_tuple *tuple = &clause->tuples[t];
+
+        if (!bi_tuple_inline_fits(ctx, tuple))
+                return false;
+
+        unsigned reads[6];
+        unsigned count = bi_tuple_reads(ctx, tuple, reads);
+
+        /* The first tuple is checked against the last once the clause is
+         * closed */
+        if (t == 0)
+                return count <= 3;
+
+        bool fma_write, add_write;
+        bi_tuple_writes(ctx, &clause->tuples[t - 1], &fma_write, &add_write);
+
+        return bi_registers_fit(count, fma_write, add_write, false);
+}
+
+/* Places an instruction tentatively, keeping it only if the tuple is still
+ * encodable */
+
+static bool
+bi_try_schedule(struct compiler_context *ctx, struct bifrost_clause *clause, unsigned t, struct bifrost_instruction *ins, bool add_unit)
+{
+        struct bifrost_tuple *tuple = &clause->tuples[t];
+        struct bifrost_instruction **slot = add_unit ? &tuple->add : &tuple->fma;
+
+        /* There is one data register per clause */
+        if (bi_is_message(ins) && clause->message)
+                return false;
+
+        if (!bi_ready(ctx, ins, clause, t, add_unit))
+                return false;
+
+        ins->scheduled = true;
+        ins->clause = ctx->clause_count;
+        ins->tuple = clause->first_tuple + t;
+        ins->add_unit = add_unit;
+        *slot = ins;
+
+        if (bi_tuple_valid(ctx, clause, t) && bi_assign_constants(ctx, clause) <= bi_constant_capacity(t + 1)) {
+                if (bi_is_message(ins))
+                        clause->message = ins;
+
+                return true;
+        }
+
+        ins->scheduled = false;
+        *slot = NULL;
+
+        return false;
+}
+
+/* Fills one slot of a tuple, preferring ops that can't go on the other unit,
+ * otherwise in program order */
+
+static void
+bi_fill_slot(struct compiler_context *ctx, struct bifrost_block *block, struct bifrost_clause *clause, unsigned t, bool add_unit)
+{
+        for (unsigned pass = 0; pass < 2; ++pass) {
+                mir_foreach_instr_in_block(block, ins) {
+                        if (ins->scheduled)
+                                continue;
+
+                        bool possible = add_unit ? bi_can_add(ins) : bi_can_fma(ins);
+                        bool exclusive = add_unit ? !bi_can_fma(ins) : !bi_can_add(ins);
+
+                        if (!possible || exclusive != (pass == 0))
+                                continue;
+
+                        if (bi_try_schedule(ctx, clause, t, ins, add_unit))
+                                return;
+                }
+        }
+}
+
+static void
+bi_unschedule_tuple(struct bifrost_clause *clause, struct bifrost_tuple *tuple)
+{
+        struct bifrost_instruction *units[2] = { tuple->fma, tuple->add };
+
+        for (unsigned u = 0; u < 2; ++u) {
+                if (!units[u])
+                        continue;
+
+                units[u]->scheduled = false;
+
+                if (units[u] == clause->message)
+                        clause->message = NULL;
+        }
+}
+
+/* Closes a clause. The first tuple's register block also carries the writes of
+ * the last tuple; if they don't fit, pad with an empty tuple, or failing that
+ * give the last tuple back */
+
+static void
+bi_close_clause(struct compiler_context *ctx, struct bifrost_clause *clause)
+{
+        for (;;) {
+                unsigned reads[6];
+                unsigned count = bi_tuple_reads(ctx, &clause->tuples[0], reads);
+                unsigned slots = bi_assign_constants(ctx, clause);
+
+                bool fma_write, add_write;
+                bi_tuple_writes(ctx, &clause->tuples[clause->tuple_count - 1], &fma_write, &add_write);
+
+                if (bi_registers_fit(count, fma_write, add_write, true) &&
+                    slots <= bi_constant_capacity(clause->tuple_count))
+                        break;
+
+                if (clause->tuple_count < 8 && slots <= bi_constant_capacity(clause->tuple_count + 1)) {
+                        struct bifrost_tuple *pad = &clause->tuples[clause->tuple_count++];
+                        memset(pad, 0, sizeof(*pad));
+                        pad->constant_slot = -1;
+                        continue;
+                }
+
+                bi_unschedule_tuple(clause, &clause->tuples[--clause->tuple_count]);
+                assert(clause->tuple_count);
+        }
+
+        clause->instruction_count = 0;
+
+        for (unsigned t = 0; t < clause->tuple_count; ++t)
+                clause->instruction_count += !!clause->tuples[t].fma + !!clause->tuples[t].add;
+}
+
+/* Greedily forms a clause from the unscheduled instructions of a block, tuple
+ * by tuple, filling the FMA slot first so the ADD can consume its result */
+
+static struct bifrost_clause
+schedule_clause(struct compiler_context *ctx, struct bifrost_block *block)
+{
+        struct bifrost_clause clause = {
+                .first_tuple = ctx->tuple_count,
+        };
+
+        for (unsigned t = 0; t < ARRAY_SIZE(clause.tuples); ++t) {
+                /* Another tuple moves the constants around, and can leave
+                 * room for fewer of them */
+                if (t && bi_assign_constants(ctx, &clause) > bi_constant_capacity(t + 1))
+                        break;
+
+                struct bifrost_tuple *tuple = &clause.tuples[t];
+                tuple->constant_slot = -1;
+                clause.tuple_count = t + 1;
+
+                bi_fill_slot(ctx, block, &clause, t, false);
+                bi_fill_slot(ctx, block, &clause, t, true);
+
+                if (!tuple->fma && !tuple->add) {
+                        clause.tuple_count = t;
+                        break;
+                }
+        }
+
+        assert(clause.tuple_count && "Nothing schedulable");
+
+        bi_close_clause(ctx, &clause);
+
+        return clause;
+}
+
+static void
+schedule_block(struct compiler_context *ctx, struct bifrost_block *block)
+{
+        util_dynarray_init(&block->clauses, NULL);
+
+        for (;;) {
+                bool done = true;
+
+                mir_foreach_instr_in_block(block, ins)
+                        done &= ins->scheduled;
+
+                if (done)
+                        break;
+
+                struct bifrost_clause clause = schedule_clause(ctx, block);
+                util_dynarray_append(&block->clauses, struct bifrost_clause, clause);
+
+                ctx->clause_count++;
+                ctx->tuple_count = clause.first_tuple + clause.tuple_count;
+        }
+}
+
+static bool
+bi_clause_reads(struct bifrost_clause *clause, unsigned index)
+{
+        for (unsigned t = 0; t < clause->tuple_count; ++t) {
+                struct bifrost_instruction *units[2] = { clause->tuples[t].fma, clause->tuples[t].add };
+
+                for (unsigned u = 0; u < 2; ++u) {
+                        if (!units[u])
+                                continue;
+
+                        if (units[u]->args.src0 == index || units[u]->args.src1 == index || units[u]->args.src2 == index)
+                                return true;
+                }
+        }
+
+        return false;
+}
+
+/* A message's data register is in use until the clause waiting on it */
+
+static void
+bi_retire(struct compiler_context *ctx, struct bifrost_instruction *message, unsigned tuple)
+{
+        unsigned index = bi_is_store(message) ? message->args.src0 : message->args.dest;
+        ctx->retire[index] = MAX2(ctx->retire[index], tuple);
+}
+
+/* Messages complete asynchronously, each tracked by one of the scoreboard
+ * slots, handed out round robin. A clause reading the result of a load waits
+ * on its slot first, as does the next clause to take the slot. Waits are
+ * encoded in the header of the clause before */
+
+#define BIFROST_SCOREBOARD_SLOTS 6
+
+static void
+assign_scoreboard(struct compiler_context *ctx)
+{
+        struct bifrost_instruction *pending[BIFROST_SCOREBOARD_SLOTS] = { NULL };
+        unsigned next_slot = 0;
+
+        mir_foreach_block(ctx, block) {
+                mir_foreach_clause_in_block(block, clause) {
+                        for (unsigned s = 0; s < BIFROST_SCOREBOARD_SLOTS; ++s) {
+                                struct bifrost_instruction *message = pending[s];
+
+                                if (!message)
+                                        continue;
+
+                                bool reuse = clause->message && s == next_slot;
+
+                                if (!reuse && (bi_is_store(message) || !bi_clause_reads(clause, message->args.dest)))
+                                        continue;
+
+                                clause->wait |= 1 << s;
+                                bi_retire(ctx, message, clause->first_tuple);
+                                pending[s] = NULL;
+                        }
+
+                        if (clause->message) {
+                                clause->header.scoreboard_index = next_slot;
+                                pending[next_slot] = clause->message;
+                                next_slot = (next_slot + 1) % BIFROST_SCOREBOARD_SLOTS;
+                        }
+                }
+        }
+
+        /* Never waited on, so in use until the end */
+        for (unsigned s = 0; s < BIFROST_SCOREBOARD_SLOTS; ++s) {
+                if (pending[s])
+                        bi_retire(ctx, pending[s], ctx->tuple_count);
+        }
+}
+
+static unsigned int
+bifrost_ra_select_callback(struct ra_graph *g, BITSET_WORD *regs, void *data)
+{
+        /* Choose the first available register to minimise reported register pressure */
+
+        for (int i = 0; i < 64; ++i) {
+                if (BITSET_TEST(regs, i)) {
+                        return i;
+                }
+        }
+
+        assert(0);
+        return 0;
+}
+
+/* Registers are allocated after scheduling, over tuple positions. A value
+ * becomes live once written back, after the tuple producing it, and dies with
+ * its last register read. Values only ever forwarded between tuples don't
+ * take a register at all */
+
+static struct ra_graph *
+allocate_registers(struct compiler_context *ctx)
+{
+        /* First, initialize the RA */
+        struct ra_regs *regs = ra_alloc_reg_set(NULL, 64, true);
+
+        int primary_class = ra_alloc_reg_class(regs);
+
+        /* Add the work registers, leaving the vertex and instance ID
+         * preloaded to r61 and r62 alone */
+        for (int i = 0; i < 64; ++i) {
+                if (i != 61 && i != 62)
+                        ra_class_add_reg(regs, primary_class, i);
+        }
+
+        /* We're done setting up */
+        ra_set_finalize(regs, NULL);
+
+        unsigned nodes = ctx->temp_count;
+        struct ra_graph *g = ra_alloc_interference_graph(regs, nodes);
+
+        for (unsigned i = 0; i < nodes; ++i) {
+                ra_set_node_class(g, i, primary_class);
+
+                if (ctx->pinned[i])
+                        ra_set_node_reg(g, i, ctx->pinned[i] - 1);
+        }
+
+        /* Determine liveness */
+
+        int *live_start = malloc(nodes * sizeof(int));
+        int *live_end = malloc(nodes * sizeof(int));
+
+        for (unsigned i = 0; i < nodes; ++i) {
+                struct bifrost_instruction *producer = ctx->producers[i];
+
+                live_start[i] = live_end[i] = -1;
+
+                if (!producer)
+                        continue;
+
+                /* Loads write their register on completion, but it's
+                 * reserved from issue */
+                if (bi_is_message(producer)) {
+                        ctx->needs_register[i] = true;
+                        live_start[i] = producer->tuple;
+                } else {
+                        ctx->needs_register[i] = bi_writes_register(ctx, producer);
+                        live_start[i] = producer->tuple + 1;
+                }
+
+                live_end[i] = MAX2(live_start[i], (int) ctx->retire[i]);
+
+                if (ctx->pinned[i])
+                        live_end[i] = ctx->tuple_count;
+
+                util_dynarray_foreach(&ctx->users[i], struct bifrost_instruction *, user) {
+                        struct bifrost_instruction *u = *user;
+                        unsigned srcs[3];
+                        unsigned count = bi_hw_sources(u, srcs);
+                        bool read = bi_is_store(u) && u->args.src0 == i;
+
+                        for (unsigned s = 0; s < count; ++s)
+                                read |= srcs[s] == i && bi_forward(ctx, u, i) == BI_FORWARD_NONE;
+
+                        if (read)
+                                live_end[i] = MAX2(live_end[i], (int) u->tuple);
+                }
+        }
+
+        /* Setup interference between nodes that are live at the same time */
+
+        for (unsigned i = 0; i < nodes; ++i) {
+                if (!ctx->needs_register[i])
+                        continue;
+
+                for (unsigned j = i + 1; j < nodes; ++j) {
+                        if (!ctx->needs_register[j])
+                                continue;
+
+                        if (!(live_start[i] > live_end[j] || live_start[j] > live_end[i]))
+                                ra_add_node_interference(g, i, j);
+                }
+        }
+
+        ra_set_select_reg_callback(g, bifrost_ra_select_callback, NULL);
+
+        if (!ra_allocate(g)) {
+                printf("Error allocating registers\n");
+                assert(0);
+        }
+
+        /* Cleanup */
+        free(live_start);
+        free(live_end);
+
+        for (unsigned i = 0; i < nodes; ++i) {
+                if (ctx->needs_register[i])
+                        ctx->work_registers = MAX2(ctx->work_registers, ra_get_node_reg(g, i) + 1);
+        }
+
+        return g;
+}
+
+static unsigned
+bi_register(struct ra_graph *g, unsigned index)
+{
+        if (index >= SSA_FIXED_MINIMUM)
+                return index - SSA_FIXED_MINIMUM;
+
+        return ra_get_node_reg(g, index);
+}
+
+/* Selects the 3-bit source field of each hardware source of an instruction */
+
+static void
+bi_source_fields(struct compiler_context *ctx, struct bifrost_clause *clause, struct bifrost_tuple *tuple,
+                 struct bifrost_instruction *ins, const unsigned *ports, unsigned port_count,
+                 struct ra_graph *g, unsigned *fields)
+{
+        unsigned srcs[3];
+        unsigned count = bi_hw_sources(ins, srcs);
+
+        for (unsigned i = 0; i < count; ++i) {
+                unsigned src = srcs[i];
+
+                if (bi_is_inline(src)) {
+                        if (src < SSA_CONSTANT_MINIMUM) {
+                                fields[i] = 4 + ((src - SSA_UNIFORM_MINIMUM) & 1);
+                        } else {
+                                uint64_t slot = clause->constants[tuple->constant_slot];
+                                fields[i] = (uint32_t) slot == bi_constant_value(ctx, src) ? 4 : 5;
+                        }
+
+                        continue;
+                }
+
+                switch (bi_forward(ctx, ins, src)) {
+                case BI_FORWARD_T:
+                        fields[i] = 3;
+                        continue;
+                case BI_FORWARD_T0:
+                        fields[i] = 6;
+                        continue;
+                case BI_FORWARD_T1:
+                        fields[i] = 7;
+                        continue;
+                default:
+                        break;
+                }
+
+                unsigned reg = bi_register(g, src);
+
+                for (unsigned p = 0; p < port_count; ++p) {
+                        if (ports[p] == reg)
+                                fields[i] = p;
+                }
+        }
+}
+
+static uint32_t
+bi_pack_fma(struct bifrost_instruction *ins, const unsigned *fields)
+{
+        if (!ins)
+                return bifrost_fma_op_nop << 3;
+
+        unsigned srcs[3];
+        unsigned count = bi_hw_sources(ins, srcs);
+        unsigned op = ins->fma.op;
+
+        if (op == bifrost_fma_op_fma_f32) {
+                /* a * b + -0, which keeps the sign of zero products */
+                op |= fields[1] | (3 << 3) | (1 << 15);
+                op |= (ins->src_neg[0] ^ ins->src_neg[1]) << 14;
+                op |= ins->src_abs[0] << 9;
+                op |= ins->src_abs[1] << 16;
+                op |= ins->outmod << 12;
+        } else if (ins->float_mods) {
+                /* A single source is added to -0 */
+                if (count > 1)
+                        op |= fields[1] | (ins->src_neg[1] << 5) | (ins->src_abs[1] << 3);
+                else
+                        op |= 3 | (1 << 5);
+
+                op |= ins->src_neg[0] << 4;
+                op |= ins->src_abs[0] << 9;
+                op |= ins->outmod << 12;
+        } else {
+                if (count > 1)
+                        op |= fields[1];
+
+                if (count > 2)
+                        op |= fields[2] << 3;
+        }
+
+        return fields[0] | (op << 3);
+}
+
+static uint32_t
+bi_pack_add(struct bifrost_instruction *ins, const unsigned *fields)
+{
+        if (!ins)
+                return bifrost_add_op_nop << 3;
+
+        unsigned srcs[3];
+        unsigned count = bi_hw_sources(ins, srcs);
+        unsigned op = ins->add.op;
+
+        if (ins->float_mods) {
+                assert(count == 2);
+
+                op |= fields[1];
+                op |= ins->src_abs[1] << 3;
+                op |= ins->src_neg[0] << 4;
+                op |= ins->src_neg[1] << 5;
+                op |= ins->src_abs[0] << 12;
+                op |= ins->outmod << 8;
+        } else {
+                if (count > 1)
+                        op |= fields[1];
+
+                if (count > 2)
+                        op |= fields[2] << 3;
+        }
+
+        return fields[0] | (op << 3);
+}
+
+/* Encodes the register block of a tuple: its reads, sorted over the ports,
+ * and the writes of the tuple before */
+
+static uint64_t
+bi_pack_registers(const unsigned *ports, unsigned port_count, int fma_write, int add_write, bool first, unsigned uniform_const)
+{
+        struct bifrost_regs regs = {
+                .uniform_const = uniform_const,
+        };
+
+        bool read3 = port_count > 2;
+        unsigned ctrl;
+
+        if (fma_write >= 0 && add_write >= 0) {
+                assert(!first && !read3);
+                ctrl = 15;
+                regs.reg3 = fma_write;
+                regs.reg2 = add_write;
+        } else if (fma_write >= 0) {
+                assert(!(first && read3));
+                ctrl = first ? 9 : (read3 ? 3 : 1);
+                regs.reg2 = fma_write;
+        } else if (add_write >= 0) {
+                assert(!(first && read3));
+                ctrl = first ? 13 : (read3 ? 6 : 5);
+                regs.reg2 = add_write;
+        } else {
+                ctrl = first ? (read3 ? 12 : 8) : (read3 ? 4 : 11);
+        }
+
+        if (read3)
+                regs.reg3 = ports[2];
+
+        if (port_count >= 2) {
+                unsigned reg0 = ports[0], reg1 = ports[1];
+
+                /* Port 0 has five bits; above that, both ports are stored
+                 * as 63 - reg, which flips their order */
+                if (reg0 > 31) {
+                        reg0 = 63 - reg0;
+                        reg1 = 63 - reg1;
+                }
+
+                regs.reg0 = reg0;
+                regs.reg1 = reg1;
+                regs.ctrl = ctrl;
+        } else {
+                /* Port 1 is free, so it holds the control along with the top
+                 * bit of port 0, or a flag that port 0 is unused */
+                regs.reg1 = ctrl << 2;
+
+                if (port_count) {
+                        regs.reg0 = ports[0] & 0x1f;
+                        regs.reg1 |= ports[0] >> 5;
+                } else {
+                        regs.reg1 |= 1 << 1;
+                }
+        }
+
+        uint64_t bits = 0;
+        memcpy(&bits, &regs, sizeof(regs));
+        return bits;
+}
+
+/* Packed instruction, as laid out across the clause quadwords */
+
+struct bi_packed_tuple {
+        uint32_t fma;
+        uint32_t add;
+        uint64_t regs;
+};
+
+static void
+bi_pack_tuple(struct compiler_context *ctx, struct ra_graph *g, struct bifrost_clause *clause, unsigned t, struct bi_packed_tuple *packed)
+{
+        struct bifrost_tuple *tuple = &clause->tuples[t];
+        struct bifrost_tuple *prev = &clause->tuples[t ? t - 1 : clause->tuple_count - 1];
+
+        unsigned reads[6];
+        unsigned port_count = bi_tuple_reads(ctx, tuple, reads);
+
+        unsigned ports[3];
+        assert(port_count <= 3);
+
+        for (unsigned i = 0; i < port_count; ++i) {
+                unsigned reg = bi_register(g, reads[i]);
+                unsigned j = i;
+
+                for (; j > 0 && ports[j - 1] > reg; --j)
+                        ports[j] = ports[j - 1];
+
+                ports[j] = reg;
+        }
+
+        unsigned uniform_const = 0;
+
+        if (tuple->constant_slot >= 0) {
+                static const unsigned slot_codes[6] = { 4, 5, 6, 7, 2, 3 };
+                uniform_const = (slot_codes[tuple->constant_slot] << 4) |
+                                (clause->constants[tuple->constant_slot] & 0xf);
+        } else {
+                struct bifrost_instruction *units[2] = { tuple->fma, tuple->add };
+
+                for (unsigned u = 0; u < 2; ++u) {
+                        if (!units[u])
+                                continue;
+
+                        unsigned srcs[3];
+                        unsigned count = bi_hw_sources(units[u], srcs);
+
+                        for (unsigned i = 0; i < count; ++i) {
+                                if (bi_is_inline(srcs[i]))
+                                        uniform_const = 0x80 | ((srcs[i] - SSA_UNIFORM_MINIMUM) >> 1);
+                        }
+                }
+        }
+
+        bool fma_write, add_write;
+        bi_tuple_writes(ctx, prev, &fma_write, &add_write);
+
+        packed->regs = bi_pack_registers(ports, port_count,
+                                         fma_write ? (int) bi_register(g, prev->fma->args.dest) : -1,
+                                         add_write ? (int) bi_register(g, prev->add->args.dest) : -1,
+                                         t == 0, uniform_const);
+
+        unsigned fields[3] = { 0 };
+
+        if (tuple->fma)
+                bi_source_fields(ctx, clause, tuple, tuple->fma, ports, port_count, g, fields);
+
+        packed->fma = bi_pack_fma(tuple->fma, fields);
+
+        memset(fields, 0, sizeof(fields));
+
+        if (tuple->add)
+                bi_source_fields(ctx, clause, tuple, tuple->add, ports, port_count, g, fields);
+
+        packed->add = bi_pack_add(tuple->add, fields);
+}
+
+/* Placement of instructions and constants within the quadwords of a clause,
+ * each quadword being four 32-bit words tagged in the low byte */
+
+static void
+bi_place_main(uint32_t *w, struct bi_packed_tuple *p)
+{
+        w[0] |= (p->regs & 0xffffff) << 8;
+        w[1] |= (p->regs >> 24) & 0x7ff;
+        w[1] |= (p->fma & 0x1fffff) << 11;
+        w[2] |= (p->fma >> 21) & 0x3;
+        w[2] |= (p->add & 0x1ffff) << 2;
+}
+
+static void
+bi_place_partial(uint32_t *w, struct bi_packed_tuple *p)
+{
+        w[2] |= (p->regs & 0x1fff) << 19;
+        w[3] |= (p->regs >> 13) & 0x3fffff;
+        w[3] |= (p->fma & 0x3ff) << 22;
+}
+
+static void
+bi_place_tail(uint32_t *w, struct bi_packed_tuple *p)
+{
+        w[2] |= ((p->fma >> 10) & 0x1fff) << 19;
+        w[3] |= p->add & 0x1ffff;
+}
+
+static unsigned
+bi_add_high(struct bi_packed_tuple *p)
+{
+        return p->add >> 17;
+}
+
+static void
+bi_place_header(uint32_t *w, uint64_t header)
+{
+        w[2] |= (header & 0x1fff) << 19;
+        w[3] |= header >> 13;
+}
+
+static void
+bi_place_constant0(uint32_t *w, uint64_t c)
+{
+        w[0] |= ((c >> 4) & 0xffffff) << 8;
+        w[1] |= c >> 28;
+        w[2] |= (c >> 60) & 0xf;
+}
+
+static void
+bi_place_constant1(uint32_t *w, uint64_t c)
+{
+        w[2] |= ((c >> 4) & 0xfffffff) << 4;
+        w[3] |= c >> 32;
+}
+
+/* Constants split across two quadwords, for 5 and 8 tuples */
+
+static void
+bi_place_constant_low(uint32_t *w, uint64_t c)
+{
+        w[3] |= ((c >> 4) & 0x7fff) << 17;
+}
+
+static void
+bi_place_constant_high(uint32_t *w, uint64_t c)
+{
+        w[2] |= ((c >> 19) & 0x1fff) << 19;
+        w[3] |= c >> 32;
+}
+
+static void
+emit_clause(struct compiler_context *ctx, struct ra_graph *g, struct bifrost_clause *clause,
+            struct bifrost_clause *next, struct util_dynarray *emission)
+{
+        unsigned n = clause->tuple_count;
+        struct bi_packed_tuple p[8];
+
+        bi_assign_constants(ctx, clause);
+
+        for (unsigned t = 0; t < n; ++t)
+                bi_pack_tuple(ctx, g, clause, t, &p[t]);
+
+        /* Fill out the header */
+
+        struct bifrost_header header = clause->header;
+        header.suppress_inf = true;
+        header.suppress_nan = true;
+        header.elide_writes = ctx->stage == MESA_SHADER_FRAGMENT;
+        header.no_end_of_shader = next != NULL;
+        header.back_to_back = next != NULL;
+        header.branch_cond = next != NULL;
+
+        if (clause->message) {
+                struct bifrost_instruction *message = clause->message;
+                unsigned data = bi_is_store(message) ? message->args.src0 : message->args.dest;
+
+                header.datareg = bi_register(g, data);
+                header.clause_type = bi_is_store(message) ? bifrost_clause_type_store : bifrost_clause_type_load;
+        }
+
+        if (next) {
+                header.scoreboard_deps = next->wait;
+                header.next_clause_type = next->message ?
+                        (bi_is_store(next->message) ? bifrost_clause_type_store : bifrost_clause_type_load) : 0;
+        }
+
+        uint64_t header_bits = 0;
+        memcpy(&header_bits, &header, sizeof(header));
+
+        /* Quadwords holding the instructions */
+
+        uint32_t q[6][4];
+        unsigned quads = 0;
+        memset(q, 0, sizeof(q));
+
+        bool embedded = bifrost_embedded_constant[n - 1];
+        uint64_t e = clause->constant_count ? clause->constants[0] : 0;
+        unsigned base = embedded ? 1 : 0;
+        unsigned constant_quads = clause->constant_count > base ? DIV_ROUND_UP(clause->constant_count - base, 2) : 0;
+
+        if (n == 1) {
+                q[0][0] = 0x08 | bi_add_high(&p[0]);
+                bi_place_main(q[0], &p[0]);
+                bi_place_header(q[0], header_bits);
+                quads = 1;
+        } else {
+                q[0][0] = 0x28 | bi_add_high(&p[0]);
+                bi_place_main(q[0], &p[0]);
+                bi_place_header(q[0], header_bits);
+
+                if (n == 2) {
+                        q[1][0] = 0x03;
+                        bi_place_main(q[1], &p[1]);
+                        q[1][3] |= bi_add_high(&p[1]) << 29;
+                        quads = 2;
+                } else {
+                        q[1][0] = 0x20 | bi_add_high(&p[1]);
+                        bi_place_main(q[1], &p[1]);
+                        bi_place_partial(q[1], &p[2]);
+                }
+        }
+
+        if (n == 3) {
+                q[2][0] = 0x04;
+                bi_place_constant0(q[2], e);
+                bi_place_tail(q[2], &p[2]);
+                q[2][3] |= bi_add_high(&p[2]) << 29;
+                quads = 3;
+        } else if (n == 4 || n >= 6) {
+                q[2][0] = n == 4 ? 0x05 : 0x01;
+                bi_place_tail(q[2], &p[2]);
+                q[2][3] |= bi_add_high(&p[2]) << 29;
+                bi_place_main(q[2], &p[3]);
+                q[2][3] |= bi_add_high(&p[3]) << 26;
+                quads = 3;
+        } else if (n == 5) {
+                q[2][0] = 0x80 | (bi_add_high(&p[3]) << 3) | bi_add_high(&p[2]);
+                bi_place_tail(q[2], &p[2]);
+                bi_place_main(q[2], &p[3]);
+                bi_place_constant_low(q[2], e);
+
+                q[3][0] = 0x10 | bi_add_high(&p[4]);
+                bi_place_main(q[3], &p[4]);
+                bi_place_constant_high(q[3], e);
+                quads = 4;
+        }
+
+        if (n >= 6) {
+                q[3][0] = 0x60 | bi_add_high(&p[4]);
+                bi_place_main(q[3], &p[4]);
+                bi_place_partial(q[3], &p[5]);
+
+                if (n == 6) {
+                        q[4][0] = 0x06;
+                        bi_place_constant0(q[4], e);
+                        bi_place_tail(q[4], &p[5]);
+                        q[4][3] |= bi_add_high(&p[5]) << 29;
+                        quads = 5;
+                } else if (n == 7) {
+                        q[4][0] = 0x07;
+                        bi_place_tail(q[4], &p[5]);
+                        q[4][3] |= bi_add_high(&p[5]) << 29;
+                        bi_place_main(q[4], &p[6]);
+                        q[4][3] |= bi_add_high(&p[6]) << 26;
+                        quads = 5;
+                } else {
+                        q[4][0] = 0xc0 | (bi_add_high(&p[6]) << 3) | bi_add_high(&p[5]);
+                        bi_place_tail(q[4], &p[5]);
+                        bi_place_main(q[4], &p[6]);
+                        bi_place_constant_low(q[4], e);
+
+                        q[5][0] = 0x18 | bi_add_high(&p[7]);
+                        bi_place_main(q[5], &p[7]);
+                        bi_place_constant_high(q[5], e);
+                        quads = 6;
+                }
+        }
+
+        /* The last quadword of the clause carries the stop bit */
+        if (!constant_quads)
+                q[quads - 1][0] |= 0x40;
+
+        memcpy(util_dynarray_grow(emission, quads * sizeof(q[0])), q, quads * sizeof(q[0]));
+
+        /* Followed by the remaining constants, two to a quadword */
+
+        for (unsigned c = 0; c < constant_quads; ++c) {
+                uint32_t w[4] = { 0 };
+                unsigned idx = base + 2 * c;
+
+                w[0] = 0x30 | bifrost_constant_pos[n - 1][c];
+
+                if (c + 1 == constant_quads)
+                        w[0] |= 0x40;
+
+                bi_place_constant0(w, clause->constants[idx]);
+
+                if (idx + 1 < clause->constant_count)
+                        bi_place_constant1(w, clause->constants[idx + 1]);
+
+                memcpy(util_dynarray_grow(emission, sizeof(w)), w, sizeof(w));
+        }
+}
+
+static void
+schedule_program(struct compiler_context *ctx, struct bifrost_program *program)
+{
+        index_temps(ctx);
+
+        mir_foreach_block(ctx, block) {
+                schedule_block(ctx, block);
+        }
+
+        assign_scoreboard(ctx);
+
+        struct ra_graph *g = allocate_registers(ctx);
+
+        /* Emit, in execution order */
+
+        util_dynarray_init(&program->compiled, NULL);
+
+        struct bifrost_clause *prev = NULL;
+
+        mir_foreach_block(ctx, block) {
+                mir_foreach_clause_in_block(block, clause) {
+                        if (prev)
+                                emit_clause(ctx, g, prev, clause, &program->compiled);
+
+                        prev = clause;
+                }
+        }
+
+        if (prev)
+                emit_clause(ctx, g, prev, NULL, &program->compiled);
+
+        program->instruction_count = 0;
+        program->tuple_count = 0;
+        program->constant_count = 0;
+
+        mir_foreach_block(ctx, block) {
+                mir_foreach_clause_in_block(block, clause) {
+                        program->instruction_count += clause->instruction_count;
+                        program->tuple_count += clause->tuple_count;
+                        program->constant_count += clause->constant_count;
+                }
+        }
+
+        program->nop_count = program->tuple_count * 2 - program->instruction_count;
+        program->clause_count = ctx->clause_count;
+        program->work_register_count = ctx->work_registers;
+
+        for (unsigned i = 0; i < ctx->temp_count; ++i)
+                util_dynarray_fini(&ctx->users[i]);
+
+        free(ctx->producers);
+        free(ctx->users);
+        free(ctx->pinned);
+        free(ctx->needs_register);
+        free(ctx->retire);
+}
+
+int
+bifrost_compile_shader_nir(nir_shader *nir, struct bifrost_program *program) {
+        struct compiler_context ictx = {
+                .nir = nir,
+                .stage = nir->info.stage,
+        };
+
+        struct compiler_context *ctx = &ictx;
+
+        /* Assign var locations early, so the epilogue can use them if necessary */
+
+        nir_assign_var_locations(&nir->outputs, &nir->num_outputs, glsl_type_size);
+        nir_assign_var_locations(&nir->inputs, &nir->num_inputs, glsl_type_size);
+        nir_assign_var_locations(&nir->uniforms, &nir->num_uniforms, glsl_type_size);
+
+        /* Initialize at a global (not block) level hash tables */
+        ctx->ssa_constants = _mesa_hash_table_u64_create(NULL);
+        ctx->ssa_uniforms = _mesa_hash_table_u64_create(NULL);
+        ctx->ssa_to_register = _mesa_hash_table_u64_create(NULL);
+        ctx->hash_to_temp = _mesa_hash_table_u64_create(NULL);
+        util_dynarray_init(&ctx->constants, NULL);
+
+        /* Assign actual uniform location, skipping over samplers */
+        ctx->uniform_nir_to_bi  = _mesa_hash_table_u64_create(NULL);
+
+        nir_foreach_variable(var, &nir->uniforms) {
+                if (glsl_get_base_type(var->type) == GLSL_TYPE_SAMPLER) continue;
+
+                for (int col = 0; col < glsl_get_matrix_columns(var->type); ++col) {
+                        int id = ctx->uniform_count++;
+                        _mesa_hash_table_u64_insert(ctx->uniform_nir_to_bi, var->data.driver_location + col + 1, (void *) ((uintptr_t) (id + 1)));
+                }
+        }
+
+        if (ctx->stage == MESA_SHADER_VERTEX) {
+                ctx->varying_nir_to_bi = _mesa_hash_table_u64_create(NULL);
+
+                nir_foreach_variable(var, &nir->outputs) {
+                        if (var->data.location < VARYING_SLOT_VAR0) {
+                                if (var->data.location == VARYING_SLOT_POS)
+                                        _mesa_hash_table_u64_insert(ctx->varying_nir_to_bi, var->data.driver_location + 1, (void *) ((uintptr_t) (1)));
+
+                                continue;
+                        }
+
+                        for (int col = 0; col < glsl_get_matrix_columns(var->type); ++col) {
+                                for (int comp = 0; comp < 4; ++comp) {
+                                        int id = comp + ctx->varying_count++;
+                                        _mesa_hash_table_u64_insert(ctx->varying_nir_to_bi, var->data.driver_location + col + comp + 1, (void *) ((uintptr_t) (id + 1)));
+                                }
+                        }
+                }
+        }
+
+        /* Lower vars -- not I/O -- before epilogue */
+
+        NIR_PASS_V(nir, nir_lower_var_copies);
+        NIR_PASS_V(nir, nir_lower_vars_to_ssa);
+        NIR_PASS_V(nir, nir_split_var_copies);
+        NIR_PASS_V(nir, nir_lower_var_copies);
+        NIR_PASS_V(nir, nir_lower_global_vars_to_local);
+        NIR_PASS_V(nir, nir_lower_var_copies);
+        NIR_PASS_V(nir, nir_lower_vars_to_ssa);
+        NIR_PASS_V(nir, nir_lower_io, nir_var_all, glsl_type_size, 0);
+
+        /* Inline everything into main, the only function we emit */
+        NIR_PASS_V(nir, nir_lower_returns);
+        NIR_PASS_V(nir, nir_inline_functions);
+
+        foreach_list_typed_safe(nir_function, func, node, &nir->functions) {
+                if (strcmp(func->name, "main") != 0)
+                        exec_node_remove(&func->node);
+        }
+
+        /* Optimisation passes */
+        optimize_nir(nir);
+
+        nir_print_shader(nir, stdout);
+
+        nir_foreach_function(func, nir) {
+                if (!func->impl)
+                        continue;
+
+                list_inithead(&ctx->blocks);
+                ctx->block_count = 0;
+                ctx->func = func;
+
+                emit_cf_list(ctx, &func->impl->body);
+                emit_block(ctx, func->impl->end_block);
+
+                break; /* Only main is left after inlining */
+        }
+
+        /* Schedule, allocate registers and pack */
+        schedule_program(ctx, program);
+
+        util_dynarray_fini(&ctx->constants);
 
         return 0;
 }
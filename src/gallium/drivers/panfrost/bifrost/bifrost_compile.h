@@ -25,8 +25,19 @@
 #define __bifrost_compile_h__
 
 #include "compiler/nir/nir.h"
+#include "util/u_dynarray.h"
 
 struct bifrost_program {
+        /* Packed clauses, in execution order */
+        struct util_dynarray compiled;
+
+        /* Shader statistics */
+        unsigned instruction_count;
+        unsigned tuple_count;
+        unsigned nop_count;
+        unsigned clause_count;
+        unsigned constant_count;
+        unsigned work_register_count;
 };
 
 int
@@ -29,6 +29,16 @@
 #include "util/u_dynarray.h"
 #include "main/mtypes.h"
 
+static void
+print_stats(gl_shader_stage stage, struct bifrost_program *compiled)
+{
+        printf("%s shader: %u instructions, %u tuples, %u nops, %u clauses, %u constants, %u registers\n",
+               stage == MESA_SHADER_VERTEX ? "Vertex" : "Fragment",
+               compiled->instruction_count, compiled->tuple_count,
+               compiled->nop_count, compiled->clause_count,
+               compiled->constant_count, compiled->work_register_count);
+}
+
 static void
 compile_shader(char **argv)
 {
@@ -43,12 +53,18 @@ compile_shader(char **argv)
         prog = standalone_compile_shader(&options, 2, argv);
         prog->_LinkedShaders[MESA_SHADER_FRAGMENT]->Program->info.stage = MESA_SHADER_FRAGMENT;
 
-        struct bifrost_program compiled;
-        nir = glsl_to_nir(prog, MESA_SHADER_VERTEX, &bifrost_nir_options);
-        bifrost_compile_shader_nir(nir, &compiled);
+        for (unsigned i = 0; i < 2; ++i) {
+                gl_shader_stage stage = i ? MESA_SHADER_FRAGMENT : MESA_SHADER_VERTEX;
+                struct bifrost_program compiled;
 
-        nir = glsl_to_nir(prog, MESA_SHADER_FRAGMENT, &bifrost_nir_options);
-        bifrost_compile_shader_nir(nir, &compiled);
+                nir = glsl_to_nir(prog, stage, &bifrost_nir_options);
+                bifrost_compile_shader_nir(nir, &compiled);
+
+                disassemble_bifrost(compiled.compiled.data, compiled.compiled.size);
+                print_stats(stage, &compiled);
+
+                util_dynarray_fini(&compiled.compiled);
+        }
 }
 
 static void
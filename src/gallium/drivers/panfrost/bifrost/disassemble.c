@@ -51,15 +51,6 @@ struct bifrost_alu_inst {
         uint64_t reg_bits;
 };
 
-struct bifrost_regs {
-        unsigned uniform_const : 8;
-        unsigned reg2 : 6;
-        unsigned reg3 : 6;
-        unsigned reg0 : 5;
-        unsigned reg1 : 6;
-        unsigned ctrl : 4;
-};
-
 static unsigned get_reg0(struct bifrost_regs regs)
 {
         if (regs.ctrl == 0)
@@ -45,6 +45,10 @@ enum bifrost_op_type {
         TAG_LOAD_STORE_UBO_3,
         TAG_LOAD_STORE_UBO_4,
         TAG_FMA_OP,
+        TAG_ADD_OP,
+
+        /* Can issue on either unit */
+        TAG_ALU_OP,
 };
 
 /**
@@ -61,13 +65,38 @@ struct bifrost_instruction {
          */
         struct ssa_args args;
 
+        /* Float source modifiers and output modifier, for the ops taking
+         * them */
+        bool float_mods;
+        bool src_neg[3];
+        bool src_abs[3];
+        unsigned outmod;
+
         bool scheduled;
 
-        // Unionize all the hardware encoded instructions
-        union {
-                struct bifrost_fma_inst fma;
-                struct bifrost_add_inst add;
-        };
+        /* Placement once scheduled: the index of the clause, the global index
+         * of the tuple, and the unit within the tuple */
+        unsigned clause;
+        unsigned tuple;
+        bool add_unit;
+
+        /* The op on each unit it can issue on. Sources are filled in at pack
+         * time */
+        struct bifrost_fma_inst fma;
+        struct bifrost_add_inst add;
+};
+
+/**
+ * @brief A pair of instructions issued together, one on each unit. Either may
+ * be NULL, in which case a NOP is packed in its place
+ */
+struct bifrost_tuple {
+        struct bifrost_instruction *fma;
+        struct bifrost_instruction *add;
+
+        /* Index of the constant slot read through the uniform/const port, or
+         * -1 */
+        int constant_slot;
 };
 
 /**
@@ -80,10 +109,23 @@ struct bifrost_clause {
         struct bifrost_header header;
 
         uint32_t instruction_count;
-        /**
-         * @brief List of bifrost_instructions for the clause
-         */
-        struct util_dynarray instructions;
+
+        /* Global index of the first tuple */
+        uint32_t first_tuple;
+
+        uint32_t tuple_count;
+        struct bifrost_tuple tuples[8];
+
+        /* 64-bit constants embedded in the clause */
+        uint32_t constant_count;
+        uint64_t constants[6];
+
+        /* The load or store in this clause, if any. There is one data
+         * register per clause, so only one message is sent per clause */
+        struct bifrost_instruction *message;
+
+        /* Scoreboard slots to wait on before this clause runs */
+        uint32_t wait;
 };
 
 struct bifrost_block {
@@ -120,6 +162,16 @@ struct compiler_context {
         /* Constants which have been loaded, for later inlining */
         struct hash_table_u64 *ssa_constants;
 
+        /* Uniforms which have been loaded, read directly through the uniform
+         * port */
+        struct hash_table_u64 *ssa_uniforms;
+
+        /* Pool of 32-bit constants referenced by SSA_CONSTANT sources */
+        struct util_dynarray constants;
+
+        /* Indices handed out for moves the compiler inserts itself */
+        uint32_t generated_count;
+
         /* Actual SSA-to-register for RA */
         struct hash_table_u64 *ssa_to_register;
 
@@ -137,13 +189,47 @@ struct compiler_context {
 
         /* Count of instructions emitted from NIR overall, across all blocks */
         uint32_t instruction_count;
+
+        /* Per temp: the instruction writing it, and every instruction reading
+         * it, filled in before scheduling */
+        struct bifrost_instruction **producers;
+        struct util_dynarray *users;
+
+        /* Per temp: the register it's pinned to plus one, or zero */
+        unsigned *pinned;
+
+        /* Per temp, after scheduling: whether the value has to live in a
+         * register, rather than only being forwarded between tuples */
+        bool *needs_register;
+
+        /* Per temp, after scheduling: the tuple a load or store's data
+         * register is known to be free again */
+        unsigned *retire;
+
+        uint32_t clause_count;
+        uint32_t tuple_count;
+
+        /* Highest work register used, plus one */
+        uint32_t work_registers;
 };
 
 #define mir_foreach_block(ctx, v) list_for_each_entry(struct bifrost_block, v, &ctx->blocks, link)
 #define mir_foreach_block_from(ctx, from, v) list_for_each_entry_from(struct bifrost_block, v, from, &ctx->blocks, link)
 #define mir_foreach_instr(ctx, v) list_for_each_entry(struct bifrost_instruction, v, &ctx->current_block->instructions, link)
 #define mir_foreach_instr_in_block(block, v) list_for_each_entry(struct bifrost_instruction, v, &block->instructions, link)
+#define mir_foreach_clause_in_block(block, v) util_dynarray_foreach(&block->clauses, struct bifrost_clause, v)
+
+/* Indices of moves the compiler inserts itself, above any index taken from
+ * NIR */
+#define SSA_GENERATED_MINIMUM (1 << 20)
 
+/* Sources at or above SSA_FIXED_MINIMUM bypass RA: fixed registers, uniforms
+ * read through the uniform port, and constants, found in the constant pool */
 #define SSA_FIXED_MINIMUM (1 << 24)
+#define SSA_FIXED_REGISTER(reg) (SSA_FIXED_MINIMUM + (reg))
+#define SSA_UNIFORM_MINIMUM (SSA_FIXED_MINIMUM + 64)
+#define SSA_UNIFORM(u) (SSA_UNIFORM_MINIMUM + (u))
+#define SSA_CONSTANT_MINIMUM (SSA_UNIFORM_MINIMUM + 256)
+#define SSA_CONSTANT(c) (SSA_CONSTANT_MINIMUM + (c))
 
 #endif
@@ -5,7 +5,7 @@ void
 print_mir_instruction(struct bifrost_instruction *ins)
 {
         // XXX: prettify this
-        printf("\t%d ", ins->add.op);
+        printf("\t%d ", ins->type == TAG_FMA_OP ? ins->fma.op : ins->add.op);
 
         printf("<%d %d %d %d>",
                 ins->args.dest,
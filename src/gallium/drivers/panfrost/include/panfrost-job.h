@@ -84,6 +84,9 @@ enum mali_gl_mode {
 
 #define MALI_GL_OCCLUSION_BOOLEAN 0x8
 
+/* With the above, count the samples passed instead of setting a boolean */
+#define MALI_GL_OCCLUSION_PRECISE 0x10
+
 /* TODO: Might this actually be a finer bitfield? */
 #define MALI_DEPTH_STENCIL_ENABLE 0x6400
 
@@ -822,6 +825,7 @@ struct mali_uniform_buffer_meta {
 #define MALI_DRAW_INDEXED_UINT8  (0x10)
 #define MALI_DRAW_INDEXED_UINT16 (0x20)
 #define MALI_DRAW_INDEXED_UINT32 (0x30)
+#define MALI_DRAW_INDEXED_SIZE   (0x30)
 
 struct mali_vertex_tiler_prefix {
         /* This is a dynamic bitfield containing the following things in this order:
@@ -418,8 +418,12 @@ typedef struct compiler_context {
         /* Alpha ref value passed in */
         float alpha_ref;
 
-        /* The index corresponding to the fragment output */
-        unsigned fragment_output;
+        /* The index corresponding to each render target's fragment output,
+         * or -1 if the render target isn't written */
+        int fragment_outputs[MIDGARD_MAX_RTS];
+
+        /* For a blend shader, the render target blended */
+        unsigned blend_rt;
 } compiler_context;
 
 /* Append instruction to end of current block */
@@ -752,6 +756,29 @@ midgard_is_pinned(compiler_context *ctx, int index)
         return _mesa_hash_table_u64_search(ctx->ssa_to_register, index + 1) != NULL;
 }
 
+/* Maps a fragment output's driver location to the render target it writes,
+ * or -1 for outputs that aren't colours */
+
+static int
+fragment_output_rt(compiler_context *ctx, unsigned driver_location)
+{
+        nir_foreach_variable(var, &ctx->nir->outputs) {
+                if (var->data.driver_location != driver_location)
+                        continue;
+
+                if (var->data.location == FRAG_RESULT_COLOR)
+                        return 0;
+
+                if (var->data.location >= FRAG_RESULT_DATA0 &&
+                    var->data.location < FRAG_RESULT_DATA0 + MIDGARD_MAX_RTS)
+                        return var->data.location - FRAG_RESULT_DATA0;
+
+                return -1;
+        }
+
+        return -1;
+}
+
 /* Do not actually emit a load; instead, cache the constant for inlining */
 
 static void
@@ -1344,12 +1371,24 @@ emit_intrinsic(compiler_context *ctx, nir_intrinsic_instr *instr)
                          * framebuffer writeout dance. TODO: Defer
                          * writes */
 
-                        midgard_pin_output(ctx, reg, 0);
+                        int rt = fragment_output_rt(ctx, offset);
+
+                        if (rt < 0) {
+                                printf("WARNING: skipping fragment output\n");
+                                break;
+                        }
+
+                        /* The first render target is written straight
+                         * from r0; the others are moved in turn by the
+                         * epilogue */
+
+                        if (rt == 0)
+                                midgard_pin_output(ctx, reg, 0);
 
                         /* Save the index we're writing to for later reference
                          * in the epilogue */
 
-                        ctx->fragment_output = reg;
+                        ctx->fragment_outputs[rt] = reg;
                 } else if (ctx->stage == MESA_SHADER_VERTEX) {
                         /* Varyings are written into one of two special
                          * varying register, r26 or r27. The register itself is selected as the register
@@ -1711,6 +1750,13 @@ allocate_registers(compiler_context *ctx)
         for (int i = 0; i < work_count; ++i)
                 ra_class_add_reg(regs, primary_class, i);
 
+        /* Outputs of render targets past the first stay live while the
+         * epilogue writes out the others through r0 and r1 */
+        int mrt_class = ra_alloc_reg_class(regs);
+
+        for (int i = 2; i < work_count; ++i)
+                ra_class_add_reg(regs, mrt_class, i);
+
         /* Add special registers */
         ra_class_add_reg(regs, varying_class, REGISTER_VARYING_BASE);
         ra_class_add_reg(regs, varying_class, REGISTER_VARYING_BASE + 1);
@@ -1752,6 +1798,18 @@ allocate_registers(compiler_context *ctx)
                 }
         }
 
+        for (unsigned rt = 1; rt < MIDGARD_MAX_RTS; ++rt) {
+                int output = ctx->fragment_outputs[rt];
+
+                if (output < 0 || _mesa_hash_table_u64_search(ctx->ssa_constants, output + 1))
+                        continue;
+
+                int t = find_or_allocate_temp(ctx, output);
+
+                if (t < nodes)
+                        ra_set_node_class(g, t, mrt_class);
+        }
+
         for (int index = 0; index <= ctx->max_hash; ++index) {
                 unsigned temp = (uintptr_t) _mesa_hash_table_u64_search(ctx->ssa_to_register, index + 1);
 
@@ -3023,26 +3081,71 @@ transform_position_writes(nir_shader *shader)
         }
 }
 
+/* With multiple render targets, the writeout branch writes r0 to the render
+ * target selected by r1.z, in units of 0x100 */
+
+static void
+emit_render_target_select(compiler_context *ctx, unsigned rt)
+{
+        midgard_instruction ins = {
+                .type = TAG_ALU_4,
+                .inline_constant = rt * 0x100,
+                .ssa_args = {
+                        .src0 = SSA_UNUSED_1,
+                        .src1 = SSA_UNUSED_0,
+                        .dest = SSA_FIXED_REGISTER(1),
+                        .inline_constant = true
+                },
+                .alu = {
+                        .op = midgard_alu_op_imov,
+                        .reg_mode = midgard_reg_mode_full,
+                        .dest_override = midgard_dest_override_none,
+                        .mask = 0x3 << 4, /* z */
+                        .src1 = vector_alu_srco_unsigned(zero_alu_src),
+                        .src2 = vector_alu_srco_unsigned(blank_alu_src)
+                },
+        };
+
+        emit_mir_instruction(ctx, ins);
+        ctx->work_registers = MAX2(ctx->work_registers, 1);
+}
+
 static void
 emit_fragment_epilogue(compiler_context *ctx)
 {
-        /* Special case: writing out constants requires us to include the move
-         * explicitly now, so shove it into r0 */
+        for (unsigned rt = 0; rt < MIDGARD_MAX_RTS; ++rt) {
+                int output = ctx->fragment_outputs[rt];
 
-        void *constant_value = _mesa_hash_table_u64_search(ctx->ssa_constants, ctx->fragment_output + 1);
+                if (output < 0)
+                        continue;
 
-        if (constant_value) {
-                midgard_instruction ins = v_fmov(SSA_FIXED_REGISTER(REGISTER_CONSTANT), blank_alu_src, SSA_FIXED_REGISTER(0));
-                attach_constants(ctx, &ins, constant_value, ctx->fragment_output + 1);
-                emit_mir_instruction(ctx, ins);
-        }
+                /* Special case: writing out constants requires us to include
+                 * the move explicitly now, so shove it into r0. Render
+                 * targets past the first aren't pinned, so they always need
+                 * the move */
 
-        /* Perform the actual fragment writeout. We have two writeout/branch
-         * instructions, forming a loop until writeout is successful as per the
-         * docs. TODO: gl_FragDepth */
+                void *constant_value = _mesa_hash_table_u64_search(ctx->ssa_constants, output + 1);
 
-        EMIT(alu_br_compact_cond, midgard_jmp_writeout_op_writeout, TAG_ALU_4, 0, midgard_condition_always);
-        EMIT(alu_br_compact_cond, midgard_jmp_writeout_op_writeout, TAG_ALU_4, -1, midgard_condition_always);
+                if (constant_value) {
+                        midgard_instruction ins = v_fmov(SSA_FIXED_REGISTER(REGISTER_CONSTANT), blank_alu_src, SSA_FIXED_REGISTER(0));
+                        attach_constants(ctx, &ins, constant_value, output + 1);
+                        emit_mir_instruction(ctx, ins);
+                } else if (rt > 0) {
+                        /* Aliases were already resolved for the block */
+                        map_ssa_to_alias(ctx, &ctx->fragment_outputs[rt]);
+                        emit_mir_instruction(ctx, v_fmov(ctx->fragment_outputs[rt], blank_alu_src, SSA_FIXED_REGISTER(0)));
+                }
+
+                if (rt > 0)
+                        emit_render_target_select(ctx, rt);
+
+                /* Perform the actual fragment writeout. We have two
+                 * writeout/branch instructions, forming a loop until writeout
+                 * is successful as per the docs. TODO: gl_FragDepth */
+
+                EMIT(alu_br_compact_cond, midgard_jmp_writeout_op_writeout, TAG_ALU_4, 0, midgard_condition_always);
+                EMIT(alu_br_compact_cond, midgard_jmp_writeout_op_writeout, TAG_ALU_4, -1, midgard_condition_always);
+        }
 }
 
 /* For the blend epilogue, we need to convert the blended fragment vec4 (stored
@@ -3123,6 +3226,9 @@ emit_blend_epilogue(compiler_context *ctx)
 
         /* Emit branch epilogue with the 8-bit move as the source */
 
+        if (ctx->blend_rt > 0)
+                emit_render_target_select(ctx, ctx->blend_rt);
+
         emit_mir_instruction(ctx, imov_8);
         EMIT(alu_br_compact_cond, midgard_jmp_writeout_op_writeout, TAG_ALU_4, 0, midgard_condition_always);
 
@@ -3332,11 +3438,15 @@ midgard_compile_shader_nir(nir_shader *nir, midgard_program *program, bool is_bl
                 .is_blend = is_blend,
                 .blend_constant_offset = -1,
 
-                .alpha_ref = program->alpha_ref
+                .alpha_ref = program->alpha_ref,
+                .blend_rt = is_blend ? program->blend_rt : 0
         };
 
         compiler_context *ctx = &ictx;
 
+        for (unsigned rt = 0; rt < MIDGARD_MAX_RTS; ++rt)
+                ctx->fragment_outputs[rt] = -1;
+
         /* TODO: Decide this at runtime */
         ctx->uniform_cutoff = 8;
 
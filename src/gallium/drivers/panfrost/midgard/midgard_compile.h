@@ -48,8 +48,15 @@ typedef struct {
 
         /* IN: For a fragment shader with a lowered alpha test, the ref value */
         float alpha_ref;
+
+        /* IN: For a blend shader, the render target it blends */
+        unsigned blend_rt;
 } midgard_program;
 
+/* Maximum number of render targets a fragment shader can write */
+
+#define MIDGARD_MAX_RTS 4
+
 int
 midgard_compile_shader_nir(nir_shader *nir, midgard_program *program, bool is_blend);
 
@@ -29,6 +29,10 @@
 #include <panfrost-misc.h>
 #include <panfrost-job.h>
 #include "pan_context.h"
+#include "pan_screen.h"
+#include "util/hash_table.h"
+#include "util/u_math.h"
+#include "util/u_memory.h"
 
 /* TODO: What does this actually have to be? */
 #define ALIGNMENT 128
@@ -52,9 +56,55 @@ panfrost_allocate_chunk(struct panfrost_context *ctx, size_t size, unsigned heap
         return transfer;
 }
 
+/* Uploads larger than a pool entry get a dedicated chunk. Idle chunks from
+ * earlier frames are reused when one is large enough, taking the smallest
+ * that fits; otherwise a new one is allocated, rounded up to a power of two
+ * so later frames with similar uploads can reuse it */
+
+static struct panfrost_transfer
+panfrost_allocate_oversized(struct panfrost_context *ctx,
+                            struct panfrost_transient_pool *pool, size_t sz)
+{
+        struct panfrost_memory **best = NULL;
+
+        util_dynarray_foreach(&ctx->transient_free, struct panfrost_memory *, mem) {
+                if ((*mem)->size >= sz && (!best || (*mem)->size < (*best)->size))
+                        best = mem;
+        }
+
+        struct panfrost_memory *mem;
+
+        if (best) {
+                mem = *best;
+
+                /* Unordered, so fill the hole with the last element */
+                struct panfrost_memory *last = util_dynarray_pop(&ctx->transient_free, struct panfrost_memory *);
+
+                if (best != util_dynarray_end(&ctx->transient_free))
+                        *best = last;
+        } else {
+                struct pipe_context *gallium = (struct pipe_context *) ctx;
+                struct panfrost_screen *screen = pan_screen(gallium->screen);
+                size_t size = util_next_power_of_two(sz);
+
+                mem = CALLOC_STRUCT(panfrost_memory);
+                screen->driver->allocate_slab(screen, mem, size / 4096, true, 0, 0, 0);
+        }
+
+        util_dynarray_append(&pool->oversized, struct panfrost_memory *, mem);
+
+        struct panfrost_transfer ret = {
+                .cpu = mem->cpu,
+                .gpu = mem->gpu
+        };
+
+        return ret;
+}
+
 /* Transient command stream pooling: command stream uploads try to simply copy
- * into whereever we left off. If there isn't space, we allocate a new entry
- * into the pool and copy there */
+ * into whereever we left off. If there isn't space, we advance to the next
+ * entry of the pool, allocating it if the pool hasn't been this large
+ * before */
 
 struct panfrost_transfer
 panfrost_allocate_transient(struct panfrost_context *ctx, size_t sz)
@@ -62,33 +112,37 @@ panfrost_allocate_transient(struct panfrost_context *ctx, size_t sz)
         /* Pad the size */
         sz = ALIGN(sz, ALIGNMENT);
 
-        /* Check if there is room in the current entry */
+        ctx->counters[PAN_COUNTER_TRANSIENT_BYTES] += sz;
+
         struct panfrost_transient_pool *pool = &ctx->transient_pools[ctx->cmdstream_i];
 
+        if (sz > pool->entry_size)
+                return panfrost_allocate_oversized(ctx, pool, sz);
+
+        /* Check if there is room in the current entry */
+
         if ((pool->entry_offset + sz) > pool->entry_size) {
                 /* Don't overflow this entry -- advance to the next */
 
                 pool->entry_offset = 0;
-
                 pool->entry_index++;
-                assert(pool->entry_index < PANFROST_MAX_TRANSIENT_ENTRIES);
 
                 /* Check if this entry exists */
-                
-                if (pool->entry_index >= pool->entry_count) {
+
+                unsigned entry_count = util_dynarray_num_elements(&pool->entries, struct panfrost_memory_entry *);
+
+                if (pool->entry_index >= entry_count) {
                         /* Don't overflow the pool -- allocate a new one */
                         struct pb_slab_entry *entry = pb_slab_alloc(&ctx->slabs, pool->entry_size, HEAP_TRANSIENT);
 
-                        pool->entry_count++;
-                        pool->entries[pool->entry_index] = (struct panfrost_memory_entry *) entry;
+                        util_dynarray_append(&pool->entries, struct panfrost_memory_entry *,
+                                             (struct panfrost_memory_entry *) entry);
                 }
-
-                /* Make sure we -still- won't overflow */
-                assert(sz < pool->entry_size);
         }
 
         /* We have an entry we can write to, so do the upload! */
-        struct panfrost_memory_entry *p_entry = pool->entries[pool->entry_index];
+        struct panfrost_memory_entry *p_entry =
+                *util_dynarray_element(&pool->entries, struct panfrost_memory_entry *, pool->entry_index);
         struct panfrost_memory *backing = (struct panfrost_memory *) p_entry->base.slab;
 
         struct panfrost_transfer ret = {
@@ -111,6 +165,105 @@ panfrost_upload_transient(struct panfrost_context *ctx, const void *data, size_t
         return transfer.gpu;
 }
 
+/* Like panfrost_upload_transient, but returns an earlier upload of the same
+ * data in this frame if there is one. Only worth it for small descriptors
+ * that tend to repeat between draws, as each one is also kept on the CPU to
+ * compare against */
+
+mali_ptr
+panfrost_upload_transient_dedup(struct panfrost_context *ctx, const void *data, size_t sz)
+{
+        struct panfrost_transient_pool *pool = &ctx->transient_pools[ctx->cmdstream_i];
+        uint32_t hash = _mesa_hash_data(data, sz);
+        unsigned mask = PANFROST_TRANSIENT_DEDUP_SLOTS - 1;
+        unsigned i;
+
+        for (i = hash & mask; pool->dedup[i].size; i = (i + 1) & mask) {
+                struct panfrost_transient_upload *upload = &pool->dedup[i];
+
+                if (upload->hash == hash && upload->size == sz &&
+                    !memcmp((uint8_t *) pool->dedup_data.data + upload->data, data, sz))
+                        return upload->gpu;
+        }
+
+        struct panfrost_transfer transfer = panfrost_allocate_transient(ctx, sz);
+        memcpy(transfer.cpu, data, sz);
+
+        /* Slot i is the free one ending the probe sequence */
+
+        if (sz && (pool->dedup_count + 1) * 2 <= PANFROST_TRANSIENT_DEDUP_SLOTS) {
+                pool->dedup[i].hash = hash;
+                pool->dedup[i].size = sz;
+                pool->dedup[i].data = pool->dedup_data.size;
+                pool->dedup[i].gpu = transfer.gpu;
+                pool->dedup_count++;
+
+                memcpy(util_dynarray_grow(&pool->dedup_data, sz), data, sz);
+        }
+
+        return transfer.gpu;
+}
+
+void
+panfrost_transient_pool_init(struct panfrost_context *ctx, struct panfrost_transient_pool *pool, size_t entry_size)
+{
+        /* Allocate the beginning of the transient pool */
+        struct pb_slab_entry *entry = pb_slab_alloc(&ctx->slabs, entry_size, HEAP_TRANSIENT);
+
+        pool->entry_size = entry_size;
+        pool->entry_index = 0;
+        pool->entry_offset = 0;
+
+        util_dynarray_init(&pool->entries, NULL);
+        util_dynarray_init(&pool->oversized, NULL);
+        util_dynarray_init(&pool->retired, NULL);
+
+        util_dynarray_append(&pool->entries, struct panfrost_memory_entry *,
+                             (struct panfrost_memory_entry *) entry);
+
+        memset(pool->dedup, 0, sizeof(pool->dedup));
+        pool->dedup_count = 0;
+        util_dynarray_init(&pool->dedup_data, NULL);
+}
+
+/* Recycles a pool whose frame has completed: rewinds to the first entry
+ * (keeping the rest for later frames), and releases what was allocated on the
+ * side */
+
+void
+panfrost_transient_pool_reset(struct panfrost_context *ctx, struct panfrost_transient_pool *pool)
+{
+        struct pipe_context *gallium = (struct pipe_context *) ctx;
+        struct panfrost_screen *screen = pan_screen(gallium->screen);
+
+        pool->entry_index = 0;
+        pool->entry_offset = 0;
+
+        util_dynarray_foreach(&pool->oversized, struct panfrost_memory *, mem) {
+                if (util_dynarray_num_elements(&ctx->transient_free, struct panfrost_memory *) < PANFROST_MAX_FREE_OVERSIZED) {
+                        util_dynarray_append(&ctx->transient_free, struct panfrost_memory *, *mem);
+                } else {
+                        screen->driver->free_slab(screen, *mem);
+                        FREE(*mem);
+                }
+        }
+
+        util_dynarray_clear(&pool->oversized);
+
+        util_dynarray_foreach(&pool->retired, struct panfrost_memory_entry *, entry) {
+                (*entry)->freed = true;
+                pb_slab_free(&ctx->slabs, &(*entry)->base);
+        }
+
+        util_dynarray_clear(&pool->retired);
+
+        if (pool->dedup_count) {
+                memset(pool->dedup, 0, sizeof(pool->dedup));
+                pool->dedup_count = 0;
+                util_dynarray_clear(&pool->dedup_data);
+        }
+}
+
 // TODO: An actual allocator, perhaps
 // TODO: Multiple stacks for multiple bases?
 
@@ -67,6 +67,9 @@ struct panfrost_memory {
         mali_ptr gpu;
         int stack_bottom;
         size_t size;
+
+        /* GEM handle of the backing BO, for the DRM backend */
+        uint32_t gem_handle;
 };
 
 /* Slab entry sizes range from 2^min to 2^max. In this case, we range from 1k
@@ -101,6 +104,17 @@ panfrost_allocate_transient(struct panfrost_context *ctx, size_t sz);
 mali_ptr
 panfrost_upload_transient(struct panfrost_context *ctx, const void *data, size_t sz);
 
+mali_ptr
+panfrost_upload_transient_dedup(struct panfrost_context *ctx, const void *data, size_t sz);
+
+struct panfrost_transient_pool;
+
+void
+panfrost_transient_pool_init(struct panfrost_context *ctx, struct panfrost_transient_pool *pool, size_t entry_size);
+
+void
+panfrost_transient_pool_reset(struct panfrost_context *ctx, struct panfrost_transient_pool *pool);
+
 void *
 panfrost_allocate_transfer(struct panfrost_memory *mem, size_t sz, mali_ptr *gpu);
 
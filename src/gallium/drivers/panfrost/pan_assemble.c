@@ -31,6 +31,7 @@
 #include "nir/tgsi_to_nir.h"
 #include "midgard/midgard_compile.h"
 #include "util/u_dynarray.h"
+#include "util/os_time.h"
 
 #include "tgsi/tgsi_dump.h"
 
@@ -38,6 +39,7 @@ void
 panfrost_shader_compile(struct panfrost_context *ctx, struct mali_shader_meta *meta, const char *src, int type, struct panfrost_shader_state *state)
 {
         uint8_t *dst;
+        int64_t start = os_time_get_nano();
 
         nir_shader *s;
 
@@ -69,6 +71,9 @@ panfrost_shader_compile(struct panfrost_context *ctx, struct mali_shader_meta *m
 
         midgard_compile_shader_nir(s, &program, false);
 
+        ctx->counters[PAN_COUNTER_SHADER_COMPILES]++;
+        ctx->counters[PAN_COUNTER_SHADER_COMPILE_TIME] += os_time_get_nano() - start;
+
         /* Prepare the compiled binary for upload */
         int size = program.compiled.size;
         dst = program.compiled.data;
@@ -82,10 +82,10 @@
  */
 
 void
-panfrost_make_blend_shader(struct panfrost_context *ctx, struct panfrost_blend_state *cso, const struct pipe_blend_color *blend_color)
+panfrost_make_blend_shader(struct panfrost_context *ctx, struct panfrost_blend_state *cso, unsigned rt, const struct pipe_blend_color *blend_color)
 {
-        const struct pipe_rt_blend_state *blend = &cso->base.rt[0];
-        mali_ptr *out = &cso->blend_shader;
+        const struct pipe_rt_blend_state *blend = &cso->base.rt[cso->base.independent_blend_enable ? rt : 0];
+        mali_ptr *out = &cso->rt[rt].blend_shader;
 
         /* Build the shader */
 
@@ -124,7 +124,10 @@ panfrost_make_blend_shader(struct panfrost_context *ctx, struct panfrost_blend_s
 
         /* Compile the built shader */
 
-        midgard_program program;
+        midgard_program program = {
+                .blend_rt = rt
+        };
+
         midgard_compile_shader_nir(shader, &program, true);
 
 
@@ -161,8 +164,9 @@ panfrost_make_blend_shader(struct panfrost_context *ctx, struct panfrost_blend_s
         *out = panfrost_upload(&ctx->shaders, dst, size, true) | program.first_tag;
 
         /* We need to switch to shader mode */
+        cso->rt[rt].has_blend_shader = true;
         cso->has_blend_shader = true;
 
         /* At least two work registers are needed due to an encoding quirk */
-        cso->blend_work_count = MAX2(program.work_register_count, 2);
+        cso->rt[rt].blend_work_count = MAX2(program.work_register_count, 2);
 }
@@ -0,0 +1,97 @@
+/*
+ * © Copyright 2019 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include "pan_context.h"
+#include "util/u_format.h"
+#include "util/u_memory.h"
+
+/* Blits are implemented as draws with u_blitter, which means the hardware
+ * does any format conversion, scaling and (de)compression for us. u_blitter
+ * binds its own state over the top of ours, so everything it may touch has to
+ * be saved first for it to restore afterwards */
+
+static void
+panfrost_blitter_save(struct panfrost_context *ctx, struct blitter_context *blitter)
+{
+        if (ctx->vertex_buffers)
+                util_blitter_save_vertex_buffer_slot(blitter, ctx->vertex_buffers);
+
+        util_blitter_save_vertex_elements(blitter, ctx->vertex);
+        util_blitter_save_vertex_shader(blitter, ctx->vs);
+        util_blitter_save_rasterizer(blitter, ctx->rasterizer);
+        util_blitter_save_viewport(blitter, &ctx->pipe_viewport);
+        util_blitter_save_scissor(blitter, &ctx->scissor);
+        util_blitter_save_fragment_shader(blitter, ctx->fs);
+        util_blitter_save_blend(blitter, ctx->blend);
+        util_blitter_save_depth_stencil_alpha(blitter, ctx->depth_stencil);
+        util_blitter_save_stencil_ref(blitter, &ctx->stencil_ref);
+        util_blitter_save_so_targets(blitter, 0, NULL);
+
+        util_blitter_save_framebuffer(blitter, &ctx->pipe_framebuffer);
+
+        util_blitter_save_fragment_sampler_states(blitter,
+                        ctx->sampler_count[PIPE_SHADER_FRAGMENT],
+                        (void **) ctx->samplers[PIPE_SHADER_FRAGMENT]);
+
+        util_blitter_save_fragment_sampler_views(blitter,
+                        ctx->sampler_view_count[PIPE_SHADER_FRAGMENT],
+                        (struct pipe_sampler_view **) ctx->sampler_views[PIPE_SHADER_FRAGMENT]);
+}
+
+void
+panfrost_blit(struct pipe_context *pipe,
+              const struct pipe_blit_info *info)
+{
+        struct panfrost_context *ctx = pan_context(pipe);
+        struct panfrost_screen *screen = pan_screen(pipe->screen);
+
+        if (!util_blitter_is_blit_supported(ctx->blitter, info)) {
+                if (screen->debug & PAN_DBG_MSGS)
+                        fprintf(stderr, "Unsupported blit %s -> %s\n",
+                                util_format_short_name(info->src.resource->format),
+                                util_format_short_name(info->dst.resource->format));
+                return;
+        }
+
+        /* u_blitter only restores the first vertex buffer slot, and we don't
+         * track slots individually, so hold on to the whole array and let
+         * u_blitter work on a copy */
+
+        struct pipe_vertex_buffer *vertex_buffers = ctx->vertex_buffers;
+        unsigned vertex_buffer_count = ctx->vertex_buffer_count;
+        ctx->vertex_buffers = NULL;
+
+        if (vertex_buffers) {
+                size_t sz = sizeof(vertex_buffers[0]) * vertex_buffer_count;
+                ctx->vertex_buffers = malloc(sz);
+                memcpy(ctx->vertex_buffers, vertex_buffers, sz);
+        }
+
+        panfrost_blitter_save(ctx, ctx->blitter);
+        util_blitter_blit(ctx->blitter, info);
+
+        free(ctx->vertex_buffers);
+        ctx->vertex_buffers = vertex_buffers;
+        ctx->vertex_buffer_count = vertex_buffer_count;
+}
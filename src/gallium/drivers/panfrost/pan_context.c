@@ -24,6 +24,8 @@
 
 #include <sys/poll.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <libsync.h>
 #include <panfrost-mali-base.h>
 
 #include "pan_context.h"
@@ -35,8 +37,13 @@
 #include "util/u_inlines.h"
 #include "util/u_upload_mgr.h"
 #include "util/u_memory.h"
+#include "util/u_prim.h"
+#include "util/u_prim_restart.h"
 #include "util/half_float.h"
+#include "util/hash_table.h"
+#include "util/os_time.h"
 #include "indices/u_primconvert.h"
+#include "indices/u_indices.h"
 #include "tgsi/tgsi_parse.h"
 
 #include "pan_screen.h"
@@ -72,7 +79,8 @@ panfrost_set_framebuffer_msaa(struct panfrost_context *ctx, bool enabled)
 #ifdef SFBD
         SET_BIT(ctx->fragment_fbd.format, MALI_FRAMEBUFFER_MSAA_A | MALI_FRAMEBUFFER_MSAA_B, enabled);
 #else
-        SET_BIT(ctx->fragment_rts[0].format, MALI_MFBD_FORMAT_MSAA, enabled);
+        for (unsigned rt = 0; rt < PANFROST_MAX_RTS; ++rt)
+                SET_BIT(ctx->fragment_rts[rt].format, MALI_MFBD_FORMAT_MSAA, enabled);
 
         SET_BIT(ctx->fragment_fbd.unk1, (1 << 4) | (1 << 1), enabled);
 
@@ -101,10 +109,11 @@ panfrost_enable_afbc(struct panfrost_context *ctx, struct panfrost_resource *rsr
 
         stride *= 2;  /* TODO: Should this be carried over? */
         int main_size = stride * rsrc->base.height0;
-        rsrc->bo->afbc_metadata_size = tile_w * tile_h * 16;
+        /* Keep the body that follows the headers aligned */
+        rsrc->bo->afbc_metadata_size = ALIGN(tile_w * tile_h * 16, 64);
 
         /* Allocate the AFBC slab itself, large enough to hold the above */
-        screen->driver->allocate_slab(ctx, &rsrc->bo->afbc_slab,
+        screen->driver->allocate_slab(screen, &rsrc->bo->afbc_slab,
                                (rsrc->bo->afbc_metadata_size + main_size + 4095) / 4096,
                                true, 0, 0, 0);
 
@@ -112,30 +121,14 @@ panfrost_enable_afbc(struct panfrost_context *ctx, struct panfrost_resource *rsr
 
         /* Compressed textured reads use a tagged pointer to the metadata */
 
-        rsrc->bo->gpu[0] = rsrc->bo->afbc_slab.gpu | (ds ? 0 : 1);
-        rsrc->bo->cpu[0] = rsrc->bo->afbc_slab.cpu;
+        rsrc->bo->gpu = rsrc->bo->afbc_slab.gpu | (ds ? 0 : 1);
+        rsrc->bo->cpu = rsrc->bo->afbc_slab.cpu;
 #else
         printf("AFBC not supported yet on SFBD\n");
         assert(0);
 #endif
 }
 
-static void
-panfrost_enable_checksum(struct panfrost_context *ctx, struct panfrost_resource *rsrc)
-{
-        struct pipe_context *gallium = (struct pipe_context *) ctx;
-        struct panfrost_screen *screen = pan_screen(gallium->screen);
-        int tile_w = (rsrc->base.width0 + (MALI_TILE_LENGTH - 1)) >> MALI_TILE_SHIFT;
-        int tile_h = (rsrc->base.height0 + (MALI_TILE_LENGTH - 1)) >> MALI_TILE_SHIFT;
-
-        /* 8 byte checksum per tile */
-        rsrc->bo->checksum_stride = tile_w * 8;
-        int pages = (((rsrc->bo->checksum_stride * tile_h) + 4095) / 4096);
-        screen->driver->allocate_slab(ctx, &rsrc->bo->checksum_slab, pages, false, 0, 0, 0);
-
-        rsrc->bo->has_checksum = true;
-}
-
 /* ..by contrast, this routine runs for every FRAGMENT job, but does no
  * allocation. AFBC is enabled on a per-surface basis */
 
@@ -150,23 +143,23 @@ panfrost_set_fragment_afbc(struct panfrost_context *ctx)
                         continue;
 
                 /* Enable AFBC for the render target */
-                ctx->fragment_rts[0].afbc.metadata = rsrc->bo->afbc_slab.gpu;
-                ctx->fragment_rts[0].afbc.stride = 0;
-                ctx->fragment_rts[0].afbc.unk = 0x30009;
+                ctx->fragment_rts[cb].afbc.metadata = rsrc->bo->afbc_slab.gpu;
+                ctx->fragment_rts[cb].afbc.stride = 0;
+                ctx->fragment_rts[cb].afbc.unk = 0x30009;
 
-                ctx->fragment_rts[0].format |= MALI_MFBD_FORMAT_AFBC;
+                ctx->fragment_rts[cb].format |= MALI_MFBD_FORMAT_AFBC;
 
                 /* Change colourspace from RGB to BGR? */
 #if 0
-                ctx->fragment_rts[0].format |= 0x800000;
-                ctx->fragment_rts[0].format &= ~0x20000;
+                ctx->fragment_rts[cb].format |= 0x800000;
+                ctx->fragment_rts[cb].format &= ~0x20000;
 #endif
 
                 /* Point rendering to our special framebuffer */
-                ctx->fragment_rts[0].framebuffer = rsrc->bo->afbc_slab.gpu + rsrc->bo->afbc_metadata_size;
+                ctx->fragment_rts[cb].framebuffer = rsrc->bo->afbc_slab.gpu + rsrc->bo->afbc_metadata_size;
 
                 /* WAT? Stride is diff from the scanout case */
-                ctx->fragment_rts[0].framebuffer_stride = ctx->pipe_framebuffer.width * 2 * 4;
+                ctx->fragment_rts[cb].framebuffer_stride = ctx->pipe_framebuffer.width * 2 * 4;
         }
 
         /* Enable depth/stencil AFBC for the framebuffer (not the render target) */
@@ -265,6 +258,16 @@ panfrost_emit_fbd(struct panfrost_context *ctx)
         return framebuffer;
 }
 
+/* Is a colour buffer shown on screen (rather than an FBO)? */
+
+static bool
+panfrost_is_scanout_surface(struct pipe_surface *surf)
+{
+        return surf->texture->bind & PIPE_BIND_DISPLAY_TARGET ||
+               surf->texture->bind & PIPE_BIND_SCANOUT ||
+               surf->texture->bind & PIPE_BIND_SHARED;
+}
+
 /* Are we currently rendering to the screen (rather than an FBO)? */
 
 static bool
@@ -278,10 +281,56 @@ panfrost_is_scanout(struct panfrost_context *ctx)
         if (!ctx->pipe_framebuffer.cbufs[0])
                 return true;
 
-        return ctx->pipe_framebuffer.cbufs[0]->texture->bind & PIPE_BIND_DISPLAY_TARGET ||
-               ctx->pipe_framebuffer.cbufs[0]->texture->bind & PIPE_BIND_SCANOUT ||
-               ctx->pipe_framebuffer.cbufs[0]->texture->bind & PIPE_BIND_SHARED;
+        return panfrost_is_scanout_surface(ctx->pipe_framebuffer.cbufs[0]);
+}
+
+/* Computes where a colour buffer is rendered to. The default is upside down
+ * from OpenGL's perspective, so buffers shown on screen are flipped */
+
+static void
+panfrost_rt_address(struct panfrost_context *ctx, struct pipe_surface *surf,
+                    mali_ptr *framebuffer, int *stride)
+{
+        if (!surf) {
+                /* Depth-only framebuffer -> dummy RT */
+                *framebuffer = 0;
+                *stride = 0;
+                return;
+        }
+
+        struct panfrost_resource *rsrc = pan_resource(surf->texture);
+
+        *framebuffer = panfrost_get_texture_address(rsrc, surf->u.tex.level, surf->u.tex.first_layer);
+        *stride = rsrc->bo->slices[surf->u.tex.level].stride;
+
+        if (panfrost_is_scanout_surface(surf)) {
+                *framebuffer += *stride * (ctx->pipe_framebuffer.height - 1);
+                *stride = -*stride;
+        }
+}
+
+#ifdef MFBD
+/* Render target format word. What is known of it, from the low bits up: 0x1,
+ * the channel count (MALI_POSITIVE) in bits 3-4, 0x4, the block layout in
+ * bits 10-11 (linear, with MALI_MFBD_FORMAT_AFBC switching to compressed),
+ * flags in bits 12-15 (0x8, with MALI_MFBD_FORMAT_MSAA), the swizzle from
+ * bit 16, and 0x8 on top. Only 8-bit UNORM colour has been seen */
+
+static unsigned
+panfrost_mfbd_format(enum pipe_format format)
+{
+        const struct util_format_description *desc = util_format_description(format);
+        unsigned swizzle = panfrost_translate_swizzle_4(desc->swizzle);
+
+        return 0x1 |
+               (MALI_POSITIVE(desc->nr_channels) << 3) |
+               (0x4 << 5) |
+               (0x2 << 10) |
+               (0x8 << 12) |
+               (swizzle << 16) |
+               (0x8 << 28);
 }
+#endif
 
 /* The above function is for generalised fbd emission, used in both fragment as
  * well as vertex/tiler payloads. This payload is specific to fragment
@@ -290,25 +339,13 @@ panfrost_is_scanout(struct panfrost_context *ctx)
 static void
 panfrost_new_frag_framebuffer(struct panfrost_context *ctx)
 {
+#ifdef SFBD
         mali_ptr framebuffer;
         int stride;
 
-        if (ctx->pipe_framebuffer.nr_cbufs > 0) {
-	        framebuffer = ((struct panfrost_resource *) ctx->pipe_framebuffer.cbufs[0]->texture)->bo->gpu[0];
-                stride = util_format_get_stride(ctx->pipe_framebuffer.cbufs[0]->format, ctx->pipe_framebuffer.width);
-        } else {
-                /* Depth-only framebuffer -> dummy RT */
-                framebuffer = 0;
-                stride = 0;
-        }
-
-        /* The default is upside down from OpenGL's perspective. */
-        if (panfrost_is_scanout(ctx)) {
-                framebuffer += stride * (ctx->pipe_framebuffer.height - 1);
-                stride = -stride;
-        }
+        panfrost_rt_address(ctx, ctx->pipe_framebuffer.nr_cbufs ? ctx->pipe_framebuffer.cbufs[0] : NULL,
+                            &framebuffer, &stride);
 
-#ifdef SFBD
         struct mali_single_framebuffer fb = panfrost_emit_fbd(ctx);
 
         fb.framebuffer = framebuffer;
@@ -318,18 +355,32 @@ panfrost_new_frag_framebuffer(struct panfrost_context *ctx)
 #else
         struct bifrost_framebuffer fb = panfrost_emit_fbd(ctx);
 
-        /* XXX: MRT case */
+        /* A depth-only framebuffer still gets a (dummy) render target */
+        unsigned rt_count = MAX2(ctx->pipe_framebuffer.nr_cbufs, 1);
+
+        fb.rt_count_1 = MALI_POSITIVE(rt_count);
         fb.rt_count_2 = 1;
         fb.unk3 = 0x100;
 
-        struct bifrost_render_target rt = {
-                .unk1 = 0x4000000,
-                .format = 0x860a8899, /* RGBA32, no MSAA */
-                .framebuffer = framebuffer,
-                .framebuffer_stride = (stride / 16) & 0xfffffff,
-        };
+        for (unsigned cb = 0; cb < rt_count; ++cb) {
+                struct pipe_surface *surf = cb < ctx->pipe_framebuffer.nr_cbufs ? ctx->pipe_framebuffer.cbufs[cb] : NULL;
+                mali_ptr framebuffer;
+                int stride;
+
+                panfrost_rt_address(ctx, surf, &framebuffer, &stride);
+
+                struct bifrost_render_target rt = {
+                        .unk1 = 0x4000000,
+                        .format = 0x860a8899, /* BGRA8, no MSAA */
+                        .framebuffer = framebuffer,
+                        .framebuffer_stride = (stride / 16) & 0xfffffff,
+                };
+
+                if (surf)
+                        rt.format = panfrost_mfbd_format(surf->format);
 
-        memcpy(&ctx->fragment_rts[0], &rt, sizeof(rt));
+                memcpy(&ctx->fragment_rts[cb], &rt, sizeof(rt));
+        }
 
         memset(&ctx->fragment_extra, 0, sizeof(ctx->fragment_extra));
 #endif
@@ -371,36 +422,49 @@ panfrost_clear(
         /* Remember that we've done something */
         ctx->frame_cleared = true;
 
-        /* Alpha clear only meaningful without alpha channel */
-        bool has_alpha = ctx->pipe_framebuffer.nr_cbufs && util_format_has_alpha(ctx->pipe_framebuffer.cbufs[0]->format);
-        float clear_alpha = has_alpha ? color->f[3] : 1.0f;
-
-        uint32_t packed_color =
-                (normalised_float_to_u8(clear_alpha) << 24) |
-                (normalised_float_to_u8(color->f[2]) << 16) |
-                (normalised_float_to_u8(color->f[1]) <<  8) |
-                (normalised_float_to_u8(color->f[0]) <<  0);
+#ifdef MFBD
+        struct bifrost_framebuffer *buffer_ds = &ctx->fragment_fbd;
+#else
+        struct mali_single_framebuffer *buffer_ds = &ctx->fragment_fbd;
+#endif
 
+        if (clear_color) {
 #ifdef MFBD
-        struct bifrost_render_target *buffer_color = &ctx->fragment_rts[0];
+                unsigned rt_count = MAX2(ctx->pipe_framebuffer.nr_cbufs, 1);
 #else
-        struct mali_single_framebuffer *buffer_color = &ctx->fragment_fbd;
+                unsigned rt_count = 1;
 #endif
 
+                for (unsigned cb = 0; cb < rt_count; ++cb) {
+                        struct pipe_surface *surf = cb < ctx->pipe_framebuffer.nr_cbufs ? ctx->pipe_framebuffer.cbufs[cb] : NULL;
+
+                        if (surf && !(buffers & (PIPE_CLEAR_COLOR0 << cb)))
+                                continue;
+
+                        /* Alpha clear only meaningful without alpha channel */
+                        bool has_alpha = surf && util_format_has_alpha(surf->format);
+                        float clear_alpha = has_alpha ? color->f[3] : 1.0f;
+
+                        uint32_t packed_color =
+                                (normalised_float_to_u8(clear_alpha) << 24) |
+                                (normalised_float_to_u8(color->f[2]) << 16) |
+                                (normalised_float_to_u8(color->f[1]) <<  8) |
+                                (normalised_float_to_u8(color->f[0]) <<  0);
+
 #ifdef MFBD
-        struct bifrost_framebuffer *buffer_ds = &ctx->fragment_fbd;
+                        struct bifrost_render_target *buffer_color = &ctx->fragment_rts[cb];
 #else
-        struct mali_single_framebuffer *buffer_ds = buffer_color;
+                        struct mali_single_framebuffer *buffer_color = &ctx->fragment_fbd;
 #endif
 
-        if (clear_color) {
-                /* Fields duplicated 4x for unknown reasons. Same in Utgard,
-                 * too, which is doubly weird. */
+                        /* Fields duplicated 4x for unknown reasons. Same in
+                         * Utgard, too, which is doubly weird. */
 
-                buffer_color->clear_color_1 = packed_color;
-                buffer_color->clear_color_2 = packed_color;
-                buffer_color->clear_color_3 = packed_color;
-                buffer_color->clear_color_4 = packed_color;
+                        buffer_color->clear_color_1 = packed_color;
+                        buffer_color->clear_color_2 = packed_color;
+                        buffer_color->clear_color_3 = packed_color;
+                        buffer_color->clear_color_4 = packed_color;
+                }
         }
 
         if (clear_depth) {
@@ -547,8 +611,7 @@ panfrost_invalidate_frame(struct panfrost_context *ctx)
         /* The transient cmdstream is dirty every frame; the only bits worth preserving
          * (textures, shaders, etc) are in other buffers anyways */
 
-        ctx->transient_pools[ctx->cmdstream_i].entry_index = 0;
-        ctx->transient_pools[ctx->cmdstream_i].entry_offset = 0;
+        panfrost_transient_pool_reset(ctx, &ctx->transient_pools[ctx->cmdstream_i]);
 
         /* Regenerate payloads */
         panfrost_attach_vt_framebuffer(ctx);
@@ -885,7 +948,6 @@ panfrost_fragment_job(struct panfrost_context *ctx)
 
         if (ctx->pipe_framebuffer.nr_cbufs == 1) {
                 struct panfrost_resource *rsrc = (struct panfrost_resource *) ctx->pipe_framebuffer.cbufs[0]->texture;
-                int stride = util_format_get_stride(rsrc->base.format, rsrc->base.width0);
 
                 if (rsrc->bo->has_checksum) {
                         //ctx->fragment_fbd.unk3 |= 0xa00000;
@@ -893,14 +955,15 @@ panfrost_fragment_job(struct panfrost_context *ctx)
                         ctx->fragment_fbd.unk3 |= MALI_MFBD_EXTRA;
                         ctx->fragment_extra.unk |= 0x420;
                         ctx->fragment_extra.checksum_stride = rsrc->bo->checksum_stride;
-                        ctx->fragment_extra.checksum = rsrc->bo->gpu[0] + stride * rsrc->base.height0;
+                        ctx->fragment_extra.checksum = rsrc->bo->checksum_slab.gpu;
                 }
         }
 
         /* The frame is complete and therefore the framebuffer descriptor is
          * ready for linkage and upload */
 
-        size_t sz = sizeof(ctx->fragment_fbd) + sizeof(struct bifrost_fb_extra) + sizeof(struct bifrost_render_target) * 1;
+        unsigned rt_count = MAX2(ctx->pipe_framebuffer.nr_cbufs, 1);
+        size_t sz = sizeof(ctx->fragment_fbd) + sizeof(struct bifrost_fb_extra) + sizeof(struct bifrost_render_target) * rt_count;
         struct panfrost_transfer fbd_t = panfrost_allocate_transient(ctx, sz);
         off_t offset = 0;
 
@@ -913,8 +976,8 @@ panfrost_fragment_job(struct panfrost_context *ctx)
                 offset += sizeof(struct bifrost_fb_extra);
         }
 
-        /* Upload (single) render target */
-        memcpy(fbd_t.cpu + offset, &ctx->fragment_rts[0], sizeof(struct bifrost_render_target) * 1);
+        /* Upload render targets */
+        memcpy(fbd_t.cpu + offset, ctx->fragment_rts, sizeof(struct bifrost_render_target) * rt_count);
 
         /* Generate the fragment (frame) job */
 
@@ -942,21 +1005,157 @@ panfrost_fragment_job(struct panfrost_context *ctx)
         return transfer.gpu;
 }
 
+/* Computes the number of vertex shader invocations the hardware dispatches
+ * per instance when instancing, following the algorithm described alongside
+ * mali_attr. Per-vertex and per-instance attributes must agree with it */
+
+static unsigned
+panfrost_padded_vertex_count(unsigned vertex_count)
+{
+        if (vertex_count < 20)
+                return ((vertex_count / 4) + 1) * 4;
+
+        /* Look at the most significant set bit and the three after it */
+        unsigned n = util_logbase2(vertex_count) - 3;
+        unsigned high = vertex_count >> n;
+
+        switch (high) {
+        case 0x8:
+                return 9 << n;
+        case 0x9:
+                return 5 << (n + 1);
+        case 0xA:
+        case 0xB:
+                return 3 << (n + 2);
+        case 0xC:
+        case 0xD:
+                return 7 << (n + 1);
+        default:
+                return 1 << (n + 4);
+        }
+}
+
+/* Vertex jobs are dispatched like glDispatchCompute(1, vertex_count,
+ * instance_count); see mali_vertex_tiler_prefix. For non-instanced draws,
+ * the blob sets workgroups_z_shift to 32, so we match that */
+
+static void
+panfrost_pack_invocations(struct mali_vertex_tiler_prefix *prefix,
+                          unsigned vertex_count, unsigned instance_count)
+{
+        if (instance_count > 1) {
+                unsigned shift = util_logbase2_ceil(vertex_count);
+
+                prefix->invocation_count = MALI_POSITIVE(vertex_count) |
+                                           (MALI_POSITIVE(instance_count) << shift);
+                prefix->workgroups_z_shift = shift;
+        } else {
+                prefix->invocation_count = MALI_POSITIVE(vertex_count);
+                prefix->workgroups_z_shift = 32;
+        }
+}
+
+/* Vertex elements are -already- GPU-visible, at rsrc->gpu. However, attribute
+ * buffers must be 64 aligned. If it is not, for now we have to duplicate the
+ * buffer. Instanced draws also fetch their padding vertices, which can run
+ * past the end of the BO; the size is clamped to the BO (or only the bytes
+ * that exist are copied), since whatever the padding reads is discarded. */
+
+static mali_ptr
+panfrost_vertex_buffer_address(struct panfrost_context *ctx,
+                               const struct pipe_vertex_buffer *buf,
+                               unsigned offset, unsigned *size)
+{
+        struct panfrost_resource *rsrc = (struct panfrost_resource *) (buf->buffer.resource);
+        size_t start = buf->buffer_offset + offset;
+        mali_ptr effective_address = (rsrc->bo->gpu + start);
+        size_t available = rsrc->bo->size > start ? rsrc->bo->size - start : 0;
+
+        if (effective_address & 0x3F) {
+                struct panfrost_transfer transfer = panfrost_allocate_transient(ctx, *size);
+
+                ctx->counters[PAN_COUNTER_VERTEX_BUFFER_COPIES]++;
+                ctx->counters[PAN_COUNTER_VERTEX_BUFFER_COPY_BYTES] += *size;
+                memcpy(transfer.cpu, rsrc->bo->cpu + start, MIN2(*size, available));
+                return transfer.gpu;
+        } else {
+                *size = MIN2(*size, available);
+                panfrost_frame_add_resource(ctx, &rsrc->base);
+                return effective_address;
+        }
+}
+
+/* Fills in the record(s) for an element with an instance divisor, fetching
+ * element (instance_id / divisor). The hardware divides the linear invocation
+ * ID, so the divisor is scaled by the padded vertex count */
+
+static void
+panfrost_emit_instanced_attr(union mali_attr *attr, mali_ptr elements,
+                             unsigned padded_count, unsigned divisor)
+{
+        unsigned hw_divisor = padded_count * divisor;
+
+        if (util_is_power_of_two_or_zero(hw_divisor)) {
+                attr[0].elements = elements | MALI_ATTR_POT_DIVIDE;
+                attr[0].shift = __builtin_ctz(hw_divisor);
+                attr[0].extra_flags = 0;
+                return;
+        }
+
+        /* Magic multiplier with an implicit high bit and optional round-down,
+         * per the algorithm described alongside mali_attr */
+
+        unsigned shift = util_logbase2(hw_divisor);
+        uint64_t t = 1ull << (shift + 32);
+        uint32_t magic = (t + hw_divisor - 1) / hw_divisor;
+        bool round_down = (t % hw_divisor) <= (1ull << shift);
+
+        if (round_down)
+                magic--;
+
+        attr[0].elements = elements | MALI_ATTR_NPOT_DIVIDE;
+        attr[0].shift = shift;
+        attr[0].extra_flags = round_down;
+
+        attr[1] = (union mali_attr) {
+                .unk = 0x20,
+                .magic_divisor = magic & ~(1u << 31),
+                .divisor = divisor
+        };
+}
+
 /* Emits attributes and varying descriptors, which should be called every draw,
  * excepting some obscure circumstances */
 
 static void
 panfrost_emit_vertex_data(struct panfrost_context *ctx)
 {
+        struct panfrost_vertex_state *so = ctx->vertex;
+
         /* TODO: Only update the dirtied buffers */
-        union mali_attr attrs[PIPE_MAX_ATTRIBS];
+        union mali_attr attrs[PIPE_MAX_ATTRIBS * 3];
         union mali_attr varyings[PIPE_MAX_ATTRIBS];
 
-        unsigned invocation_count = MALI_NEGATIVE(ctx->payload_tiler.prefix.invocation_count);
+        unsigned invocation_count = ctx->invocation_count;
+        unsigned padded_count = ctx->padded_count;
+        bool instanced = ctx->instance_count > 1;
+
+        /* Per-vertex attributes are fetched at linear_id modulo the padded
+         * count when instancing, encoded as (2 * extra_flags + 1) << shift */
+
+        unsigned vertex_mode = instanced ? MALI_ATTR_MODULO : MALI_ATTR_LINEAR;
+        unsigned modulo_shift = instanced ? __builtin_ctz(padded_count) : 0;
+        unsigned modulo_odd = instanced ? (padded_count >> modulo_shift) >> 1 : 0;
+
+        unsigned buffer_count = so->instanced_count ? so->instanced_base : ctx->vertex_buffer_count;
+
+        for (int i = 0; i < buffer_count; ++i) {
+                if (i >= ctx->vertex_buffer_count) {
+                        memset(&attrs[i], 0, sizeof(attrs[i]));
+                        continue;
+                }
 
-        for (int i = 0; i < ctx->vertex_buffer_count; ++i) {
                 struct pipe_vertex_buffer *buf = &ctx->vertex_buffers[i];
-                struct panfrost_resource *rsrc = (struct panfrost_resource *) (buf->buffer.resource);
 
                 /* Let's figure out the layout of the attributes in memory so
                  * we can be smart about size computation. The idea is to
@@ -971,28 +1170,60 @@ panfrost_emit_vertex_data(struct panfrost_context *ctx)
 
                 unsigned max_src_offset = 0;
 
-                for (unsigned j = 0; j < ctx->vertex->num_elements; ++j) {
-                        if (ctx->vertex->pipe[j].vertex_buffer_index != i) continue;
-                        max_src_offset = MAX2(max_src_offset, ctx->vertex->pipe[j].src_offset);
+                for (unsigned j = 0; j < so->num_elements; ++j) {
+                        if (so->pipe[j].vertex_buffer_index != i) continue;
+                        max_src_offset = MAX2(max_src_offset, so->pipe[j].src_offset);
                 }
 
-                /* Offset vertex count by draw_start to make sure we upload enough */
+                /* Offset vertex count by draw_start to make sure we upload
+                 * enough. Instancing fetches the padding vertices too */
+                unsigned fetched = instanced ? padded_count : invocation_count;
+                unsigned size = buf->stride * (ctx->payload_vertex.draw_start + fetched) + max_src_offset;
+
+                attrs[i].elements = panfrost_vertex_buffer_address(ctx, buf, 0, &size) | vertex_mode;
                 attrs[i].stride = buf->stride;
-                attrs[i].size = buf->stride * (ctx->payload_vertex.draw_start + invocation_count) + max_src_offset;
+                attrs[i].size = size;
+                attrs[i].shift = modulo_shift;
+                attrs[i].extra_flags = modulo_odd;
+        }
 
-                /* Vertex elements are -already- GPU-visible, at
-                 * rsrc->gpu. However, attribute buffers must be 64 aligned. If
-                 * it is not, for now we have to duplicate the buffer. */
+        /* Instanced elements. Without instancing, every vertex fetches the
+         * first element, so just zero the stride. A draw split by instance
+         * range starts each range on a multiple of every divisor, so the
+         * range's first element is a whole number of strides in */
 
-                mali_ptr effective_address = (rsrc->bo->gpu[0] + buf->buffer_offset);
+        for (unsigned j = 0; j < so->num_elements; ++j) {
+                const struct pipe_vertex_element *elem = &so->pipe[j];
 
-                if (effective_address & 0x3F) {
-                        attrs[i].elements = panfrost_upload_transient(ctx, rsrc->bo->cpu[0] + buf->buffer_offset, attrs[i].size) | 1;
-                } else {
-                        attrs[i].elements = effective_address | 1;
-                }
+                if (!elem->instance_divisor)
+                        continue;
+
+                union mali_attr *attr = &attrs[so->hw[j].index];
+                struct pipe_vertex_buffer *buf = &ctx->vertex_buffers[elem->vertex_buffer_index];
+
+                unsigned instances = instanced ? DIV_ROUND_UP(ctx->instance_count, elem->instance_divisor) : 1;
+                unsigned size = buf->stride * instances + elem->src_offset;
+                unsigned first = buf->stride * (ctx->start_instance / elem->instance_divisor);
+                mali_ptr elements = panfrost_vertex_buffer_address(ctx, buf, first, &size);
+
+                memset(attr, 0, sizeof(*attr) * 2);
+
+                attr->stride = instanced ? buf->stride : 0;
+                attr->size = size;
+
+                if (instanced)
+                        panfrost_emit_instanced_attr(attr, elements, padded_count, elem->instance_divisor);
+                else
+                        attr->elements = elements | MALI_ATTR_LINEAR;
         }
 
+        unsigned attr_count = buffer_count + (so->instanced_count * 2);
+
+        /* Varyings are written and read at the linear invocation ID, padding
+         * included */
+
+        unsigned varying_count = instanced ? padded_count * ctx->instance_count : invocation_count;
+
         struct panfrost_varyings *vars = &ctx->vs->variants[ctx->vs->active_variant].varyings;
 
         for (int i = 0; i < vars->varying_buffer_count; ++i) {
@@ -1000,7 +1231,7 @@ panfrost_emit_vertex_data(struct panfrost_context *ctx)
                 varyings[i].stride = vars->varyings_stride[i];
 
                 /* XXX: Why does adding an extra ~8000 vertices fix missing triangles in glmark2-es2 -bshadow? */
-                varyings[i].size = vars->varyings_stride[i] * invocation_count;
+                varyings[i].size = vars->varyings_stride[i] * varying_count;
 
                 /* gl_Position varying is always last by convention */
                 if ((i + 1) == vars->varying_buffer_count)
@@ -1009,13 +1240,13 @@ panfrost_emit_vertex_data(struct panfrost_context *ctx)
                 /* Varyings appear to need 64-byte alignment */
                 ctx->varying_height += ALIGN(varyings[i].size, 64);
 
-                /* Ensure that we fit */
-                assert(ctx->varying_height < ctx->varying_mem.size);
+                /* Checked ahead of the draw by panfrost_draw_vbo */
+                assert(ctx->varying_height <= ctx->varying_mem.size);
         }
 
-        ctx->payload_vertex.postfix.attributes = panfrost_upload_transient(ctx, attrs, ctx->vertex_buffer_count * sizeof(union mali_attr));
+        ctx->payload_vertex.postfix.attributes = panfrost_upload_transient_dedup(ctx, attrs, attr_count * sizeof(union mali_attr));
 
-        mali_ptr varyings_p = panfrost_upload_transient(ctx, &varyings, vars->varying_buffer_count * sizeof(union mali_attr));
+        mali_ptr varyings_p = panfrost_upload_transient_dedup(ctx, &varyings, vars->varying_buffer_count * sizeof(union mali_attr));
         ctx->payload_vertex.postfix.varyings = varyings_p;
         ctx->payload_tiler.postfix.varyings = varyings_p;
 }
@@ -1036,9 +1267,18 @@ panfrost_emit_for_draw(struct panfrost_context *ctx, bool with_vertex_data)
                 panfrost_set_framebuffer_msaa(ctx, FORCE_MSAA || ctx->rasterizer->base.multisample);
         }
 
-        if (ctx->occlusion_query) {
+        if (ctx->occlusion_query && ctx->active_queries) {
                 ctx->payload_tiler.gl_enables |= MALI_GL_OCCLUSION_BOOLEAN;
-                ctx->payload_tiler.postfix.occlusion_counter = ctx->occlusion_query->transfer.gpu;
+
+                if (ctx->occlusion_query->type == PIPE_QUERY_OCCLUSION_COUNTER)
+                        ctx->payload_tiler.gl_enables |= MALI_GL_OCCLUSION_PRECISE;
+                else
+                        ctx->payload_tiler.gl_enables &= ~MALI_GL_OCCLUSION_PRECISE;
+
+                ctx->payload_tiler.postfix.occlusion_counter = panfrost_query_slot(ctx, ctx->occlusion_query->slot).gpu;
+        } else {
+                ctx->payload_tiler.gl_enables &= ~(MALI_GL_OCCLUSION_BOOLEAN | MALI_GL_OCCLUSION_PRECISE);
+                ctx->payload_tiler.postfix.occlusion_counter = 0;
         }
 
         if (ctx->dirty & PAN_DIRTY_VS) {
@@ -1114,59 +1354,64 @@ panfrost_emit_for_draw(struct panfrost_context *ctx, bool with_vertex_data)
                         ctx->fragment_shader_core.midgard1.unknown1 = 0x4200;
                 }
 
-                if (ctx->blend->has_blend_shader)
-                        ctx->fragment_shader_core.blend_shader = ctx->blend->blend_shader;
+                if (ctx->blend->rt[0].has_blend_shader)
+                        ctx->fragment_shader_core.blend_shader = ctx->blend->rt[0].blend_shader;
 
-                size_t size = sizeof(struct mali_shader_meta) + sizeof(struct mali_blend_meta);
+                unsigned rt_count = MAX2(ctx->pipe_framebuffer.nr_cbufs, 1);
+                size_t size = sizeof(struct mali_shader_meta) + sizeof(struct mali_blend_meta) * rt_count;
                 struct panfrost_transfer transfer = panfrost_allocate_transient(ctx, size);
                 memcpy(transfer.cpu, &ctx->fragment_shader_core, sizeof(struct mali_shader_meta));
 
                 ctx->payload_tiler.postfix._shader_upper = (transfer.gpu) >> 4;
 
 #ifdef T8XX
-                /* Additional blend descriptor tacked on for newer systems */
+                /* Additional blend descriptors tacked on for newer systems,
+                 * one per render target */
 
-                unsigned blend_count = 0;
+                /* Second blend equation is always a simple replace */
 
-                if (ctx->blend->has_blend_shader) {
-                        /* For a blend shader, the bottom nibble corresponds to
-                         * the number of work registers used, which signals the
-                         * -existence- of a blend shader */
+                uint64_t replace_magic = 0xf0122122;
+                struct mali_blend_equation replace_mode;
+                memcpy(&replace_mode, &replace_magic, sizeof(replace_mode));
 
-                        assert(ctx->blend->blend_work_count >= 2);
-                        blend_count |= MIN2(ctx->blend->blend_work_count, 3);
-                } else {
-                        /* Otherwise, the bottom bit simply specifies if
-                         * blending (anything other than REPLACE) is enabled */
+                struct mali_blend_meta blend_meta[PANFROST_MAX_RTS];
 
-                        /* XXX: Less ugly way to do this? */
-                        bool no_blending =
-                                (ctx->blend->equation.rgb_mode == 0x122) &&
-                                (ctx->blend->equation.alpha_mode == 0x122) &&
-                                (ctx->blend->equation.color_mask == 0xf);
+                for (unsigned i = 0; i < rt_count; ++i) {
+                        struct panfrost_blend_rt *blend = &ctx->blend->rt[i];
+                        unsigned blend_count = 0;
 
-                        if (!no_blending)
-                                blend_count |= 0x1;
-                }
+                        if (blend->has_blend_shader) {
+                                /* For a blend shader, the bottom nibble corresponds to
+                                 * the number of work registers used, which signals the
+                                 * -existence- of a blend shader */
 
-                /* Second blend equation is always a simple replace */
+                                assert(blend->blend_work_count >= 2);
+                                blend_count |= MIN2(blend->blend_work_count, 3);
+                        } else {
+                                /* Otherwise, the bottom bit simply specifies if
+                                 * blending (anything other than REPLACE) is enabled */
 
-                uint64_t replace_magic = 0xf0122122;
-                struct mali_blend_equation replace_mode;
-                memcpy(&replace_mode, &replace_magic, sizeof(replace_mode));
+                                /* XXX: Less ugly way to do this? */
+                                bool no_blending =
+                                        (blend->equation.rgb_mode == 0x122) &&
+                                        (blend->equation.alpha_mode == 0x122) &&
+                                        (blend->equation.color_mask == 0xf);
+
+                                if (!no_blending)
+                                        blend_count |= 0x1;
+                        }
 
-                struct mali_blend_meta blend_meta[] = {
-                        {
+                        blend_meta[i] = (struct mali_blend_meta) {
                                 .unk1 = 0x200 | blend_count,
-                                .blend_equation_1 = ctx->blend->equation,
+                                .blend_equation_1 = blend->equation,
                                 .blend_equation_2 = replace_mode
-                        },
-                };
+                        };
 
-                if (ctx->blend->has_blend_shader)
-                        memcpy(&blend_meta[0].blend_equation_1, &ctx->blend->blend_shader, sizeof(ctx->blend->blend_shader));
+                        if (blend->has_blend_shader)
+                                memcpy(&blend_meta[i].blend_equation_1, &blend->blend_shader, sizeof(blend->blend_shader));
+                }
 
-                memcpy(transfer.cpu + sizeof(struct mali_shader_meta), blend_meta, sizeof(blend_meta));
+                memcpy(transfer.cpu + sizeof(struct mali_shader_meta), blend_meta, sizeof(struct mali_blend_meta) * rt_count);
 #endif
         }
 
@@ -1180,17 +1425,18 @@ panfrost_emit_for_draw(struct panfrost_context *ctx, bool with_vertex_data)
                 for (int t = 0; t <= PIPE_SHADER_FRAGMENT; ++t) {
                         if (!ctx->sampler_count[t]) continue;
 
-                        struct panfrost_transfer transfer = panfrost_allocate_transient(ctx, sizeof(struct mali_sampler_descriptor) * ctx->sampler_count[t]);
-                        struct mali_sampler_descriptor *desc = (struct mali_sampler_descriptor *) transfer.cpu;
+                        struct mali_sampler_descriptor desc[PIPE_MAX_SAMPLERS];
 
                         for (int i = 0; i < ctx->sampler_count[t]; ++i) {
                                 desc[i] = ctx->samplers[t][i]->hw;
                         }
 
+                        mali_ptr samplers = panfrost_upload_transient_dedup(ctx, desc, sizeof(struct mali_sampler_descriptor) * ctx->sampler_count[t]);
+
                         if (t == PIPE_SHADER_FRAGMENT)
-                                ctx->payload_tiler.postfix.sampler_descriptor = transfer.gpu;
+                                ctx->payload_tiler.postfix.sampler_descriptor = samplers;
                         else if (t == PIPE_SHADER_VERTEX)
-                                ctx->payload_vertex.postfix.sampler_descriptor = transfer.gpu;
+                                ctx->payload_vertex.postfix.sampler_descriptor = samplers;
                         else
                                 assert(0);
                 }
@@ -1201,7 +1447,7 @@ panfrost_emit_for_draw(struct panfrost_context *ctx, bool with_vertex_data)
                         /* Shortcircuit */
                         if (!ctx->sampler_view_count[t]) continue;
 
-                        uint64_t trampolines[PIPE_MAX_SHADER_SAMPLER_VIEWS];
+                        uint64_t trampolines[PIPE_MAX_SHADER_SAMPLER_VIEWS] = { 0 };
 
                         for (int i = 0; i < ctx->sampler_view_count[t]; ++i) {
                                 if (!ctx->sampler_views[t][i])
@@ -1210,24 +1456,38 @@ panfrost_emit_for_draw(struct panfrost_context *ctx, bool with_vertex_data)
                                 struct pipe_resource *tex_rsrc = ctx->sampler_views[t][i]->base.texture;
                                 struct panfrost_resource *rsrc = (struct panfrost_resource *) tex_rsrc;
 
-                                /* Inject the address in. */
-                                for (int l = 0; l < (tex_rsrc->last_level + 1); ++l)
-                                        ctx->sampler_views[t][i]->hw.swizzled_bitmaps[l] = rsrc->bo->gpu[l];
+                                panfrost_frame_add_resource(ctx, tex_rsrc);
+
+                                struct pipe_sampler_view *view = &ctx->sampler_views[t][i]->base;
+                                unsigned first_level = view->u.tex.first_level;
+                                unsigned last_level = view->u.tex.last_level;
+                                unsigned first_face = view->target == PIPE_TEXTURE_CUBE ? view->u.tex.first_layer : 0;
+                                unsigned last_face = view->target == PIPE_TEXTURE_CUBE ? view->u.tex.last_layer : 0;
+                                unsigned idx = 0;
+
+                                /* Inject the addresses in, level-major */
+                                for (unsigned l = first_level; l <= last_level; ++l) {
+                                        for (unsigned f = first_face; f <= last_face; ++f)
+                                                ctx->sampler_views[t][i]->hw.swizzled_bitmaps[idx++] = panfrost_get_texture_address(rsrc, l, f);
+                                }
 
                                 /* Workaround maybe-errata (?) with non-mipmaps */
                                 int s = ctx->sampler_views[t][i]->hw.nr_mipmap_levels;
 
-                                if (!rsrc->bo->is_mipmap) {
+                                bool is_mipmap = last_level > first_level &&
+                                                 rsrc->bo->slices[first_level + 1].initialized;
+
+                                if (!is_mipmap) {
 #ifdef T6XX
                                         /* HW ERRATA, not needed after T6XX */
-                                        ctx->sampler_views[t][i]->hw.swizzled_bitmaps[1] = rsrc->bo->gpu[0];
+                                        ctx->sampler_views[t][i]->hw.swizzled_bitmaps[1] = ctx->sampler_views[t][i]->hw.swizzled_bitmaps[0];
 
                                         ctx->sampler_views[t][i]->hw.unknown3A = 1;
 #endif
                                         ctx->sampler_views[t][i]->hw.nr_mipmap_levels = 0;
                                 }
 
-                                trampolines[i] = panfrost_upload_transient(ctx, &ctx->sampler_views[t][i]->hw, sizeof(struct mali_texture_descriptor));
+                                trampolines[i] = panfrost_upload_transient_dedup(ctx, &ctx->sampler_views[t][i]->hw, sizeof(struct mali_texture_descriptor));
 
                                 /* Restore */
                                 ctx->sampler_views[t][i]->hw.nr_mipmap_levels = s;
@@ -1237,7 +1497,7 @@ panfrost_emit_for_draw(struct panfrost_context *ctx, bool with_vertex_data)
 #endif
                         }
 
-                        mali_ptr trampoline = panfrost_upload_transient(ctx, trampolines, sizeof(uint64_t) * ctx->sampler_view_count[t]);
+                        mali_ptr trampoline = panfrost_upload_transient_dedup(ctx, trampolines, sizeof(uint64_t) * ctx->sampler_view_count[t]);
 
                         if (t == PIPE_SHADER_FRAGMENT)
                                 ctx->payload_tiler.postfix.texture_trampoline = trampoline;
@@ -1404,6 +1664,68 @@ allocate_atom()
         return atom_counter;
 }
 
+/* With PAN_MESA_DEBUG=crcstats, count the tiles transaction elimination
+ * skipped last frame. The hardware doesn't report this, but a tile is only
+ * skipped if its checksum is unchanged, so compare against our copy of the
+ * previous frame's. Requires the frame to have finished. */
+
+static void
+panfrost_count_skipped_tiles(struct panfrost_context *ctx)
+{
+        struct pipe_surface *surf = ctx->pipe_framebuffer.cbufs[0];
+
+        if (!surf)
+                return;
+
+        struct panfrost_bo *bo = pan_resource(surf->texture)->bo;
+
+        if (!bo->has_checksum)
+                return;
+
+        int tile_w = (surf->texture->width0 + (MALI_TILE_LENGTH - 1)) >> MALI_TILE_SHIFT;
+        int tile_h = (surf->texture->height0 + (MALI_TILE_LENGTH - 1)) >> MALI_TILE_SHIFT;
+        const uint64_t *checksums = (const uint64_t *) bo->checksum_slab.cpu;
+
+        if (!bo->checksum_shadow)
+                bo->checksum_shadow = CALLOC(1, bo->checksum_slab.size);
+
+        for (int i = 0; i < tile_w * tile_h; ++i) {
+                if (checksums[i] == bo->checksum_shadow[i])
+                        ctx->counters[PAN_COUNTER_TE_TILES_SKIPPED]++;
+        }
+
+        ctx->counters[PAN_COUNTER_TE_TILES] += tile_w * tile_h;
+        memcpy(bo->checksum_shadow, checksums, tile_w * tile_h * sizeof(uint64_t));
+}
+
+/* The kernel is told which BOs each job uses, so it can keep them resident
+ * and order access to buffers shared with other processes. Resources are
+ * recorded as the frame references them, and kept alive until it is
+ * submitted */
+
+void
+panfrost_frame_add_resource(struct panfrost_context *ctx, struct pipe_resource *prsrc)
+{
+        struct pipe_resource *ref = NULL;
+
+        if (_mesa_set_search(ctx->frame_resources, prsrc))
+                return;
+
+        pipe_resource_reference(&ref, prsrc);
+        _mesa_set_add(ctx->frame_resources, ref);
+}
+
+static void
+panfrost_frame_release_resources(struct panfrost_context *ctx)
+{
+        set_foreach(ctx->frame_resources, entry) {
+                struct pipe_resource *prsrc = (struct pipe_resource *) entry->key;
+                pipe_resource_reference(&prsrc, NULL);
+        }
+
+        _mesa_set_clear(ctx->frame_resources, NULL);
+}
+
 /* The entire frame is in memory -- send it off to the kernel! */
 
 static void
@@ -1429,9 +1751,17 @@ panfrost_submit_frame(struct panfrost_context *ctx, bool flush_immediate)
 #ifndef DRY_RUN
         /* XXX: flush_immediate was causing lock-ups wrt readpixels in dEQP. Investigate. */
 
+        for (unsigned cb = 0; cb < ctx->pipe_framebuffer.nr_cbufs; ++cb) {
+                if (ctx->pipe_framebuffer.cbufs[cb])
+                        panfrost_frame_add_resource(ctx, ctx->pipe_framebuffer.cbufs[cb]->texture);
+        }
+
+        if (ctx->pipe_framebuffer.zsbuf)
+                panfrost_frame_add_resource(ctx, ctx->pipe_framebuffer.zsbuf->texture);
+
         struct pipe_surface *surf = ctx->pipe_framebuffer.cbufs[0];
         base_external_resource framebuffer[] = {
-                {.ext_resource = surf ? (((struct panfrost_resource *) surf->texture)->bo->gpu[0] | (BASE_EXT_RES_ACCESS_EXCLUSIVE & LOCAL_PAGE_LSB)) : 0},
+                {.ext_resource = surf ? (((struct panfrost_resource *) surf->texture)->bo->gpu | (BASE_EXT_RES_ACCESS_EXCLUSIVE & LOCAL_PAGE_LSB)) : 0},
         };
 
         int vt_atom = allocate_atom();
@@ -1472,33 +1802,118 @@ panfrost_submit_frame(struct panfrost_context *ctx, bool flush_immediate)
 				   (mali_ptr)(atoms + (has_draws ? 0 : 1)),
 				   has_draws ? 2 : 1);
 
+        panfrost_frame_release_resources(ctx);
+
         /* If visual, we can stall a frame */
 
         if (panfrost_is_scanout(ctx) && !flush_immediate)
-                screen->driver->force_flush_fragment(ctx);
+                panfrost_force_flush_fragment(ctx);
 
         screen->last_fragment_id = atoms[1].atom_number;
         screen->last_fragment_flushed = false;
+        ctx->frame_in_flight = ctx->frame;
 
         /* If readback, flush now (hurts the pipelined performance) */
         if (panfrost_is_scanout(ctx) && flush_immediate)
-                screen->driver->force_flush_fragment(ctx);
+                panfrost_force_flush_fragment(ctx);
+
+        if (screen->debug & PAN_DBG_CRC_STATS) {
+                panfrost_force_flush_fragment(ctx);
+                panfrost_count_skipped_tiles(ctx);
+        }
 
 #endif
 }
 
-bool dont_scanout = false;
+/* Stamps the pending time queries whose frame has completed */
+
+static void
+panfrost_complete_time_queries(struct panfrost_context *ctx, int64_t now)
+{
+        struct panfrost_query **queries = util_dynarray_begin(&ctx->pending_time_queries);
+        unsigned count = util_dynarray_num_elements(&ctx->pending_time_queries, struct panfrost_query *);
+
+        for (unsigned i = 0; i < count; ) {
+                if (queries[i]->frame <= ctx->frame_completed) {
+                        queries[i]->completed = now;
+                        queries[i]->pending = false;
+                        queries[i] = queries[--count];
+                        (void) util_dynarray_pop(&ctx->pending_time_queries, struct panfrost_query *);
+                } else {
+                        ++i;
+                }
+        }
+}
+
+static void
+panfrost_cancel_time_query(struct panfrost_context *ctx, struct panfrost_query *query)
+{
+        struct panfrost_query **queries = util_dynarray_begin(&ctx->pending_time_queries);
+        unsigned count = util_dynarray_num_elements(&ctx->pending_time_queries, struct panfrost_query *);
+
+        if (!query->pending)
+                return;
+
+        for (unsigned i = 0; i < count; ++i) {
+                if (queries[i] == query) {
+                        queries[i] = queries[count - 1];
+                        (void) util_dynarray_pop(&ctx->pending_time_queries, struct panfrost_query *);
+                        break;
+                }
+        }
+
+        query->pending = false;
+}
+
+/* Everything submitted has now completed */
+
+static void
+panfrost_frame_completed(struct panfrost_context *ctx)
+{
+        if (ctx->frame_completed != ctx->frame_in_flight) {
+                ctx->frame_completed = ctx->frame_in_flight;
+                panfrost_complete_time_queries(ctx, os_time_get_nano());
+        }
+}
+
+/* Waits for the last fragment job, if it is still in flight. Every CPU stall on
+ * the GPU goes through here, so it can be accounted for */
 
 void
-panfrost_flush(
-        struct pipe_context *pipe,
-        struct pipe_fence_handle **fence,
-        unsigned flags)
+panfrost_force_flush_fragment(struct panfrost_context *ctx)
 {
-        struct panfrost_context *ctx = pan_context(pipe);
+        struct panfrost_screen *screen = pan_screen(ctx->base.screen);
 
-        /* If there is nothing drawn, skip the frame */
-        if (!ctx->draw_count && !ctx->frame_cleared) return;
+        if (screen->last_fragment_flushed) {
+                screen->driver->force_flush_fragment(ctx);
+        } else {
+                int64_t start = os_time_get_nano();
+                screen->driver->force_flush_fragment(ctx);
+
+                ctx->counters[PAN_COUNTER_STALLS]++;
+                ctx->counters[PAN_COUNTER_STALL_TIME] += os_time_get_nano() - start;
+        }
+
+        panfrost_frame_completed(ctx);
+}
+
+/* Non-blocking counterpart of panfrost_force_flush_fragment, for polls */
+
+static void
+panfrost_poll_fragment(struct panfrost_context *ctx)
+{
+        struct panfrost_screen *screen = pan_screen(ctx->base.screen);
+
+        if (screen->driver->fragment_done(ctx))
+                panfrost_frame_completed(ctx);
+}
+
+bool dont_scanout = false;
+
+static void
+panfrost_flush_frame(struct panfrost_context *ctx, unsigned flags)
+{
+        ctx->counters[PAN_COUNTER_FLUSHES]++;
 
         if (!ctx->frame_cleared) {
                 /* While there are draws, there was no clear. This is a partial
@@ -1508,7 +1923,7 @@ panfrost_flush(
 
                 panfrost_clear(&ctx->base, ctx->last_clear.buffers, ctx->last_clear.color, ctx->last_clear.depth, ctx->last_clear.stencil);
 
-                panfrost_draw_wallpaper(pipe);
+                panfrost_draw_wallpaper(&ctx->base);
         }
 
         /* Frame clear handled, reset */
@@ -1519,29 +1934,80 @@ panfrost_flush(
 
         /* Submit the frame itself */
         panfrost_submit_frame(ctx, flush_immediate);
+        ctx->frame++;
 
         /* Prepare for the next frame */
         panfrost_invalidate_frame(ctx);
 }
 
-#define DEFINE_CASE(c) case PIPE_PRIM_##c: return MALI_GL_##c;
-
-static int
-g2m_draw_mode(enum pipe_prim_type mode)
+void
+panfrost_flush(
+        struct pipe_context *pipe,
+        struct pipe_fence_handle **fence,
+        unsigned flags)
 {
-        switch (mode) {
-                DEFINE_CASE(POINTS);
-                DEFINE_CASE(LINES);
-                DEFINE_CASE(LINE_LOOP);
-                DEFINE_CASE(LINE_STRIP);
-                DEFINE_CASE(TRIANGLES);
-                DEFINE_CASE(TRIANGLE_STRIP);
-                DEFINE_CASE(TRIANGLE_FAN);
+        struct panfrost_context *ctx = pan_context(pipe);
+        struct panfrost_screen *screen = pan_screen(pipe->screen);
 
-        default:
-                printf("Illegal draw mode %d\n", mode);
-                assert(0);
-                return MALI_GL_LINE_LOOP;
+        /* If there is nothing drawn, skip the frame */
+        if (ctx->draw_count || ctx->frame_cleared)
+                panfrost_flush_frame(ctx, flags);
+
+        /* The fence covers everything submitted so far, whether or not this
+         * flush had anything to submit */
+        if (fence && screen->driver->fence_create) {
+                struct panfrost_fence *f = screen->driver->fence_create(ctx);
+
+                pipe->screen->fence_reference(pipe->screen, fence, NULL);
+                *fence = (struct pipe_fence_handle *) f;
+        }
+}
+
+static void
+panfrost_create_fence_fd(struct pipe_context *pipe,
+                         struct pipe_fence_handle **pfence,
+                         int fd, enum pipe_fd_type type)
+{
+        struct panfrost_fence *f = CALLOC_STRUCT(panfrost_fence);
+
+        assert(type == PIPE_FD_TYPE_NATIVE_SYNC);
+
+        pipe_reference_init(&f->reference, 1);
+        f->fd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+        *pfence = (struct pipe_fence_handle *) f;
+}
+
+/* Makes the GPU rather than the CPU wait for the fence, by holding back the
+ * next submit until it signals */
+
+static void
+panfrost_fence_server_sync(struct pipe_context *pipe,
+                           struct pipe_fence_handle *pfence)
+{
+        struct panfrost_context *ctx = pan_context(pipe);
+        struct panfrost_fence *f = (struct panfrost_fence *) pfence;
+
+        sync_accumulate("panfrost", &ctx->in_fence_fd, f->fd);
+}
+
+#define DEFINE_CASE(c) case PIPE_PRIM_##c: return MALI_GL_##c;
+
+static int
+g2m_draw_mode(enum pipe_prim_type mode)
+{
+        switch (mode) {
+                DEFINE_CASE(POINTS);
+                DEFINE_CASE(LINES);
+                DEFINE_CASE(LINE_LOOP);
+                DEFINE_CASE(LINE_STRIP);
+                DEFINE_CASE(TRIANGLES);
+                DEFINE_CASE(TRIANGLE_STRIP);
+                DEFINE_CASE(TRIANGLE_FAN);
+
+        default:
+                printf("Illegal draw mode %d\n", mode);
+                assert(0);
+                return MALI_GL_LINE_LOOP;
         }
 }
 
@@ -1574,7 +2040,7 @@ panfrost_get_index_buffer_raw(const struct pipe_draw_info *info)
                 return (const uint8_t *) info->index.user;
         } else {
                 struct panfrost_resource *rsrc = (struct panfrost_resource *) (info->index.resource);
-                return (const uint8_t *) rsrc->bo->cpu[0];
+                return (const uint8_t *) rsrc->bo->cpu;
         }
 }
 
@@ -1590,7 +2056,8 @@ panfrost_get_index_buffer_mapped(struct panfrost_context *ctx, const struct pipe
 
         if (!info->has_user_indices) {
                 /* Only resources can be directly mapped */
-                return rsrc->bo->gpu[0] + offset;
+                panfrost_frame_add_resource(ctx, &rsrc->base);
+                return rsrc->bo->gpu + offset;
         } else {
                 /* Otherwise, we need to upload to transient memory */
                 const uint8_t *ibuf8 = panfrost_get_index_buffer_raw(info);
@@ -1603,48 +2070,185 @@ panfrost_draw_vbo(
         struct pipe_context *pipe,
         const struct pipe_draw_info *info);
 
-#define CALCULATE_MIN_MAX_INDEX(T, buffer, start, count) \
-        for (unsigned _idx = (start); _idx < (start + count); ++_idx) { \
-                T idx = buffer[_idx]; \
-                if (idx > max_index) max_index = idx; \
-                if (idx < min_index) min_index = idx; \
-        }
+/* Computes the range of indices referenced by an indexed draw, so we can
+ * figure out how many times to invoke the vertex shader */
 
 static void
-panfrost_draw_vbo(
-        struct pipe_context *pipe,
-        const struct pipe_draw_info *info)
+panfrost_get_index_bounds(const struct pipe_draw_info *info, unsigned *min_index, unsigned *max_index)
 {
-        struct panfrost_context *ctx = pan_context(pipe);
+        /* The state tracker may already know the bounds (e.g. from
+         * glDrawRangeElements); ~0 signals that it doesn't */
 
-        ctx->payload_vertex.draw_start = info->start;
-        ctx->payload_tiler.draw_start = info->start;
+        if (info->max_index != ~0u && info->max_index > info->min_index) {
+                *min_index = info->min_index;
+                *max_index = info->max_index;
+                return;
+        }
+
+        unsigned offset = info->start * info->index_size;
+        const uint8_t *ibuf8 = panfrost_get_index_buffer_raw(info) + offset;
+        int64_t restart = info->primitive_restart ? info->restart_index : PANFROST_NO_RESTART;
+
+        /* User indices change from draw to draw, so there's nothing to cache */
+
+        if (info->has_user_indices) {
+                panfrost_minmax_index(ibuf8, info->index_size, info->count, restart, min_index, max_index);
+                return;
+        }
+
+        struct panfrost_resource *rsrc = pan_resource(info->index.resource);
+
+        if (!rsrc->index_cache)
+                rsrc->index_cache = CALLOC_STRUCT(panfrost_minmax_cache);
+
+        if (panfrost_minmax_cache_get(rsrc->index_cache, offset, info->count, info->index_size, restart, min_index, max_index))
+                return;
+
+        panfrost_minmax_index(ibuf8, info->index_size, info->count, restart, min_index, max_index);
+        panfrost_minmax_cache_add(rsrc->index_cache, offset, info->count, info->index_size, restart, *min_index, *max_index);
+}
+
+/* Hardware primitives, for u_indices. Everything below quads is native */
+
+#define PANFROST_PRIM_MASK ((1 << PIPE_PRIM_QUADS) - 1)
+
+/* Returns a generated index buffer drawing count vertices of a quad/polygon
+ * mode as triangles, growing the cached buffer if needed. Returns 0 if the
+ * buffer would be too large to keep around, in which case the caller falls
+ * back to primconvert */
+
+static mali_ptr
+panfrost_get_generated_indices(struct panfrost_context *ctx,
+                               enum pipe_prim_type mode, unsigned count, unsigned pv,
+                               unsigned *out_index_size, unsigned *out_count)
+{
+        struct panfrost_generated_indices *gen =
+                &ctx->generated_indices[mode - PIPE_PRIM_QUADS][pv == PV_FIRST];
+
+        enum pipe_prim_type out_prim;
+        u_generate_func generate;
+        unsigned index_size, nr;
+
+        if (count > gen->capacity) {
+                /* Round up so a slowly growing vertex count doesn't
+                 * regenerate every draw */
+
+                unsigned capacity = MAX2(util_next_power_of_two(count), 1024);
+
+                u_index_generator(PANFROST_PRIM_MASK, mode, 0, capacity, pv, pv,
+                                  &out_prim, &index_size, &nr, &generate);
+
+                size_t size = nr * index_size;
+
+                if (size > (1 << MAX_SLAB_ENTRY_SIZE))
+                        return 0;
+
+                struct pb_slab_entry *entry = pb_slab_alloc(&ctx->slabs, size, HEAP_DESCRIPTOR);
+                struct panfrost_memory_entry *p_entry = (struct panfrost_memory_entry *) entry;
+                struct panfrost_memory *backing = (struct panfrost_memory *) entry->slab;
+
+                generate(0, nr, backing->cpu + p_entry->offset);
+
+                /* The old buffer may still be in use by the current frame */
+
+                if (gen->entry) {
+                        util_dynarray_append(&ctx->transient_pools[ctx->cmdstream_i].retired,
+                                             struct panfrost_memory_entry *, gen->entry);
+                }
+
+                gen->entry = p_entry;
+                gen->gpu = backing->gpu + p_entry->offset;
+                gen->capacity = capacity;
+                gen->index_size = index_size;
+        }
+
+        /* The patterns are prefix-stable, so we just need the count */
+
+        u_index_generator(PANFROST_PRIM_MASK, mode, 0, count, pv, pv,
+                          &out_prim, &index_size, &nr, &generate);
+
+        *out_index_size = gen->index_size;
+        *out_count = nr;
+
+        return gen->gpu;
+}
 
+/* Translates an indexed quad/polygon draw to triangles in transient memory.
+ * Restart indices are dropped in the process */
+
+static mali_ptr
+panfrost_translate_indices(struct panfrost_context *ctx,
+                           const struct pipe_draw_info *info,
+                           unsigned count, unsigned pv,
+                           unsigned *out_index_size, unsigned *out_count)
+{
+        enum pipe_prim_type out_prim;
+        u_translate_func translate;
+
+        u_index_translator(PANFROST_PRIM_MASK, info->mode, info->index_size, count, pv, pv,
+                           info->primitive_restart ? PR_ENABLE : PR_DISABLE,
+                           &out_prim, out_index_size, out_count, &translate);
+
+        size_t size = *out_count * *out_index_size;
+
+        struct panfrost_transfer transfer = panfrost_allocate_transient(ctx, size);
+        const uint8_t *ibuf8 = panfrost_get_index_buffer_raw(info);
+
+        translate(ibuf8, info->start, count, *out_count, info->restart_index, transfer.cpu);
+
+        return transfer.gpu;
+}
+
+/* Queues a draw whose varyings are known to fit in varying_mem */
+
+static void
+panfrost_draw_range(struct panfrost_context *ctx, const struct pipe_draw_info *info)
+{
         int mode = info->mode;
+        unsigned count = info->count;
+
+        /* Non-ES draw modes are drawn as triangles, with either generated or
+         * translated indices in place of the application's */
+
+        mali_ptr lowered_indices = 0;
+        unsigned lowered_index_size = 0, lowered_count = 0;
+
+        if (mode >= PIPE_PRIM_QUADS) {
+                if (!u_trim_pipe_prim(mode, &count))
+                        return;
 
-        /* Fallback for non-ES draw modes */
+                bool flatshade = ctx->rasterizer && ctx->rasterizer->base.flatshade;
+                unsigned pv = (ctx->rasterizer && ctx->rasterizer->base.flatshade_first) ? PV_FIRST : PV_LAST;
+
+                bool single_quad = mode == PIPE_PRIM_QUADS && count == 4 && !info->primitive_restart;
+
+                if (!flatshade && (single_quad || mode == PIPE_PRIM_POLYGON)) {
+                        /* Without flat shading, a polygon (or a lone quad)
+                         * rasterises identically as a fan */
 
-        if (info->mode >= PIPE_PRIM_QUADS) {
-                if (info->mode == PIPE_PRIM_QUADS && info->count == 4 && ctx->rasterizer && !ctx->rasterizer->base.flatshade) {
                         mode = PIPE_PRIM_TRIANGLE_FAN;
                 } else {
-                        if (info->count < 4) {
-                                /* Degenerate case? */
+                        if (info->index_size)
+                                lowered_indices = panfrost_translate_indices(ctx, info, count, pv, &lowered_index_size, &lowered_count);
+                        else
+                                lowered_indices = panfrost_get_generated_indices(ctx, mode, count, pv, &lowered_index_size, &lowered_count);
+
+                        if (!lowered_indices) {
+                                util_primconvert_save_rasterizer_state(ctx->primconvert, &ctx->rasterizer->base);
+                                util_primconvert_draw_vbo(ctx->primconvert, info);
                                 return;
                         }
 
-                        util_primconvert_save_rasterizer_state(ctx->primconvert, &ctx->rasterizer->base);
-                        util_primconvert_draw_vbo(ctx->primconvert, info);
-                        return;
+                        mode = PIPE_PRIM_TRIANGLES;
                 }
         }
 
         ctx->payload_tiler.prefix.draw_mode = g2m_draw_mode(mode);
 
-        ctx->vertex_count = info->count;
+        ctx->vertex_count = lowered_indices ? lowered_count : count;
 
         /* For non-indexed draws, they're the same */
-        unsigned invocation_count = ctx->vertex_count;
+        unsigned invocation_count = count;
 
         /* For higher amounts of vertices (greater than what fits in a 16-bit
          * short), the other value is needed, otherwise there will be bizarre
@@ -1653,65 +2257,203 @@ panfrost_draw_vbo(
         ctx->payload_tiler.prefix.unknown_draw &= ~(0x3000 | 0x18000);
         ctx->payload_tiler.prefix.unknown_draw |= (ctx->vertex_count > 65535) ? 0x3000 : 0x18000;
 
-        if (info->index_size) {
-                /* Calculate the min/max index used so we can figure out how
-                 * many times to invoke the vertex shader */
-
-                const uint8_t *ibuf8 = panfrost_get_index_buffer_raw(info);
+        /* Reset index state, set below for indexed draws */
+        ctx->payload_tiler.prefix.unknown_draw &= ~MALI_DRAW_INDEXED_SIZE;
 
-                int min_index = INT_MAX;
-                int max_index = 0;
-
-                if (info->index_size == 1) {
-                        CALCULATE_MIN_MAX_INDEX(uint8_t, ibuf8, info->start, info->count);
-                } else if (info->index_size == 2) {
-                        const uint16_t *ibuf16 = (const uint16_t *) ibuf8;
-                        CALCULATE_MIN_MAX_INDEX(uint16_t, ibuf16, info->start, info->count);
-                } else if (info->index_size == 4) {
-                        const uint32_t *ibuf32 = (const uint32_t *) ibuf8;
-                        CALCULATE_MIN_MAX_INDEX(uint32_t, ibuf32, info->start, info->count);
-                } else {
-                        assert(0);
-                }
+        if (info->index_size) {
+                unsigned min_index = 0, max_index = 0;
+                panfrost_get_index_bounds(info, &min_index, &max_index);
 
                 /* Make sure we didn't go crazy */
-                assert(min_index < INT_MAX);
-                assert(max_index > 0);
-                assert(max_index > min_index);
+                assert(min_index <= max_index);
+
+                /* Use the corresponding values. The vertex job starts at the
+                 * biased index, while the tiler subtracts the unbiased minimum
+                 * from each index to find its vertex */
 
-                /* Use the corresponding values */
                 invocation_count = max_index - min_index + 1;
-                ctx->payload_vertex.draw_start = min_index;
-                ctx->payload_tiler.draw_start = min_index;
+                ctx->payload_vertex.draw_start = min_index + info->index_bias;
+                ctx->payload_tiler.draw_start = min_index + info->index_bias;
 
                 ctx->payload_tiler.prefix.negative_start = -min_index;
-                ctx->payload_tiler.prefix.index_count = MALI_POSITIVE(info->count);
+                ctx->payload_tiler.prefix.index_count = MALI_POSITIVE(ctx->vertex_count);
 
-                //assert(!info->restart_index); /* TODO: Research */
-                assert(!info->index_bias);
-                //assert(!info->min_index); /* TODO: Use value */
+                if (lowered_indices) {
+                        ctx->payload_tiler.prefix.unknown_draw |= panfrost_translate_index_size(lowered_index_size);
+                        ctx->payload_tiler.prefix.indices = lowered_indices;
+                } else {
+                        ctx->payload_tiler.prefix.unknown_draw |= panfrost_translate_index_size(info->index_size);
+                        ctx->payload_tiler.prefix.indices = panfrost_get_index_buffer_mapped(ctx, info);
+                }
+        } else if (lowered_indices) {
+                /* Generated indices are zero-based, so they act like an
+                 * indexed draw of [0, count) biased by the start vertex */
+
+                ctx->payload_vertex.draw_start = info->start;
+                ctx->payload_tiler.draw_start = info->start;
+
+                ctx->payload_tiler.prefix.negative_start = 0;
+                ctx->payload_tiler.prefix.index_count = MALI_POSITIVE(ctx->vertex_count);
 
-                ctx->payload_tiler.prefix.unknown_draw |= panfrost_translate_index_size(info->index_size);
-                ctx->payload_tiler.prefix.indices = panfrost_get_index_buffer_mapped(ctx, info);
+                ctx->payload_tiler.prefix.unknown_draw |= panfrost_translate_index_size(lowered_index_size);
+                ctx->payload_tiler.prefix.indices = lowered_indices;
         } else {
                 /* Index count == vertex count, if no indexing is applied, as
                  * if it is internally indexed in the expected order */
 
+                ctx->payload_vertex.draw_start = info->start;
+                ctx->payload_tiler.draw_start = info->start;
+
                 ctx->payload_tiler.prefix.negative_start = 0;
                 ctx->payload_tiler.prefix.index_count = MALI_POSITIVE(ctx->vertex_count);
 
-                /* Reverse index state */
-                ctx->payload_tiler.prefix.unknown_draw &= ~MALI_DRAW_INDEXED_UINT32;
                 ctx->payload_tiler.prefix.indices = (uintptr_t) NULL;
         }
 
-        ctx->payload_vertex.prefix.invocation_count = MALI_POSITIVE(invocation_count);
-        ctx->payload_tiler.prefix.invocation_count = MALI_POSITIVE(invocation_count);
+        /* Instancing dispatches the vertex count (padded by the hardware)
+         * once per instance, for both the vertex and tiler jobs */
+
+        ctx->invocation_count = invocation_count;
+        ctx->instance_count = info->instance_count;
+        ctx->start_instance = info->start_instance;
+
+        if (info->instance_count > 1)
+                ctx->padded_count = panfrost_padded_vertex_count(invocation_count);
+        else
+                ctx->padded_count = invocation_count;
+
+        panfrost_pack_invocations(&ctx->payload_vertex.prefix, invocation_count, info->instance_count);
+        panfrost_pack_invocations(&ctx->payload_tiler.prefix, invocation_count, info->instance_count);
 
         /* Fire off the draw itself */
         panfrost_queue_draw(ctx);
 }
 
+/* Bytes of varying_mem written by a draw of the given number of vertices and
+ * instances, following the allocation in panfrost_emit_vertex_data */
+
+static size_t
+panfrost_varying_size(struct panfrost_context *ctx, unsigned vertices, unsigned instances)
+{
+        struct panfrost_varyings *vars = &ctx->vs->variants[ctx->vs->active_variant].varyings;
+        size_t count = vertices;
+        size_t size = 0;
+
+        if (instances > 1 && vertices)
+                count = (size_t) panfrost_padded_vertex_count(vertices) * instances;
+
+        for (int i = 0; i < vars->varying_buffer_count; ++i)
+                size += ALIGN(vars->varyings_stride[i] * count, 64);
+
+        return size;
+}
+
+/* Instances per range when a draw too big for varying_mem is split up. Each
+ * range starts on a multiple of every instance divisor, so per-instance
+ * attributes can simply be offset. Zero if no such range fits */
+
+static unsigned
+panfrost_instance_range(struct panfrost_context *ctx, unsigned vertices, unsigned instances)
+{
+        struct panfrost_vertex_state *so = ctx->vertex;
+        struct panfrost_varyings *vars = &ctx->vs->variants[ctx->vs->active_variant].varyings;
+        size_t padded = panfrost_padded_vertex_count(vertices);
+        size_t per_instance = 0;
+        size_t slack = 64 * vars->varying_buffer_count;
+        unsigned step = 1;
+
+        for (unsigned j = 0; j < so->num_elements && step < instances; ++j) {
+                unsigned a = step, b = so->pipe[j].instance_divisor;
+
+                if (!b)
+                        continue;
+
+                while (b) {
+                        unsigned t = a % b;
+                        a = b;
+                        b = t;
+                }
+
+                step = (step / a) * so->pipe[j].instance_divisor;
+        }
+
+        for (int i = 0; i < vars->varying_buffer_count; ++i)
+                per_instance += vars->varyings_stride[i] * padded;
+
+        if (!per_instance || ctx->varying_mem.size <= slack)
+                return 0;
+
+        size_t range = (ctx->varying_mem.size - slack) / per_instance;
+        range -= range % step;
+
+        return MIN2(range, instances);
+}
+
+static void
+panfrost_draw_vbo(
+        struct pipe_context *pipe,
+        const struct pipe_draw_info *info)
+{
+        struct panfrost_context *ctx = pan_context(pipe);
+
+        /* We don't know how to make the tiler restart primitives yet, so
+         * restarts are split up into separate draws on the CPU. Quads and
+         * quad strips are translated to triangles below, which drops the
+         * restart indices anyway */
+
+        if (info->primitive_restart && info->index_size &&
+            info->mode != PIPE_PRIM_QUADS && info->mode != PIPE_PRIM_QUAD_STRIP) {
+                util_draw_vbo_without_prim_restart(pipe, info);
+                return;
+        }
+
+        ctx->counters[PAN_COUNTER_DRAW_CALLS]++;
+
+        /* Varyings of every instance go to varying_mem, which is only reset by
+         * a flush, so flush first if the draw won't fit in what is left. A
+         * draw that won't fit even then is split by instance range. This must
+         * happen before the draw uploads anything, as flushing rotates the
+         * transient pool. The vertex count is an upper bound here */
+
+        unsigned vertices = info->count;
+
+        if (info->index_size) {
+                unsigned min_index = 0, max_index = 0;
+                panfrost_get_index_bounds(info, &min_index, &max_index);
+                vertices = max_index - min_index + 1;
+        }
+
+        size_t size = panfrost_varying_size(ctx, vertices, info->instance_count);
+
+        if (ctx->varying_height + size > ctx->varying_mem.size)
+                panfrost_flush(pipe, NULL, 0);
+
+        if (size <= ctx->varying_mem.size) {
+                panfrost_draw_range(ctx, info);
+                return;
+        }
+
+        unsigned range = info->instance_count > 1 ?
+                panfrost_instance_range(ctx, vertices, info->instance_count) : 0;
+
+        if (!range) {
+                fprintf(stderr, "panfrost: Varyings overflow, ignoring draw\n");
+                return;
+        }
+
+        struct pipe_draw_info split = *info;
+
+        for (unsigned first = 0; first < info->instance_count; first += range) {
+                split.start_instance = info->start_instance + first;
+                split.instance_count = MIN2(range, info->instance_count - first);
+
+                if (first)
+                        panfrost_flush(pipe, NULL, 0);
+
+                panfrost_draw_range(ctx, &split);
+        }
+}
+
 /* CSO state */
 
 static void
@@ -1808,8 +2550,14 @@ panfrost_create_vertex_elements_state(
 
         /* Allocate memory for the descriptor state */
 
+        for (int i = 0; i < num_elements; ++i)
+                so->instanced_base = MAX2(so->instanced_base, elements[i].vertex_buffer_index + 1);
+
         for (int i = 0; i < num_elements; ++i) {
-                so->hw[i].index = elements[i].vertex_buffer_index;
+                if (elements[i].instance_divisor)
+                        so->hw[i].index = so->instanced_base + (2 * so->instanced_count++);
+                else
+                        so->hw[i].index = elements[i].vertex_buffer_index;
 
                 enum pipe_format fmt = elements[i].src_format;
                 const struct util_format_description *desc = util_format_description(fmt);
@@ -2041,6 +2789,7 @@ panfrost_set_vertex_buffers(
         /* XXX: Dirty tracking? etc */
         if (buffers) {
                 size_t sz = sizeof(buffers[0]) * num_buffers;
+                free(ctx->vertex_buffers);
                 ctx->vertex_buffers = malloc(sz);
                 ctx->vertex_buffer_count = num_buffers;
                 memcpy(ctx->vertex_buffers, buffers, sz);
@@ -2088,7 +2837,7 @@ panfrost_set_constant_buffer(
         struct panfrost_resource *rsrc = (struct panfrost_resource *) (buf->buffer);
 
         if (rsrc) {
-                cpu = rsrc->bo->cpu[0];
+                cpu = rsrc->bo->cpu;
         } else if (buf->user_buffer) {
                 cpu = buf->user_buffer;
         } else {
@@ -2137,7 +2886,7 @@ panfrost_create_sampler_view(
          * later. */
 
         /* TODO: Other types of textures */
-        assert(template->target == PIPE_TEXTURE_2D);
+        assert(template->target == PIPE_TEXTURE_2D || template->target == PIPE_TEXTURE_CUBE);
 
         /* Make sure it's something with which we're familiar */
         assert(bytes_per_pixel >= 1 && bytes_per_pixel <= 4);
@@ -2155,9 +2904,9 @@ panfrost_create_sampler_view(
         enum mali_format format = panfrost_find_format(desc);
 
         struct mali_texture_descriptor texture_descriptor = {
-                .width = MALI_POSITIVE(texture->width0),
-                .height = MALI_POSITIVE(texture->height0),
-                .depth = MALI_POSITIVE(texture->depth0),
+                .width = MALI_POSITIVE(u_minify(texture->width0, template->u.tex.first_level)),
+                .height = MALI_POSITIVE(u_minify(texture->height0, template->u.tex.first_level)),
+                .depth = MALI_POSITIVE(u_minify(texture->depth0, template->u.tex.first_level)),
 
                 /* TODO: Decode */
                 .format = {
@@ -2165,7 +2914,7 @@ panfrost_create_sampler_view(
                         .format = format,
 
                         .usage1 = 0x0,
-                        .is_not_cubemap = 1,
+                        .is_not_cubemap = template->target != PIPE_TEXTURE_CUBE,
 
                         /* 0x11 - regular texture 2d, uncompressed tiled */
                         /* 0x12 - regular texture 2d, uncompressed linear */
@@ -2177,9 +2926,6 @@ panfrost_create_sampler_view(
                 .swizzle = panfrost_translate_swizzle_4(user_swizzle)
         };
 
-        /* TODO: Other base levels require adjusting dimensions / level numbers / etc */
-        assert (template->u.tex.first_level == 0);
-
         texture_descriptor.nr_mipmap_levels = template->u.tex.last_level - template->u.tex.first_level;
 
         so->hw = texture_descriptor;
@@ -2221,6 +2967,7 @@ panfrost_set_framebuffer_state(struct pipe_context *pctx,
                                const struct pipe_framebuffer_state *fb)
 {
         struct panfrost_context *ctx = pan_context(pctx);
+        struct panfrost_screen *screen = pan_screen(pctx->screen);
 
         /* Flush when switching away from an FBO */
 
@@ -2234,45 +2981,66 @@ panfrost_set_framebuffer_state(struct pipe_context *pctx,
         ctx->pipe_framebuffer.width = fb->width;
         ctx->pipe_framebuffer.height = fb->height;
 
+        bool cbufs_changed = false;
+
         for (int i = 0; i < PIPE_MAX_COLOR_BUFS; i++) {
                 struct pipe_surface *cb = i < fb->nr_cbufs ? fb->cbufs[i] : NULL;
 
                 /* check if changing cbuf */
                 if (ctx->pipe_framebuffer.cbufs[i] == cb) continue;
 
+#ifdef SFBD
                 if (cb && (i != 0)) {
                         printf("XXX: Multiple render targets not supported before t7xx!\n");
                         assert(0);
                 }
+#else
+                assert(!cb || i < PANFROST_MAX_RTS);
+#endif
 
                 /* assign new */
                 pipe_surface_reference(&ctx->pipe_framebuffer.cbufs[i], cb);
+                cbufs_changed = true;
 
                 if (!cb)
                         continue;
 
-                ctx->vt_framebuffer = panfrost_emit_fbd(ctx);
-                panfrost_attach_vt_framebuffer(ctx);
-                panfrost_new_frag_framebuffer(ctx);
-                panfrost_set_scissor(ctx);
-
                 struct panfrost_resource *tex = ((struct panfrost_resource *) ctx->pipe_framebuffer.cbufs[i]->texture);
-                bool is_scanout = panfrost_is_scanout(ctx);
+                bool is_scanout = panfrost_is_scanout_surface(cb);
+
+                bool linear = tex->base.bind & PIPE_BIND_LINEAR;
 
-                if (!is_scanout && !tex->bo->has_afbc) {
+                /* Rendered levels are worth sampling from now */
+                tex->bo->slices[cb->u.tex.level].initialized = true;
+
+                if (!is_scanout && !linear && !tex->bo->has_afbc && !tex->base.last_level) {
                         /* The blob is aggressive about enabling AFBC. As such,
                          * it's pretty much necessary to use it here, since we
-                         * have no traces of non-compressed FBO. */
+                         * have no traces of non-compressed FBO. Staging
+                         * resources ask for linear, so they can be mapped.
+                         * The AFBC buffer only holds a single level, so
+                         * mipmapped textures stay uncompressed */
 
                         panfrost_enable_afbc(ctx, tex, false);
                 }
 
-                if (!is_scanout && !tex->bo->has_checksum) {
-                        /* Enable transaction elimination if we can */
-                        panfrost_enable_checksum(ctx, tex);
+                if (!tex->bo->has_checksum && panfrost_resource_wants_checksum(screen, &tex->base)) {
+                        /* Imported resources get transaction elimination
+                         * on first use instead */
+                        panfrost_resource_enable_checksum(screen, tex);
                 }
         }
 
+        if (cbufs_changed) {
+                ctx->vt_framebuffer = panfrost_emit_fbd(ctx);
+                panfrost_attach_vt_framebuffer(ctx);
+                panfrost_new_frag_framebuffer(ctx);
+                panfrost_set_scissor(ctx);
+
+                /* There is a blend descriptor per render target */
+                ctx->dirty |= PAN_DIRTY_FS;
+        }
+
         {
                 struct pipe_surface *zb = fb->zsbuf;
 
@@ -2318,14 +3086,18 @@ panfrost_create_blend_state(struct pipe_context *pipe,
         assert(!blend->alpha_to_coverage);
         assert(!blend->alpha_to_one);
 
-        /* Compile the blend state, first as fixed-function if we can */
+        for (unsigned rt = 0; rt < PANFROST_MAX_RTS; ++rt) {
+                const struct pipe_rt_blend_state *rt_blend = &blend->rt[blend->independent_blend_enable ? rt : 0];
 
-        if (panfrost_make_fixed_blend_mode(&blend->rt[0], &so->equation, blend->rt[0].colormask, &ctx->blend_color))
-                return so;
+                /* Compile the blend state, first as fixed-function if we can */
 
-        /* If we can't, compile a blend shader instead */
+                if (panfrost_make_fixed_blend_mode(rt_blend, &so->rt[rt].equation, rt_blend->colormask, &ctx->blend_color))
+                        continue;
 
-        panfrost_make_blend_shader(ctx, so, &ctx->blend_color);
+                /* If we can't, compile a blend shader instead */
+
+                panfrost_make_blend_shader(ctx, so, rt, &ctx->blend_color);
+        }
 
         return so;
 }
@@ -2495,7 +3267,8 @@ static void
 panfrost_set_active_query_state(struct pipe_context *pipe,
                                 boolean enable)
 {
-        //struct panfrost_context *panfrost = pan_context(pipe);
+        struct panfrost_context *ctx = pan_context(pipe);
+        ctx->active_queries = enable;
 }
 
 static void
@@ -2505,6 +3278,79 @@ panfrost_destroy(struct pipe_context *pipe)
 
         if (panfrost->blitter)
                 util_blitter_destroy(panfrost->blitter);
+
+        panfrost_frame_release_resources(panfrost);
+        _mesa_set_destroy(panfrost->frame_resources, NULL);
+        util_dynarray_fini(&panfrost->pending_time_queries);
+
+        if (panfrost->in_fence_fd >= 0)
+                close(panfrost->in_fence_fd);
+}
+
+struct panfrost_transfer
+panfrost_query_slot(struct panfrost_context *ctx, unsigned slot)
+{
+        struct panfrost_transfer *block = util_dynarray_element(&ctx->query_pool.blocks,
+                        struct panfrost_transfer, slot / PANFROST_QUERY_BLOCK_SLOTS);
+        unsigned offset = (slot % PANFROST_QUERY_BLOCK_SLOTS) * sizeof(uint64_t);
+
+        struct panfrost_transfer transfer = {
+                .cpu = block->cpu + offset,
+                .gpu = block->gpu + offset,
+        };
+
+        return transfer;
+}
+
+static unsigned
+panfrost_query_pool_alloc(struct panfrost_context *ctx)
+{
+        struct panfrost_query_pool *pool = &ctx->query_pool;
+
+        /* Recycle slots whose frames have since completed */
+        unsigned count = util_dynarray_num_elements(&pool->retired, struct panfrost_query_retired);
+        struct panfrost_query_retired *retired = util_dynarray_begin(&pool->retired);
+
+        for (unsigned i = 0; i < count; ) {
+                if (retired[i].frame <= ctx->frame_completed) {
+                        util_dynarray_append(&pool->free, unsigned, retired[i].slot);
+                        retired[i] = retired[--count];
+                } else {
+                        ++i;
+                }
+        }
+
+        pool->retired.size = count * sizeof(struct panfrost_query_retired);
+
+        if (!util_dynarray_num_elements(&pool->free, unsigned)) {
+                unsigned first = util_dynarray_num_elements(&pool->blocks, struct panfrost_transfer) * PANFROST_QUERY_BLOCK_SLOTS;
+                struct panfrost_transfer block = panfrost_allocate_chunk(ctx, PANFROST_QUERY_BLOCK_SLOTS * sizeof(uint64_t), HEAP_DESCRIPTOR);
+
+                util_dynarray_append(&pool->blocks, struct panfrost_transfer, block);
+
+                /* Hand out the lowest slots first */
+                for (unsigned i = PANFROST_QUERY_BLOCK_SLOTS; i > 0; --i)
+                        util_dynarray_append(&pool->free, unsigned, first + i - 1);
+        }
+
+        return util_dynarray_pop(&pool->free, unsigned);
+}
+
+static void
+panfrost_query_pool_release(struct panfrost_context *ctx, unsigned slot, uint64_t frame)
+{
+        struct panfrost_query_pool *pool = &ctx->query_pool;
+
+        if (frame <= ctx->frame_completed) {
+                util_dynarray_append(&pool->free, unsigned, slot);
+        } else {
+                struct panfrost_query_retired retired = {
+                        .slot = slot,
+                        .frame = frame,
+                };
+
+                util_dynarray_append(&pool->retired, struct panfrost_query_retired, retired);
+        }
 }
 
 static struct pipe_query *
@@ -2523,6 +3369,17 @@ panfrost_create_query(struct pipe_context *pipe,
 static void
 panfrost_destroy_query(struct pipe_context *pipe, struct pipe_query *q)
 {
+        struct panfrost_context *ctx = pan_context(pipe);
+        struct panfrost_query *query = (struct panfrost_query *) q;
+
+        if (ctx->occlusion_query == query)
+                ctx->occlusion_query = NULL;
+
+        if (query->has_slot)
+                panfrost_query_pool_release(ctx, query->slot, query->frame);
+
+        panfrost_cancel_time_query(ctx, query);
+
         FREE(q);
 }
 
@@ -2532,18 +3389,45 @@ panfrost_begin_query(struct pipe_context *pipe, struct pipe_query *q)
         struct panfrost_context *ctx = pan_context(pipe);
         struct panfrost_query *query = (struct panfrost_query *) q;
 
+        if (query->type >= PIPE_QUERY_DRIVER_SPECIFIC) {
+                query->start = ctx->counters[query->type - PIPE_QUERY_DRIVER_SPECIFIC];
+                return true;
+        }
+
         switch (query->type) {
+                case PIPE_QUERY_OCCLUSION_COUNTER:
                 case PIPE_QUERY_OCCLUSION_PREDICATE:
                 case PIPE_QUERY_OCCLUSION_PREDICATE_CONSERVATIVE:
                 {
-                        /* Allocate a word for the query results to be stored */
-                        query->transfer = panfrost_allocate_chunk(ctx, sizeof(unsigned), HEAP_DESCRIPTOR);
+                        /* If the last result may still be written, leave
+                         * its slot to the GPU and take a fresh one */
+
+                        if (query->has_slot && query->frame > ctx->frame_completed) {
+                                panfrost_query_pool_release(ctx, query->slot, query->frame);
+                                query->has_slot = false;
+                        }
+
+                        if (!query->has_slot) {
+                                query->slot = panfrost_query_pool_alloc(ctx);
+                                query->has_slot = true;
+                        }
+
+                        *((uint64_t *) panfrost_query_slot(ctx, query->slot).cpu) = 0;
 
                         ctx->occlusion_query = query;
 
                         break;
                 }
 
+                case PIPE_QUERY_TIME_ELAPSED:
+                        panfrost_cancel_time_query(ctx, query);
+                        query->start = os_time_get_nano();
+                        break;
+
+                case PIPE_QUERY_TIMESTAMP:
+                        /* Only ended */
+                        break;
+
                 default:
                         fprintf(stderr, "Skipping query %d\n", query->type);
                         break;
@@ -2556,34 +3440,103 @@ static bool
 panfrost_end_query(struct pipe_context *pipe, struct pipe_query *q)
 {
         struct panfrost_context *ctx = pan_context(pipe);
-        ctx->occlusion_query = NULL;
+        struct panfrost_query *query = (struct panfrost_query *) q;
+
+        if (query->type >= PIPE_QUERY_DRIVER_SPECIFIC) {
+                query->end = ctx->counters[query->type - PIPE_QUERY_DRIVER_SPECIFIC];
+                return true;
+        }
+
+        /* Without draws in the current frame, nothing in it can affect the
+         * result, so don't wait for it */
+
+        query->frame = ctx->draw_count ? ctx->frame : ctx->frame - 1;
+
+        if (ctx->occlusion_query == query)
+                ctx->occlusion_query = NULL;
+
+        if (query->type == PIPE_QUERY_TIMESTAMP || query->type == PIPE_QUERY_TIME_ELAPSED) {
+                panfrost_cancel_time_query(ctx, query);
+                query->end = os_time_get_nano();
+
+                if (query->frame <= ctx->frame_completed) {
+                        query->completed = query->end;
+                } else {
+                        query->pending = true;
+                        util_dynarray_append(&ctx->pending_time_queries, struct panfrost_query *, query);
+                }
+        }
+
         return true;
 }
 
+/* Results are read straight from the pool once the frame last writing them
+ * has completed, so polling many queries costs no flushes. Only a waiting
+ * read of a pending result flushes and stalls.
+ *
+ * Neither kernel interface exposes a GPU timestamp, so time queries are
+ * measured on the CPU, up to the later of the end of the query and the point
+ * the driver sees the query's frame complete */
+
 static boolean
 panfrost_get_query_result(struct pipe_context *pipe, 
                           struct pipe_query *q,
                           boolean wait,
                           union pipe_query_result *vresult)
 {
-        /* STUB */
+        struct panfrost_context *ctx = pan_context(pipe);
         struct panfrost_query *query = (struct panfrost_query *) q;
 
-        /* We need to flush out the jobs to actually run the counter, TODO
-         * check wait, TODO wallpaper after if needed */
+        /* Driver queries are CPU-side, so there is nothing to wait for */
+
+        if (query->type >= PIPE_QUERY_DRIVER_SPECIFIC) {
+                enum panfrost_counter counter = query->type - PIPE_QUERY_DRIVER_SPECIFIC;
+                uint64_t value = query->end - query->start;
 
-        panfrost_flush(pipe, NULL, PIPE_FLUSH_END_OF_FRAME);
+                /* The HUD wants microseconds */
+                vresult->u64 = panfrost_counter_is_time(counter) ? value / 1000 : value;
+                return true;
+        }
+
+        if (query->frame > ctx->frame_completed) {
+                /* Submit the query's frame even when polling, or offscreen
+                 * work would never be kicked off and the poll never succeed */
+
+                if (query->frame == ctx->frame)
+                        panfrost_flush(pipe, NULL, 0);
+
+                if (wait)
+                        panfrost_force_flush_fragment(ctx);
+                else
+                        panfrost_poll_fragment(ctx);
+
+                if (query->frame > ctx->frame_completed)
+                        return false;
+        }
 
         switch (query->type) {
+                case PIPE_QUERY_OCCLUSION_COUNTER:
                 case PIPE_QUERY_OCCLUSION_PREDICATE:
                 case PIPE_QUERY_OCCLUSION_PREDICATE_CONSERVATIVE: {
-                        /* Read back the query results */
-                        unsigned *result = (unsigned *) query->transfer.cpu;
-                        unsigned passed = *result;
+                        uint64_t passed = query->has_slot ?
+                                *((uint64_t *) panfrost_query_slot(ctx, query->slot).cpu) : 0;
+
+                        if (query->type == PIPE_QUERY_OCCLUSION_COUNTER)
+                                vresult->u64 = passed;
+                        else
+                                vresult->b = !!passed;
 
-                        vresult->b = !!passed;
                         break;
                 }
+
+                case PIPE_QUERY_TIMESTAMP:
+                        vresult->u64 = MAX2(query->completed, (int64_t) query->end);
+                        break;
+
+                case PIPE_QUERY_TIME_ELAPSED:
+                        vresult->u64 = MAX2(query->completed, (int64_t) query->end) - query->start;
+                        break;
+
                 default:
                         fprintf(stderr, "Skipped query get %d\n", query->type);
                         break;
@@ -2592,6 +3545,41 @@ panfrost_get_query_result(struct pipe_context *pipe,
         return true;
 }
 
+#define PAN_QUERY(name, counter, type) \
+        { name, PIPE_QUERY_DRIVER_SPECIFIC + PAN_COUNTER_##counter, { 0 }, PIPE_DRIVER_QUERY_TYPE_##type }
+
+static const struct pipe_driver_query_info panfrost_driver_queries[] = {
+        PAN_QUERY("draw-calls", DRAW_CALLS, UINT64),
+        PAN_QUERY("flushes", FLUSHES, UINT64),
+        PAN_QUERY("transient-bytes", TRANSIENT_BYTES, BYTES),
+        PAN_QUERY("vertex-buffer-copies", VERTEX_BUFFER_COPIES, UINT64),
+        PAN_QUERY("vertex-buffer-copy-bytes", VERTEX_BUFFER_COPY_BYTES, BYTES),
+        PAN_QUERY("shader-compiles", SHADER_COMPILES, UINT64),
+        PAN_QUERY("shader-compile-time", SHADER_COMPILE_TIME, MICROSECONDS),
+        PAN_QUERY("tiled-bytes", TILED_BYTES, BYTES),
+        PAN_QUERY("tiling-time", TILING_TIME, MICROSECONDS),
+        PAN_QUERY("stalls", STALLS, UINT64),
+        PAN_QUERY("stall-time", STALL_TIME, MICROSECONDS),
+        PAN_QUERY("te-tiles", TE_TILES, UINT64),
+        PAN_QUERY("te-tiles-skipped", TE_TILES_SKIPPED, UINT64),
+};
+
+#undef PAN_QUERY
+
+int
+panfrost_get_driver_query_info(struct pipe_screen *pscreen, unsigned index,
+                               struct pipe_driver_query_info *info)
+{
+        if (!info)
+                return ARRAY_SIZE(panfrost_driver_queries);
+
+        if (index >= ARRAY_SIZE(panfrost_driver_queries))
+                return 0;
+
+        *info = panfrost_driver_queries[index];
+        return 1;
+}
+
 static struct pb_slab *
 panfrost_slab_alloc(void *priv, unsigned heap, unsigned entry_size, unsigned group_index)
 {
@@ -2620,7 +3608,8 @@ panfrost_slab_alloc(void *priv, unsigned heap, unsigned entry_size, unsigned gro
         /* Actually allocate the memory from kernel-space. Mapped, same_va, no
          * special flags */
 
-        screen->driver->allocate_slab(ctx, mem, slab_size / 4096, true, 0, 0, 0);
+        screen->driver->allocate_slab(screen, mem, slab_size / 4096, true, 0, 0, 0);
+        util_dynarray_append(&ctx->slab_memory, struct panfrost_memory *, mem);
 
         return &mem->slab;
 }
@@ -2658,21 +3647,29 @@ panfrost_setup_hardware(struct panfrost_context *ctx)
                         panfrost_slab_alloc,
                         panfrost_slab_free);
 
-        for (int i = 0; i < ARRAY_SIZE(ctx->transient_pools); ++i) {
-                /* Allocate the beginning of the transient pool */
-                int entry_size = (1 << 22); /* 4MB */
+        /* 4MB entries */
+        for (int i = 0; i < ARRAY_SIZE(ctx->transient_pools); ++i)
+                panfrost_transient_pool_init(ctx, &ctx->transient_pools[i], 1 << 22);
 
-                ctx->transient_pools[i].entry_size = entry_size;
-                ctx->transient_pools[i].entry_count = 1;
+        util_dynarray_init(&ctx->transient_free, NULL);
+        util_dynarray_init(&ctx->slab_memory, NULL);
 
-                ctx->transient_pools[i].entries[0] = (struct panfrost_memory_entry *) pb_slab_alloc(&ctx->slabs, entry_size, HEAP_TRANSIENT);
-        }
+        ctx->frame_resources = _mesa_set_create(NULL, _mesa_hash_pointer, _mesa_key_pointer_equal);
+        ctx->in_fence_fd = -1;
+
+        screen->driver->allocate_slab(screen, &ctx->scratchpad, 64, false, 0, 0, 0);
+        screen->driver->allocate_slab(screen, &ctx->varying_mem, 16384, false, 0, 0, 0);
+        screen->driver->allocate_slab(screen, &ctx->shaders, 4096, true, BASE_MEM_PROT_GPU_EX, 0, 0);
+        screen->driver->allocate_slab(screen, &ctx->tiler_heap, 32768, false, BASE_MEM_GROW_ON_GPF, 1, 128);
+        screen->driver->allocate_slab(screen, &ctx->misc_0, 128, false, BASE_MEM_GROW_ON_GPF, 1, 128);
 
-        screen->driver->allocate_slab(ctx, &ctx->scratchpad, 64, false, 0, 0, 0);
-        screen->driver->allocate_slab(ctx, &ctx->varying_mem, 16384, false, 0, 0, 0);
-        screen->driver->allocate_slab(ctx, &ctx->shaders, 4096, true, BASE_MEM_PROT_GPU_EX, 0, 0);
-        screen->driver->allocate_slab(ctx, &ctx->tiler_heap, 32768, false, BASE_MEM_GROW_ON_GPF, 1, 128);
-        screen->driver->allocate_slab(ctx, &ctx->misc_0, 128, false, BASE_MEM_GROW_ON_GPF, 1, 128);
+        util_dynarray_init(&ctx->query_pool.blocks, NULL);
+        util_dynarray_init(&ctx->query_pool.free, NULL);
+        util_dynarray_init(&ctx->query_pool.retired, NULL);
+        util_dynarray_init(&ctx->pending_time_queries, NULL);
+
+        ctx->active_queries = true;
+        ctx->frame = 1;
 }
 
 /* New context creation, which also does hardware initialisation since I don't
@@ -2697,6 +3694,12 @@ panfrost_create_context(struct pipe_screen *screen, void *priv, unsigned flags)
         gallium->set_framebuffer_state = panfrost_set_framebuffer_state;
 
         gallium->flush = panfrost_flush;
+
+        if (pscreen->driver->fence_create) {
+                gallium->create_fence_fd = panfrost_create_fence_fd;
+                gallium->fence_server_sync = panfrost_fence_server_sync;
+        }
+
         gallium->clear = panfrost_clear;
         gallium->draw_vbo = panfrost_draw_vbo;
 
@@ -42,6 +42,8 @@
 #include "pipe/p_screen.h"
 #include "pipe/p_state.h"
 #include "util/u_blitter.h"
+#include "util/u_dynarray.h"
+#include "util/set.h"
 
 /* Forward declare to avoid extra header dep */
 struct prim_convert_context;
@@ -58,6 +60,9 @@ struct prim_convert_context;
 #define MAX_DRAW_CALLS 4096
 #define MAX_VARYINGS   4096
 
+/* The MFBD counts render targets in two bits */
+#define PANFROST_MAX_RTS 4
+
 //#define PAN_DIRTY_CLEAR	     (1 << 0)
 #define PAN_DIRTY_RASTERIZER (1 << 2)
 #define PAN_DIRTY_FS	     (1 << 3)
@@ -75,25 +80,112 @@ struct panfrost_constant_buffer {
         void *buffer;
 };
 
+/* CPU-side counters of what the driver is spending its time on, exposed to
+ * the HUD as driver-specific queries. Times are in nanoseconds */
+
+enum panfrost_counter {
+        PAN_COUNTER_DRAW_CALLS,
+        PAN_COUNTER_FLUSHES,
+        PAN_COUNTER_TRANSIENT_BYTES,
+        PAN_COUNTER_VERTEX_BUFFER_COPIES,
+        PAN_COUNTER_VERTEX_BUFFER_COPY_BYTES,
+        PAN_COUNTER_SHADER_COMPILES,
+        PAN_COUNTER_SHADER_COMPILE_TIME,
+        PAN_COUNTER_TILED_BYTES,
+        PAN_COUNTER_TILING_TIME,
+        PAN_COUNTER_STALLS,
+        PAN_COUNTER_STALL_TIME,
+
+        /* Render target tiles written, and how many of those transaction
+         * elimination skipped. Only counted with PAN_MESA_DEBUG=crcstats */
+        PAN_COUNTER_TE_TILES,
+        PAN_COUNTER_TE_TILES_SKIPPED,
+
+        PAN_NUM_COUNTERS
+};
+
+static inline bool
+panfrost_counter_is_time(enum panfrost_counter counter)
+{
+        return counter == PAN_COUNTER_SHADER_COMPILE_TIME ||
+               counter == PAN_COUNTER_TILING_TIME ||
+               counter == PAN_COUNTER_STALL_TIME;
+}
+
 struct panfrost_query {
         /* Passthrough from Gallium */
         unsigned type;
         unsigned index;
 
-        /* Memory for the GPU to writeback the value of the query */
-        struct panfrost_transfer transfer;
+        /* Slot in the query pool for the GPU to write the result to */
+        bool has_slot;
+        unsigned slot;
+
+        /* Last frame that may write the result. Results are ready once it
+         * has completed */
+        uint64_t frame;
+
+        /* For driver queries, the counter at begin and end. For time
+         * queries, CPU time at begin and end */
+        uint64_t start, end;
+
+        /* For time queries, CPU time frame was seen to complete at. Until
+         * then the query is in the context's pending_time_queries */
+        bool pending;
+        int64_t completed;
 };
 
-#define PANFROST_MAX_TRANSIENT_ENTRIES 64
+/* Occlusion results are written by the GPU into 64-bit slots of a pool,
+ * allocated a block at a time. Slots still to be written by an in-flight frame
+ * are retired, and recycled once that frame completes, so reusing a query
+ * never waits on the GPU */
 
-struct panfrost_transient_pool {
-        /* Memory blocks in the pool */
-        struct panfrost_memory_entry *entries[PANFROST_MAX_TRANSIENT_ENTRIES];
+#define PANFROST_QUERY_BLOCK_SLOTS 512
+
+struct panfrost_query_retired {
+        unsigned slot;
+        uint64_t frame;
+};
+
+struct panfrost_query_pool {
+        /* struct panfrost_transfer, one per block */
+        struct util_dynarray blocks;
+
+        /* unsigned slot indices */
+        struct util_dynarray free;
+
+        /* struct panfrost_query_retired */
+        struct util_dynarray retired;
+};
 
-        /* Number of entries we own */
-        unsigned entry_count;
+/* Descriptors that don't change between draws (attribute and varying
+ * records, sampler and texture tables) would otherwise be uploaded again for
+ * every draw. Uploads through panfrost_upload_transient_dedup are looked up in
+ * a small per-frame table first and reuse the earlier copy if the contents
+ * match. The contents are compared against a CPU-side copy, since reading the
+ * write-combined upload back would be slow. The table is open addressed and
+ * simply stops taking new entries once half full */
 
-        /* Current entry that we are writing to, zero-indexed, strictly less than entry_count */
+#define PANFROST_TRANSIENT_DEDUP_SLOTS 256
+
+struct panfrost_transient_upload {
+        uint32_t hash;
+        uint32_t size;
+
+        /* Byte offset of the CPU-side copy in dedup_data */
+        uint32_t data;
+
+        mali_ptr gpu;
+};
+
+struct panfrost_transient_pool {
+        /* Memory blocks in the pool (struct panfrost_memory_entry *). They
+         * are kept across frames, so a pool only calls into pb_slab while it
+         * grows to the size of the largest frame */
+        struct util_dynarray entries;
+
+        /* Current entry that we are writing to, zero-indexed, strictly less
+         * than the number of entries */
         unsigned entry_index;
 
         /* Number of bytes into the current entry we are */
@@ -101,6 +193,44 @@ struct panfrost_transient_pool {
 
         /* Entry size (all entries must be homogenous) */
         size_t entry_size;
+
+        /* Uploads too large for an entry each get a chunk of their own
+         * (struct panfrost_memory *), returned to the context's free list
+         * when the pool is recycled */
+        struct util_dynarray oversized;
+
+        /* Generated index buffers outgrown while this pool was current. The
+         * frame may still reference them, so they are only released when the
+         * pool itself is recycled */
+        struct util_dynarray retired;
+
+        struct panfrost_transient_upload dedup[PANFROST_TRANSIENT_DEDUP_SLOTS];
+        unsigned dedup_count;
+        struct util_dynarray dedup_data;
+};
+
+/* Number of oversized transient chunks kept around for reuse between frames;
+ * beyond this they are given back to the winsys */
+
+#define PANFROST_MAX_FREE_OVERSIZED 8
+
+/* Quads, quad strips and polygons have no hardware equivalent, so
+ * non-indexed draws of them go through a generated triangle index buffer.
+ * The generated patterns only depend on the vertex count and grow by
+ * appending, so a single GPU-resident buffer per mode and provoking vertex
+ * serves every draw up to its capacity */
+
+#define PANFROST_GENERATED_MODES (PIPE_PRIM_POLYGON - PIPE_PRIM_QUADS + 1)
+
+struct panfrost_generated_indices {
+        struct panfrost_memory_entry *entry;
+        mali_ptr gpu;
+
+        /* Number of vertices covered */
+        unsigned capacity;
+
+        /* Size of each index in bytes */
+        unsigned index_size;
 };
 
 struct panfrost_context {
@@ -115,6 +245,9 @@ struct panfrost_context {
         struct panfrost_transient_pool transient_pools[2];
         int cmdstream_i;
 
+        /* Idle oversized transient chunks (struct panfrost_memory *) */
+        struct util_dynarray transient_free;
+
         struct panfrost_memory cmdstream_persistent;
         struct panfrost_memory shaders;
         struct panfrost_memory scratchpad;
@@ -133,6 +266,21 @@ struct panfrost_context {
 
         struct panfrost_query *occlusion_query;
 
+        /* Disabled by u_blitter, so its draws don't count */
+        bool active_queries;
+
+        struct panfrost_query_pool query_pool;
+
+        /* Frames are numbered from one: the frame being built, the last one
+         * submitted, and the last one known to have completed */
+        uint64_t frame;
+        uint64_t frame_in_flight;
+        uint64_t frame_completed;
+
+        /* Ended time queries whose frame has not completed yet (struct
+         * panfrost_query *) */
+        struct util_dynarray pending_time_queries;
+
         /* Each render job has multiple framebuffer descriptors associated with
          * it, used for various purposes with more or less the same format. The
          * most obvious is the fragment framebuffer descriptor, which carries
@@ -145,7 +293,7 @@ struct panfrost_context {
 
         struct bifrost_fb_extra fragment_extra;
 
-        struct bifrost_render_target fragment_rts[4];
+        struct bifrost_render_target fragment_rts[PANFROST_MAX_RTS];
 #endif
 
         /* Each draw has corresponding vertex and tiler payloads */
@@ -175,6 +323,9 @@ struct panfrost_context {
         unsigned vertex_job_count;
         unsigned tiler_job_count;
 
+        /* Indexed by enum panfrost_counter; never reset */
+        uint64_t counters[PAN_NUM_COUNTERS];
+
         /* Per-draw Dirty flags are setup like any other driver */
         int dirty;
 
@@ -183,6 +334,13 @@ struct panfrost_context {
 
         unsigned vertex_count;
 
+        /* Vertex shader invocations per instance, as seen by the driver and
+         * as padded by the hardware when instancing, and the instance range */
+        unsigned invocation_count;
+        unsigned padded_count;
+        unsigned instance_count;
+        unsigned start_instance;
+
         union mali_attr attributes[PIPE_MAX_ATTRIBS];
 
         unsigned varying_height;
@@ -212,6 +370,10 @@ struct panfrost_context {
         unsigned sampler_view_count[PIPE_SHADER_TYPES];
 
         struct primconvert_context *primconvert;
+
+        /* Indexed by mode - PIPE_PRIM_QUADS, then by whether the first vertex
+         * is provoking */
+        struct panfrost_generated_indices generated_indices[PANFROST_GENERATED_MODES][2];
         struct blitter_context *blitter;
 
         struct panfrost_blend_state *blend;
@@ -224,6 +386,18 @@ struct panfrost_context {
 
         /* Memory management is based on subdividing slabs with AMD's allocator */
         struct pb_slabs slabs;
+
+        /* Backing of every slab in slabs (struct panfrost_memory *) */
+        struct util_dynarray slab_memory;
+
+        /* Resources the frame being built reads or writes (struct
+         * pipe_resource *), each holding a reference until the frame is
+         * submitted. Together with the context's own memory, these are the
+         * BOs the winsys passes to the kernel with the frame's jobs */
+        struct set *frame_resources;
+
+        /* Native fence the next submit has to wait on, or -1 */
+        int in_fence_fd;
 };
 
 /* Corresponds to the CSO */
@@ -235,9 +409,9 @@ struct panfrost_rasterizer {
         unsigned tiler_gl_enables;
 };
 
-struct panfrost_blend_state {
-        struct pipe_blend_state base;
+/* Blending compiled for a single render target */
 
+struct panfrost_blend_rt {
         /* Whether a blend shader is in use */
         bool has_blend_shader;
 
@@ -249,6 +423,16 @@ struct panfrost_blend_state {
         int blend_work_count;
 };
 
+struct panfrost_blend_state {
+        struct pipe_blend_state base;
+
+        /* Without independent blending, every entry is compiled from rt[0] */
+        struct panfrost_blend_rt rt[PANFROST_MAX_RTS];
+
+        /* Whether any render target uses a blend shader */
+        bool has_blend_shader;
+};
+
 /* Internal varyings descriptor */
 struct panfrost_varyings {
         /* Varyings information: stride of each chunk of memory used for
@@ -312,6 +496,12 @@ struct panfrost_vertex_state {
         struct pipe_vertex_element pipe[PIPE_MAX_ATTRIBS];
         int nr_components[PIPE_MAX_ATTRIBS];
 
+        /* Elements with an instance divisor get attribute buffer records of
+         * their own, two apiece to leave room for NPOT divisors, placed after
+         * the records of the vertex buffers referenced */
+        unsigned instanced_base;
+        unsigned instanced_count;
+
         /* The actual attribute meta, prebaked and GPU mapped. TODO: Free memory */
         struct mali_attr_meta *hw;
         mali_ptr descriptor_ptr;
@@ -359,7 +549,24 @@ panfrost_flush(
         struct pipe_fence_handle **fence,
         unsigned flags);
 
+void
+panfrost_blit(struct pipe_context *pipe,
+              const struct pipe_blit_info *info);
+
 void
 panfrost_shader_compile(struct panfrost_context *ctx, struct mali_shader_meta *meta, const char *src, int type, struct panfrost_shader_state *state);
 
+void
+panfrost_force_flush_fragment(struct panfrost_context *ctx);
+
+void
+panfrost_frame_add_resource(struct panfrost_context *ctx, struct pipe_resource *prsrc);
+
+struct panfrost_transfer
+panfrost_query_slot(struct panfrost_context *ctx, unsigned slot);
+
+int
+panfrost_get_driver_query_info(struct pipe_screen *pscreen, unsigned index,
+                               struct pipe_driver_query_info *info);
+
 #endif
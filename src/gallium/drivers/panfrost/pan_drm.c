@@ -21,22 +21,669 @@
  * SOFTWARE.
  *
  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <xf86drm.h>
+
+#include "drm-uapi/panfrost_drm.h"
+
+#include "util/macros.h"
+#include "util/list.h"
+#include "util/os_time.h"
+#include "util/simple_mtx.h"
+#include "util/u_dynarray.h"
+#include "util/u_format.h"
+#include "util/u_inlines.h"
+#include "util/u_math.h"
 #include "util/u_memory.h"
+#include "util/set.h"
+#include "state_tracker/winsys_handle.h"
 
+#include <panfrost-mali-base.h>
+#include <panfrost-misc.h>
 #include "pan_screen.h"
 #include "pan_drm.h"
+#include "pan_resource.h"
+#include "pan_context.h"
+
+/* Creating, mapping and destroying GEM objects is expensive compared to the
+ * rate the driver churns through slabs, so freed BOs are kept around for a
+ * while in size buckets, and handed back out to later allocations of the same
+ * bucket once the GPU is done with them. Each power of two is split into four
+ * buckets (1, 1.25, 1.5 and 1.75 times it), so rounding a size up to its
+ * bucket wastes at most a fifth of it. */
+
+#define MIN_BO_CACHE_BUCKET (12) /* 4KB */
+#define MAX_BO_CACHE_BUCKET (22) /* 4MB */
+#define BO_CACHE_STEPS (4)
+#define NR_BO_CACHE_BUCKETS ((MAX_BO_CACHE_BUCKET - MIN_BO_CACHE_BUCKET) * BO_CACHE_STEPS + 1)
+
+/* Cached BOs unused for longer than this are released to the kernel */
+#define BO_CACHE_MAX_AGE_NS (1000000000ll)
+
+struct panfrost_drm_cached_bo {
+        struct list_head link;
+
+        uint32_t handle;
+        size_t size;
+        uint8_t *cpu;
+        mali_ptr gpu;
+
+        /* When the BO entered the cache */
+        int64_t freed;
+};
 
 struct panfrost_drm {
 	struct panfrost_driver base;
 	int fd;
+
+        simple_mtx_t lock;
+
+        /* Free BOs, by bucket, most recently freed first */
+        struct list_head bo_cache[NR_BO_CACHE_BUCKETS];
+
+        /* Scratch list of the handles of the BOs referenced by the job being
+         * submitted. The kernel keeps them resident and orders the job
+         * against other users of shared buffers (implicit fencing) */
+        struct util_dynarray handles;
+
+        /* Signalled when the last submitted job completes. Each job waits on
+         * it before replacing it, which serialises jobs in submission order.
+         * Native fences are exported from it */
+        uint32_t syncobj;
+
+        /* Holds the context's accumulated in-fence while a job waiting on it
+         * is submitted */
+        uint32_t in_syncobj;
 };
 
+struct panfrost_drm_bo {
+	struct panfrost_bo base;
+
+        /* Backing for every level and layer */
+        struct panfrost_memory mem;
+
+        /* Imported from another device, so never cached */
+        bool imported;
+};
+
+static void
+panfrost_drm_close_handle(struct panfrost_drm *drm, uint32_t handle)
+{
+        struct drm_gem_close gem_close = {
+                .handle = handle,
+        };
+
+        if (drmIoctl(drm->fd, DRM_IOCTL_GEM_CLOSE, &gem_close))
+                fprintf(stderr, "panfrost: Failed to close BO %u: %s\n", handle, strerror(errno));
+}
+
+static uint8_t *
+panfrost_drm_mmap_bo(struct panfrost_drm *drm, uint32_t handle, size_t size)
+{
+        struct drm_panfrost_mmap_bo mmap_bo = {
+                .handle = handle,
+        };
+
+        if (drmIoctl(drm->fd, DRM_IOCTL_PANFROST_MMAP_BO, &mmap_bo)) {
+                fprintf(stderr, "panfrost: Failed to get mmap offset of BO %u: %s\n", handle, strerror(errno));
+                return NULL;
+        }
+
+        uint8_t *cpu = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            drm->fd, mmap_bo.offset);
+
+        if (cpu == MAP_FAILED) {
+                fprintf(stderr, "panfrost: Failed to mmap BO %u: %s\n", handle, strerror(errno));
+                return NULL;
+        }
+
+        return cpu;
+}
+
+/* Index of the cache bucket a size rounds up to, or -1 if it's too large to
+ * be cached */
+
+static int
+panfrost_drm_bucket_index(size_t size)
+{
+        size = MAX2(size, 1 << MIN_BO_CACHE_BUCKET);
+
+        unsigned l = util_logbase2(size);
+        unsigned step = DIV_ROUND_UP(size, 1ull << (l - 2)) - BO_CACHE_STEPS;
+        unsigned index = (l - MIN_BO_CACHE_BUCKET) * BO_CACHE_STEPS + step;
+
+        return index >= NR_BO_CACHE_BUCKETS ? -1 : index;
+}
+
+static size_t
+panfrost_drm_bucket_size(unsigned index)
+{
+        unsigned l = (index / BO_CACHE_STEPS) + MIN_BO_CACHE_BUCKET;
+
+        return (size_t) (BO_CACHE_STEPS + (index % BO_CACHE_STEPS)) << (l - 2);
+}
+
+static bool
+panfrost_drm_bo_idle(struct panfrost_drm *drm, uint32_t handle)
+{
+        /* The timeout is absolute, so zero polls */
+        struct drm_panfrost_wait_bo wait = {
+                .handle = handle,
+                .timeout_ns = 0,
+        };
+
+        return drmIoctl(drm->fd, DRM_IOCTL_PANFROST_WAIT_BO, &wait) == 0;
+}
+
+static void
+panfrost_drm_wait_bo(struct panfrost_drm *drm, uint32_t handle)
+{
+        struct drm_panfrost_wait_bo wait = {
+                .handle = handle,
+                .timeout_ns = INT64_MAX,
+        };
+
+        if (drmIoctl(drm->fd, DRM_IOCTL_PANFROST_WAIT_BO, &wait))
+                fprintf(stderr, "panfrost: Failed to wait on BO %u: %s\n", handle, strerror(errno));
+}
+
+/* Releases cached BOs that have gone unused for a while. Called with the lock
+ * held */
+
+static void
+panfrost_drm_evict_cache(struct panfrost_drm *drm, int64_t now)
+{
+        for (unsigned b = 0; b < NR_BO_CACHE_BUCKETS; ++b) {
+                /* Oldest at the tail */
+                list_for_each_entry_safe_rev(struct panfrost_drm_cached_bo, entry,
+                                             &drm->bo_cache[b], link) {
+                        if (now - entry->freed < BO_CACHE_MAX_AGE_NS)
+                                break;
+
+                        munmap(entry->cpu, entry->size);
+                        panfrost_drm_close_handle(drm, entry->handle);
+                        list_del(&entry->link);
+                        FREE(entry);
+                }
+        }
+}
+
+/* Finds an idle cached BO of the given bucket, removing it from the cache.
+ * Jobs complete in submission order, so if the least recently freed BO is
+ * still busy, so is every other one, and only it is worth polling */
+
+static struct panfrost_drm_cached_bo *
+panfrost_drm_cache_fetch(struct panfrost_drm *drm, int bucket)
+{
+        struct panfrost_drm_cached_bo *found = NULL;
+        struct list_head *cache = &drm->bo_cache[bucket];
+
+        simple_mtx_lock(&drm->lock);
+
+        if (!list_empty(cache)) {
+                struct panfrost_drm_cached_bo *oldest =
+                        LIST_ENTRY(struct panfrost_drm_cached_bo, cache->prev, link);
+
+                if (panfrost_drm_bo_idle(drm, oldest->handle)) {
+                        list_del(&oldest->link);
+                        found = oldest;
+                }
+        }
+
+        simple_mtx_unlock(&drm->lock);
+
+        return found;
+}
+
+static void
+panfrost_drm_allocate_slab(struct panfrost_screen *screen,
+		           struct panfrost_memory *mem,
+		           size_t pages,
+		           bool same_va,
+		           int extra_flags,
+		           int commit_count,
+		           int extent)
+{
+	struct panfrost_drm *drm = (struct panfrost_drm *)screen->driver;
+        size_t size = pages * 4096;
+
+        /* Every BO is mapped on the CPU and the GPU, and growable heaps are
+         * allocated at their full size upfront, so same_va, the protection
+         * flags and the commit parameters have no equivalent here */
+
+        int bucket = panfrost_drm_bucket_index(size);
+
+        if (bucket >= 0) {
+                size = panfrost_drm_bucket_size(bucket);
+
+                struct panfrost_drm_cached_bo *cached = panfrost_drm_cache_fetch(drm, bucket);
+
+                if (cached) {
+                        mem->gem_handle = cached->handle;
+                        mem->cpu = cached->cpu;
+                        mem->gpu = cached->gpu;
+                        mem->size = cached->size;
+                        mem->stack_bottom = 0;
+
+                        FREE(cached);
+                        return;
+                }
+        }
+
+        struct drm_panfrost_create_bo create_bo = {
+                .size = size,
+        };
+
+        if (drmIoctl(drm->fd, DRM_IOCTL_PANFROST_CREATE_BO, &create_bo)) {
+                fprintf(stderr, "panfrost: Failed to allocate %zu bytes: %s\n", size, strerror(errno));
+                abort();
+        }
+
+        mem->gem_handle = create_bo.handle;
+        mem->gpu = create_bo.offset;
+        mem->size = size;
+        mem->stack_bottom = 0;
+        mem->cpu = panfrost_drm_mmap_bo(drm, create_bo.handle, size);
+
+        if (!mem->cpu)
+                abort();
+}
+
+static void
+panfrost_drm_free_slab(struct panfrost_screen *screen,
+                       struct panfrost_memory *mem)
+{
+	struct panfrost_drm *drm = (struct panfrost_drm *)screen->driver;
+        int bucket = panfrost_drm_bucket_index(mem->size);
+
+        /* Only BOs of exactly a bucket's size were allocated from it */
+        if (bucket >= 0 && mem->size == panfrost_drm_bucket_size(bucket)) {
+                struct panfrost_drm_cached_bo *entry = CALLOC_STRUCT(panfrost_drm_cached_bo);
+                int64_t now = os_time_get_nano();
+
+                entry->handle = mem->gem_handle;
+                entry->size = mem->size;
+                entry->cpu = mem->cpu;
+                entry->gpu = mem->gpu;
+                entry->freed = now;
+
+                simple_mtx_lock(&drm->lock);
+                list_add(&entry->link, &drm->bo_cache[bucket]);
+                panfrost_drm_evict_cache(drm, now);
+                simple_mtx_unlock(&drm->lock);
+        } else {
+                munmap(mem->cpu, mem->size);
+                panfrost_drm_close_handle(drm, mem->gem_handle);
+        }
+
+        mem->cpu = NULL;
+        mem->gpu = 0;
+        mem->gem_handle = 0;
+}
+
+static struct panfrost_bo *
+panfrost_drm_create_bo(struct panfrost_screen *screen, const struct pipe_resource *template)
+{
+	struct panfrost_drm_bo *bo = CALLOC_STRUCT(panfrost_drm_bo);
+        bool is_rt = template->bind & (PIPE_BIND_RENDER_TARGET | PIPE_BIND_DEPTH_STENCIL);
+
+        /* Tiling textures is almost always faster, unless we only use it once */
+        bo->base.tiled = !is_rt && (template->usage != PIPE_USAGE_STREAM) && (template->bind & PIPE_BIND_SAMPLER_VIEW);
+
+        /* Every resource gets a BO of its own, holding every level and
+         * layer. Small ones come out of the BO cache */
+
+        size_t sz = panfrost_setup_slices(template, &bo->base);
+
+        screen->driver->allocate_slab(screen, &bo->mem, DIV_ROUND_UP(sz, 4096), true, 0, 0, 0);
+
+        bo->base.cpu = bo->mem.cpu;
+        bo->base.gpu = bo->mem.gpu;
+
+        return &bo->base;
+}
+
+static struct panfrost_bo *
+panfrost_drm_import_bo(struct panfrost_screen *screen, struct winsys_handle *whandle)
+{
+	struct panfrost_drm_bo *bo = CALLOC_STRUCT(panfrost_drm_bo);
+	struct panfrost_drm *drm = (struct panfrost_drm *)screen->driver;
+        uint32_t handle;
+
+        if (drmPrimeFDToHandle(drm->fd, whandle->handle, &handle)) {
+                fprintf(stderr, "panfrost: Failed to import BO: %s\n", strerror(errno));
+                FREE(bo);
+                return NULL;
+        }
+
+        struct drm_panfrost_get_bo_offset get_bo_offset = {
+                .handle = handle,
+        };
+
+        if (drmIoctl(drm->fd, DRM_IOCTL_PANFROST_GET_BO_OFFSET, &get_bo_offset)) {
+                fprintf(stderr, "panfrost: Failed to get offset of imported BO: %s\n", strerror(errno));
+                panfrost_drm_close_handle(drm, handle);
+                FREE(bo);
+                return NULL;
+        }
+
+        bo->imported = true;
+        bo->mem.gem_handle = handle;
+        bo->mem.gpu = get_bo_offset.offset;
+        bo->mem.size = lseek(whandle->handle, 0, SEEK_END);
+        bo->mem.cpu = panfrost_drm_mmap_bo(drm, handle, bo->mem.size);
+
+        if (!bo->mem.cpu) {
+                panfrost_drm_close_handle(drm, handle);
+                FREE(bo);
+                return NULL;
+        }
+
+        bo->base.cpu = bo->mem.cpu;
+        bo->base.gpu = bo->mem.gpu;
+
+        return &bo->base;
+}
+
+static uint8_t *
+panfrost_drm_map_bo(struct panfrost_context *ctx, struct pipe_transfer *transfer)
+{
+        struct panfrost_screen *screen = pan_screen(ctx->base.screen);
+	struct panfrost_drm *drm = (struct panfrost_drm *)screen->driver;
+	struct panfrost_drm_bo *bo = (struct panfrost_drm_bo *)pan_resource(transfer->resource)->bo;
+
+        if (transfer->resource->bind & PIPE_BIND_DEPTH_STENCIL) {
+                /* Mipmapped readpixels?! */
+                assert(transfer->level == 0);
+
+                /* Map the depth/stencil buffer in memory, untiled */
+                return ctx->depth_stencil_buffer.cpu;
+        }
+
+        /* Direct mappings see the GPU's writes, so wait for them */
+        if (!(transfer->usage & PIPE_TRANSFER_UNSYNCHRONIZED))
+                panfrost_drm_wait_bo(drm, bo->mem.gem_handle);
+
+        return bo->base.cpu;
+}
+
+static void
+panfrost_drm_unmap_bo(struct panfrost_context *ctx,
+                      struct pipe_transfer *transfer)
+{
+        /* Direct mappings are coherent, and tiled textures are written back
+         * by the caller, so there is nothing to do */
+}
+
+static void
+panfrost_drm_destroy_bo(struct panfrost_screen *screen, struct panfrost_bo *pbo)
+{
+	struct panfrost_drm *drm = (struct panfrost_drm *)screen->driver;
+	struct panfrost_drm_bo *bo = (struct panfrost_drm_bo *)pbo;
+
+        if (bo->imported) {
+                munmap(bo->mem.cpu, bo->mem.size);
+                panfrost_drm_close_handle(drm, bo->mem.gem_handle);
+        } else {
+                screen->driver->free_slab(screen, &bo->mem);
+        }
+
+        if (bo->base.has_afbc)
+                screen->driver->free_slab(screen, &bo->base.afbc_slab);
+
+        if (bo->base.has_checksum)
+                screen->driver->free_slab(screen, &bo->base.checksum_slab);
+
+        FREE(bo);
+}
+
+static void
+panfrost_drm_add_handle(struct panfrost_drm *drm, const struct panfrost_memory *mem)
+{
+        /* Never allocated */
+        if (!mem->gem_handle)
+                return;
+
+        util_dynarray_append(&drm->handles, uint32_t, mem->gem_handle);
+}
+
+/* Gathers the handles of every BO the context's current frame may reference:
+ * its own memory, the transient memory of the current pool and the resources
+ * added with panfrost_frame_add_resource. Called with the lock held */
+
+static void
+panfrost_drm_collect_handles(struct panfrost_drm *drm, struct panfrost_context *ctx)
+{
+        struct panfrost_transient_pool *pool = &ctx->transient_pools[ctx->cmdstream_i];
+
+        util_dynarray_clear(&drm->handles);
+
+        panfrost_drm_add_handle(drm, &ctx->cmdstream_persistent);
+        panfrost_drm_add_handle(drm, &ctx->shaders);
+        panfrost_drm_add_handle(drm, &ctx->scratchpad);
+        panfrost_drm_add_handle(drm, &ctx->tiler_heap);
+        panfrost_drm_add_handle(drm, &ctx->varying_mem);
+        panfrost_drm_add_handle(drm, &ctx->misc_0);
+        panfrost_drm_add_handle(drm, &ctx->misc_1);
+        panfrost_drm_add_handle(drm, &ctx->depth_stencil_buffer);
+
+        /* Transient pool entries and generated index buffers are slab
+         * entries, so the slabs cover them */
+        util_dynarray_foreach(&ctx->slab_memory, struct panfrost_memory *, mem)
+                panfrost_drm_add_handle(drm, *mem);
+
+        util_dynarray_foreach(&pool->oversized, struct panfrost_memory *, mem)
+                panfrost_drm_add_handle(drm, *mem);
+
+        set_foreach(ctx->frame_resources, entry) {
+                struct panfrost_resource *rsrc = (struct panfrost_resource *) entry->key;
+                struct panfrost_drm_bo *bo = (struct panfrost_drm_bo *) rsrc->bo;
+
+                panfrost_drm_add_handle(drm, &bo->mem);
+
+                if (bo->base.has_afbc)
+                        panfrost_drm_add_handle(drm, &bo->base.afbc_slab);
+
+                if (bo->base.has_checksum)
+                        panfrost_drm_add_handle(drm, &bo->base.checksum_slab);
+        }
+}
+
+/* The context builds kbase atoms; each becomes a job of its own, chained
+ * through the syncobj so they execute in order, as the atom dependencies
+ * require. The first also waits on the context's in-fence, if any */
+
+static void
+panfrost_drm_submit_job(struct panfrost_context *ctx, mali_ptr addr, int nr_atoms)
+{
+        struct pipe_context *gallium = (struct pipe_context *) ctx;
+        struct panfrost_screen *screen = panfrost_screen(gallium->screen);
+	struct panfrost_drm *drm = (struct panfrost_drm *)screen->driver;
+        const struct base_jd_atom_v2 *atoms = (const struct base_jd_atom_v2 *) (uintptr_t) addr;
+        uint32_t in_syncs[2] = { drm->syncobj };
+        unsigned in_sync_count = 1;
+
+        simple_mtx_lock(&drm->lock);
+
+        panfrost_drm_collect_handles(drm, ctx);
+
+        if (ctx->in_fence_fd >= 0) {
+                if (drmSyncobjImportSyncFile(drm->fd, drm->in_syncobj, ctx->in_fence_fd))
+                        fprintf(stderr, "panfrost: Failed to import fence: %s\n", strerror(errno));
+                else
+                        in_syncs[in_sync_count++] = drm->in_syncobj;
+
+                close(ctx->in_fence_fd);
+                ctx->in_fence_fd = -1;
+        }
+
+        for (int i = 0; i < nr_atoms; ++i) {
+                struct drm_panfrost_submit submit = {
+                        .jc = atoms[i].jc,
+                        .in_syncs = (uintptr_t) in_syncs,
+                        .in_sync_count = in_sync_count,
+                        .out_sync = drm->syncobj,
+                        .bo_handles = (uintptr_t) util_dynarray_begin(&drm->handles),
+                        .bo_handle_count = util_dynarray_num_elements(&drm->handles, uint32_t),
+                };
+
+                if (atoms[i].core_req & BASE_JD_REQ_FS)
+                        submit.requirements |= PANFROST_JD_REQ_FS;
+
+                if (drmIoctl(drm->fd, DRM_IOCTL_PANFROST_SUBMIT, &submit))
+                        fprintf(stderr, "panfrost: Error submitting: %s\n", strerror(errno));
+
+                /* Later jobs are ordered after this one already */
+                in_sync_count = 1;
+        }
+
+        simple_mtx_unlock(&drm->lock);
+}
+
+/* Native fences are snapshots of the syncobj, so they signal once every job
+ * submitted so far has completed */
+
+static struct panfrost_fence *
+panfrost_drm_fence_create(struct panfrost_context *ctx)
+{
+        struct pipe_context *gallium = (struct pipe_context *) ctx;
+        struct panfrost_screen *screen = panfrost_screen(gallium->screen);
+	struct panfrost_drm *drm = (struct panfrost_drm *)screen->driver;
+        struct panfrost_fence *f;
+        int fd = -1;
+        int ret;
+
+        simple_mtx_lock(&drm->lock);
+        ret = drmSyncobjExportSyncFile(drm->fd, drm->syncobj, &fd);
+        simple_mtx_unlock(&drm->lock);
+
+        if (ret || fd < 0) {
+                fprintf(stderr, "panfrost: Failed to export fence: %s\n", strerror(errno));
+                return NULL;
+        }
+
+        f = CALLOC_STRUCT(panfrost_fence);
+        pipe_reference_init(&f->reference, 1);
+        f->fd = fd;
+
+        return f;
+}
+
+/* Forces a flush, to make sure everything is consistent.
+ * Bad for parallelism. Necessary for glReadPixels etc. Use cautiously.
+ */
+
+static void
+panfrost_drm_force_flush_fragment(struct panfrost_context *ctx)
+{
+        struct pipe_context *gallium = (struct pipe_context *) ctx;
+        struct panfrost_screen *screen = panfrost_screen(gallium->screen);
+	struct panfrost_drm *drm = (struct panfrost_drm *)screen->driver;
+
+        if (!screen->last_fragment_flushed) {
+                if (drmSyncobjWait(drm->fd, &drm->syncobj, 1, INT64_MAX, 0, NULL))
+                        fprintf(stderr, "panfrost: Failed to wait for the last job: %s\n", strerror(errno));
+
+                screen->last_fragment_flushed = true;
+        }
+}
+
+static bool
+panfrost_drm_fragment_done(struct panfrost_context *ctx)
+{
+        struct pipe_context *gallium = (struct pipe_context *) ctx;
+        struct panfrost_screen *screen = panfrost_screen(gallium->screen);
+	struct panfrost_drm *drm = (struct panfrost_drm *)screen->driver;
+
+        /* A zero absolute timeout has always passed, so this only polls */
+
+        if (!screen->last_fragment_flushed &&
+            drmSyncobjWait(drm->fd, &drm->syncobj, 1, 0, 0, NULL) == 0)
+                screen->last_fragment_flushed = true;
+
+        return screen->last_fragment_flushed;
+}
+
+static void
+panfrost_drm_destroy(struct panfrost_screen *screen)
+{
+	struct panfrost_drm *drm = (struct panfrost_drm *)screen->driver;
+
+        for (unsigned b = 0; b < NR_BO_CACHE_BUCKETS; ++b) {
+                list_for_each_entry_safe(struct panfrost_drm_cached_bo, entry,
+                                         &drm->bo_cache[b], link) {
+                        munmap(entry->cpu, entry->size);
+                        panfrost_drm_close_handle(drm, entry->handle);
+                        list_del(&entry->link);
+                        FREE(entry);
+                }
+        }
+
+        drmSyncobjDestroy(drm->fd, drm->syncobj);
+        drmSyncobjDestroy(drm->fd, drm->in_syncobj);
+
+        util_dynarray_fini(&drm->handles);
+        simple_mtx_destroy(&drm->lock);
+
+        FREE(drm);
+}
+
 struct panfrost_driver *
 panfrost_create_drm_driver(int fd)
 {
 	struct panfrost_drm *driver = CALLOC_STRUCT(panfrost_drm);
+        struct drm_panfrost_get_param get_param = {
+                .param = DRM_PANFROST_PARAM_GPU_PROD_ID,
+        };
+        int ret;
 
 	driver->fd = fd;
 
+	driver->base.create_bo = panfrost_drm_create_bo;
+	driver->base.import_bo = panfrost_drm_import_bo;
+	driver->base.map_bo = panfrost_drm_map_bo;
+	driver->base.unmap_bo = panfrost_drm_unmap_bo;
+	driver->base.destroy_bo = panfrost_drm_destroy_bo;
+	driver->base.submit_job = panfrost_drm_submit_job;
+	driver->base.force_flush_fragment = panfrost_drm_force_flush_fragment;
+	driver->base.fragment_done = panfrost_drm_fragment_done;
+	driver->base.allocate_slab = panfrost_drm_allocate_slab;
+	driver->base.free_slab = panfrost_drm_free_slab;
+	driver->base.fence_create = panfrost_drm_fence_create;
+	driver->base.destroy = panfrost_drm_destroy;
+
+        simple_mtx_init(&driver->lock, mtx_plain);
+        util_dynarray_init(&driver->handles, NULL);
+
+        for (unsigned b = 0; b < NR_BO_CACHE_BUCKETS; ++b)
+                list_inithead(&driver->bo_cache[b]);
+
+        ret = drmIoctl(fd, DRM_IOCTL_PANFROST_GET_PARAM, &get_param);
+        if (ret != 0) {
+                fprintf(stderr, "panfrost: Failed to query GPU: %s\n", strerror(errno));
+                abort();
+        }
+        printf("panfrost: Using DRM, GPU product ID 0x%" PRIx64 ", fd %d\n", (uint64_t) get_param.value, fd);
+
+        /* Created signalled, so the first job has nothing to wait for */
+        ret = drmSyncobjCreate(fd, DRM_SYNCOBJ_CREATE_SIGNALED, &driver->syncobj);
+        if (ret != 0) {
+                fprintf(stderr, "panfrost: Failed to create syncobj: %s\n", strerror(errno));
+                abort();
+        }
+
+        ret = drmSyncobjCreate(fd, 0, &driver->in_syncobj);
+        if (ret != 0) {
+                fprintf(stderr, "panfrost: Failed to create syncobj: %s\n", strerror(errno));
+                abort();
+        }
+
         return &driver->base;
 }
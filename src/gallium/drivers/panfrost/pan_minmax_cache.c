@@ -0,0 +1,448 @@
+/*
+ * © Copyright 2019 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "pipe/p_config.h"
+#include "pan_minmax_cache.h"
+
+#if defined(PIPE_ARCH_SSE)
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Index buffers are usually read straight out of write-combined GPU memory,
+ * where every access is expensive, so we want the widest loads we can get.
+ * The vector loops below consume 16 bytes per iteration, reducing into a
+ * vector of partial minima/maxima; the lanes and any leftover tail are then
+ * folded in with the scalar loop.
+ *
+ * With primitive restart, the restart index is almost always the all-ones
+ * value of the index type, so it can never lower the minimum. To keep it out
+ * of the maximum without a compare per lane, the maximum is then taken over
+ * index + 1 with wraparound, which maps the restart index to zero and
+ * preserves the order of everything else. Any other restart index takes a
+ * scalar loop that compares and skips it, while one that doesn't fit in the
+ * index type can never match, so it is ignored. */
+
+#define FOLD_MIN(T, buffer, start, end) \
+        for (unsigned _idx = (start); _idx < (end); ++_idx) { \
+                T idx = (buffer)[_idx]; \
+                if (idx < min) min = idx; \
+        }
+
+#define FOLD_MAX(T, buffer, start, end) \
+        for (unsigned _idx = (start); _idx < (end); ++_idx) { \
+                T idx = (buffer)[_idx]; \
+                if (idx > max) max = idx; \
+        }
+
+#define SCALAR_MINMAX(T, buffer, start, end) \
+        for (unsigned _idx = (start); _idx < (end); ++_idx) { \
+                T idx = (buffer)[_idx]; \
+                T biased = idx + bias; \
+                if (biased > max) max = biased; \
+                if (idx < min) min = idx; \
+        }
+
+#define SCALAR_MINMAX_SKIP(T, buffer, count, restart_index) \
+        for (unsigned _idx = 0; _idx < (count); ++_idx) { \
+                T idx = (buffer)[_idx]; \
+                if (idx == (restart_index)) continue; \
+                if (idx > max) max = idx; \
+                if (idx < min) min = idx; \
+        }
+
+/* Restart indices out of range of the index type never match */
+
+static int64_t
+panfrost_effective_restart(int64_t restart_index, unsigned type_max)
+{
+        return restart_index > (int64_t) type_max ? PANFROST_NO_RESTART : restart_index;
+}
+
+/* Finishes the compare-and-skip scan. Nothing but restart indices gives the
+ * same result as the biased scan */
+
+static void
+panfrost_minmax_skip_finish(unsigned min, unsigned max,
+                            unsigned *out_min, unsigned *out_max)
+{
+        if (min > max) {
+                *out_min = 0;
+                *out_max = 0;
+        } else {
+                *out_min = min;
+                *out_max = max;
+        }
+}
+
+/* Undoes the bias on the maximum. A biased maximum of zero means there was
+ * nothing but restart indices (or nothing at all) */
+
+static void
+panfrost_minmax_finish(unsigned min, unsigned max, unsigned bias,
+                       unsigned *out_min, unsigned *out_max)
+{
+        if (bias && !max) {
+                *out_min = 0;
+                *out_max = 0;
+        } else {
+                *out_min = min;
+                *out_max = max - bias;
+        }
+}
+
+#if defined(PIPE_ARCH_SSE)
+
+/* SSE2 only has signed 16-bit and no 32-bit min/max, so flip the sign bit to
+ * map unsigned ordering onto signed ordering, and emulate the 32-bit variants
+ * with a compare and select */
+
+#define BIAS_16 ((short) 0x8000)
+#define BIAS_32 ((int) 0x80000000)
+
+#ifndef __SSE4_1__
+static inline __m128i
+pan_min_epi32(__m128i a, __m128i b)
+{
+        __m128i gt = _mm_cmpgt_epi32(a, b);
+        return _mm_or_si128(_mm_and_si128(gt, b), _mm_andnot_si128(gt, a));
+}
+
+static inline __m128i
+pan_max_epi32(__m128i a, __m128i b)
+{
+        __m128i gt = _mm_cmpgt_epi32(a, b);
+        return _mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b));
+}
+#endif
+
+#endif
+
+static void
+panfrost_minmax_u8(const uint8_t *indices, unsigned count, int64_t restart_index,
+                   unsigned *out_min, unsigned *out_max)
+{
+        unsigned min = ~0u, max = 0, i = 0;
+
+        restart_index = panfrost_effective_restart(restart_index, UINT8_MAX);
+
+        if (restart_index != PANFROST_NO_RESTART && restart_index != UINT8_MAX) {
+                SCALAR_MINMAX_SKIP(uint8_t, indices, count, restart_index);
+                panfrost_minmax_skip_finish(min, max, out_min, out_max);
+                return;
+        }
+
+        uint8_t bias = restart_index != PANFROST_NO_RESTART ? 1 : 0;
+
+#if defined(PIPE_ARCH_SSE)
+        if (count >= 16) {
+                __m128i vbias = _mm_set1_epi8(bias);
+                __m128i vmin = _mm_set1_epi8((char) 0xFF);
+                __m128i vmax = _mm_setzero_si128();
+
+                for (; i + 16 <= count; i += 16) {
+                        __m128i v = _mm_loadu_si128((const __m128i *) (indices + i));
+                        vmin = _mm_min_epu8(vmin, v);
+                        vmax = _mm_max_epu8(vmax, _mm_add_epi8(v, vbias));
+                }
+
+                uint8_t lmin[16], lmax[16];
+                _mm_storeu_si128((__m128i *) lmin, vmin);
+                _mm_storeu_si128((__m128i *) lmax, vmax);
+
+                FOLD_MIN(uint8_t, lmin, 0, 16);
+                FOLD_MAX(uint8_t, lmax, 0, 16);
+        }
+#elif defined(__ARM_NEON)
+        if (count >= 16) {
+                uint8x16_t vbias = vdupq_n_u8(bias);
+                uint8x16_t vmin = vdupq_n_u8(0xFF);
+                uint8x16_t vmax = vdupq_n_u8(0);
+
+                for (; i + 16 <= count; i += 16) {
+                        uint8x16_t v = vld1q_u8(indices + i);
+                        vmin = vminq_u8(vmin, v);
+                        vmax = vmaxq_u8(vmax, vaddq_u8(v, vbias));
+                }
+
+                uint8_t lmin[16], lmax[16];
+                vst1q_u8(lmin, vmin);
+                vst1q_u8(lmax, vmax);
+
+                FOLD_MIN(uint8_t, lmin, 0, 16);
+                FOLD_MAX(uint8_t, lmax, 0, 16);
+        }
+#endif
+
+        SCALAR_MINMAX(uint8_t, indices, i, count);
+        panfrost_minmax_finish(min, max, bias, out_min, out_max);
+}
+
+static void
+panfrost_minmax_u16(const uint16_t *indices, unsigned count, int64_t restart_index,
+                    unsigned *out_min, unsigned *out_max)
+{
+        unsigned min = ~0u, max = 0, i = 0;
+
+        restart_index = panfrost_effective_restart(restart_index, UINT16_MAX);
+
+        if (restart_index != PANFROST_NO_RESTART && restart_index != UINT16_MAX) {
+                SCALAR_MINMAX_SKIP(uint16_t, indices, count, restart_index);
+                panfrost_minmax_skip_finish(min, max, out_min, out_max);
+                return;
+        }
+
+        uint16_t bias = restart_index != PANFROST_NO_RESTART ? 1 : 0;
+
+#if defined(PIPE_ARCH_SSE)
+        if (count >= 8) {
+                __m128i vbias = _mm_set1_epi16(bias);
+                __m128i sign = _mm_set1_epi16(BIAS_16);
+                __m128i vmin = _mm_set1_epi16(0x7FFF);
+                __m128i vmax = _mm_set1_epi16(BIAS_16);
+
+                for (; i + 8 <= count; i += 8) {
+                        __m128i v = _mm_loadu_si128((const __m128i *) (indices + i));
+                        __m128i b = _mm_add_epi16(v, vbias);
+                        vmin = _mm_min_epi16(vmin, _mm_xor_si128(v, sign));
+                        vmax = _mm_max_epi16(vmax, _mm_xor_si128(b, sign));
+                }
+
+                uint16_t lmin[8], lmax[8];
+                _mm_storeu_si128((__m128i *) lmin, _mm_xor_si128(vmin, sign));
+                _mm_storeu_si128((__m128i *) lmax, _mm_xor_si128(vmax, sign));
+
+                FOLD_MIN(uint16_t, lmin, 0, 8);
+                FOLD_MAX(uint16_t, lmax, 0, 8);
+        }
+#elif defined(__ARM_NEON)
+        if (count >= 8) {
+                uint16x8_t vbias = vdupq_n_u16(bias);
+                uint16x8_t vmin = vdupq_n_u16(0xFFFF);
+                uint16x8_t vmax = vdupq_n_u16(0);
+
+                for (; i + 8 <= count; i += 8) {
+                        uint16x8_t v = vld1q_u16(indices + i);
+                        vmin = vminq_u16(vmin, v);
+                        vmax = vmaxq_u16(vmax, vaddq_u16(v, vbias));
+                }
+
+                uint16_t lmin[8], lmax[8];
+                vst1q_u16(lmin, vmin);
+                vst1q_u16(lmax, vmax);
+
+                FOLD_MIN(uint16_t, lmin, 0, 8);
+                FOLD_MAX(uint16_t, lmax, 0, 8);
+        }
+#endif
+
+        SCALAR_MINMAX(uint16_t, indices, i, count);
+        panfrost_minmax_finish(min, max, bias, out_min, out_max);
+}
+
+static void
+panfrost_minmax_u32(const uint32_t *indices, unsigned count, int64_t restart_index,
+                    unsigned *out_min, unsigned *out_max)
+{
+        unsigned min = ~0u, max = 0, i = 0;
+
+        restart_index = panfrost_effective_restart(restart_index, UINT32_MAX);
+
+        if (restart_index != PANFROST_NO_RESTART && restart_index != UINT32_MAX) {
+                SCALAR_MINMAX_SKIP(uint32_t, indices, count, restart_index);
+                panfrost_minmax_skip_finish(min, max, out_min, out_max);
+                return;
+        }
+
+        uint32_t bias = restart_index != PANFROST_NO_RESTART ? 1 : 0;
+
+#if defined(PIPE_ARCH_SSE)
+        if (count >= 4) {
+                __m128i vbias = _mm_set1_epi32(bias);
+#ifdef __SSE4_1__
+                __m128i vmin = _mm_set1_epi32(-1);
+                __m128i vmax = _mm_setzero_si128();
+
+                for (; i + 4 <= count; i += 4) {
+                        __m128i v = _mm_loadu_si128((const __m128i *) (indices + i));
+                        vmin = _mm_min_epu32(vmin, v);
+                        vmax = _mm_max_epu32(vmax, _mm_add_epi32(v, vbias));
+                }
+#else
+                __m128i sign = _mm_set1_epi32(BIAS_32);
+                __m128i vmin = _mm_set1_epi32(0x7FFFFFFF);
+                __m128i vmax = _mm_set1_epi32(BIAS_32);
+
+                for (; i + 4 <= count; i += 4) {
+                        __m128i v = _mm_loadu_si128((const __m128i *) (indices + i));
+                        __m128i b = _mm_add_epi32(v, vbias);
+                        vmin = pan_min_epi32(vmin, _mm_xor_si128(v, sign));
+                        vmax = pan_max_epi32(vmax, _mm_xor_si128(b, sign));
+                }
+
+                vmin = _mm_xor_si128(vmin, sign);
+                vmax = _mm_xor_si128(vmax, sign);
+#endif
+
+                uint32_t lmin[4], lmax[4];
+                _mm_storeu_si128((__m128i *) lmin, vmin);
+                _mm_storeu_si128((__m128i *) lmax, vmax);
+
+                FOLD_MIN(uint32_t, lmin, 0, 4);
+                FOLD_MAX(uint32_t, lmax, 0, 4);
+        }
+#elif defined(__ARM_NEON)
+        if (count >= 4) {
+                uint32x4_t vbias = vdupq_n_u32(bias);
+                uint32x4_t vmin = vdupq_n_u32(0xFFFFFFFF);
+                uint32x4_t vmax = vdupq_n_u32(0);
+
+                for (; i + 4 <= count; i += 4) {
+                        uint32x4_t v = vld1q_u32(indices + i);
+                        vmin = vminq_u32(vmin, v);
+                        vmax = vmaxq_u32(vmax, vaddq_u32(v, vbias));
+                }
+
+                uint32_t lmin[4], lmax[4];
+                vst1q_u32(lmin, vmin);
+                vst1q_u32(lmax, vmax);
+
+                FOLD_MIN(uint32_t, lmin, 0, 4);
+                FOLD_MAX(uint32_t, lmax, 0, 4);
+        }
+#endif
+
+        SCALAR_MINMAX(uint32_t, indices, i, count);
+        panfrost_minmax_finish(min, max, bias, out_min, out_max);
+}
+
+/* Computes the minimum and maximum index of the given index buffer, ignoring
+ * the restart index unless it is PANFROST_NO_RESTART. Without restart, if
+ * count is zero, min will be ~0 and max will be 0, as with the scalar path */
+
+void
+panfrost_minmax_index(const void *indices, unsigned index_size, unsigned count,
+                      int64_t restart_index, unsigned *min_index, unsigned *max_index)
+{
+        switch (index_size) {
+        case 1:
+                panfrost_minmax_u8((const uint8_t *) indices, count, restart_index, min_index, max_index);
+                break;
+        case 2:
+                panfrost_minmax_u16((const uint16_t *) indices, count, restart_index, min_index, max_index);
+                break;
+        case 4:
+                panfrost_minmax_u32((const uint32_t *) indices, count, restart_index, min_index, max_index);
+                break;
+        default:
+                assert(0);
+        }
+}
+
+bool
+panfrost_minmax_cache_get(struct panfrost_minmax_cache *cache,
+                          unsigned offset, unsigned count, unsigned index_size,
+                          int64_t restart_index, unsigned *min_index, unsigned *max_index)
+{
+        if (!cache)
+                return false;
+
+        for (unsigned i = 0; i < cache->size; ++i) {
+                struct panfrost_minmax_entry *e = &cache->entries[i];
+
+                bool match =
+                        e->offset == offset && e->count == count &&
+                        e->index_size == index_size && e->restart_index == restart_index;
+
+                if (match) {
+                        *min_index = e->min_index;
+                        *max_index = e->max_index;
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+void
+panfrost_minmax_cache_add(struct panfrost_minmax_cache *cache,
+                          unsigned offset, unsigned count, unsigned index_size,
+                          int64_t restart_index, unsigned min_index, unsigned max_index)
+{
+        unsigned slot;
+
+        if (!cache)
+                return;
+
+        if (cache->size < PANFROST_MINMAX_SIZE) {
+                slot = cache->size++;
+        } else {
+                slot = cache->index;
+                cache->index = (cache->index + 1) % PANFROST_MINMAX_SIZE;
+        }
+
+        struct panfrost_minmax_entry entry = {
+                .offset = offset,
+                .count = count,
+                .index_size = index_size,
+                .restart_index = restart_index,
+                .min_index = min_index,
+                .max_index = max_index
+        };
+
+        cache->entries[slot] = entry;
+}
+
+/* Drops every entry whose index range overlaps the written byte range
+ * [offset, offset + size), compacting the survivors to the front */
+
+void
+panfrost_minmax_cache_invalidate(struct panfrost_minmax_cache *cache,
+                                 unsigned offset, unsigned size)
+{
+        if (!cache)
+                return;
+
+        unsigned valid = 0;
+
+        for (unsigned i = 0; i < cache->size; ++i) {
+                struct panfrost_minmax_entry *e = &cache->entries[i];
+                unsigned end = e->offset + e->count * e->index_size;
+
+                bool overlaps = (e->offset < (offset + size)) && (offset < end);
+
+                if (!overlaps)
+                        cache->entries[valid++] = *e;
+        }
+
+        cache->size = valid;
+        cache->index = 0;
+}
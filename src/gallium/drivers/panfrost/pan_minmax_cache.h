@@ -0,0 +1,83 @@
+/*
+ * © Copyright 2019 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef __PAN_MINMAX_CACHE_H__
+#define __PAN_MINMAX_CACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Indexed draws need the range of indices referenced to size the vertex job,
+ * which means scanning the index buffer on the CPU. For resource-backed
+ * indices, that scan reads from (uncached) GPU memory, so we remember the
+ * results per resource. Static meshes drawn every frame then only pay for the
+ * scan once. Entries are replaced round-robin once the cache fills up. */
+
+#define PANFROST_MINMAX_SIZE 64
+
+/* Restart index of draws without primitive restart */
+#define PANFROST_NO_RESTART (-1ll)
+
+struct panfrost_minmax_entry {
+        /* Key: byte offset into the buffer, index count, index size, and
+         * the restart index skipped (or PANFROST_NO_RESTART) */
+        unsigned offset;
+        unsigned count;
+        unsigned index_size;
+        int64_t restart_index;
+
+        /* Value */
+        unsigned min_index;
+        unsigned max_index;
+};
+
+struct panfrost_minmax_cache {
+        struct panfrost_minmax_entry entries[PANFROST_MINMAX_SIZE];
+
+        /* Number of valid entries */
+        unsigned size;
+
+        /* Next entry to evict when full */
+        unsigned index;
+};
+
+void
+panfrost_minmax_index(const void *indices, unsigned index_size, unsigned count,
+                      int64_t restart_index, unsigned *min_index, unsigned *max_index);
+
+bool
+panfrost_minmax_cache_get(struct panfrost_minmax_cache *cache,
+                          unsigned offset, unsigned count, unsigned index_size,
+                          int64_t restart_index, unsigned *min_index, unsigned *max_index);
+
+void
+panfrost_minmax_cache_add(struct panfrost_minmax_cache *cache,
+                          unsigned offset, unsigned count, unsigned index_size,
+                          int64_t restart_index, unsigned min_index, unsigned max_index);
+
+void
+panfrost_minmax_cache_invalidate(struct panfrost_minmax_cache *cache,
+                                 unsigned offset, unsigned size);
+
+#endif /* __PAN_MINMAX_CACHE_H__ */
@@ -28,6 +28,7 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <assert.h>
+#include <poll.h>
 #include <xf86drm.h>
 
 #include "util/u_format.h"
@@ -39,7 +40,6 @@
 #include "pan_nondrm.h"
 #include "pan_resource.h"
 #include "pan_context.h"
-#include "pan_swizzle.h"
 
 /* From the kernel module */
 
@@ -52,6 +52,11 @@ struct panfrost_nondrm {
 
 struct panfrost_nondrm_bo {
 	struct panfrost_bo base;
+
+        /* Backing of allocations too large to suballocate, and of render
+         * targets, which get a slab of their own */
+        struct panfrost_memory mem;
+        bool has_mem;
 };
 
 static int
@@ -97,51 +102,32 @@ static struct panfrost_bo *
 panfrost_nondrm_create_bo(struct panfrost_screen *screen, const struct pipe_resource *template)
 {
 	struct panfrost_nondrm_bo *bo = CALLOC_STRUCT(panfrost_nondrm_bo);
-        int bytes_per_pixel = util_format_get_blocksize(template->format);
-        int stride = bytes_per_pixel * template->width0; /* TODO: Alignment? */
-        size_t sz = stride;
-
-        if (template->height0) sz *= template->height0;
+        bool is_rt = template->bind & (PIPE_BIND_RENDER_TARGET | PIPE_BIND_DEPTH_STENCIL);
 
-        if (template->depth0) sz *= template->depth0;
+        /* Tiling textures is almost always faster, unless we only use it once */
+        bo->base.tiled = !is_rt && (template->usage != PIPE_USAGE_STREAM) && (template->bind & PIPE_BIND_SAMPLER_VIEW);
 
-        if ((template->bind & PIPE_BIND_RENDER_TARGET) || (template->bind & PIPE_BIND_DEPTH_STENCIL)) {
-		/* TODO: Mipmapped RTs */
-		//assert(template->last_level == 0);
+        /* Every level and layer goes in one allocation */
+        size_t sz = panfrost_setup_slices(template, &bo->base);
 
+        if (is_rt || sz > (1 << MAX_SLAB_ENTRY_SIZE)) {
 		/* Allocate the framebuffer as its own slab of GPU-accessible memory */
-		struct panfrost_memory slab;
-		screen->driver->allocate_slab(screen->any_context, &slab, (sz / 4096) + 1, false, 0, 0, 0);
+		screen->driver->allocate_slab(screen, &bo->mem, (sz / 4096) + 1, false, 0, 0, 0);
+                bo->has_mem = true;
 
 		/* Make the resource out of the slab */
-		bo->base.cpu[0] = slab.cpu;
-		bo->base.gpu[0] = slab.gpu;
+		bo->base.cpu = bo->mem.cpu;
+		bo->base.gpu = bo->mem.gpu;
 	} else {
                 /* TODO: For linear resources, allocate straight on the cmdstream for
                  * zero-copy operation */
 
-                /* Tiling textures is almost always faster, unless we only use it once */
-                bo->base.tiled = (template->usage != PIPE_USAGE_STREAM) && (template->bind & PIPE_BIND_SAMPLER_VIEW);
-
-                if (bo->base.tiled) {
-                        /* For tiled, we don't map directly, so just malloc any old buffer */
-
-                        for (int l = 0; l < (template->last_level + 1); ++l) {
-                                bo->base.cpu[l] = malloc(sz);
-                                //sz >>= 2;
-                        }
-                } else {
-                        /* But for linear, we can! */
-
-                        struct pb_slab_entry *entry = pb_slab_alloc(&screen->any_context->slabs, sz, HEAP_TEXTURE);
-                        struct panfrost_memory_entry *p_entry = (struct panfrost_memory_entry *) entry;
-                        struct panfrost_memory *backing = (struct panfrost_memory *) entry->slab;
-                        bo->base.entry[0] = p_entry;
-                        bo->base.cpu[0] = backing->cpu + p_entry->offset;
-                        bo->base.gpu[0] = backing->gpu + p_entry->offset;
-
-                        /* TODO: Mipmap */
-                }
+                struct pb_slab_entry *entry = pb_slab_alloc(&screen->any_context->slabs, sz, HEAP_TEXTURE);
+                struct panfrost_memory_entry *p_entry = (struct panfrost_memory_entry *) entry;
+                struct panfrost_memory *backing = (struct panfrost_memory *) entry->slab;
+                bo->base.entry = p_entry;
+                bo->base.cpu = backing->cpu + p_entry->offset;
+                bo->base.gpu = backing->gpu + p_entry->offset;
 	}
 
         return &bo->base;
@@ -170,7 +156,7 @@ panfrost_nondrm_import_bo(struct panfrost_screen *screen, struct winsys_handle *
         ret = pandev_ioctl(nondrm->fd, KBASE_IOCTL_MEM_IMPORT, &framebuffer_import);
         assert(ret == 0);
 
-        bo->base.gpu[0] = mmap(NULL, framebuffer_import.out.va_pages * 4096, PROT_READ | PROT_WRITE, MAP_SHARED, nondrm->fd, framebuffer_import.out.gpu_va);
+        bo->base.gpu = (mali_ptr) (uintptr_t) mmap(NULL, framebuffer_import.out.va_pages * 4096, PROT_READ | PROT_WRITE, MAP_SHARED, nondrm->fd, framebuffer_import.out.gpu_va);
 
         ret = drmPrimeFDToHandle(screen->ro->kms_fd, whandle->handle, &gem_handle);
         assert(ret >= 0);
@@ -181,10 +167,10 @@ panfrost_nondrm_import_bo(struct panfrost_screen *screen, struct winsys_handle *
         ret = drmIoctl(screen->ro->kms_fd, DRM_IOCTL_MODE_MAP_DUMB, &map_arg);
         assert(!ret);
 
-        bo->base.cpu[0] = mmap(NULL, framebuffer_import.out.va_pages * 4096, PROT_READ | PROT_WRITE, MAP_SHARED, screen->ro->kms_fd, map_arg.offset);
+        bo->base.cpu = mmap(NULL, framebuffer_import.out.va_pages * 4096, PROT_READ | PROT_WRITE, MAP_SHARED, screen->ro->kms_fd, map_arg.offset);
 
         u64 addresses[1];
-        addresses[0] = bo->base.gpu[0];
+        addresses[0] = bo->base.gpu;
         struct kbase_ioctl_sticky_resource_map map = {
                 .count = 1,
                 .address = addresses,
@@ -200,81 +186,23 @@ panfrost_nondrm_map_bo(struct panfrost_context *ctx, struct pipe_transfer *trans
 {
 	struct panfrost_nondrm_bo *bo = (struct panfrost_nondrm_bo *)pan_resource(transfer->resource)->bo;
 
-        /* If non-zero level, it's a mipmapped resource and needs to be treated as such */
-        bo->base.is_mipmap |= transfer->level;
-
-        if (transfer->usage & PIPE_TRANSFER_MAP_DIRECTLY && bo->base.tiled) {
-                /* We cannot directly map tiled textures */
-                return NULL;
-        }
-
         if (transfer->resource->bind & PIPE_BIND_DEPTH_STENCIL) {
                 /* Mipmapped readpixels?! */
                 assert(transfer->level == 0);
 
-                /* Set the CPU mapping to that of the depth/stencil buffer in memory, untiled */
-                bo->base.cpu[transfer->level] = ctx->depth_stencil_buffer.cpu;
+                /* Map the depth/stencil buffer in memory, untiled */
+                return ctx->depth_stencil_buffer.cpu;
         }
 
-        return bo->base.cpu[transfer->level];
-}
-
-static void
-panfrost_tile_texture(struct panfrost_context *ctx, struct panfrost_resource *rsrc, int level)
-{
-	struct panfrost_nondrm_bo *bo = (struct panfrost_nondrm_bo *)rsrc->bo;
-        int bytes_per_pixel = util_format_get_blocksize(rsrc->base.format);
-        int stride = bytes_per_pixel * rsrc->base.width0; /* TODO: Alignment? */
-
-        int width = rsrc->base.width0 >> level;
-        int height = rsrc->base.height0 >> level;
-
-        /* Estimate swizzled bitmap size. Slight overestimates are fine.
-         * Underestimates will result in memory corruption or worse. */
-
-        int swizzled_sz = panfrost_swizzled_size(width, height, bytes_per_pixel);
-
-        /* Allocate the transfer given that known size but do not copy */
-        struct pb_slab_entry *entry = pb_slab_alloc(&ctx->slabs, swizzled_sz, HEAP_TEXTURE);
-        struct panfrost_memory_entry *p_entry = (struct panfrost_memory_entry *) entry;
-        struct panfrost_memory *backing = (struct panfrost_memory *) entry->slab;
-        uint8_t *swizzled = backing->cpu + p_entry->offset;
-
-        /* Save the entry. But if there was already an entry here (from a
-         * previous upload of the resource), free that one so we don't leak */
-
-        if (bo->base.entry[level] != NULL) {
-                bo->base.entry[level]->freed = true;
-                pb_slab_free(&ctx->slabs, &bo->base.entry[level]->base);
-        }
-
-        bo->base.entry[level] = p_entry;
-        bo->base.gpu[level] = backing->gpu + p_entry->offset;
-
-        /* Run actual texture swizzle, writing directly to the mapped
-         * GPU chunk we allocated */
-
-        panfrost_texture_swizzle(width, height, bytes_per_pixel, stride, bo->base.cpu[level], swizzled);
+        return bo->base.cpu;
 }
 
 static void
 panfrost_nondrm_unmap_bo(struct panfrost_context *ctx,
                          struct pipe_transfer *transfer)
 {
-	struct panfrost_nondrm_bo *bo = (struct panfrost_nondrm_bo *)pan_resource(transfer->resource)->bo;
-
-        if (transfer->usage & PIPE_TRANSFER_WRITE) {
-                if (transfer->resource->target == PIPE_TEXTURE_2D) {
-                        struct panfrost_resource *prsrc = (struct panfrost_resource *) transfer->resource;
-
-                        /* Gallium thinks writeback happens here; instead, this is our cue to tile */
-                        if (bo->base.has_afbc) {
-                                printf("Warning: writes to afbc surface can't possibly work out well for you...\n");
-                        } else if (bo->base.tiled) {
-                                panfrost_tile_texture(ctx, prsrc, transfer->level);
-                        }
-                }
-        }
+        /* Direct mappings are coherent, and tiled textures are written back
+         * by the caller, so there is nothing to do */
 }
 
 static void
@@ -283,28 +211,20 @@ panfrost_nondrm_destroy_bo(struct panfrost_screen *screen, struct panfrost_bo *p
         struct panfrost_context *ctx = screen->any_context;
 	struct panfrost_nondrm_bo *bo = (struct panfrost_nondrm_bo *)pbo;
 
-        if (bo->base.tiled) {
-                /* CPU is all malloc'ed, so just plain ol' free needed */
-
-                for (int l = 0; bo->base.cpu[l]; l++) {
-                        free(bo->base.cpu[l]);
-                }
-        } else if (bo->base.entry[0] != NULL) {
-                bo->base.entry[0]->freed = true;
-                pb_slab_free(&ctx->slabs, &bo->base.entry[0]->base);
+        if (bo->has_mem) {
+                screen->driver->free_slab(screen, &bo->mem);
+        } else if (bo->base.entry != NULL) {
+                bo->base.entry->freed = true;
+                pb_slab_free(&ctx->slabs, &bo->base.entry->base);
         } else {
                 printf("--leaking main allocation--\n");
         }
 
-        if (bo->base.has_afbc) {
-                /* TODO */
-                printf("--leaking afbc--\n");
-        }
+        if (bo->base.has_afbc)
+                screen->driver->free_slab(screen, &bo->base.afbc_slab);
 
-        if (bo->base.has_checksum) {
-                /* TODO */
-                printf("--leaking afbc--\n");
-        }
+        if (bo->base.has_checksum)
+                screen->driver->free_slab(screen, &bo->base.checksum_slab);
 }
 
 static void
@@ -355,8 +275,32 @@ panfrost_nondrm_force_flush_fragment(struct panfrost_context *ctx)
         }
 }
 
+static bool
+panfrost_nondrm_fragment_done(struct panfrost_context *ctx)
+{
+        struct pipe_context *gallium = (struct pipe_context *) ctx;
+        struct panfrost_screen *screen = panfrost_screen(gallium->screen);
+	struct panfrost_nondrm *nondrm = (struct panfrost_nondrm *)screen->driver;
+        struct pollfd pfd = { .fd = nondrm->fd, .events = POLLIN };
+        struct base_jd_event_v2 event;
+
+        /* Only consume the events already queued, so a read never blocks */
+
+        while (!screen->last_fragment_flushed && poll(&pfd, 1, 0) == 1) {
+                if (read(nondrm->fd, &event, sizeof(event)) != sizeof(event)) {
+                        fprintf(stderr, "error when reading from mali device: %s\n", strerror(errno));
+                        break;
+                }
+
+                if (event.atom_number == screen->last_fragment_id)
+                        screen->last_fragment_flushed = true;
+        }
+
+        return screen->last_fragment_flushed;
+}
+
 static void
-panfrost_nondrm_allocate_slab(struct panfrost_context *ctx,
+panfrost_nondrm_allocate_slab(struct panfrost_screen *screen,
 		              struct panfrost_memory *mem,
 		              size_t pages,
 		              bool same_va,
@@ -364,8 +308,6 @@ panfrost_nondrm_allocate_slab(struct panfrost_context *ctx,
 		              int commit_count,
 		              int extent)
 {
-        struct pipe_context *gallium = (struct pipe_context *) ctx;
-        struct panfrost_screen *screen = panfrost_screen(gallium->screen);
 	struct panfrost_nondrm *nondrm = (struct panfrost_nondrm *)screen->driver;
         int flags = BASE_MEM_PROT_CPU_RD | BASE_MEM_PROT_CPU_WR |
                     BASE_MEM_PROT_GPU_RD | BASE_MEM_PROT_GPU_WR;
@@ -405,6 +347,33 @@ panfrost_nondrm_allocate_slab(struct panfrost_context *ctx,
         mem->stack_bottom = 0;
 }
 
+static void
+panfrost_nondrm_free_slab(struct panfrost_screen *screen,
+                          struct panfrost_memory *mem)
+{
+	struct panfrost_nondrm *nondrm = (struct panfrost_nondrm *)screen->driver;
+        struct kbase_ioctl_mem_free gpu_mem = {
+                .gpu_addr = mem->gpu,
+        };
+
+        if (mem->cpu)
+                munmap(mem->cpu, mem->size);
+
+        if (pandev_ioctl(nondrm->fd, KBASE_IOCTL_MEM_FREE, &gpu_mem))
+                printf("Error freeing slab\n");
+
+        mem->cpu = NULL;
+        mem->gpu = 0;
+}
+
+static void
+panfrost_nondrm_destroy(struct panfrost_screen *screen)
+{
+	struct panfrost_nondrm *nondrm = (struct panfrost_nondrm *)screen->driver;
+
+        FREE(nondrm);
+}
+
 struct panfrost_driver *
 panfrost_create_nondrm_driver(int fd)
 {
@@ -422,7 +391,10 @@ panfrost_create_nondrm_driver(int fd)
 	driver->base.destroy_bo = panfrost_nondrm_destroy_bo;
 	driver->base.submit_job = panfrost_nondrm_submit_job;
 	driver->base.force_flush_fragment = panfrost_nondrm_force_flush_fragment;
+	driver->base.fragment_done = panfrost_nondrm_fragment_done;
 	driver->base.allocate_slab = panfrost_nondrm_allocate_slab;
+	driver->base.free_slab = panfrost_nondrm_free_slab;
+	driver->base.destroy = panfrost_nondrm_destroy;
 
         ret = ioctl(fd, KBASE_IOCTL_VERSION_CHECK, &version);
         if (ret != 0) {
@@ -33,10 +33,12 @@
 
 #include "state_tracker/winsys_handle.h"
 #include "util/u_format.h"
+#include "util/u_box.h"
 #include "util/u_memory.h"
 #include "util/u_surface.h"
 #include "util/u_transfer.h"
 #include "util/u_transfer_helper.h"
+#include "util/os_time.h"
 
 #include "pan_context.h"
 #include "pan_screen.h"
@@ -68,6 +70,9 @@ panfrost_resource_from_handle(struct pipe_screen *pscreen,
 
 	rsc->bo = screen->driver->import_bo(screen, whandle);
 
+        if (rsc->bo)
+                panfrost_setup_slices(prsc, rsc->bo);
+
         return prsc;
 }
 
@@ -81,10 +86,7 @@ panfrost_resource_get_handle(struct pipe_screen *pscreen,
         struct panfrost_screen *screen = pan_screen(pscreen);
         struct panfrost_resource *rsrc = (struct panfrost_resource *) pt;
         struct renderonly_scanout *scanout = rsrc->scanout;
-        int bytes_per_pixel = util_format_get_blocksize(rsrc->base.format);
-        int stride = bytes_per_pixel * rsrc->base.width0; /* TODO: Alignment? */
-
-        handle->stride = stride;
+        handle->stride = rsrc->bo->slices[0].stride;
         handle->modifier = DRM_FORMAT_MOD_INVALID;
 
         if (handle->type == WINSYS_HANDLE_TYPE_SHARED) {
@@ -127,15 +129,6 @@ panfrost_flush_resource(struct pipe_context *pctx, struct pipe_resource *prsc)
         //fprintf(stderr, "TODO %s\n", __func__);
 }
 
-static void
-panfrost_blit(struct pipe_context *pipe,
-              const struct pipe_blit_info *info)
-{
-        /* STUB */
-        printf("Skipping blit XXX\n");
-        return;
-}
-
 static struct pipe_surface *
 panfrost_create_surface(struct pipe_context *pipe,
                         struct pipe_resource *pt,
@@ -181,6 +174,156 @@ panfrost_surface_destroy(struct pipe_context *pipe,
         free(surf);
 }
 
+/* Every level and layer of a texture lives in a single allocation. Each array
+ * layer (or cube face) holds a full mip chain, levels following one another;
+ * the depth slices of a 3D level are consecutive within it. */
+
+size_t
+panfrost_setup_slices(const struct pipe_resource *tmpl, struct panfrost_bo *bo)
+{
+        int bytes_per_pixel = util_format_get_blocksize(tmpl->format);
+        unsigned width = tmpl->width0;
+        unsigned height = MAX2(tmpl->height0, 1);
+        unsigned depth = MAX2(tmpl->depth0, 1);
+        bool is_3d = tmpl->target == PIPE_TEXTURE_3D;
+        unsigned offset = 0;
+
+        for (unsigned l = 0; l <= tmpl->last_level; ++l) {
+                struct panfrost_slice *slice = &bo->slices[l];
+
+                slice->offset = offset;
+
+                if (bo->tiled) {
+                        /* 16x16 tiles. The size is an overestimate */
+                        slice->stride = bytes_per_pixel * ALIGN(width, 16) * 16;
+                        slice->size = panfrost_swizzled_size(width, height, bytes_per_pixel);
+                } else {
+                        slice->stride = bytes_per_pixel * width; /* TODO: Alignment? */
+                        slice->size = slice->stride * height;
+                }
+
+                /* Keep each level aligned for the texture descriptor */
+                offset += ALIGN(slice->size * (is_3d ? depth : 1), 64);
+
+                width = u_minify(width, 1);
+                height = u_minify(height, 1);
+                depth = u_minify(depth, 1);
+        }
+
+        bo->cubemap_stride = offset;
+        bo->size = (size_t) offset * (is_3d ? 1 : MAX2(tmpl->array_size, 1));
+
+        return bo->size;
+}
+
+unsigned
+panfrost_texture_offset(const struct pipe_resource *prsrc, unsigned level, unsigned layer)
+{
+        struct panfrost_bo *bo = pan_resource((struct pipe_resource *) prsrc)->bo;
+        struct panfrost_slice *slice = &bo->slices[level];
+
+        if (prsrc->target == PIPE_TEXTURE_3D)
+                return slice->offset + layer * slice->size;
+        else
+                return slice->offset + layer * bo->cubemap_stride;
+}
+
+mali_ptr
+panfrost_get_texture_address(struct panfrost_resource *rsrc, unsigned level, unsigned layer)
+{
+        return rsrc->bo->gpu + panfrost_texture_offset(&rsrc->base, level, layer);
+}
+
+/* Tiles the transfer's box from its linear buffer into the allocation, or
+ * with untile, the reverse */
+
+static void
+panfrost_tile_transfer(struct panfrost_context *ctx, struct panfrost_gtransfer *trans, bool untile)
+{
+        struct pipe_transfer *transfer = &trans->base;
+        struct pipe_resource *prsrc = transfer->resource;
+        struct panfrost_bo *bo = pan_resource(prsrc)->bo;
+        const struct pipe_box *box = &transfer->box;
+        int bytes_per_pixel = util_format_get_blocksize(prsrc->format);
+
+        int64_t start = os_time_get_nano();
+
+        for (int z = 0; z < box->depth; ++z) {
+                uint8_t *tiled = bo->cpu + panfrost_texture_offset(prsrc, transfer->level, box->z + z);
+
+                panfrost_swizzle_box(box->x, box->y, box->width, box->height, bytes_per_pixel,
+                                     trans->map + z * transfer->layer_stride, transfer->stride,
+                                     tiled, bo->slices[transfer->level].stride,
+                                     untile);
+        }
+
+        if (!untile) {
+                ctx->counters[PAN_COUNTER_TILED_BYTES] += (uint64_t) transfer->layer_stride * box->depth;
+                ctx->counters[PAN_COUNTER_TILING_TIME] += os_time_get_nano() - start;
+        }
+}
+
+/* Transaction elimination: the GPU computes a CRC for each tile of a render
+ * target as it is rendered, and skips writing back tiles whose CRC matches the
+ * one stored from the last frame. Static content (UIs, wallpapers) then costs
+ * next to no write bandwidth after the first frame. */
+
+bool
+panfrost_resource_wants_checksum(struct panfrost_screen *screen,
+                                 const struct pipe_resource *prsrc)
+{
+        if (screen->debug & PAN_DBG_NO_CRC)
+                return false;
+
+        if (prsrc->target == PIPE_BUFFER)
+                return false;
+
+        if (!(prsrc->bind & PIPE_BIND_RENDER_TARGET))
+                return false;
+
+        /* Linear resources are mapped directly and written by the CPU, which
+         * would invalidate the checksums all the time anyway */
+
+        return !(prsrc->bind & (PIPE_BIND_DEPTH_STENCIL | PIPE_BIND_LINEAR));
+}
+
+void
+panfrost_resource_enable_checksum(struct panfrost_screen *screen,
+                                  struct panfrost_resource *rsrc)
+{
+        int tile_w = (rsrc->base.width0 + (MALI_TILE_LENGTH - 1)) >> MALI_TILE_SHIFT;
+        int tile_h = (rsrc->base.height0 + (MALI_TILE_LENGTH - 1)) >> MALI_TILE_SHIFT;
+
+        /* 8 byte checksum per tile. Mapped on the CPU for invalidation */
+        rsrc->bo->checksum_stride = tile_w * 8;
+        int pages = (((rsrc->bo->checksum_stride * tile_h) + 4095) / 4096);
+        screen->driver->allocate_slab(screen, &rsrc->bo->checksum_slab, pages, true, 0, 0, 0);
+
+        /* A zeroed checksum won't match any real tile, so the first frame is
+         * written back in full */
+        memset(rsrc->bo->checksum_slab.cpu, 0, rsrc->bo->checksum_slab.size);
+
+        rsrc->bo->has_checksum = true;
+}
+
+/* The CPU wrote behind the GPU's back, so the contents in memory no longer
+ * correspond to the stored checksums. Clearing them forces a full write back
+ * on the next frame */
+
+void
+panfrost_resource_invalidate_checksum(struct panfrost_resource *rsrc)
+{
+        struct panfrost_bo *bo = rsrc->bo;
+
+        if (!bo || !bo->has_checksum)
+                return;
+
+        memset(bo->checksum_slab.cpu, 0, bo->checksum_slab.size);
+
+        if (bo->checksum_shadow)
+                memset(bo->checksum_shadow, 0, bo->checksum_slab.size);
+}
+
 /* TODO: Proper resource tracking depends on, well, proper resources. This
  * section will be woefully incomplete until we can sort out a proper DRM
  * driver. */
@@ -203,6 +346,7 @@ panfrost_resource_create(struct pipe_screen *screen,
                 case PIPE_TEXTURE_1D:
                 case PIPE_TEXTURE_2D:
                 case PIPE_TEXTURE_3D:
+                case PIPE_TEXTURE_CUBE:
                 case PIPE_TEXTURE_RECT:
                         break;
                 default:
@@ -239,6 +383,12 @@ panfrost_resource_create(struct pipe_screen *screen,
                 } else {
 			so->bo = pscreen->driver->create_bo(pscreen, template);
                 }
+
+                /* Allocate checksums up front, scanout included, so they
+                 * persist across frames */
+
+                if (panfrost_resource_wants_checksum(pscreen, template))
+                        panfrost_resource_enable_checksum(pscreen, so);
         } else {
 		so->bo = pscreen->driver->create_bo(pscreen, template);
         }
@@ -258,12 +408,119 @@ panfrost_resource_destroy(struct pipe_screen *screen,
 	if (rsrc->scanout)
 		renderonly_scanout_destroy(rsrc->scanout, pscreen->ro);
 
-	if (rsrc->bo)
+	if (rsrc->bo) {
+                FREE(rsrc->bo->checksum_shadow);
 		pscreen->driver->destroy_bo(pscreen, rsrc->bo);
+        }
+
+        if (rsrc->index_cache)
+                FREE(rsrc->index_cache);
 
 	FREE(rsrc);
 }
 
+/* AFBC resources can't be mapped directly, since the CPU knows nothing of the
+ * compressed layout. Instead, the box is blitted to and from a linear staging
+ * resource, letting the GPU do the (de)compression */
+
+static bool
+panfrost_needs_staging(struct pipe_resource *resource)
+{
+        struct panfrost_resource *rsrc = pan_resource(resource);
+
+        if (!rsrc->bo || !rsrc->bo->has_afbc)
+                return false;
+
+        /* Depth/stencil is mapped from the untiled copy instead */
+        return !(resource->bind & PIPE_BIND_DEPTH_STENCIL);
+}
+
+static void
+panfrost_staging_blit(struct pipe_context *pctx,
+                      struct pipe_resource *dst, const struct pipe_box *dst_box,
+                      struct pipe_resource *src, const struct pipe_box *src_box)
+{
+        struct pipe_blit_info blit = {
+                .dst = {
+                        .resource = dst,
+                        .format = dst->format,
+                        .box = *dst_box,
+                },
+                .src = {
+                        .resource = src,
+                        .format = src->format,
+                        .box = *src_box,
+                },
+                .mask = PIPE_MASK_RGBA,
+                .filter = PIPE_TEX_FILTER_NEAREST,
+        };
+
+        /* Draws are only ever submitted against the current framebuffer, so
+         * the blit needs a frame of its own */
+
+        panfrost_flush(pctx, NULL, 0);
+        panfrost_blit(pctx, &blit);
+        panfrost_flush(pctx, NULL, 0);
+}
+
+static void *
+panfrost_staging_map(struct pipe_context *pctx,
+                     struct panfrost_gtransfer *trans)
+{
+        struct panfrost_context *ctx = pan_context(pctx);
+        struct pipe_transfer *transfer = &trans->base;
+        struct pipe_resource *resource = transfer->resource;
+
+        struct pipe_resource templ = {
+                .target = PIPE_TEXTURE_2D,
+                .format = resource->format,
+                .width0 = transfer->box.width,
+                .height0 = transfer->box.height,
+                .depth0 = 1,
+                .array_size = 1,
+                .usage = PIPE_USAGE_STAGING,
+                .bind = PIPE_BIND_RENDER_TARGET | PIPE_BIND_SAMPLER_VIEW | PIPE_BIND_LINEAR,
+        };
+
+        trans->staging = pctx->screen->resource_create(pctx->screen, &templ);
+
+        if (!trans->staging)
+                return NULL;
+
+        struct panfrost_resource *staging = pan_resource(trans->staging);
+
+        transfer->stride = util_format_get_blocksize(templ.format) * templ.width0;
+
+        if ((transfer->usage & PIPE_TRANSFER_READ) &&
+            !(transfer->usage & PIPE_TRANSFER_DISCARD_RANGE)) {
+                struct pipe_box box;
+                u_box_2d(0, 0, templ.width0, templ.height0, &box);
+
+                /* Decompress and wait for it */
+
+                panfrost_staging_blit(pctx, trans->staging, &box, resource, &transfer->box);
+                panfrost_force_flush_fragment(ctx);
+        }
+
+        return staging->bo->cpu;
+}
+
+static void
+panfrost_staging_unmap(struct pipe_context *pctx,
+                       struct panfrost_gtransfer *trans)
+{
+        struct pipe_transfer *transfer = &trans->base;
+
+        if (transfer->usage & PIPE_TRANSFER_WRITE) {
+                struct pipe_box box;
+                u_box_2d(0, 0, transfer->box.width, transfer->box.height, &box);
+
+                panfrost_staging_blit(pctx, transfer->resource, &transfer->box, trans->staging, &box);
+        }
+
+        pipe_resource_reference(&trans->staging, NULL);
+}
+
 static void *
 panfrost_transfer_map(struct pipe_context *pctx,
                       struct pipe_resource *resource,
@@ -274,21 +531,27 @@ panfrost_transfer_map(struct pipe_context *pctx,
 {
         struct panfrost_context *ctx = pan_context(pctx);
         struct panfrost_screen *screen = panfrost_screen(pctx->screen);
+        struct panfrost_resource *rsrc = pan_resource(resource);
         int bytes_per_pixel = util_format_get_blocksize(resource->format);
-        int stride = bytes_per_pixel * resource->width0; /* TODO: Alignment? */
 	uint8_t *cpu;
 
-        struct pipe_transfer *transfer = CALLOC_STRUCT(pipe_transfer);
+        struct panfrost_gtransfer *trans = CALLOC_STRUCT(panfrost_gtransfer);
+        struct pipe_transfer *transfer = &trans->base;
         transfer->level = level;
         transfer->usage = usage;
         transfer->box = *box;
-        transfer->stride = stride;
-        assert(!transfer->box.z);
 
         pipe_resource_reference(&transfer->resource, resource);
 
         *out_transfer = transfer;
 
+        if (panfrost_needs_staging(resource)) {
+                /* Mipmapped AFBC?! */
+                assert(level == 0);
+
+                return panfrost_staging_map(pctx, trans);
+        }
+
         if (resource->bind & PIPE_BIND_DISPLAY_TARGET ||
             resource->bind & PIPE_BIND_SCANOUT ||
             resource->bind & PIPE_BIND_SHARED) {
@@ -299,11 +562,41 @@ panfrost_transfer_map(struct pipe_context *pctx,
                 panfrost_flush(pctx, NULL, PIPE_FLUSH_END_OF_FRAME);
         }
 
+        if (rsrc->bo->tiled) {
+                /* We cannot directly map tiled textures */
+                if (usage & PIPE_TRANSFER_MAP_DIRECTLY)
+                        return NULL;
+
+                /* Levels are tiled in place, so let the winsys wait for the
+                 * GPU to be done with the allocation */
+
+                if (!screen->driver->map_bo(ctx, transfer))
+                        return NULL;
+
+                /* Map a linear copy of just the box, only filling it in if
+                 * it is to be read */
+
+                transfer->stride = box->width * bytes_per_pixel;
+                transfer->layer_stride = transfer->stride * box->height;
+                trans->map = malloc(transfer->layer_stride * box->depth);
+
+                if (usage & PIPE_TRANSFER_READ)
+                        panfrost_tile_transfer(ctx, trans, true);
+
+                return trans->map;
+        }
+
 	cpu = screen->driver->map_bo(ctx, transfer);
 	if (cpu == NULL)
 		return NULL;
 
-        return cpu + transfer->box.x * bytes_per_pixel + transfer->box.y * stride;
+        transfer->stride = rsrc->bo->slices[level].stride;
+        transfer->layer_stride = resource->target == PIPE_TEXTURE_3D ?
+                                 rsrc->bo->slices[level].size : rsrc->bo->cubemap_stride;
+
+        return cpu + panfrost_texture_offset(resource, level, transfer->box.z) +
+               transfer->box.y * transfer->stride +
+               transfer->box.x * bytes_per_pixel;
 }
 
 static void
@@ -312,8 +605,41 @@ panfrost_transfer_unmap(struct pipe_context *pctx,
 {
         struct panfrost_context *ctx = pan_context(pctx);
         struct panfrost_screen *screen = pan_screen(pctx->screen);
+        struct panfrost_resource *rsrc = pan_resource(transfer->resource);
+        struct panfrost_gtransfer *trans = (struct panfrost_gtransfer *) transfer;
+
+        if (trans->staging) {
+                panfrost_staging_unmap(pctx, trans);
+        } else if (rsrc->bo->tiled) {
+                /* Gallium thinks writeback happens here; instead, this is
+                 * our cue to tile */
+
+                if (transfer->usage & PIPE_TRANSFER_WRITE) {
+                        panfrost_tile_transfer(ctx, trans, false);
+                        rsrc->bo->slices[transfer->level].initialized = true;
+                }
+
+                free(trans->map);
+                screen->driver->unmap_bo(ctx, transfer);
+        } else {
+                screen->driver->unmap_bo(ctx, transfer);
+
+                if (transfer->usage & PIPE_TRANSFER_WRITE)
+                        rsrc->bo->slices[transfer->level].initialized = true;
+        }
 
-	screen->driver->unmap_bo(ctx, transfer);
+        /* Staged writes are blitted by the GPU, which keeps the checksums
+         * coherent itself; direct CPU writes do not */
+        if ((transfer->usage & PIPE_TRANSFER_WRITE) && !trans->staging)
+                panfrost_resource_invalidate_checksum(rsrc);
+
+        /* Any index ranges computed over the written bytes are now stale */
+        if ((transfer->usage & PIPE_TRANSFER_WRITE) && rsrc->index_cache) {
+                if (transfer->usage & PIPE_TRANSFER_DISCARD_WHOLE_RESOURCE)
+                        rsrc->index_cache->size = 0;
+                else
+                        panfrost_minmax_cache_invalidate(rsrc->index_cache, transfer->box.x, transfer->box.width);
+        }
 
         /* Derefence the resource */
         pipe_resource_reference(&transfer->resource, NULL);
@@ -322,10 +648,80 @@ panfrost_transfer_unmap(struct pipe_context *pctx,
         free(transfer);
 }
 
+/* Mipmaps are generated on the GPU, each level a linear blit of the one
+ * above. The GPU only renders to linear levels, so tiled textures are left to
+ * the state tracker's fallback */
+
+static boolean
+panfrost_generate_mipmap(struct pipe_context *pctx,
+                         struct pipe_resource *prsrc,
+                         enum pipe_format format,
+                         unsigned base_level,
+                         unsigned last_level,
+                         unsigned first_layer,
+                         unsigned last_layer)
+{
+        struct panfrost_resource *rsrc = pan_resource(prsrc);
+
+        if (rsrc->bo->tiled || rsrc->bo->has_afbc)
+                return false;
+
+        if (util_format_is_depth_or_stencil(format) ||
+            !pctx->screen->is_format_supported(pctx->screen, format, prsrc->target,
+                                               prsrc->nr_samples, prsrc->nr_storage_samples,
+                                               PIPE_BIND_SAMPLER_VIEW | PIPE_BIND_RENDER_TARGET))
+                return false;
+
+        struct pipe_blit_info blit = {
+                .dst = {
+                        .resource = prsrc,
+                        .format = format,
+                },
+                .src = {
+                        .resource = prsrc,
+                        .format = format,
+                },
+                .mask = PIPE_MASK_RGBA,
+                .filter = PIPE_TEX_FILTER_LINEAR,
+        };
+
+        for (unsigned l = base_level + 1; l <= last_level; ++l) {
+                unsigned depth = prsrc->target == PIPE_TEXTURE_3D ?
+                                 u_minify(prsrc->depth0, l) : last_layer - first_layer + 1;
+
+                blit.src.level = l - 1;
+                u_box_3d(0, 0, first_layer,
+                         u_minify(prsrc->width0, l - 1), u_minify(prsrc->height0, l - 1),
+                         depth, &blit.src.box);
+
+                blit.dst.level = l;
+                u_box_3d(0, 0, first_layer,
+                         u_minify(prsrc->width0, l), u_minify(prsrc->height0, l),
+                         depth, &blit.dst.box);
+
+                /* Each level samples the previous one, so each blit is a
+                 * frame of its own, submitted before the next */
+
+                panfrost_flush(pctx, NULL, 0);
+                panfrost_blit(pctx, &blit);
+                panfrost_flush(pctx, NULL, 0);
+
+                rsrc->bo->slices[l].initialized = true;
+        }
+
+        return true;
+}
+
 static void
 panfrost_invalidate_resource(struct pipe_context *pctx, struct pipe_resource *prsc)
 {
+        struct panfrost_resource *rsrc = pan_resource(prsc);
+
         //fprintf(stderr, "TODO %s\n", __func__);
+
+        /* Contents are undefined from here on */
+        if (rsrc->index_cache)
+                rsrc->index_cache->size = 0;
 }
 
 static const struct u_transfer_vtbl transfer_vtbl = {
@@ -364,7 +760,7 @@ panfrost_resource_context_init(struct pipe_context *pctx)
         pctx->surface_destroy = panfrost_surface_destroy;
         pctx->resource_copy_region = util_resource_copy_region;
         pctx->blit = panfrost_blit;
-        //pctx->generate_mipmap = panfrost_generate_mipmap;
+        pctx->generate_mipmap = panfrost_generate_mipmap;
         pctx->flush_resource = panfrost_flush_resource;
         pctx->invalidate_resource = panfrost_invalidate_resource;
         pctx->transfer_flush_region = u_transfer_helper_transfer_flush_region;
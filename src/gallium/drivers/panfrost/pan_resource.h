@@ -29,28 +29,47 @@
 #include <panfrost-job.h>
 #include "pan_screen.h"
 #include "pan_allocate.h"
+#include "pan_minmax_cache.h"
 #include <drm.h>
 
+/* Layout of one mipmap level within the resource's allocation */
+
+struct panfrost_slice {
+        /* From the start of the allocation, for the first layer */
+        unsigned offset;
+
+        /* Bytes from one row to the next. For tiled levels, a row of tiles */
+        unsigned stride;
+
+        /* Bytes of one layer of the level (one depth slice, for 3D) */
+        unsigned size;
+
+        /* Has anything been written to this level? */
+        bool initialized;
+};
+
 struct panfrost_bo {
-        /* Address to the BO in question */
+        /* Address of the allocation holding every level and layer. For tiled
+         * textures, the CPU mapping is of the tiled data */
+
+        uint8_t *cpu;
+        mali_ptr gpu;
 
-        uint8_t *cpu[MAX_MIP_LEVELS];
+        struct panfrost_slice slices[MAX_MIP_LEVELS];
 
-        /* Not necessarily a GPU mapping of cpu! In case of texture tiling, gpu
-         * points to the GPU-side, tiled texture, while cpu points to the
-         * CPU-side, untiled texture from mesa */
+        /* Bytes from one array layer (or cube face) to the next, each layer
+         * holding a full mip chain */
+        unsigned cubemap_stride;
 
-        mali_ptr gpu[MAX_MIP_LEVELS];
+        /* Total size of the allocation */
+        size_t size;
 
-        /* Memory entry corresponding to gpu above */
-        struct panfrost_memory_entry *entry[MAX_MIP_LEVELS];
+        /* Slab entry backing the allocation, for winsys that suballocate */
+        struct panfrost_memory_entry *entry;
 
         /* Set for tiled, clear for linear. */
         bool tiled;
 
-        /* Is something other than level 0 ever written? */
-        bool is_mipmap;
-
         /* If AFBC is enabled for this resource, we lug around an AFBC
          * metadata buffer as well. The actual AFBC resource is also in
          * afbc_slab (only defined for AFBC) at position afbc_main_offset */
@@ -59,10 +78,14 @@ struct panfrost_bo {
         struct panfrost_memory afbc_slab;
         int afbc_metadata_size;
 
-        /* Similarly for TE */
+        /* Similarly for TE. The checksums live as long as the BO, since
+         * they are compared against the previous frame's */
         bool has_checksum;
         struct panfrost_memory checksum_slab;
         int checksum_stride;
+
+        /* CPU copy of the last frame's checksums, for PAN_DBG_CRC_STATS */
+        uint64_t *checksum_shadow;
 };
 
 struct panfrost_resource {
@@ -70,6 +93,19 @@ struct panfrost_resource {
 
         struct panfrost_bo *bo;
         struct renderonly_scanout *scanout;
+
+        /* Cached index ranges, allocated on first use as an index buffer */
+        struct panfrost_minmax_cache *index_cache;
+};
+
+/* Transfers of resources the CPU can't address directly (AFBC) go through a
+ * linear staging resource. Tiled textures are instead (de)tiled by the CPU,
+ * through a linear buffer the size of the box */
+
+struct panfrost_gtransfer {
+        struct pipe_transfer base;
+        struct pipe_resource *staging;
+        uint8_t *map;
 };
 
 static inline struct panfrost_resource *
@@ -78,6 +114,26 @@ pan_resource(struct pipe_resource *p)
    return (struct panfrost_resource *)p;
 }
 
+bool
+panfrost_resource_wants_checksum(struct panfrost_screen *screen,
+                                 const struct pipe_resource *prsrc);
+
+void
+panfrost_resource_enable_checksum(struct panfrost_screen *screen,
+                                  struct panfrost_resource *rsrc);
+
+void
+panfrost_resource_invalidate_checksum(struct panfrost_resource *rsrc);
+
+size_t
+panfrost_setup_slices(const struct pipe_resource *tmpl, struct panfrost_bo *bo);
+
+unsigned
+panfrost_texture_offset(const struct pipe_resource *prsrc, unsigned level, unsigned layer);
+
+mali_ptr
+panfrost_get_texture_address(struct panfrost_resource *rsrc, unsigned level, unsigned layer);
+
 void panfrost_resource_screen_init(struct panfrost_screen *screen);
 
 void panfrost_resource_context_init(struct pipe_context *pctx);
@@ -28,6 +28,8 @@
  **************************************************************************/
 
 
+#include "util/u_debug.h"
+#include "util/u_inlines.h"
 #include "util/u_memory.h"
 #include "util/u_format.h"
 #include "util/u_format_s3tc.h"
@@ -39,6 +41,7 @@
 #include <xf86drm.h>
 
 #include <fcntl.h>
+#include <libsync.h>
 
 #include "drm_fourcc.h"
 
@@ -88,7 +91,11 @@ panfrost_get_param(struct pipe_screen *screen, enum pipe_cap param)
                 return 1;
 
         case PIPE_CAP_MAX_RENDER_TARGETS:
-                return PIPE_MAX_COLOR_BUFS;
+#ifdef MFBD
+                return PANFROST_MAX_RTS;
+#else
+                return 1;
+#endif
 
         case PIPE_CAP_MAX_DUAL_SOURCE_RENDER_TARGETS:
                 return 1;
@@ -145,13 +152,15 @@ panfrost_get_param(struct pipe_screen *screen, enum pipe_cap param)
                 return 1;
 
         case PIPE_CAP_PRIMITIVE_RESTART:
-                return 0; /* We don't understand this yet */
+                return 1; /* Split on the CPU, see panfrost_draw_vbo */
 
         case PIPE_CAP_SHADER_STENCIL_EXPORT:
                 return 1;
 
-        case PIPE_CAP_TGSI_INSTANCEID:
         case PIPE_CAP_VERTEX_ELEMENT_INSTANCE_DIVISOR:
+                return 1;
+
+        case PIPE_CAP_TGSI_INSTANCEID:
         case PIPE_CAP_START_INSTANCE:
                 return 0; /* TODO: Instances */
 
@@ -368,7 +377,6 @@ panfrost_get_param(struct pipe_screen *screen, enum pipe_cap param)
         case PIPE_CAP_POLYGON_OFFSET_UNITS_UNSCALED:
         case PIPE_CAP_VIEWPORT_SUBPIXEL_BITS:
         case PIPE_CAP_TGSI_CAN_READ_OUTPUTS:
-        case PIPE_CAP_NATIVE_FENCE_FD:
         case PIPE_CAP_GLSL_OPTIMIZE_CONSERVATIVELY:
         case PIPE_CAP_TGSI_FS_FBFETCH:
         case PIPE_CAP_TGSI_MUL_ZERO_WINS:
@@ -396,6 +404,9 @@ panfrost_get_param(struct pipe_screen *screen, enum pipe_cap param)
         case PIPE_CAP_SHADER_BUFFER_OFFSET_ALIGNMENT:
                 return 4;
 
+        case PIPE_CAP_NATIVE_FENCE_FD:
+                return pan_screen(screen)->driver->fence_create != NULL;
+
         default:
                 debug_printf("Unexpected PIPE_CAP %d query\n", param);
                 return 0;
@@ -622,6 +633,9 @@ panfrost_is_format_supported( struct pipe_screen *screen,
 static void
 panfrost_destroy_screen( struct pipe_screen *screen )
 {
+        struct panfrost_screen *pscreen = pan_screen(screen);
+
+        pscreen->driver->destroy(pscreen);
         FREE(screen);
 }
 
@@ -643,12 +657,24 @@ panfrost_get_timestamp(struct pipe_screen *_screen)
         return os_time_get_nano();
 }
 
+/* Fences are only ever created by winsys that support them, see
+ * panfrost_driver::fence_create */
+
 static void
 panfrost_fence_reference(struct pipe_screen *screen,
                          struct pipe_fence_handle **ptr,
                          struct pipe_fence_handle *fence)
 {
-        *ptr = fence;
+        struct panfrost_fence **p = (struct panfrost_fence **) ptr;
+        struct panfrost_fence *f = (struct panfrost_fence *) fence;
+        struct panfrost_fence *old = *p;
+
+        if (pipe_reference(&(*p)->reference, &f->reference)) {
+                close(old->fd);
+                FREE(old);
+        }
+
+        *p = f;
 }
 
 static boolean
@@ -657,8 +683,24 @@ panfrost_fence_finish(struct pipe_screen *screen,
                       struct pipe_fence_handle *fence,
                       uint64_t timeout)
 {
+        struct panfrost_fence *f = (struct panfrost_fence *) fence;
+        int timeout_ms = -1;
+
         assert(fence);
-        return TRUE;
+
+        if (timeout != PIPE_TIMEOUT_INFINITE)
+                timeout_ms = MIN2(DIV_ROUND_UP(timeout, 1000000), INT_MAX);
+
+        return sync_wait(f->fd, timeout_ms) == 0;
+}
+
+static int
+panfrost_fence_get_fd(struct pipe_screen *screen,
+                      struct pipe_fence_handle *fence)
+{
+        struct panfrost_fence *f = (struct panfrost_fence *) fence;
+
+        return fcntl(f->fd, F_DUPFD_CLOEXEC, 3);
 }
 
 static const void *
@@ -669,6 +711,15 @@ panfrost_screen_get_compiler_options(struct pipe_screen *pscreen,
         return &midgard_nir_options;
 }
 
+static const struct debug_named_value debug_options[] = {
+        {"nocrc",       PAN_DBG_NO_CRC,         "Disable transaction elimination"},
+        {"crcstats",    PAN_DBG_CRC_STATS,      "Count tiles skipped by transaction elimination for the HUD (stalls every frame)"},
+        {"msgs",        PAN_DBG_MSGS,           "Print debug messages"},
+        DEBUG_NAMED_VALUE_END
+};
+
+DEBUG_GET_ONCE_FLAGS_OPTION(pan_debug, "PAN_MESA_DEBUG", debug_options, 0)
+
 struct pipe_screen *
 panfrost_create_screen(int fd, struct renderonly *ro, bool is_drm)
 {
@@ -686,6 +737,8 @@ panfrost_create_screen(int fd, struct renderonly *ro, bool is_drm)
                 }
         }
 
+        screen->debug = debug_get_option_pan_debug();
+
 	if (is_drm)
 	        screen->driver = panfrost_create_drm_driver(fd);
         else
@@ -700,12 +753,14 @@ panfrost_create_screen(int fd, struct renderonly *ro, bool is_drm)
         screen->base.get_shader_param = panfrost_get_shader_param;
         screen->base.get_paramf = panfrost_get_paramf;
         screen->base.get_timestamp = panfrost_get_timestamp;
+        screen->base.get_driver_query_info = panfrost_get_driver_query_info;
         screen->base.is_format_supported = panfrost_is_format_supported;
         screen->base.context_create = panfrost_create_context;
         screen->base.flush_frontbuffer = panfrost_flush_frontbuffer;
         screen->base.get_compiler_options = panfrost_screen_get_compiler_options;
         screen->base.fence_reference = panfrost_fence_reference;
         screen->base.fence_finish = panfrost_fence_finish;
+        screen->base.fence_get_fd = panfrost_fence_get_fd;
 
 	screen->last_fragment_id = -1;
 	screen->last_fragment_flushed = true;
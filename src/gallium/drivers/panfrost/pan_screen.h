@@ -33,6 +33,7 @@
 
 #include "pipe/p_screen.h"
 #include "pipe/p_defines.h"
+#include "pipe/p_state.h"
 #include "renderonly/renderonly.h"
 
 #include <panfrost-misc.h>
@@ -42,6 +43,14 @@ struct panfrost_context;
 struct panfrost_resource;
 struct panfrost_screen;
 
+/* A native sync file, signalled once everything submitted before the fence
+ * was created has completed */
+
+struct panfrost_fence {
+        struct pipe_reference reference;
+        int fd;
+};
+
 struct panfrost_driver {
 	struct panfrost_bo * (*create_bo) (struct panfrost_screen *screen, const struct pipe_resource *template);
 	struct panfrost_bo * (*import_bo) (struct panfrost_screen *screen, struct winsys_handle *whandle);
@@ -51,18 +60,37 @@ struct panfrost_driver {
 
 	void (*submit_job) (struct panfrost_context *ctx, mali_ptr addr, int nr_atoms);
 	void (*force_flush_fragment) (struct panfrost_context *ctx);
-	void (*allocate_slab) (struct panfrost_context *ctx,
+
+        /* Checks whether the last fragment job completed, without waiting */
+	bool (*fragment_done) (struct panfrost_context *ctx);
+	void (*allocate_slab) (struct panfrost_screen *screen,
 		               struct panfrost_memory *mem,
 		               size_t pages,
 		               bool same_va,
 		               int extra_flags,
 		               int commit_count,
 		               int extent);
+	void (*free_slab) (struct panfrost_screen *screen,
+		           struct panfrost_memory *mem);
+
+        /* NULL if the winsys has no native fences */
+	struct panfrost_fence * (*fence_create) (struct panfrost_context *ctx);
+
+	void (*destroy) (struct panfrost_screen *screen);
 };
 
+/* Flags for PAN_MESA_DEBUG */
+
+#define PAN_DBG_NO_CRC    0x0001
+#define PAN_DBG_CRC_STATS 0x0002
+#define PAN_DBG_MSGS      0x0004
+
 struct panfrost_screen {
         struct pipe_screen base;
 
+        /* PAN_DBG_* flags */
+        unsigned debug;
+
         struct renderonly *ro;
         struct panfrost_driver *driver;
 
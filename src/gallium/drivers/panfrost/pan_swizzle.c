@@ -23,6 +23,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "pan_swizzle.h"
 #include "pan_allocate.h"
 
@@ -185,6 +186,61 @@ panfrost_texture_swizzle(int width, int height, int bytes_per_pixel, int source_
         }
 }
 
+/* Moves a rectangle of pixels between a linear buffer and the tiled level it
+ * belongs in, in either direction. The rectangle may start anywhere, so this
+ * goes pixel by pixel; the constant bytes_per_pixel of each caller below lets
+ * the copies be inlined */
+
+static inline void
+swizzle_box(int x0, int y0, int width, int height, int bytes_per_pixel,
+            uint8_t *linear, int linear_stride,
+            uint8_t *tiled, int tiled_stride,
+            bool untile)
+{
+        for (int y = 0; y < height; ++y) {
+                int tile_y = y0 + y;
+                uint8_t *tile_row = tiled + (tile_y >> 4) * tiled_stride;
+                uint8_t *row = linear + y * linear_stride;
+                const uint32_t *filler = space_filler[tile_y & 0x0F];
+
+                for (int x = 0; x < width; ++x) {
+                        int tile_x = x0 + x;
+                        int index = ((tile_x >> 4) * 256) + filler[tile_x & 0x0F];
+                        uint8_t *t = tile_row + index * bytes_per_pixel;
+                        uint8_t *l = row + x * bytes_per_pixel;
+
+                        if (untile)
+                                memcpy(l, t, bytes_per_pixel);
+                        else
+                                memcpy(t, l, bytes_per_pixel);
+                }
+        }
+}
+
+#define SWIZZLE_BOX_CASE(bpp) \
+        case bpp: \
+                swizzle_box(x, y, width, height, bpp, linear, linear_stride, tiled, tiled_stride, untile); \
+                break;
+
+void
+panfrost_swizzle_box(int x, int y, int width, int height, int bytes_per_pixel,
+                     uint8_t *linear, int linear_stride,
+                     uint8_t *tiled, int tiled_stride,
+                     bool untile)
+{
+        switch (bytes_per_pixel) {
+                SWIZZLE_BOX_CASE(1);
+                SWIZZLE_BOX_CASE(2);
+                SWIZZLE_BOX_CASE(4);
+                SWIZZLE_BOX_CASE(8);
+                SWIZZLE_BOX_CASE(16);
+        default:
+                swizzle_box(x, y, width, height, bytes_per_pixel, linear, linear_stride, tiled, tiled_stride, untile);
+                break;
+        }
+}
+
+#undef SWIZZLE_BOX_CASE
 
 unsigned
 panfrost_swizzled_size(int width, int height, int bytes_per_pixel)
@@ -26,6 +26,7 @@
 #define __TEXSWZ_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 
 void
 panfrost_generate_space_filler_indices(void);
@@ -35,6 +36,15 @@ panfrost_texture_swizzle(int width, int height, int bytes_per_pixel, int source_
                          const uint8_t *pixels,
                          uint8_t *ldest);
 
+/* Tiles a width x height rectangle at (x, y) of a level from a linear buffer,
+ * or with untile, the reverse. tiled_stride is the bytes per row of tiles */
+
+void
+panfrost_swizzle_box(int x, int y, int width, int height, int bytes_per_pixel,
+                     uint8_t *linear, int linear_stride,
+                     uint8_t *tiled, int tiled_stride,
+                     bool untile);
+
 unsigned
 panfrost_swizzled_size(int width, int height, int bytes_per_pixel);
 
@@ -30,15 +30,13 @@
 #include "../pan_pretty_print.h"
 
 #define MEMORY_PROP(obj, p) {\
-	char *a = pointer_as_memory_reference(obj->p); \
+	const char *a = pointer_as_memory_reference(obj->p); \
 	panwrap_prop("%s = %s", #p, a); \
-	free(a); \
 }
 
 #define MEMORY_COMMENT(obj, p) {\
-	char *a = pointer_as_memory_reference(obj->p); \
+	const char *a = pointer_as_memory_reference(obj->p); \
 	panwrap_msg("%s = %s\n", #p, a); \
-	free(a); \
 }
 
 #define DYN_MEMORY_PROP(obj, no, p) { \
@@ -595,9 +593,8 @@ panwrap_replay_mfbd_bfr(uint64_t gpu_va, int job_no)
 
                         panwrap_prop("unk = 0x%" PRIx64, rt->chunknown.unk);
 
-                        char *a = pointer_as_memory_reference(rt->chunknown.pointer);
+                        const char *a = pointer_as_memory_reference(rt->chunknown.pointer);
                         panwrap_prop("pointer = %s", a);
-                        free(a);
 
                         panwrap_indent--;
                         panwrap_log("},\n");
@@ -695,9 +692,8 @@ panwrap_replay_attributes(const struct panwrap_mapped_memory *mem,
                 } else {
                         /* TODO: Allocate space for varyings dynamically? */
 
-                        char *a = pointer_as_memory_reference(raw_elements);
+                        const char *a = pointer_as_memory_reference(raw_elements);
                         panwrap_log("mali_ptr %s_%d_p = %s;\n", base, i, a);
-                        free(a);
                 }
         }
 
@@ -744,9 +740,8 @@ panwrap_replay_shader_address(const char *name, mali_ptr ptr)
         /* TODO: Decode flags */
         mali_ptr shader_ptr = ptr & ~15;
 
-        char *a = pointer_as_memory_reference(shader_ptr);
+        const char *a = pointer_as_memory_reference(shader_ptr);
         panwrap_prop("%s = (%s) | %d", name, a, (int) (ptr & 15));
-        free(a);
 
         return shader_ptr;
 }
@@ -1362,9 +1357,8 @@ panwrap_replay_vertex_tiler_postfix_pre(const struct mali_vertex_tiler_postfix *
 
                         for (int tex = 0; tex < texture_count; ++tex) {
                                 mali_ptr *PANWRAP_PTR_VAR(u, mmem, p->texture_trampoline + tex * sizeof(mali_ptr));
-                                char *a = pointer_as_memory_reference(*u);
+                                const char *a = pointer_as_memory_reference(*u);
                                 panwrap_log("%s,\n", a);
-                                free(a);
                         }
 
                         panwrap_indent--;
@@ -1433,9 +1427,8 @@ panwrap_replay_vertex_tiler_postfix_pre(const struct mali_vertex_tiler_postfix *
                                         }
 
                                         for (int i = 0; i < bitmap_count; ++i) {
-                                                char *a = pointer_as_memory_reference(t->swizzled_bitmaps[i]);
+                                                const char *a = pointer_as_memory_reference(t->swizzled_bitmaps[i]);
                                                 panwrap_log("%s, \n", a);
-                                                free(a);
                                         }
 
                                         panwrap_indent--;
@@ -1599,9 +1592,8 @@ panwrap_replay_tiler_heap_meta(mali_ptr gpu_va, int job_no)
          * really the end of the tiler heap buffer, so we have to be careful
          * here.
          */
-        char *a = pointer_as_memory_reference(h->tiler_heap_end - 1);
+        const char *a = pointer_as_memory_reference(h->tiler_heap_end - 1);
         panwrap_prop("tiler_heap_end = %s + 1", a);
-        free(a);
 
         panwrap_indent--;
         panwrap_log("};\n");
@@ -1754,9 +1746,8 @@ panwrap_replay_vertex_or_tiler_job_mdg(const struct mali_job_descriptor_header *
         struct midgard_payload_vertex_tiler *PANWRAP_PTR_VAR(v, mem, payload);
 
 
-        char *a = pointer_as_memory_reference(payload);
+        const char *a = pointer_as_memory_reference(payload);
         panwrap_msg("vt payload: %s\n", a);
-        free(a);
 
         panwrap_replay_vertex_tiler_postfix_pre(&v->postfix, job_no, h->job_type, "", false);
 
@@ -2087,3 +2078,161 @@ panwrap_replay_soft_replay(mali_ptr jc_gpu_va)
 
         return start_no;
 }
+
+#define FLAG_INFO(flag)  { BASE_JD_REQ_##flag, "BASE_JD_REQ_" #flag }
+#define PFLAG_INFO(flag) { BASEP_JD_REQ_##flag, "BASEP_JD_REQ_" #flag}
+static const struct panwrap_flag_info jd_req_flag_info[] = {
+        FLAG_INFO(FS),
+        FLAG_INFO(CS),
+        FLAG_INFO(T),
+        FLAG_INFO(CF),
+        FLAG_INFO(V),
+        FLAG_INFO(FS_AFBC),
+        FLAG_INFO(EVENT_COALESCE),
+        FLAG_INFO(COHERENT_GROUP),
+        FLAG_INFO(PERMON),
+        FLAG_INFO(EXTERNAL_RESOURCES),
+        FLAG_INFO(ONLY_COMPUTE),
+        FLAG_INFO(SPECIFIC_COHERENT_GROUP),
+        FLAG_INFO(EVENT_ONLY_ON_FAILURE),
+        PFLAG_INFO(EVENT_NEVER),
+        FLAG_INFO(SKIP_CACHE_START),
+        FLAG_INFO(SKIP_CACHE_END),
+        {}
+};
+#undef FLAG_INFO
+#undef PFLAG_INFO
+
+#define SOFT_FLAG(flag)                                  \
+	case BASE_JD_REQ_SOFT_##flag:                    \
+		panwrap_log_cont("BASE_JD_REQ_%s", "SOFT_" #flag); \
+		break
+/* Decodes the actual jd_core_req flags, but not their meanings */
+void
+ioctl_log_decoded_jd_core_req(mali_jd_core_req req)
+{
+        if (req & BASE_JD_REQ_SOFT_JOB) {
+                /* External resources are allowed in e.g. replay jobs */
+
+                if (req & BASE_JD_REQ_EXTERNAL_RESOURCES) {
+                        panwrap_log_cont("BASE_JD_REQ_EXTERNAL_RESOURCES | ");
+                        req &= ~(BASE_JD_REQ_EXTERNAL_RESOURCES);
+                }
+
+                switch (req) {
+                        SOFT_FLAG(REPLAY);
+
+                default:
+                        panwrap_log_cont("0x%010x", req);
+                        break;
+                }
+        } else {
+                panwrap_log_decoded_flags(jd_req_flag_info, req);
+        }
+}
+#undef SOFT_FLAG
+
+static int job_count = 0;
+
+/* Decodes the job chains of every atom in a submission, followed by the atoms
+ * themselves. Returns the number of the atoms array in the output */
+
+int
+panwrap_replay_atoms(const struct kbase_ioctl_job_submit *args, bool bifrost)
+{
+        const struct base_jd_atom_v2 *atoms = (void *) (uintptr_t) args->addr;
+
+        int job_no = job_count++;
+
+        int job_numbers[256] = { 0 };
+
+        for (int i = 0; i < args->nr_atoms; i++) {
+                const struct base_jd_atom_v2 *a = &atoms[i];
+
+                if (a->jc) {
+                        int req = a->core_req | a->compat_core_req;
+
+                        if (!(req & BASE_JD_REQ_SOFT_JOB))
+                                job_numbers[i] = panwrap_replay_jc(a->jc, bifrost);
+                        else if (req & BASE_JD_REQ_SOFT_REPLAY)
+                                job_numbers[i] = panwrap_replay_soft_replay(a->jc);
+                }
+        }
+
+        for (int i = 0; i < args->nr_atoms; i++) {
+                const struct base_jd_atom_v2 *a = &atoms[i];
+
+                if (a->extres_list) {
+                        panwrap_log("base_external_resource resources_%d_%d[] = {\n", job_no, i);
+                        panwrap_indent++;
+
+                        for (int j = 0; j < a->nr_extres; j++) {
+                                /* Substitute in our framebuffer */
+                                panwrap_log("framebuffer_va | BASE_EXT_RES_ACCESS_EXCLUSIVE,\n");
+                        }
+
+                        panwrap_indent--;
+                        panwrap_log("};\n\n");
+
+                }
+        }
+
+        panwrap_log("struct base_jd_atom_v2 atoms_%d[] = {\n", job_no);
+        panwrap_indent++;
+
+        for (int i = 0; i < args->nr_atoms; i++) {
+                const struct base_jd_atom_v2 *a = &atoms[i];
+
+                panwrap_log("{\n");
+                panwrap_indent++;
+
+                panwrap_prop("jc = job_%d_p", job_numbers[i]);
+
+                /* Don't passthrough udata; it's nondeterministic and for userspace use only */
+
+                panwrap_prop("nr_extres = %d", a->nr_extres);
+
+                if (a->extres_list)
+                        panwrap_prop("extres_list = resources_%d_%d", job_no, i);
+
+                if (a->compat_core_req)
+                        panwrap_prop("compat_core_req = 0x%x", a->compat_core_req);
+
+                if (a->core_req) {
+                        /* Note that older kernels prefer compat_core_req... */
+                        panwrap_log(".core_req = ");
+                        ioctl_log_decoded_jd_core_req(a->core_req);
+                        panwrap_log_cont(",\n");
+                }
+
+                panwrap_log(".pre_dep = {\n");
+                panwrap_indent++;
+
+                for (int j = 0; j < ARRAY_SIZE(a->pre_dep); j++) {
+                        if (a->pre_dep[j].dependency_type || a->pre_dep[j].atom_id)
+                                panwrap_log("{ .atom_id = %d, .dependency_type = %d },\n",
+                                            a->pre_dep[j].atom_id, a->pre_dep[j].dependency_type);
+                }
+
+                panwrap_indent--;
+                panwrap_log("},\n");
+
+                /* TODO: Compute atom numbers dynamically and correctly */
+                panwrap_prop("atom_number = %d + %d*%s", a->atom_number, 3, "i");
+
+                panwrap_prop("prio = %d", a->prio);
+                panwrap_prop("device_nr = %d", a->device_nr);
+
+                panwrap_indent--;
+                panwrap_log("},\n");
+
+        }
+
+        panwrap_indent--;
+        panwrap_log("};\n\n");
+
+        /* Nothing refers to this submit's memory references any more */
+        panwrap_release_memory_references();
+
+        return job_no;
+}
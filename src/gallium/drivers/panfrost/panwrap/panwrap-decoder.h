@@ -31,6 +31,7 @@
 
 int panwrap_replay_jc(mali_ptr jc_gpu_va, bool bifrost);
 int panwrap_replay_soft_replay(mali_ptr jc_gpu_va);
+int panwrap_replay_atoms(const struct kbase_ioctl_job_submit *args, bool bifrost);
 char *panwrap_format_name(enum mali_format format);
 
 #endif /* !PANWRAP_DECODER_H */
@@ -34,10 +34,119 @@
 #ifdef HAVE_LINUX_MMAN_H
 #include <linux/mman.h>
 #endif
-#include "util/list.h"
 
-static struct panwrap_allocated_memory allocations;
-static struct panwrap_mapped_memory mmaps;
+/* Allocations not yet mapped, by GPU address, and mappings by GPU and CPU
+ * address. The decoder resolves nearly every pointer it sees against these,
+ * so lookups need to be cheap */
+
+static struct rb_tree allocations;
+static struct rb_tree mmaps_gpu;
+static struct rb_tree mmaps_cpu;
+
+static int
+panwrap_range_cmp(const struct rb_node *a, const struct rb_node *b)
+{
+        const struct panwrap_range *ra = rb_node_data(struct panwrap_range, a, node);
+        const struct panwrap_range *rb = rb_node_data(struct panwrap_range, b, node);
+
+        /* Equal starts sort after, so the newest of those is found first */
+        return ra->start < rb->start ? -1 : 1;
+}
+
+static void
+panwrap_range_insert(struct rb_tree *tree, struct panwrap_range *range,
+                     u64 start, u64 length)
+{
+        range->start = start;
+        range->length = length;
+        rb_tree_insert(tree, &range->node, panwrap_range_cmp);
+}
+
+/* Finds the range with the greatest start at or below addr */
+
+static struct panwrap_range *
+panwrap_range_floor(struct rb_tree *tree, u64 addr)
+{
+        struct panwrap_range *best = NULL;
+        struct rb_node *x = tree->root;
+
+        while (x) {
+                struct panwrap_range *r = rb_node_data(struct panwrap_range, x, node);
+
+                if (r->start <= addr) {
+                        best = r;
+                        x = x->right;
+                } else {
+                        x = x->left;
+                }
+        }
+
+        return best;
+}
+
+#define panwrap_range_data(range, type, field) \
+        ((type *) ((char *) (range) - offsetof(type, field)))
+
+static struct panwrap_range *
+panwrap_range_containing(struct rb_tree *tree, u64 addr)
+{
+        struct panwrap_range *r = panwrap_range_floor(tree, addr);
+
+        return (r && addr - r->start < r->length) ? r : NULL;
+}
+
+static struct panwrap_range *
+panwrap_range_exact(struct rb_tree *tree, u64 addr)
+{
+        struct panwrap_range *r = panwrap_range_floor(tree, addr);
+
+        return (r && r->start == addr) ? r : NULL;
+}
+
+/* pointer_as_memory_reference is called for most pointers decoded, and the
+ * strings only need to outlive the log line. They come from an arena instead
+ * of the heap, released once a submit has been decoded */
+
+#define REFERENCE_ARENA_SIZE (64 * 1024)
+#define REFERENCE_MAX_LENGTH 64
+
+struct panwrap_reference_arena {
+        struct panwrap_reference_arena *next;
+        size_t used;
+        char data[REFERENCE_ARENA_SIZE];
+};
+
+static struct panwrap_reference_arena *arena_first;
+static struct panwrap_reference_arena *arena_current;
+
+static char *
+panwrap_reference_alloc(void)
+{
+        if (!arena_current) {
+                arena_first = arena_current = calloc(1, sizeof(*arena_current));
+        } else if (arena_current->used + REFERENCE_MAX_LENGTH > REFERENCE_ARENA_SIZE) {
+                /* Reuse chunks from previous submits before growing */
+                if (!arena_current->next)
+                        arena_current->next = calloc(1, sizeof(*arena_current));
+
+                arena_current = arena_current->next;
+                arena_current->used = 0;
+        }
+
+        char *out = arena_current->data + arena_current->used;
+        arena_current->used += REFERENCE_MAX_LENGTH;
+
+        return out;
+}
+
+void
+panwrap_release_memory_references(void)
+{
+        arena_current = arena_first;
+
+        if (arena_current)
+                arena_current->used = 0;
+}
 
 #define FLAG_INFO(flag) { flag, #flag }
 static const struct panwrap_flag_info mmap_flags_flag_info[] = {
@@ -67,11 +176,11 @@ static const struct panwrap_flag_info mmap_prot_flag_info[] = {
 };
 #undef FLAG_INFO
 
-char *
+const char *
 pointer_as_memory_reference(mali_ptr ptr)
 {
         struct panwrap_mapped_memory *mapped;
-        char *out = malloc(128);
+        char *out = panwrap_reference_alloc();
 
         /* First check for SAME_VA mappings, then look for non-SAME_VA
          * mappings, then for unmapped regions */
@@ -79,28 +188,24 @@ pointer_as_memory_reference(mali_ptr ptr)
         if ((ptr == (uintptr_t) ptr && (mapped = panwrap_find_mapped_mem_containing((void *) (uintptr_t) ptr))) ||
                         (mapped = panwrap_find_mapped_gpu_mem_containing(ptr))) {
 
-                snprintf(out, 128, "alloc_gpu_va_%d + %d", mapped->allocation_number, (int) (ptr - mapped->gpu_va));
+                snprintf(out, REFERENCE_MAX_LENGTH, "alloc_gpu_va_%d + %d", mapped->allocation_number, (int) (ptr - mapped->gpu_va));
                 return out;
         }
 
-        struct panwrap_allocated_memory *mem = NULL;
-
         /* Find the pending unmapped allocation for the memory */
-        list_for_each_entry(struct panwrap_allocated_memory, pos, &allocations.node, node) {
-                if (ptr >= pos->gpu_va && ptr < (pos->gpu_va + pos->length)) {
-                        mem = pos;
-                        break;
-                }
-        }
+        struct panwrap_range *range = panwrap_range_containing(&allocations, ptr);
 
-        if (mem) {
-                snprintf(out, 128, "alloc_gpu_va_%d + %d", mem->allocation_number, (int) (ptr - mem->gpu_va));
+        if (range) {
+                struct panwrap_allocated_memory *mem =
+                        panwrap_range_data(range, struct panwrap_allocated_memory, range);
+
+                snprintf(out, REFERENCE_MAX_LENGTH, "alloc_gpu_va_%d + %d", mem->allocation_number, (int) (ptr - mem->gpu_va));
                 return out;
         }
 
         /* Just use the raw address if other options are exhausted */
 
-        snprintf(out, 128, MALI_PTR_FMT, ptr);
+        snprintf(out, REFERENCE_MAX_LENGTH, MALI_PTR_FMT, ptr);
         return out;
 }
 
@@ -109,33 +214,64 @@ panwrap_track_allocation(mali_ptr addr, int flags, int number, size_t length)
 {
         struct panwrap_allocated_memory *mem = malloc(sizeof(*mem));
 
-        //list_inithead(&mem->node);
         mem->gpu_va = addr;
         mem->flags = flags;
         mem->allocation_number = number;
         mem->length = length;
 
-        list_add(&mem->node, &allocations.node);
+        panwrap_range_insert(&allocations, &mem->range, addr, length);
 
         /* XXX: Hacky workaround for cz's board */
         if (mem->gpu_va >> 28 == 0xb)
                 panwrap_track_mmap(addr, (void *) (uintptr_t) addr, length, PROT_READ | PROT_WRITE, MAP_SHARED);
 }
 
+static void
+panwrap_add_mapping(mali_ptr gpu_va, void *addr, size_t length,
+                    int prot, int flags, int mem_flags, int number)
+{
+        struct panwrap_mapped_memory *mapped_mem = calloc(1, sizeof(*mapped_mem));
+
+        mapped_mem->gpu_va = gpu_va;
+        mapped_mem->length = length;
+        mapped_mem->addr = addr;
+        mapped_mem->prot = prot;
+        mapped_mem->flags = mem_flags;
+        mapped_mem->allocation_number = number;
+        mapped_mem->touched = calloc(length, sizeof(bool));
+
+        panwrap_range_insert(&mmaps_gpu, &mapped_mem->gpu_range, gpu_va, length);
+        panwrap_range_insert(&mmaps_cpu, &mapped_mem->cpu_range, (uintptr_t) addr, length);
+
+        panwrap_msg("va %d mapped to %" PRIx64 "\n", mapped_mem->allocation_number,
+                    mapped_mem->gpu_va);
+
+        /* Generate somewhat semantic name for the region */
+        snprintf(mapped_mem->name, sizeof(mapped_mem->name),
+                 "%s_%d",
+                 mem_flags & BASE_MEM_PROT_GPU_EX ? "shader" : "memory",
+                 mapped_mem->allocation_number);
+
+        /* Map region itself */
+
+        panwrap_log("uint32_t *%s = mmap64(NULL, %zd, %d, %d, fd, alloc_gpu_va_%d);\n\n",
+                    mapped_mem->name, length, prot, flags, mapped_mem->allocation_number);
+
+        panwrap_log("if (%s == MAP_FAILED) printf(\"Error mapping %s\\n\");\n\n",
+                    mapped_mem->name, mapped_mem->name);
+}
+
 void
 panwrap_track_mmap(mali_ptr gpu_va, void *addr, size_t length,
                    int prot, int flags)
 {
-        struct panwrap_mapped_memory *mapped_mem = NULL;
         struct panwrap_allocated_memory *mem = NULL;
 
         /* Find the pending unmapped allocation for the memory */
-        list_for_each_entry(struct panwrap_allocated_memory, pos, &allocations.node, node) {
-                if (pos->gpu_va == gpu_va) {
-                        mem = pos;
-                        break;
-                }
-        }
+        struct panwrap_range *range = panwrap_range_exact(&allocations, gpu_va);
+
+        if (range)
+                mem = panwrap_range_data(range, struct panwrap_allocated_memory, range);
 
         if (!mem) {
                 panwrap_msg("Error: Untracked gpu memory " MALI_PTR_FMT " mapped to %p\n",
@@ -150,49 +286,30 @@ panwrap_track_mmap(mali_ptr gpu_va, void *addr, size_t length,
                 return;
         }
 
-        mapped_mem = malloc(sizeof(*mapped_mem));
-        list_inithead(&mapped_mem->node);
-
         /* Try not to break other systems... there are so many configurations
          * of userspaces/kernels/architectures and none of them are compatible,
          * ugh. */
 
 #define MEM_COOKIE_VA 0x41000
 
-        if (mem->flags & BASE_MEM_SAME_VA && gpu_va == MEM_COOKIE_VA) {
-                mapped_mem->gpu_va = (mali_ptr) (uintptr_t) addr;
-        } else {
-                mapped_mem->gpu_va = gpu_va;
-        }
+        if (mem->flags & BASE_MEM_SAME_VA && gpu_va == MEM_COOKIE_VA)
+                gpu_va = (mali_ptr) (uintptr_t) addr;
 
-        mapped_mem->length = length;
-        mapped_mem->addr = addr;
-        mapped_mem->prot = prot;
-        mapped_mem->flags = mem->flags;
-        mapped_mem->allocation_number = mem->allocation_number;
-        mapped_mem->touched = calloc(length, sizeof(bool));
+        panwrap_add_mapping(gpu_va, addr, length, prot, flags,
+                            mem->flags, mem->allocation_number);
 
-        list_add(&mapped_mem->node, &mmaps.node);
-
-        list_del(&mem->node);
+        rb_tree_remove(&allocations, &mem->range.node);
         free(mem);
+}
 
-        panwrap_msg("va %d mapped to %" PRIx64 "\n", mapped_mem->allocation_number,
-                    mapped_mem->gpu_va);
-
-        /* Generate somewhat semantic name for the region */
-        snprintf(mapped_mem->name, sizeof(mapped_mem->name),
-                 "%s_%d",
-                 mem->flags & BASE_MEM_PROT_GPU_EX ? "shader" : "memory",
-                 mapped_mem->allocation_number);
-
-        /* Map region itself */
-
-        panwrap_log("uint32_t *%s = mmap64(NULL, %zd, %d, %d, fd, alloc_gpu_va_%d);\n\n",
-                    mapped_mem->name, length, prot, flags, mapped_mem->allocation_number);
+/* Offline, memory is restored from a trace rather than mapped from the
+ * kernel, with the GPU address already resolved at capture time */
 
-        panwrap_log("if (%s == MAP_FAILED) printf(\"Error mapping %s\\n\");\n\n",
-                    mapped_mem->name, mapped_mem->name);
+void
+panwrap_track_snapshot(mali_ptr gpu_va, void *addr, size_t length,
+                       int prot, int flags, int number)
+{
+        panwrap_add_mapping(gpu_va, addr, length, prot, MAP_SHARED, flags, number);
 }
 
 void
@@ -206,49 +323,49 @@ panwrap_track_munmap(void *addr)
                 return;
         }
 
-        list_del(&mapped_mem->node);
+        rb_tree_remove(&mmaps_gpu, &mapped_mem->gpu_range.node);
+        rb_tree_remove(&mmaps_cpu, &mapped_mem->cpu_range.node);
 
+        free(mapped_mem->touched);
+        free(mapped_mem->page_hashes);
         free(mapped_mem);
 }
 
-struct panwrap_mapped_memory *panwrap_find_mapped_mem(void *addr)
+void
+panwrap_for_each_mapped_mem(void (*func)(struct panwrap_mapped_memory *mem, void *data),
+                            void *data)
 {
-        list_for_each_entry(struct panwrap_mapped_memory, pos, &mmaps.node, node) {
-                if (pos->addr == addr)
-                        return pos;
+        rb_tree_foreach(struct panwrap_mapped_memory, pos, &mmaps_gpu, gpu_range.node) {
+                func(pos, data);
         }
+}
 
-        return NULL;
+struct panwrap_mapped_memory *panwrap_find_mapped_mem(void *addr)
+{
+        struct panwrap_range *r = panwrap_range_exact(&mmaps_cpu, (uintptr_t) addr);
+
+        return r ? panwrap_range_data(r, struct panwrap_mapped_memory, cpu_range) : NULL;
 }
 
 struct panwrap_mapped_memory *panwrap_find_mapped_mem_containing(void *addr)
 {
-        list_for_each_entry(struct panwrap_mapped_memory, pos, &mmaps.node, node) {
-                if (addr >= pos->addr && addr < pos->addr + pos->length)
-                        return pos;
-        }
+        struct panwrap_range *r = panwrap_range_containing(&mmaps_cpu, (uintptr_t) addr);
 
-        return NULL;
+        return r ? panwrap_range_data(r, struct panwrap_mapped_memory, cpu_range) : NULL;
 }
 
 struct panwrap_mapped_memory *panwrap_find_mapped_gpu_mem(mali_ptr addr)
 {
-        list_for_each_entry(struct panwrap_mapped_memory, pos, &mmaps.node, node) {
-                if (pos->gpu_va == addr)
-                        return pos;
-        }
+        struct panwrap_range *r = panwrap_range_exact(&mmaps_gpu, addr);
 
-        return NULL;
+        return r ? panwrap_range_data(r, struct panwrap_mapped_memory, gpu_range) : NULL;
 }
 
 struct panwrap_mapped_memory *panwrap_find_mapped_gpu_mem_containing(mali_ptr addr)
 {
-        list_for_each_entry(struct panwrap_mapped_memory, pos, &mmaps.node, node) {
-                if (addr >= pos->gpu_va && addr < pos->gpu_va + pos->length)
-                        return pos;
-        }
+        struct panwrap_range *r = panwrap_range_containing(&mmaps_gpu, addr);
 
-        return NULL;
+        return r ? panwrap_range_data(r, struct panwrap_mapped_memory, gpu_range) : NULL;
 }
 
 void
@@ -283,7 +400,7 @@ __panwrap_fetch_mem_err(const struct panwrap_mapped_memory *mem,
         } else {
                 panwrap_msg("GPU memory is not contained within known GPU VA mappings\n");
 
-                list_for_each_entry(struct panwrap_mapped_memory, pos, &mmaps.node, node) {
+                rb_tree_foreach(struct panwrap_mapped_memory, pos, &mmaps_gpu, gpu_range.node) {
                         panwrap_msg(MALI_PTR_FMT " (%p)\n", pos->gpu_va, pos->addr);
                 }
         }
@@ -293,6 +410,7 @@ __panwrap_fetch_mem_err(const struct panwrap_mapped_memory *mem,
 }
 
 PANLOADER_CONSTRUCTOR {
-        list_inithead(&allocations.node);
-        list_inithead(&mmaps.node);
+        rb_tree_init(&allocations);
+        rb_tree_init(&mmaps_gpu);
+        rb_tree_init(&mmaps_cpu);
 }
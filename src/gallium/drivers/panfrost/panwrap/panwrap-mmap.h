@@ -31,10 +31,20 @@
 #include <panfrost-misc.h>
 #include <panfrost-mali-base.h>
 #include "panwrap.h"
-#include "util/list.h"
+#include "util/rb_tree.h"
+
+/* Address range indexed in an rb_tree by its start. Ranges in a tree don't
+ * overlap, so the range containing an address is the one starting closest
+ * below it */
+
+struct panwrap_range {
+        struct rb_node node;
+        u64 start;
+        u64 length;
+};
 
 struct panwrap_allocated_memory {
-        struct list_head node;
+        struct panwrap_range range;
 
         mali_ptr gpu_va;
         int flags;
@@ -43,7 +53,9 @@ struct panwrap_allocated_memory {
 };
 
 struct panwrap_mapped_memory {
-        struct list_head node;
+        /* Indexed by both GPU and CPU address */
+        struct panwrap_range gpu_range;
+        struct panwrap_range cpu_range;
 
         size_t length;
 
@@ -56,6 +68,10 @@ struct panwrap_mapped_memory {
         char name[32];
 
         bool *touched;
+
+        /* Hashes of each page as last written to the binary trace, or NULL if
+         * the mapping hasn't been traced yet */
+        u64 *page_hashes;
 };
 
 /* Set this if you don't want your life to be hell while debugging */
@@ -87,12 +103,18 @@ struct panwrap_mapped_memory {
 
 void replay_memory();
 void replay_memory_specific(struct panwrap_mapped_memory *pos, int offset, int len);
-char *pointer_as_memory_reference(mali_ptr ptr);
+const char *pointer_as_memory_reference(mali_ptr ptr);
+void panwrap_release_memory_references(void);
 
 void panwrap_track_allocation(mali_ptr gpu_va, int flags, int number, size_t length);
 void panwrap_track_mmap(mali_ptr gpu_va, void *addr, size_t length,
                         int prot, int flags);
 void panwrap_track_munmap(void *addr);
+void panwrap_track_snapshot(mali_ptr gpu_va, void *addr, size_t length,
+                            int prot, int flags, int number);
+
+void panwrap_for_each_mapped_mem(void (*func)(struct panwrap_mapped_memory *mem, void *data),
+                                 void *data);
 
 struct panwrap_mapped_memory *panwrap_find_mapped_mem(void *addr);
 struct panwrap_mapped_memory *panwrap_find_mapped_mem_containing(void *addr);
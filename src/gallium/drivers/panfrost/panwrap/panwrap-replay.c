@@ -0,0 +1,356 @@
+/*
+ * © Copyright 2019 The Panfrost Community
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Offline companion to PANWRAP_TRACE: restores the memory snapshots of a
+ * binary trace and, for each submit, either decodes the job chains to the
+ * usual text form or validates them.
+ *
+ *      panwrap-replay [--validate] trace.bin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <panfrost-job.h>
+#include "panwrap.h"
+#include "panwrap-trace.h"
+
+/* Page records by hash, open addressed. The record payload is kept as is,
+ * with the contents following the hash */
+
+struct replay_page {
+        u64 hash;
+        void *payload;
+};
+
+static struct replay_page *pages;
+static size_t pages_size;
+static size_t pages_count;
+
+static void
+replay_page_insert(u64 hash, void *payload)
+{
+        if ((pages_count + 1) * 2 > pages_size) {
+                size_t old_size = pages_size;
+                struct replay_page *old = pages;
+
+                pages_size = old_size ? old_size * 2 : 4096;
+                pages = calloc(pages_size, sizeof(*pages));
+                pages_count = 0;
+
+                for (size_t i = 0; i < old_size; ++i) {
+                        if (old[i].hash)
+                                replay_page_insert(old[i].hash, old[i].payload);
+                }
+
+                free(old);
+        }
+
+        size_t mask = pages_size - 1;
+        size_t i = hash & mask;
+
+        while (pages[i].hash && pages[i].hash != hash)
+                i = (i + 1) & mask;
+
+        if (!pages[i].hash)
+                pages_count++;
+        else
+                free(pages[i].payload);
+
+        pages[i].hash = hash;
+        pages[i].payload = payload;
+}
+
+static void *
+replay_page_find(u64 hash)
+{
+        size_t mask = pages_size - 1;
+
+        if (!pages_size)
+                return NULL;
+
+        for (size_t i = hash & mask; pages[i].hash; i = (i + 1) & mask) {
+                if (pages[i].hash == hash)
+                        return (uint8_t *) pages[i].payload + sizeof(u64);
+        }
+
+        return NULL;
+}
+
+/* Restores a mapping's contents from its pages, creating the backing memory
+ * the first time the mapping is seen */
+
+static bool
+replay_mapping(const struct panwrap_trace_mapping *m, const u64 *hashes)
+{
+        struct panwrap_mapped_memory *mem = panwrap_find_mapped_gpu_mem(m->gpu_va);
+
+        if (mem && mem->length != m->length) {
+                void *addr = mem->addr;
+                panwrap_track_munmap(addr);
+                free(addr);
+                mem = NULL;
+        }
+
+        if (!mem) {
+                size_t size = (size_t) m->nr_pages * PANWRAP_TRACE_PAGE_SIZE;
+
+                panwrap_track_snapshot(m->gpu_va, calloc(1, size), m->length,
+                                       m->prot, m->flags, m->allocation_number);
+                mem = panwrap_find_mapped_gpu_mem(m->gpu_va);
+        }
+
+        for (unsigned p = 0; p < m->nr_pages; ++p) {
+                void *data = replay_page_find(hashes[p]);
+
+                if (!data) {
+                        fprintf(stderr, "Page %016" PRIx64 " of mapping " MALI_PTR_FMT " missing from trace\n",
+                                hashes[p], m->gpu_va);
+                        return false;
+                }
+
+                memcpy((uint8_t *) mem->addr + (size_t) p * PANWRAP_TRACE_PAGE_SIZE,
+                       data, PANWRAP_TRACE_PAGE_SIZE);
+        }
+
+        return true;
+}
+
+/* CPU-side checks of a job chain against the snapshot. The decoder aborts on
+ * the first bad pointer; this keeps going and reports everything it finds */
+
+static unsigned validate_errors = 0;
+
+#define VALIDATE_ERROR(submit, atom, fmt, ...) do { \
+        fprintf(stderr, "submit %d atom %d: " fmt "\n", submit, atom, ##__VA_ARGS__); \
+        validate_errors++; \
+} while (0)
+
+static size_t
+replay_payload_size(enum mali_job_type type)
+{
+        switch (type) {
+        case JOB_TYPE_SET_VALUE:
+                return sizeof(struct mali_payload_set_value);
+        case JOB_TYPE_VERTEX:
+        case JOB_TYPE_TILER:
+        case JOB_TYPE_COMPUTE:
+                return sizeof(struct midgard_payload_vertex_tiler);
+        case JOB_TYPE_FRAGMENT:
+                return sizeof(struct mali_payload_fragment);
+        case JOB_TYPE_NULL:
+        case JOB_TYPE_CACHE_FLUSH:
+                return 0;
+        default:
+                return SIZE_MAX;
+        }
+}
+
+static bool
+replay_valid_range(mali_ptr va, size_t size)
+{
+        struct panwrap_mapped_memory *mem = panwrap_find_mapped_gpu_mem_containing(va);
+
+        return mem && (va - mem->gpu_va) + size <= mem->length;
+}
+
+static void
+replay_validate_jc(int submit, int atom, mali_ptr jc)
+{
+        /* job_index is 16-bit, so a longer chain must be a cycle */
+        uint8_t *indices = calloc(1 << 16, 1);
+        struct mali_job_descriptor_header *h;
+        unsigned count = 0;
+        u16 *dependencies = malloc(2 * (1 << 16) * sizeof(u16));
+        unsigned nr_dependencies = 0;
+
+        do {
+                if (++count >= (1 << 16)) {
+                        VALIDATE_ERROR(submit, atom, "job chain doesn't terminate");
+                        break;
+                }
+
+                if (!replay_valid_range(jc, sizeof(*h))) {
+                        VALIDATE_ERROR(submit, atom, "job header " MALI_PTR_FMT " outside of mapped memory", jc);
+                        break;
+                }
+
+                h = panwrap_fetch_gpu_mem(NULL, jc, sizeof(*h));
+
+                size_t payload_size = replay_payload_size(h->job_type);
+
+                if (payload_size == SIZE_MAX) {
+                        VALIDATE_ERROR(submit, atom, "job " MALI_PTR_FMT " has invalid type %d", jc, h->job_type);
+                } else {
+                        /* See panwrap_replay_jc for the offset */
+                        int offset = h->job_descriptor_size == MALI_JOB_32 &&
+                                     h->job_type != JOB_TYPE_FRAGMENT ? 4 : 0;
+
+                        if (!replay_valid_range(jc + sizeof(*h) - offset, payload_size))
+                                VALIDATE_ERROR(submit, atom, "payload of job " MALI_PTR_FMT " outside of mapped memory", jc);
+                }
+
+                if (!h->job_index)
+                        VALIDATE_ERROR(submit, atom, "job " MALI_PTR_FMT " has no index", jc);
+                else if (indices[h->job_index])
+                        VALIDATE_ERROR(submit, atom, "job index %d used twice", h->job_index);
+
+                indices[h->job_index] = 1;
+
+                if (h->job_dependency_index_1)
+                        dependencies[nr_dependencies++] = h->job_dependency_index_1;
+
+                if (h->job_dependency_index_2)
+                        dependencies[nr_dependencies++] = h->job_dependency_index_2;
+        } while ((jc = h->job_descriptor_size ? h->next_job_64 : h->next_job_32));
+
+        for (unsigned i = 0; i < nr_dependencies; ++i) {
+                if (!indices[dependencies[i]])
+                        VALIDATE_ERROR(submit, atom, "dependency on missing job index %d", dependencies[i]);
+        }
+
+        free(dependencies);
+        free(indices);
+}
+
+static void
+replay_validate_atoms(int submit, const struct base_jd_atom_v2 *atoms, unsigned nr_atoms)
+{
+        for (unsigned i = 0; i < nr_atoms; ++i) {
+                const struct base_jd_atom_v2 *a = &atoms[i];
+                int req = a->core_req | a->compat_core_req;
+
+                if (!a->jc || (req & BASE_JD_REQ_SOFT_JOB))
+                        continue;
+
+                replay_validate_jc(submit, i, a->jc);
+        }
+}
+
+int
+main(int argc, char **argv)
+{
+        bool validate = false;
+        const char *path = NULL;
+
+        for (int i = 1; i < argc; ++i) {
+                if (strcmp(argv[i], "--validate") == 0)
+                        validate = true;
+                else
+                        path = argv[i];
+        }
+
+        if (!path) {
+                fprintf(stderr, "Usage: %s [--validate] trace.bin\n", argv[0]);
+                return 1;
+        }
+
+        FILE *fp = fopen(path, "rb");
+
+        if (!fp) {
+                fprintf(stderr, "Couldn't open %s\n", path);
+                return 1;
+        }
+
+        struct panwrap_trace_header header;
+
+        if (fread(&header, sizeof(header), 1, fp) != 1 ||
+            header.magic != PANWRAP_TRACE_MAGIC ||
+            header.version != PANWRAP_TRACE_VERSION ||
+            header.page_size != PANWRAP_TRACE_PAGE_SIZE) {
+                fprintf(stderr, "%s is not a panwrap trace\n", path);
+                return 1;
+        }
+
+        struct panwrap_trace_record record;
+        int submit_count = 0;
+
+        while (fread(&record, sizeof(record), 1, fp) == 1) {
+                uint8_t *payload = malloc(record.size);
+
+                if (fread(payload, record.size, 1, fp) != 1) {
+                        fprintf(stderr, "Truncated trace\n");
+                        free(payload);
+                        break;
+                }
+
+                switch (record.type) {
+                case PANWRAP_TRACE_PAGE: {
+                        u64 hash;
+                        memcpy(&hash, payload, sizeof(hash));
+
+                        /* Owned by the page table from here on */
+                        replay_page_insert(hash, payload);
+                        continue;
+                }
+
+                case PANWRAP_TRACE_MAPPING: {
+                        const struct panwrap_trace_mapping *m = (void *) payload;
+
+                        if (!replay_mapping(m, (const u64 *) (m + 1)))
+                                return 1;
+
+                        break;
+                }
+
+                case PANWRAP_TRACE_SUBMIT: {
+                        const struct panwrap_trace_submit *s = (void *) payload;
+                        struct base_jd_atom_v2 *atoms = (void *) (s + 1);
+
+                        if (validate) {
+                                replay_validate_atoms(submit_count, atoms, s->nr_atoms);
+                        } else {
+                                struct kbase_ioctl_job_submit args = {
+                                        .addr = (uintptr_t) atoms,
+                                        .nr_atoms = s->nr_atoms,
+                                        .stride = s->stride,
+                                };
+
+                                panwrap_replay_atoms(&args, header.bifrost);
+                                panwrap_log_flush();
+                        }
+
+                        submit_count++;
+                        break;
+                }
+
+                default:
+                        fprintf(stderr, "Unknown record type %d, skipping\n", record.type);
+                        break;
+                }
+
+                free(payload);
+        }
+
+        fclose(fp);
+
+        if (validate) {
+                fprintf(stderr, "%d submits, %u errors\n", submit_count, validate_errors);
+                return validate_errors ? 1 : 0;
+        }
+
+        return 0;
+}
@@ -96,164 +96,13 @@ static int mali_fd = 0;
 #define LOCK()   pthread_mutex_lock(&l);
 #define UNLOCK() panwrap_log_flush(); pthread_mutex_unlock(&l)
 
-#define FLAG_INFO(flag)  { BASE_JD_REQ_##flag, "BASE_JD_REQ_" #flag }
-#define PFLAG_INFO(flag) { BASEP_JD_REQ_##flag, "BASEP_JD_REQ_" #flag}
-static const struct panwrap_flag_info jd_req_flag_info[] = {
-        FLAG_INFO(FS),
-        FLAG_INFO(CS),
-        FLAG_INFO(T),
-        FLAG_INFO(CF),
-        FLAG_INFO(V),
-        FLAG_INFO(FS_AFBC),
-        FLAG_INFO(EVENT_COALESCE),
-        FLAG_INFO(COHERENT_GROUP),
-        FLAG_INFO(PERMON),
-        FLAG_INFO(EXTERNAL_RESOURCES),
-        FLAG_INFO(ONLY_COMPUTE),
-        FLAG_INFO(SPECIFIC_COHERENT_GROUP),
-        FLAG_INFO(EVENT_ONLY_ON_FAILURE),
-        PFLAG_INFO(EVENT_NEVER),
-        FLAG_INFO(SKIP_CACHE_START),
-        FLAG_INFO(SKIP_CACHE_END),
-        {}
-};
-#undef FLAG_INFO
-#undef PFLAG_INFO
-
-#define SOFT_FLAG(flag)                                  \
-	case BASE_JD_REQ_SOFT_##flag:                    \
-		panwrap_log_cont("BASE_JD_REQ_%s", "SOFT_" #flag); \
-		break
-/* Decodes the actual jd_core_req flags, but not their meanings */
-void
-ioctl_log_decoded_jd_core_req(mali_jd_core_req req)
-{
-        if (req & BASE_JD_REQ_SOFT_JOB) {
-                /* External resources are allowed in e.g. replay jobs */
-
-                if (req & BASE_JD_REQ_EXTERNAL_RESOURCES) {
-                        panwrap_log_cont("BASE_JD_REQ_EXTERNAL_RESOURCES | ");
-                        req &= ~(BASE_JD_REQ_EXTERNAL_RESOURCES);
-                }
-
-                switch (req) {
-                        SOFT_FLAG(REPLAY);
-
-                default:
-                        panwrap_log_cont("0x%010x", req);
-                        break;
-                }
-        } else {
-                panwrap_log_decoded_flags(jd_req_flag_info, req);
-        }
-}
-#undef SOFT_FLAG
-
-static int job_count = 0;
-
-static void
-emit_atoms(void *ptr, bool bifrost)
-{
-        const struct kbase_ioctl_job_submit *args = ptr;
-        const struct base_jd_atom_v2 *atoms = (void*)args->addr;
-
-        int job_no = job_count++;
-
-        int job_numbers[256] = { 0 };
-
-        for (int i = 0; i < args->nr_atoms; i++) {
-                const struct base_jd_atom_v2 *a = &atoms[i];
-
-                if (a->jc) {
-                        int req = a->core_req | a->compat_core_req;
-
-                        if (!(req & BASE_JD_REQ_SOFT_JOB))
-                                job_numbers[i] = panwrap_replay_jc(a->jc, bifrost);
-                        else if (req & BASE_JD_REQ_SOFT_REPLAY)
-                                job_numbers[i] = panwrap_replay_soft_replay(a->jc);
-                }
-        }
-
-        for (int i = 0; i < args->nr_atoms; i++) {
-                const struct base_jd_atom_v2 *a = &atoms[i];
-
-                if (a->extres_list) {
-                        panwrap_log("base_external_resource resources_%d_%d[] = {\n", job_no, i);
-                        panwrap_indent++;
-
-                        for (int j = 0; j < a->nr_extres; j++) {
-                                /* Substitute in our framebuffer */
-                                panwrap_log("framebuffer_va | BASE_EXT_RES_ACCESS_EXCLUSIVE,\n");
-                        }
-
-                        panwrap_indent--;
-                        panwrap_log("};\n\n");
-
-                }
-        }
-
-        panwrap_log("struct base_jd_atom_v2 atoms_%d[] = {\n", job_no);
-        panwrap_indent++;
-
-        for (int i = 0; i < args->nr_atoms; i++) {
-                const struct base_jd_atom_v2 *a = &atoms[i];
-
-                panwrap_log("{\n");
-                panwrap_indent++;
-
-                panwrap_prop("jc = job_%d_p", job_numbers[i]);
-
-                /* Don't passthrough udata; it's nondeterministic and for userspace use only */
-
-                panwrap_prop("nr_extres = %d", a->nr_extres);
-
-                if (a->extres_list)
-                        panwrap_prop("extres_list = resources_%d_%d", job_no, i);
-
-                if (a->compat_core_req)
-                        panwrap_prop("compat_core_req = 0x%x", a->compat_core_req);
-
-                if (a->core_req) {
-                        /* Note that older kernels prefer compat_core_req... */
-                        panwrap_log(".core_req = ");
-                        ioctl_log_decoded_jd_core_req(a->core_req);
-                        panwrap_log_cont(",\n");
-                }
-
-                panwrap_log(".pre_dep = {\n");
-                panwrap_indent++;
-
-                for (int j = 0; j < ARRAY_SIZE(a->pre_dep); j++) {
-                        if (a->pre_dep[j].dependency_type || a->pre_dep[j].atom_id)
-                                panwrap_log("{ .atom_id = %d, .dependency_type = %d },\n",
-                                            a->pre_dep[j].atom_id, a->pre_dep[j].dependency_type);
-                }
-
-                panwrap_indent--;
-                panwrap_log("},\n");
-
-                /* TODO: Compute atom numbers dynamically and correctly */
-                panwrap_prop("atom_number = %d + %d*%s", a->atom_number, 3, "i");
-
-                panwrap_prop("prio = %d", a->prio);
-                panwrap_prop("device_nr = %d", a->device_nr);
-
-                panwrap_indent--;
-                panwrap_log("},\n");
-
-        }
-
-        panwrap_indent--;
-        panwrap_log("};\n\n");
-}
-
 static inline void
-ioctl_decode_pre_job_submit(unsigned long int request, void *ptr)
+ioctl_decode_pre_job_submit(unsigned long int request, void *ptr, int job_no)
 {
         const struct kbase_ioctl_job_submit *args = ptr;
         const struct base_jd_atom_v2 *atoms = (void*)args->addr;
 
-        panwrap_prop("addr = atoms_%d", job_count - 1); /* XXX */
+        panwrap_prop("addr = atoms_%d", job_no);
         panwrap_prop("nr_atoms = %d", args->nr_atoms);
         panwrap_prop("stride = %d", args->stride);
 
@@ -372,8 +221,12 @@ ioctl(int fd, unsigned long int _request, ...)
 
         switch (IOCTL_CASE(request)) {
         case IOCTL_CASE(KBASE_IOCTL_JOB_SUBMIT):
-                emit_atoms(ptr, bifrost);
-                ioctl_decode_pre_job_submit(request, ptr);
+                if (panwrap_trace_enabled()) {
+                        panwrap_trace_submit(ptr, bifrost);
+                } else {
+                        int job_no = panwrap_replay_atoms(ptr, bifrost);
+                        ioctl_decode_pre_job_submit(request, ptr, job_no);
+                }
                 break;
         case IOCTL_CASE(KBASE_IOCTL_MEM_ALLOC):
                 va_pages = ((union kbase_ioctl_mem_alloc *)ptr)->in.va_pages;
@@ -464,11 +317,9 @@ munmap(void *addr, size_t length)
         ret = orig_munmap(addr, length);
         mem = panwrap_find_mapped_mem(addr);
 
-        if (!mem)
-                goto out;
+        if (mem)
+                panwrap_track_munmap(addr);
 
-        free(mem);
-out:
         UNLOCK();
         return ret;
 }
@@ -0,0 +1,275 @@
+/*
+ * © Copyright 2019 The Panfrost Community
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "panwrap.h"
+#include "panwrap-trace.h"
+
+static FILE *trace_output;
+static bool header_written = false;
+
+/* Set of page hashes already in the trace, open addressed. Zero marks an
+ * empty slot, so the hash function never returns it */
+
+static u64 *page_set;
+static size_t page_set_size;
+static size_t page_set_count;
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+
+static inline u64
+panwrap_hash_round(u64 acc, u64 word)
+{
+        acc += word * PRIME64_2;
+        acc = (acc << 31) | (acc >> 33);
+        return acc * PRIME64_1;
+}
+
+/* Runs over every mapped page at every submit, so this wants to be quick:
+ * four independent lanes keep the multipliers busy. size must be a multiple
+ * of 32 bytes */
+
+u64
+panwrap_trace_hash_page(const void *data, size_t size)
+{
+        const u64 *words = data;
+        u64 lanes[4] = { PRIME64_1, PRIME64_2, 0, -PRIME64_1 };
+
+        for (size_t i = 0; i < size / sizeof(u64); i += 4) {
+                u64 w[4];
+                memcpy(w, words + i, sizeof(w));
+
+                for (int l = 0; l < 4; ++l)
+                        lanes[l] = panwrap_hash_round(lanes[l], w[l]);
+        }
+
+        u64 h = size;
+
+        for (int l = 0; l < 4; ++l)
+                h = panwrap_hash_round(h ^ lanes[l], l);
+
+        h ^= h >> 33;
+        h *= PRIME64_2;
+        h ^= h >> 29;
+
+        return h ? h : 1;
+}
+
+static bool
+panwrap_page_set_insert(u64 hash)
+{
+        if ((page_set_count + 1) * 2 > page_set_size) {
+                size_t old_size = page_set_size;
+                u64 *old = page_set;
+
+                page_set_size = old_size ? old_size * 2 : 4096;
+                page_set = calloc(page_set_size, sizeof(u64));
+                page_set_count = 0;
+
+                for (size_t i = 0; i < old_size; ++i) {
+                        if (old[i])
+                                panwrap_page_set_insert(old[i]);
+                }
+
+                free(old);
+        }
+
+        size_t mask = page_set_size - 1;
+
+        for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+                if (page_set[i] == hash)
+                        return false;
+
+                if (!page_set[i]) {
+                        page_set[i] = hash;
+                        page_set_count++;
+                        return true;
+                }
+        }
+}
+
+static void
+panwrap_trace_write_record(enum panwrap_trace_record_type type,
+                           const void *a, size_t a_size,
+                           const void *b, size_t b_size)
+{
+        struct panwrap_trace_record record = {
+                .type = type,
+                .size = a_size + b_size,
+        };
+
+        fwrite(&record, sizeof(record), 1, trace_output);
+        fwrite(a, a_size, 1, trace_output);
+
+        if (b_size)
+                fwrite(b, b_size, 1, trace_output);
+}
+
+/* Hashes every page of a mapping, writing out any page not yet in the trace,
+ * then the mapping itself if any page changed since the last submit */
+
+static void
+panwrap_trace_mapping(struct panwrap_mapped_memory *mem, void *data)
+{
+        if (!(mem->prot & PROT_READ))
+                return;
+
+        /* Memory the CPU can't write only ever changes by GPU writes, which
+         * replaying the jobs redoes, so the first snapshot (which records the
+         * mapping) is all the trace needs */
+
+        bool cpu_writable = (mem->prot & PROT_WRITE) && (mem->flags & BASE_MEM_PROT_CPU_WR);
+
+        if (mem->page_hashes && !cpu_writable)
+                return;
+
+        unsigned nr_pages = DIV_ROUND_UP(mem->length, PANWRAP_TRACE_PAGE_SIZE);
+        u64 *hashes = malloc(nr_pages * sizeof(u64));
+        bool changed = !mem->page_hashes;
+
+        for (unsigned p = 0; p < nr_pages; ++p) {
+                size_t offset = (size_t) p * PANWRAP_TRACE_PAGE_SIZE;
+                const uint8_t *page = (const uint8_t *) mem->addr + offset;
+                uint8_t partial[PANWRAP_TRACE_PAGE_SIZE];
+
+                /* Pad out a partial final page */
+                if (mem->length - offset < PANWRAP_TRACE_PAGE_SIZE) {
+                        memset(partial, 0, sizeof(partial));
+                        memcpy(partial, page, mem->length - offset);
+                        page = partial;
+                }
+
+                hashes[p] = panwrap_trace_hash_page(page, PANWRAP_TRACE_PAGE_SIZE);
+
+                if (panwrap_page_set_insert(hashes[p])) {
+                        panwrap_trace_write_record(PANWRAP_TRACE_PAGE,
+                                                   &hashes[p], sizeof(u64),
+                                                   page, PANWRAP_TRACE_PAGE_SIZE);
+                }
+
+                if (!changed && mem->page_hashes[p] != hashes[p])
+                        changed = true;
+        }
+
+        if (changed) {
+                struct panwrap_trace_mapping mapping = {
+                        .gpu_va = mem->gpu_va,
+                        .length = mem->length,
+                        .prot = mem->prot,
+                        .flags = mem->flags,
+                        .allocation_number = mem->allocation_number,
+                        .nr_pages = nr_pages,
+                };
+
+                panwrap_trace_write_record(PANWRAP_TRACE_MAPPING,
+                                           &mapping, sizeof(mapping),
+                                           hashes, nr_pages * sizeof(u64));
+        }
+
+        free(mem->page_hashes);
+        mem->page_hashes = hashes;
+}
+
+bool
+panwrap_trace_enabled(void)
+{
+        return trace_output != NULL;
+}
+
+void
+panwrap_trace_submit(const struct kbase_ioctl_job_submit *args, bool bifrost)
+{
+        if (!header_written) {
+                struct panwrap_trace_header header = {
+                        .magic = PANWRAP_TRACE_MAGIC,
+                        .version = PANWRAP_TRACE_VERSION,
+                        .page_size = PANWRAP_TRACE_PAGE_SIZE,
+                        .bifrost = bifrost,
+                };
+
+                fwrite(&header, sizeof(header), 1, trace_output);
+                header_written = true;
+        }
+
+        /* We don't know which memory the jobs reference without decoding
+         * them, which is what we're avoiding, so snapshot everything the CPU
+         * can write. Unchanged pages still cost a hash each: every submit
+         * reads all of that memory, uncached on kbase, so tracing slows down
+         * in proportion to how much the application has mapped. Tracking
+         * dirty pages instead would mean write-protecting the mappings and
+         * catching the faults, since soft-dirty bits aren't kept for kbase's
+         * PFN mappings */
+
+        panwrap_for_each_mapped_mem(panwrap_trace_mapping, NULL);
+
+        struct panwrap_trace_submit submit = {
+                .nr_atoms = args->nr_atoms,
+                .stride = sizeof(struct base_jd_atom_v2),
+        };
+
+        /* Pack the atoms, in case the caller used a larger stride */
+
+        struct base_jd_atom_v2 *atoms = malloc(args->nr_atoms * sizeof(*atoms));
+
+        for (unsigned i = 0; i < args->nr_atoms; ++i) {
+                memcpy(&atoms[i], (const uint8_t *) (uintptr_t) args->addr + i * args->stride,
+                       sizeof(*atoms));
+        }
+
+        panwrap_trace_write_record(PANWRAP_TRACE_SUBMIT,
+                                   &submit, sizeof(submit),
+                                   atoms, args->nr_atoms * sizeof(*atoms));
+
+        free(atoms);
+
+        /* Keep the trace usable if the application (or GPU) falls over */
+        fflush(trace_output);
+}
+
+PANLOADER_CONSTRUCTOR {
+        const char *path = panwrap_parse_env_string("PANWRAP_TRACE", NULL);
+
+        if (!path)
+                return;
+
+        trace_output = fopen(path, "wb");
+
+        if (!trace_output) {
+                fprintf(stderr, "panwrap: Couldn't open trace %s\n", path);
+                return;
+        }
+
+        /* Pages are written in bulk; don't let stdio split them up */
+        setvbuf(trace_output, NULL, _IOFBF, 1 << 20);
+}
+
+PANLOADER_DESTRUCTOR {
+        if (trace_output)
+                fclose(trace_output);
+}
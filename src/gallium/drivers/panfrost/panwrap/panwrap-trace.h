@@ -0,0 +1,94 @@
+/*
+ * © Copyright 2019 The Panfrost Community
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef __PANWRAP_TRACE_H__
+#define __PANWRAP_TRACE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <mali-kbase-ioctl.h>
+#include <panfrost-misc.h>
+
+/* Decoding job chains to text while the traced application runs is slow
+ * enough to change its behaviour. Instead, with PANWRAP_TRACE=<file> set,
+ * panwrap writes a compact binary trace: snapshots of CPU-visible GPU memory
+ * at each submit, plus the submitted atoms. panwrap-replay decodes the trace
+ * offline into the usual text form, or validates the job chains.
+ *
+ * Memory is snapshotted page by page. Each distinct page is written once,
+ * keyed by a hash of its contents; mappings then refer to their pages by
+ * hash, and are only rewritten when a page changed since the last submit.
+ *
+ * The file is a header followed by records, each a record header followed by
+ * its payload. All fields are native endian. */
+
+#define PANWRAP_TRACE_MAGIC 0x52545750 /* "PWTR" */
+#define PANWRAP_TRACE_VERSION 1
+#define PANWRAP_TRACE_PAGE_SIZE 4096
+
+struct panwrap_trace_header {
+        u32 magic;
+        u32 version;
+        u32 page_size;
+        u32 bifrost;
+};
+
+enum panwrap_trace_record_type {
+        /* u64 hash, then page_size bytes of contents */
+        PANWRAP_TRACE_PAGE = 1,
+
+        /* struct panwrap_trace_mapping, then nr_pages u64 page hashes */
+        PANWRAP_TRACE_MAPPING = 2,
+
+        /* struct panwrap_trace_submit, then nr_atoms base_jd_atom_v2 */
+        PANWRAP_TRACE_SUBMIT = 3,
+};
+
+struct panwrap_trace_record {
+        u32 type;
+
+        /* Size of the payload following, in bytes */
+        u32 size;
+};
+
+struct panwrap_trace_mapping {
+        u64 gpu_va;
+        u64 length;
+        u32 prot;
+        u32 flags;
+        s32 allocation_number;
+        u32 nr_pages;
+};
+
+struct panwrap_trace_submit {
+        u32 nr_atoms;
+        u32 stride;
+};
+
+u64 panwrap_trace_hash_page(const void *data, size_t size);
+
+bool panwrap_trace_enabled(void);
+void panwrap_trace_submit(const struct kbase_ioctl_job_submit *args, bool bifrost);
+
+#endif /* __PANWRAP_TRACE_H__ */
@@ -27,6 +27,7 @@
 #include <stdbool.h>
 #include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <time.h>
 #include <ctype.h>
@@ -141,6 +142,47 @@ panwrap_log_flush()
         fflush(log_output);
 }
 
+const char *
+panwrap_parse_env_string(const char *env, const char *def)
+{
+        const char *val = getenv(env);
+
+        return (val && *val) ? val : def;
+}
+
+bool
+panwrap_parse_env_bool(const char *env, bool def)
+{
+        const char *val = panwrap_parse_env_string(env, NULL);
+
+        if (!val)
+                return def;
+
+        return !(strcmp(val, "0") == 0 || strcasecmp(val, "false") == 0 ||
+                 strcasecmp(val, "no") == 0 || strcasecmp(val, "off") == 0);
+}
+
+long
+panwrap_parse_env_long(const char *env, long def)
+{
+        const char *val = panwrap_parse_env_string(env, NULL);
+        char *end;
+        long ret;
+
+        if (!val)
+                return def;
+
+        errno = 0;
+        ret = strtol(val, &end, 0);
+
+        if (errno || *end) {
+                fprintf(stderr, "panwrap: Invalid value for %s: %s\n", env, val);
+                return def;
+        }
+
+        return ret;
+}
+
 PANLOADER_CONSTRUCTOR {
         log_output = stdout;
 }
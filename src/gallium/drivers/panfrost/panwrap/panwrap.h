@@ -36,6 +36,7 @@
 #include "panwrap-util.h"
 #include "panwrap-mmap.h"
 #include "panwrap-decoder.h"
+#include "panwrap-trace.h"
 
 struct panwrap_flag_info {
         u64 flag;
@@ -0,0 +1,505 @@
+/*
+ * Copyright © 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * Implements the concurrent map as a linearly probed table.
+ *
+ * An entry's data pointer is what readers look at: NULL for an empty slot,
+ * CLAIMED while a writer fills the key in, REMOVED for a tombstone.  A slot
+ * is only claimed for one key until the table is rehashed, so once readers
+ * see a published pointer the key next to it doesn't change under them;
+ * removing and re-adding a key reuses its tombstone.
+ *
+ * Writers reserve a slot in table->used before claiming one, so at least a
+ * quarter of the slots stays empty and probes always end.
+ *
+ * When the reserved slots run out, the table is copied to one twice as
+ * large if the live entries need it.  Otherwise the tombstones are what
+ * fills it, and it is rehashed in place instead, so churning keys doesn't
+ * leave a trail of abandoned tables behind.  A rehash moves entries under
+ * readers, so it is bracketed by table->seq like a seqlock: readers that
+ * overlap one retry their lookup.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "concurrent_set.h"
+#include "ralloc.h"
+
+/* Lookups rely on acquire loads pairing with release stores.  With the
+ * __atomic builtins that is what they ask for.  Elsewhere p_atomic_read and
+ * p_atomic_set are plain accesses, so the ordering comes from full barriers
+ * next to volatile ones.
+ */
+#if defined(USE_GCC_ATOMIC_BUILTINS)
+#define barrier_acquire() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define barrier_release() __atomic_thread_fence(__ATOMIC_RELEASE)
+#elif defined(_MSC_VER)
+#define barrier_acquire() MemoryBarrier()
+#define barrier_release() MemoryBarrier()
+#else
+#define barrier_acquire() __sync_synchronize()
+#define barrier_release() __sync_synchronize()
+#endif
+
+static inline void *
+load_acquire(void *const *p)
+{
+#if defined(USE_GCC_ATOMIC_BUILTINS)
+   return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#else
+   void *v = *(void *const volatile *) p;
+   barrier_acquire();
+   return v;
+#endif
+}
+
+static inline void
+store_release(void **p, void *v)
+{
+#if defined(USE_GCC_ATOMIC_BUILTINS)
+   __atomic_store_n(p, v, __ATOMIC_RELEASE);
+#else
+   barrier_release();
+   *(void *volatile *) p = v;
+#endif
+}
+
+static inline uint32_t
+load_seq(const uint32_t *p)
+{
+#if defined(USE_GCC_ATOMIC_BUILTINS)
+   return __atomic_load_n(p, __ATOMIC_RELAXED);
+#else
+   return *(const volatile uint32_t *) p;
+#endif
+}
+
+static inline void
+store_seq(uint32_t *p, uint32_t v)
+{
+#if defined(USE_GCC_ATOMIC_BUILTINS)
+   __atomic_store_n(p, v, __ATOMIC_RELAXED);
+#else
+   *(volatile uint32_t *) p = v;
+#endif
+}
+
+/* Keys only change under readers during a rehash, which readers detect and
+ * retry, so these only have to keep the compiler from caching them.
+ */
+static inline uint64_t
+load_key(const uint64_t *p)
+{
+#if defined(USE_GCC_ATOMIC_BUILTINS)
+   return __atomic_load_n(p, __ATOMIC_RELAXED);
+#else
+   return *(const volatile uint64_t *) p;
+#endif
+}
+
+static inline void
+store_key(uint64_t *p, uint64_t v)
+{
+#if defined(USE_GCC_ATOMIC_BUILTINS)
+   __atomic_store_n(p, v, __ATOMIC_RELAXED);
+#else
+   *(volatile uint64_t *) p = v;
+#endif
+}
+
+#define MIN_SIZE 64
+
+struct concurrent_map_entry {
+   uint64_t key;
+   void *data;
+};
+
+struct concurrent_map_table {
+   struct concurrent_map_entry *entries;
+   uint32_t size;
+   uint32_t max_used;
+   uint32_t used;
+
+   /* Odd while the table is being rehashed in place. */
+   uint32_t seq;
+};
+
+static char claimed_marker, removed_marker;
+#define CLAIMED ((void *) &claimed_marker)
+#define REMOVED ((void *) &removed_marker)
+
+static inline uint32_t
+hash_u64(uint64_t key)
+{
+   key ^= key >> 33;
+   key *= 0xff51afd7ed558ccdull;
+   key ^= key >> 33;
+   key *= 0xc4ceb9fe1a85ec53ull;
+   key ^= key >> 33;
+   return key;
+}
+
+static inline simple_mtx_t *
+key_lock(struct concurrent_map_u64 *map, uint32_t hash)
+{
+   return &map->locks[(hash >> 16) % CONCURRENT_MAP_NUM_LOCKS];
+}
+
+static struct concurrent_map_table *
+table_create(struct concurrent_map_u64 *map, uint32_t size)
+{
+   struct concurrent_map_table *table = ralloc(map, struct concurrent_map_table);
+
+   if (table == NULL)
+      return NULL;
+
+   table->entries = rzalloc_array(table, struct concurrent_map_entry, size);
+   if (table->entries == NULL) {
+      ralloc_free(table);
+      return NULL;
+   }
+
+   table->size = size;
+   table->max_used = size / 4 * 3;
+   table->used = 0;
+   table->seq = 0;
+   return table;
+}
+
+struct concurrent_map_u64 *
+_mesa_concurrent_map_u64_create(void *mem_ctx)
+{
+   struct concurrent_map_u64 *map = ralloc(mem_ctx, struct concurrent_map_u64);
+
+   if (map == NULL)
+      return NULL;
+
+   map->entries = 0;
+   for (unsigned i = 0; i < CONCURRENT_MAP_NUM_LOCKS; i++)
+      simple_mtx_init(&map->locks[i], mtx_plain);
+
+   map->table = table_create(map, MIN_SIZE);
+   if (map->table == NULL) {
+      _mesa_concurrent_map_u64_destroy(map, NULL);
+      return NULL;
+   }
+
+   return map;
+}
+
+/**
+ * Frees the map.  No other thread may be using it any more.
+ *
+ * If delete_function is passed, it gets called on each entry present before
+ * freeing.
+ */
+void
+_mesa_concurrent_map_u64_destroy(struct concurrent_map_u64 *map,
+                                 void (*delete_function)(uint64_t key,
+                                                         void *data))
+{
+   if (map == NULL)
+      return;
+
+   if (delete_function != NULL) {
+      struct concurrent_map_table *table = map->table;
+
+      for (uint32_t i = 0; i < table->size; i++) {
+         struct concurrent_map_entry *entry = &table->entries[i];
+
+         if (entry->data != NULL && entry->data != REMOVED)
+            delete_function(entry->key, entry->data);
+      }
+   }
+
+   for (unsigned i = 0; i < CONCURRENT_MAP_NUM_LOCKS; i++)
+      simple_mtx_destroy(&map->locks[i]);
+
+   /* The old tables are children of the map. */
+   ralloc_free(map);
+}
+
+/* Gives up after looking at every slot, which only happens when a rehash
+ * empties the table under the reader.
+ */
+static void *
+table_search(struct concurrent_map_table *table, uint64_t key)
+{
+   uint32_t mask = table->size - 1;
+   uint32_t i = hash_u64(key) & mask;
+
+   for (uint32_t n = 0; n < table->size; n++, i = (i + 1) & mask) {
+      struct concurrent_map_entry *entry = &table->entries[i];
+      void *data = load_acquire(&entry->data);
+
+      if (data == NULL)
+         return NULL;
+
+      if (data != CLAIMED && load_key(&entry->key) == key)
+         return data != REMOVED ? data : NULL;
+   }
+
+   return NULL;
+}
+
+void *
+_mesa_concurrent_map_u64_search(struct concurrent_map_u64 *map, uint64_t key)
+{
+   for (;;) {
+      struct concurrent_map_table *table = load_acquire((void **) &map->table);
+      uint32_t seq = load_seq(&table->seq);
+      void *data;
+
+      barrier_acquire();
+      if (seq & 1)
+         continue;
+
+      data = table_search(table, key);
+
+      barrier_acquire();
+      if (load_seq(&table->seq) == seq)
+         return data;
+   }
+}
+
+/* Reinserts the live entries of the table into it, dropping the tombstones.
+ * Called with every lock held.
+ */
+static bool
+table_rehash(struct concurrent_map_table *table)
+{
+   struct concurrent_map_entry *live;
+   uint32_t seq = table->seq;
+   uint32_t mask = table->size - 1;
+   uint32_t count = 0;
+
+   live = malloc(table->used * sizeof(*live));
+   if (live == NULL)
+      return false;
+
+   store_seq(&table->seq, seq + 1);
+   barrier_release();
+
+   for (uint32_t i = 0; i < table->size; i++) {
+      struct concurrent_map_entry *entry = &table->entries[i];
+
+      if (entry->data != NULL && entry->data != REMOVED)
+         live[count++] = *entry;
+      store_release(&entry->data, NULL);
+   }
+
+   for (uint32_t n = 0; n < count; n++) {
+      uint32_t i;
+
+      for (i = hash_u64(live[n].key) & mask;
+           table->entries[i].data != NULL;
+           i = (i + 1) & mask)
+         ;
+      store_key(&table->entries[i].key, live[n].key);
+      store_release(&table->entries[i].data, live[n].data);
+   }
+
+   table->used = count;
+   free(live);
+
+   barrier_release();
+   store_seq(&table->seq, seq + 2);
+   return true;
+}
+
+/* Makes room for more entries: when the live ones fill half of the table, by
+ * replacing it with a copy twice as large, otherwise by rehashing it in place
+ * to get rid of the tombstones.  Readers may still be looking at a replaced
+ * table, so it stays around until the map is destroyed.  Each is half the
+ * size of the next, so together they take at most as much memory as the
+ * current one.
+ */
+static bool
+map_grow(struct concurrent_map_u64 *map, struct concurrent_map_table *old)
+{
+   struct concurrent_map_table *table;
+   uint32_t size = old->size * 2;
+   bool ret = true;
+
+   for (unsigned i = 0; i < CONCURRENT_MAP_NUM_LOCKS; i++)
+      simple_mtx_lock(&map->locks[i]);
+
+   /* Someone else did it while we were waiting. */
+   if (map->table != old || old->used < old->max_used)
+      goto unlock;
+
+   if (map->entries < old->max_used / 2) {
+      ret = table_rehash(old);
+      goto unlock;
+   }
+
+   table = table_create(map, size);
+   if (table == NULL) {
+      ret = false;
+      goto unlock;
+   }
+
+   for (uint32_t i = 0; i < old->size; i++) {
+      struct concurrent_map_entry *entry = &old->entries[i];
+      uint32_t j;
+
+      if (entry->data == NULL || entry->data == REMOVED)
+         continue;
+
+      for (j = hash_u64(entry->key) & (size - 1);
+           table->entries[j].data != NULL;
+           j = (j + 1) & (size - 1))
+         ;
+      table->entries[j] = *entry;
+      table->used++;
+   }
+
+   store_release((void **) &map->table, table);
+
+unlock:
+   for (unsigned i = CONCURRENT_MAP_NUM_LOCKS; i-- > 0;)
+      simple_mtx_unlock(&map->locks[i]);
+
+   return ret;
+}
+
+static void *
+map_insert(struct concurrent_map_u64 *map, uint64_t key, void *data,
+           bool replace)
+{
+   uint32_t hash = hash_u64(key);
+   simple_mtx_t *lock = key_lock(map, hash);
+   struct concurrent_map_table *table;
+   struct concurrent_map_entry *entry;
+   uint32_t mask, i;
+
+   assert(data != NULL);
+
+   simple_mtx_lock(lock);
+
+retry:
+   table = map->table;
+   mask = table->size - 1;
+
+   /* Writers of the same key share the lock, so whatever gets claimed under
+    * us is for another key.
+    */
+   for (i = hash & mask;; i = (i + 1) & mask) {
+      void *old_data;
+
+      entry = &table->entries[i];
+      old_data = load_acquire(&entry->data);
+
+      if (old_data == NULL)
+         break;
+
+      if (old_data == CLAIMED || entry->key != key)
+         continue;
+
+      if (old_data == REMOVED) {
+         p_atomic_inc(&map->entries);
+         store_release(&entry->data, data);
+      } else if (replace) {
+         store_release(&entry->data, data);
+      } else {
+         data = old_data;
+      }
+
+      simple_mtx_unlock(lock);
+      return data;
+   }
+
+   if (p_atomic_inc_return(&table->used) > table->max_used) {
+      p_atomic_dec(&table->used);
+      simple_mtx_unlock(lock);
+
+      if (!map_grow(map, table))
+         return NULL;
+
+      simple_mtx_lock(lock);
+      goto retry;
+   }
+
+   while (p_atomic_cmpxchg(&entry->data, NULL, CLAIMED) != NULL) {
+      i = (i + 1) & mask;
+      entry = &table->entries[i];
+   }
+
+   store_key(&entry->key, key);
+   store_release(&entry->data, data);
+   p_atomic_inc(&map->entries);
+
+   simple_mtx_unlock(lock);
+   return data;
+}
+
+void *
+_mesa_concurrent_map_u64_insert(struct concurrent_map_u64 *map, uint64_t key,
+                                void *data)
+{
+   return map_insert(map, key, data, false);
+}
+
+bool
+_mesa_concurrent_map_u64_replace(struct concurrent_map_u64 *map,
+                                 uint64_t key, void *data)
+{
+   return map_insert(map, key, data, true) != NULL;
+}
+
+void *
+_mesa_concurrent_map_u64_remove(struct concurrent_map_u64 *map,
+                                uint64_t key)
+{
+   uint32_t hash = hash_u64(key);
+   simple_mtx_t *lock = key_lock(map, hash);
+   struct concurrent_map_table *table;
+   void *data = NULL;
+
+   simple_mtx_lock(lock);
+
+   table = map->table;
+   for (uint32_t i = hash & (table->size - 1);;
+        i = (i + 1) & (table->size - 1)) {
+      struct concurrent_map_entry *entry = &table->entries[i];
+      void *old_data = load_acquire(&entry->data);
+
+      if (old_data == NULL)
+         break;
+
+      if (old_data == CLAIMED || entry->key != key)
+         continue;
+
+      if (old_data != REMOVED) {
+         store_release(&entry->data, REMOVED);
+         p_atomic_dec(&map->entries);
+         data = old_data;
+      }
+      break;
+   }
+
+   simple_mtx_unlock(lock);
+   return data;
+}
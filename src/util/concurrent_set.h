@@ -0,0 +1,164 @@
+/*
+ * Copyright © 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef _CONCURRENT_SET_H
+#define _CONCURRENT_SET_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "util/macros.h"
+#include "util/simple_mtx.h"
+#include "util/u_atomic.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CONCURRENT_MAP_NUM_LOCKS 16
+
+struct concurrent_map_table;
+
+/**
+ * Map from 64-bit keys to pointers that is safe to use from several threads
+ * without external locking, meant for caches that are read much more often
+ * than they are written.
+ *
+ * Lookups don't take any lock or write to shared memory; they only retry
+ * when the table is rehashed under them.  Insertions and removals take one
+ * of CONCURRENT_MAP_NUM_LOCKS locks, picked by the hash of the key, so they
+ * only wait for each other when they hash to the same lock or the table runs
+ * out of room.  Tombstones left by removals are then dropped by rehashing the
+ * table in place, so churn doesn't use more memory.  Growing copies the
+ * entries to a table twice as large; the old one may still be in use by
+ * readers, so it is only freed with the map, which at most doubles the
+ * memory used.
+ *
+ * NULL isn't a valid value, it's what searching for a missing key returns.
+ */
+struct concurrent_map_u64 {
+   struct concurrent_map_table *table;
+   uint32_t entries;
+   simple_mtx_t locks[CONCURRENT_MAP_NUM_LOCKS];
+};
+
+struct concurrent_map_u64 *
+_mesa_concurrent_map_u64_create(void *mem_ctx);
+
+void
+_mesa_concurrent_map_u64_destroy(struct concurrent_map_u64 *map,
+                                 void (*delete_function)(uint64_t key,
+                                                         void *data));
+
+static inline uint32_t
+_mesa_concurrent_map_u64_num_entries(struct concurrent_map_u64 *map)
+{
+   return p_atomic_read(&map->entries);
+}
+
+void *
+_mesa_concurrent_map_u64_search(struct concurrent_map_u64 *map, uint64_t key);
+
+/**
+ * Inserts data for key unless the key is already there, and returns the
+ * data now in the map, or NULL if out of memory.  When several threads race
+ * to insert the same key, they all get the data of the one that won.
+ */
+void *
+_mesa_concurrent_map_u64_insert(struct concurrent_map_u64 *map, uint64_t key,
+                                void *data);
+
+/**
+ * Replaces the data of key, inserting it if needed.  Returns false if out
+ * of memory.
+ */
+bool
+_mesa_concurrent_map_u64_replace(struct concurrent_map_u64 *map,
+                                 uint64_t key, void *data);
+
+/**
+ * Removes key from the map and returns its data, or NULL if it wasn't there.
+ */
+void *
+_mesa_concurrent_map_u64_remove(struct concurrent_map_u64 *map,
+                                uint64_t key);
+
+/**
+ * Set of 64-bit keys with the same guarantees as concurrent_map_u64, which
+ * it is built on.
+ */
+struct concurrent_set_u64 {
+   struct concurrent_map_u64 map;
+};
+
+static inline struct concurrent_set_u64 *
+_mesa_concurrent_set_u64_create(void *mem_ctx)
+{
+   return (struct concurrent_set_u64 *)
+      _mesa_concurrent_map_u64_create(mem_ctx);
+}
+
+static inline void
+_mesa_concurrent_set_u64_destroy(struct concurrent_set_u64 *set)
+{
+   _mesa_concurrent_map_u64_destroy(&set->map, NULL);
+}
+
+static inline uint32_t
+_mesa_concurrent_set_u64_num_entries(struct concurrent_set_u64 *set)
+{
+   return _mesa_concurrent_map_u64_num_entries(&set->map);
+}
+
+static inline bool
+_mesa_concurrent_set_u64_contains(struct concurrent_set_u64 *set,
+                                  uint64_t key)
+{
+   return _mesa_concurrent_map_u64_search(&set->map, key) != NULL;
+}
+
+/**
+ * Adds key to the set.  Returns false if out of memory.
+ */
+static inline bool
+_mesa_concurrent_set_u64_add(struct concurrent_set_u64 *set, uint64_t key)
+{
+   /* Any non-NULL pointer does as the data. */
+   return _mesa_concurrent_map_u64_insert(&set->map, key, set) != NULL;
+}
+
+/**
+ * Removes key from the set.  Returns whether it was there.
+ */
+static inline bool
+_mesa_concurrent_set_u64_remove(struct concurrent_set_u64 *set,
+                                uint64_t key)
+{
+   return _mesa_concurrent_map_u64_remove(&set->map, key) != NULL;
+}
+
+#ifdef __cplusplus
+} /* extern C */
+#endif
+
+#endif /* _CONCURRENT_SET_H */
@@ -39,8 +39,14 @@
 #include <dirent.h>
 #include "zlib.h"
 
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
 #include "util/crc32.h"
 #include "util/debug.h"
+#include "util/hash_table.h"
+#include "util/list.h"
 #include "util/rand_xor.h"
 #include "util/u_atomic.h"
 #include "util/u_queue.h"
@@ -50,6 +56,7 @@
 #include "main/errors.h"
 
 #include "disk_cache.h"
+#include "disk_cache_pack.h"
 
 /* Number of bits to mask off from a cache key to get an index. */
 #define CACHE_INDEX_KEY_BITS 16
@@ -72,7 +79,15 @@
  * - There is no strict requirement that cache versions be backwards
  *   compatible but effort should be taken to limit disruption where possible.
  */
-#define CACHE_VERSION 1
+#define CACHE_VERSION 2
+
+/* How the data of an entry is compressed. This is recorded in each entry,
+ * so changing the codec doesn't invalidate the cache.
+ */
+enum cache_codec {
+   CACHE_CODEC_ZLIB = 0,
+   CACHE_CODEC_LZ4 = 1,
+};
 
 struct disk_cache {
    /* The path to the cache directory. */
@@ -98,12 +113,39 @@ struct disk_cache {
    /* Maximum size of all cached objects (in bytes). */
    uint64_t max_size;
 
+   /* Single-file storage, used instead of a file per entry when
+    * MESA_GLSL_CACHE_PACK is set.
+    */
+   struct disk_cache_pack *pack;
+
    /* Driver cache keys. */
    uint8_t *driver_keys_blob;
    size_t driver_keys_blob_size;
 
    disk_cache_put_cb blob_put_cb;
    disk_cache_get_cb blob_get_cb;
+
+   /* Codec for new entries, and the level when that is zlib. */
+   enum cache_codec codec;
+   int zlib_level;
+
+   /* Recently used items, uncompressed, in front of the disk. The list is
+    * in order of use, most recent first.
+    */
+   mtx_t mem_lock;
+   struct hash_table *mem_table;
+   struct list_head mem_lru;
+   uint64_t mem_max_size;
+
+   /* Protected by mem_lock, except for disk_hits. */
+   struct disk_cache_stats stats;
+};
+
+/* An item of the in-memory cache, followed by its data. */
+struct cache_mem_entry {
+   cache_key key;
+   struct list_head link;
+   size_t size;
 };
 
 struct disk_cache_put_job {
@@ -188,13 +230,55 @@ do {                                       \
    _dst += _src_size;                      \
 } while (0);
 
+/* Parses a size in bytes, given in gigabytes unless followed by a K or M
+ * suffix. Returns 0 if the string isn't a number.
+ */
+static uint64_t
+parse_cache_size(const char *str)
+{
+   char *end;
+   uint64_t size = strtoul(str, &end, 10);
+
+   if (end == str)
+      return 0;
+
+   switch (*end) {
+   case 'K':
+   case 'k':
+      return size * 1024;
+   case 'M':
+   case 'm':
+      return size * 1024*1024;
+   case '\0':
+   case 'G':
+   case 'g':
+   default:
+      return size * 1024*1024*1024;
+   }
+}
+
+static uint32_t
+cache_key_hash(const void *key)
+{
+   /* Keys are SHA-1 hashes already. */
+   uint32_t hash;
+   memcpy(&hash, key, sizeof(hash));
+   return hash;
+}
+
+static bool
+cache_key_equals(const void *a, const void *b)
+{
+   return memcmp(a, b, CACHE_KEY_SIZE) == 0;
+}
+
 struct disk_cache *
 disk_cache_create(const char *gpu_name, const char *driver_id,
                   uint64_t driver_flags)
 {
    void *local;
    struct disk_cache *cache = NULL;
-   char *path, *max_size_str;
+   char *path, *max_size_str, *mem_size_str, *compression;
    uint64_t max_size;
    int fd = -1;
    struct stat sb;
@@ -338,30 +422,8 @@ disk_cache_create(const char *gpu_name, const char *driver_id,
    max_size = 0;
 
    max_size_str = getenv("MESA_GLSL_CACHE_MAX_SIZE");
-   if (max_size_str) {
-      char *end;
-      max_size = strtoul(max_size_str, &end, 10);
-      if (end == max_size_str) {
-         max_size = 0;
-      } else {
-         switch (*end) {
-         case 'K':
-         case 'k':
-            max_size *= 1024;
-            break;
-         case 'M':
-         case 'm':
-            max_size *= 1024*1024;
-            break;
-         case '\0':
-         case 'G':
-         case 'g':
-         default:
-            max_size *= 1024*1024*1024;
-            break;
-         }
-      }
-   }
+   if (max_size_str)
+      max_size = parse_cache_size(max_size_str);
 
    /* Default to 1GB for maximum cache size. */
    if (max_size == 0) {
@@ -370,6 +432,10 @@ disk_cache_create(const char *gpu_name, const char *driver_id,
 
    cache->max_size = max_size;
 
+   /* Fall back to a file per entry if the pack can't be opened. */
+   if (env_var_as_boolean("MESA_GLSL_CACHE_PACK", false))
+      cache->pack = disk_cache_pack_open(cache->path, max_size);
+
    /* 1 thread was chosen because we don't really care about getting things
     * to disk quickly just that it's not blocking other tasks.
     *
@@ -415,6 +481,37 @@ disk_cache_create(const char *gpu_name, const char *driver_id,
    DRV_KEY_CPY(drv_key_blob, &ptr_size, ptr_size_size)
    DRV_KEY_CPY(drv_key_blob, &driver_flags, driver_flags_size)
 
+   /* Keep 16MB of recently used items in memory unless told otherwise. */
+   mem_size_str = getenv("MESA_GLSL_CACHE_MEMORY_SIZE");
+   cache->mem_max_size = mem_size_str ? parse_cache_size(mem_size_str) :
+                                        16 * 1024 * 1024;
+
+   cache->mem_table = _mesa_hash_table_create(cache, cache_key_hash,
+                                              cache_key_equals);
+   if (!cache->mem_table)
+      goto fail;
+
+   list_inithead(&cache->mem_lru);
+   mtx_init(&cache->mem_lock, mtx_plain);
+
+   /* Entries are compressed as tightly as zlib can by default. "fast" trades
+    * disk space for CPU time on the put thread, as does "lz4" if Mesa was
+    * built with it (and the fast zlib level otherwise).
+    */
+   cache->codec = CACHE_CODEC_ZLIB;
+   cache->zlib_level = Z_BEST_COMPRESSION;
+
+   compression = getenv("MESA_GLSL_CACHE_COMPRESSION");
+   if (compression && strcmp(compression, "fast") == 0) {
+      cache->zlib_level = Z_BEST_SPEED;
+   } else if (compression && strcmp(compression, "lz4") == 0) {
+#ifdef HAVE_LZ4
+      cache->codec = CACHE_CODEC_LZ4;
+#else
+      cache->zlib_level = Z_BEST_SPEED;
+#endif
+   }
+
    /* Seed our rand function */
    s_rand_xorshift128plus(cache->seed_xorshift128plus, true);
 
@@ -438,6 +535,17 @@ disk_cache_destroy(struct disk_cache *cache)
    if (cache && !cache->path_init_failed) {
       util_queue_destroy(&cache->cache_queue);
       munmap(cache->index_mmap, cache->index_mmap_size);
+
+      if (cache->pack)
+         disk_cache_pack_close(cache->pack);
+   }
+
+   if (cache) {
+      list_for_each_entry_safe(struct cache_mem_entry, entry,
+                               &cache->mem_lru, link)
+         free(entry);
+
+      mtx_destroy(&cache->mem_lock);
    }
 
    ralloc_free(cache);
@@ -667,11 +775,120 @@ evict_lru_item(struct disk_cache *cache)
       p_atomic_add(cache->size, - (uint64_t)size);
 }
 
+static void
+mem_cache_remove_locked(struct disk_cache *cache, struct hash_entry *he)
+{
+   struct cache_mem_entry *entry = he->data;
+
+   _mesa_hash_table_remove(cache->mem_table, he);
+   list_del(&entry->link);
+   cache->stats.mem_size -= entry->size;
+   free(entry);
+}
+
+static void
+mem_cache_put(struct disk_cache *cache, const cache_key key,
+              const void *data, size_t size)
+{
+   struct cache_mem_entry *entry;
+   struct hash_entry *he;
+
+   if (size > cache->mem_max_size)
+      return;
+
+   entry = malloc(sizeof(*entry) + size);
+   if (!entry)
+      return;
+
+   memcpy(entry->key, key, CACHE_KEY_SIZE);
+   entry->size = size;
+   memcpy(entry + 1, data, size);
+
+   mtx_lock(&cache->mem_lock);
+
+   he = _mesa_hash_table_search(cache->mem_table, key);
+   if (he)
+      mem_cache_remove_locked(cache, he);
+
+   /* Evict the least recently used items until this one fits. */
+   while (cache->stats.mem_size + size > cache->mem_max_size) {
+      struct cache_mem_entry *lru =
+         list_last_entry(&cache->mem_lru, struct cache_mem_entry, link);
+
+      mem_cache_remove_locked(cache,
+                              _mesa_hash_table_search(cache->mem_table,
+                                                      lru->key));
+   }
+
+   _mesa_hash_table_insert(cache->mem_table, entry->key, entry);
+   list_add(&entry->link, &cache->mem_lru);
+   cache->stats.mem_size += size;
+
+   mtx_unlock(&cache->mem_lock);
+}
+
+/* Returns a copy of the item if it is in memory. */
+static void *
+mem_cache_get(struct disk_cache *cache, const cache_key key, size_t *size)
+{
+   struct hash_entry *he;
+   void *data = NULL;
+
+   mtx_lock(&cache->mem_lock);
+
+   he = _mesa_hash_table_search(cache->mem_table, key);
+   if (he) {
+      struct cache_mem_entry *entry = he->data;
+
+      data = malloc(entry->size);
+      if (data) {
+         memcpy(data, entry + 1, entry->size);
+
+         list_del(&entry->link);
+         list_add(&entry->link, &cache->mem_lru);
+
+         cache->stats.mem_hits++;
+         cache->stats.mem_hit_bytes += entry->size;
+
+         if (size)
+            *size = entry->size;
+      }
+   }
+
+   if (!data)
+      cache->stats.mem_misses++;
+
+   mtx_unlock(&cache->mem_lock);
+
+   return data;
+}
+
+static void
+mem_cache_remove(struct disk_cache *cache, const cache_key key)
+{
+   struct hash_entry *he;
+
+   mtx_lock(&cache->mem_lock);
+
+   he = _mesa_hash_table_search(cache->mem_table, key);
+   if (he)
+      mem_cache_remove_locked(cache, he);
+
+   mtx_unlock(&cache->mem_lock);
+}
+
 void
 disk_cache_remove(struct disk_cache *cache, const cache_key key)
 {
    struct stat sb;
 
+   mem_cache_remove(cache, key);
+
+   if (cache->pack) {
+      disk_cache_pack_remove(cache->pack, key);
+      return;
+   }
+
    char *filename = get_cache_file(cache, key);
    if (filename == NULL) {
       return;
@@ -730,8 +947,8 @@ write_all(int fd, const void *buf, size_t count)
  * of the data written to disk.
  */
 static size_t
-deflate_and_write_to_disk(const void *in_data, size_t in_data_size, int dest,
-                          const char *filename)
+deflate_and_write_to_disk(const void *in_data, size_t in_data_size, int level,
+                          int dest, const char *filename)
 {
    unsigned char out[BUFSIZE];
 
@@ -743,7 +960,7 @@ deflate_and_write_to_disk(const void *in_data, size_t in_data_size, int dest,
    strm.next_in = (uint8_t *) in_data;
    strm.avail_in = in_data_size;
 
-   int ret = deflateInit(&strm, Z_BEST_COMPRESSION);
+   int ret = deflateInit(&strm, level);
    if (ret != Z_OK)
        return 0;
 
@@ -788,6 +1005,72 @@ deflate_and_write_to_disk(const void *in_data, size_t in_data_size, int dest,
    return compressed_size;
 }
 
+/**
+ * Returns the largest size that compressing \p size bytes with the codec of
+ * the cache can produce.
+ */
+static size_t
+compress_bound(struct disk_cache *cache, size_t size)
+{
+#ifdef HAVE_LZ4
+   if (cache->codec == CACHE_CODEC_LZ4)
+      return LZ4_compressBound(size);
+#endif
+
+   return compressBound(size);
+}
+
+/**
+ * Compresses cache entry in memory with the codec of the cache. Returns the
+ * compressed size, or 0 on failure.
+ */
+static size_t
+compress_cache_data(struct disk_cache *cache, const void *in_data,
+                    size_t in_data_size, void *out_data, size_t out_data_size)
+{
+#ifdef HAVE_LZ4
+   if (cache->codec == CACHE_CODEC_LZ4) {
+      int size = LZ4_compress_default(in_data, out_data, in_data_size,
+                                      out_data_size);
+      return MAX2(size, 0);
+   }
+#endif
+
+   uLongf size = out_data_size;
+   if (compress2(out_data, &size, in_data, in_data_size,
+                 cache->zlib_level) != Z_OK)
+      return 0;
+
+   return size;
+}
+
+/**
+ * Compresses cache entry with the codec of the cache and writes it to disk.
+ * Returns the size of the data written to disk.
+ */
+static size_t
+compress_and_write_to_disk(struct disk_cache *cache, const void *in_data,
+                           size_t in_data_size, int dest, const char *filename)
+{
+   /* zlib can stream, the others need the whole output at once. */
+   if (cache->codec == CACHE_CODEC_ZLIB)
+      return deflate_and_write_to_disk(in_data, in_data_size,
+                                       cache->zlib_level, dest, filename);
+
+   size_t out_size = compress_bound(cache, in_data_size);
+   void *out = malloc(out_size);
+   if (!out)
+      return 0;
+
+   size_t size = compress_cache_data(cache, in_data, in_data_size,
+                                     out, out_size);
+   if (size && write_all(dest, out, size) == -1)
+      size = 0;
+
+   free(out);
+   return size;
+}
+
 static struct disk_cache_put_job *
 create_put_job(struct disk_cache *cache, const cache_key key,
                const void *data, size_t size,
@@ -847,8 +1130,63 @@ destroy_put_job(void *job, int thread_index)
 struct cache_entry_file_data {
    uint32_t crc32;
    uint32_t uncompressed_size;
+   uint32_t codec;
 };
 
+/* Builds in memory the same entry that cache_put() writes to a file, and
+ * appends it to the pack.
+ */
+static void
+cache_put_pack(struct disk_cache_put_job *dc_job)
+{
+   struct disk_cache *cache = dc_job->cache;
+   struct cache_item_metadata *md = &dc_job->cache_item_metadata;
+   size_t size;
+
+   /* Another process may have written it meanwhile. */
+   if (disk_cache_pack_get(cache->pack, dc_job->key, &size)) {
+      disk_cache_pack_release(cache->pack);
+      return;
+   }
+
+   /* If the cache is too large, evict something else first. */
+   if (disk_cache_pack_size(cache->pack) + dc_job->size > cache->max_size)
+      disk_cache_pack_evict(cache->pack, dc_job->size);
+
+   size_t header_size = cache->driver_keys_blob_size + sizeof(uint32_t) +
+                        sizeof(struct cache_entry_file_data);
+   if (md->type == CACHE_ITEM_TYPE_GLSL)
+      header_size += sizeof(uint32_t) + md->num_keys * sizeof(cache_key);
+
+   size_t compressed_size = compress_bound(cache, dc_job->size);
+   uint8_t *entry = malloc(header_size + compressed_size);
+   if (!entry)
+      return;
+
+   uint8_t *ptr = entry;
+   DRV_KEY_CPY(ptr, cache->driver_keys_blob, cache->driver_keys_blob_size)
+   DRV_KEY_CPY(ptr, &md->type, sizeof(uint32_t))
+   if (md->type == CACHE_ITEM_TYPE_GLSL) {
+      DRV_KEY_CPY(ptr, &md->num_keys, sizeof(uint32_t))
+      DRV_KEY_CPY(ptr, md->keys, md->num_keys * sizeof(cache_key))
+   }
+
+   struct cache_entry_file_data cf_data;
+   cf_data.crc32 = util_hash_crc32(dc_job->data, dc_job->size);
+   cf_data.uncompressed_size = dc_job->size;
+   cf_data.codec = cache->codec;
+   DRV_KEY_CPY(ptr, &cf_data, sizeof(cf_data))
+
+   compressed_size = compress_cache_data(cache, dc_job->data, dc_job->size,
+                                         ptr, compressed_size);
+   if (compressed_size) {
+      disk_cache_pack_put(cache->pack, dc_job->key, entry,
+                          header_size + compressed_size);
+   }
+
+   free(entry);
+}
+
 static void
 cache_put(void *job, int thread_index)
 {
@@ -859,6 +1197,11 @@ cache_put(void *job, int thread_index)
    char *filename = NULL, *filename_tmp = NULL;
    struct disk_cache_put_job *dc_job = (struct disk_cache_put_job *) job;
 
+   if (dc_job->cache->pack) {
+      cache_put_pack(dc_job);
+      return;
+   }
+
    filename = get_cache_file(dc_job->cache, dc_job->key);
    if (filename == NULL)
       goto done;
@@ -962,6 +1305,7 @@ cache_put(void *job, int thread_index)
    struct cache_entry_file_data cf_data;
    cf_data.crc32 = util_hash_crc32(dc_job->data, dc_job->size);
    cf_data.uncompressed_size = dc_job->size;
+   cf_data.codec = dc_job->cache->codec;
 
    size_t cf_data_size = sizeof(cf_data);
    ret = write_all(fd, &cf_data, cf_data_size);
@@ -974,8 +1318,9 @@ cache_put(void *job, int thread_index)
     * rename them atomically to the destination filename, and also
     * perform an atomic increment of the total cache size.
     */
-   size_t file_size = deflate_and_write_to_disk(dc_job->data, dc_job->size,
-                                                fd, filename_tmp);
+   size_t file_size = compress_and_write_to_disk(dc_job->cache, dc_job->data,
+                                                 dc_job->size, fd,
+                                                 filename_tmp);
    if (file_size == 0) {
       unlink(filename_tmp);
       goto done;
@@ -1020,6 +1365,8 @@ disk_cache_put(struct disk_cache *cache, const cache_key key,
    if (cache->path_init_failed)
       return;
 
+   mem_cache_put(cache, key, data, size);
+
    struct disk_cache_put_job *dc_job =
       create_put_job(cache, key, data, size, cache_item_metadata);
 
@@ -1034,7 +1381,7 @@ disk_cache_put(struct disk_cache *cache, const cache_key key,
  * Decompresses cache entry, returns true if successful.
  */
 static bool
-inflate_cache_data(uint8_t *in_data, size_t in_data_size,
+inflate_cache_data(const uint8_t *in_data, size_t in_data_size,
                    uint8_t *out_data, size_t out_data_size)
 {
    z_stream strm;
@@ -1043,7 +1390,7 @@ inflate_cache_data(uint8_t *in_data, size_t in_data_size,
    strm.zalloc = Z_NULL;
    strm.zfree = Z_NULL;
    strm.opaque = Z_NULL;
-   strm.next_in = in_data;
+   strm.next_in = (uint8_t *) in_data;
    strm.avail_in = in_data_size;
    strm.next_out = out_data;
    strm.avail_out = out_data_size;
@@ -1069,6 +1416,107 @@ inflate_cache_data(uint8_t *in_data, size_t in_data_size,
    return true;
 }
 
+/**
+ * Decompresses cache entry written with \p codec, returns true if
+ * successful.
+ */
+static bool
+uncompress_cache_data(uint32_t codec, const uint8_t *in_data,
+                      size_t in_data_size, uint8_t *out_data,
+                      size_t out_data_size)
+{
+   switch (codec) {
+   case CACHE_CODEC_ZLIB:
+      return inflate_cache_data(in_data, in_data_size, out_data,
+                                out_data_size);
+#ifdef HAVE_LZ4
+   case CACHE_CODEC_LZ4:
+      return LZ4_decompress_safe((const char *) in_data, (char *) out_data,
+                                 in_data_size, out_data_size) ==
+             (int) out_data_size;
+#endif
+   default:
+      /* Written by a build with a codec that this one lacks. */
+      return false;
+   }
+}
+
+/**
+ * Checks the header of a cache entry and returns its uncompressed contents.
+ */
+static void *
+parse_cache_entry(struct disk_cache *cache, const uint8_t *entry,
+                  size_t entry_size, size_t *size)
+{
+   const uint8_t *ptr = entry, *end = entry + entry_size;
+   uint8_t *uncompressed_data;
+
+   size_t ck_size = cache->driver_keys_blob_size;
+   if (entry_size < ck_size + sizeof(uint32_t))
+      return NULL;
+
+   /* Check for extremely unlikely hash collisions */
+   if (memcmp(cache->driver_keys_blob, ptr, ck_size) != 0) {
+      assert(!"Mesa cache keys mismatch!");
+      return NULL;
+   }
+   ptr += ck_size;
+
+   uint32_t md_type;
+   memcpy(&md_type, ptr, sizeof(uint32_t));
+   ptr += sizeof(uint32_t);
+
+   if (md_type == CACHE_ITEM_TYPE_GLSL) {
+      uint32_t num_keys;
+      if (end - ptr < sizeof(uint32_t))
+         return NULL;
+
+      memcpy(&num_keys, ptr, sizeof(uint32_t));
+      ptr += sizeof(uint32_t);
+
+      /* The cache item metadata is currently just used for distributing
+       * precompiled shaders, they are not used by Mesa so just skip them for
+       * now.
+       * TODO: pass the metadata back to the caller and do some basic
+       * validation.
+       */
+      if ((end - ptr) / sizeof(cache_key) < num_keys)
+         return NULL;
+      ptr += num_keys * sizeof(cache_key);
+   }
+
+   /* Load the CRC that was created when the entry was written. */
+   struct cache_entry_file_data cf_data;
+   if (end - ptr < sizeof(cf_data))
+      return NULL;
+
+   memcpy(&cf_data, ptr, sizeof(cf_data));
+   ptr += sizeof(cf_data);
+
+   /* Uncompress the cache data */
+   uncompressed_data = malloc(cf_data.uncompressed_size);
+   if (!uncompressed_data)
+      return NULL;
+
+   if (!uncompress_cache_data(cf_data.codec, ptr, end - ptr, uncompressed_data,
+                              cf_data.uncompressed_size))
+      goto fail;
+
+   /* Check the data for corruption */
+   if (cf_data.crc32 != util_hash_crc32(uncompressed_data,
+                                        cf_data.uncompressed_size))
+      goto fail;
+
+   *size = cf_data.uncompressed_size;
+
+   return uncompressed_data;
+
+ fail:
+   free(uncompressed_data);
+
+   return NULL;
+}
+
 void *
 disk_cache_get(struct disk_cache *cache, const cache_key key, size_t *size)
 {
@@ -1077,7 +1525,7 @@ disk_cache_get(struct disk_cache *cache, const cache_key key, size_t *size)
    char *filename = NULL;
    uint8_t *data = NULL;
    uint8_t *uncompressed_data = NULL;
-   uint8_t *file_header = NULL;
+   size_t data_size;
 
    if (size)
       *size = 0;
@@ -1104,112 +1552,61 @@ disk_cache_get(struct disk_cache *cache, const cache_key key, size_t *size)
       return blob;
    }
 
+   uncompressed_data = mem_cache_get(cache, key, size);
+   if (uncompressed_data)
+      return uncompressed_data;
+
+   /* The pack entry is parsed in place, no copy or syscall needed. */
+   if (cache->pack) {
+      size_t entry_size;
+      const void *entry = disk_cache_pack_get(cache->pack, key, &entry_size);
+
+      if (entry) {
+         uncompressed_data = parse_cache_entry(cache, entry, entry_size,
+                                               &data_size);
+         disk_cache_pack_release(cache->pack);
+      }
+      goto done;
+   }
+
    filename = get_cache_file(cache, key);
    if (filename == NULL)
-      goto fail;
+      goto done;
 
    fd = open(filename, O_RDONLY | O_CLOEXEC);
    if (fd == -1)
-      goto fail;
+      goto done;
 
    if (fstat(fd, &sb) == -1)
-      goto fail;
+      goto done;
 
    data = malloc(sb.st_size);
    if (data == NULL)
-      goto fail;
-
-   size_t ck_size = cache->driver_keys_blob_size;
-   file_header = malloc(ck_size);
-   if (!file_header)
-      goto fail;
-
-   if (sb.st_size < ck_size)
-      goto fail;
+      goto done;
 
-   ret = read_all(fd, file_header, ck_size);
+   ret = read_all(fd, data, sb.st_size);
    if (ret == -1)
-      goto fail;
-
-   /* Check for extremely unlikely hash collisions */
-   if (memcmp(cache->driver_keys_blob, file_header, ck_size) != 0) {
-      assert(!"Mesa cache keys mismatch!");
-      goto fail;
-   }
+      goto done;
 
-   size_t cache_item_md_size = sizeof(uint32_t);
-   uint32_t md_type;
-   ret = read_all(fd, &md_type, cache_item_md_size);
-   if (ret == -1)
-      goto fail;
+   uncompressed_data = parse_cache_entry(cache, data, sb.st_size, &data_size);
 
-   if (md_type == CACHE_ITEM_TYPE_GLSL) {
-      uint32_t num_keys;
-      cache_item_md_size += sizeof(uint32_t);
-      ret = read_all(fd, &num_keys, sizeof(uint32_t));
-      if (ret == -1)
-         goto fail;
+ done:
+   if (uncompressed_data) {
+      p_atomic_inc(&cache->stats.disk_hits);
+      mem_cache_put(cache, key, uncompressed_data, data_size);
 
-      /* The cache item metadata is currently just used for distributing
-       * precompiled shaders, they are not used by Mesa so just skip them for
-       * now.
-       * TODO: pass the metadata back to the caller and do some basic
-       * validation.
-       */
-      cache_item_md_size += num_keys * sizeof(cache_key);
-      ret = lseek(fd, num_keys * sizeof(cache_key), SEEK_CUR);
-      if (ret == -1)
-         goto fail;
+      if (size)
+         *size = data_size;
    }
 
-   /* Load the CRC that was created when the file was written. */
-   struct cache_entry_file_data cf_data;
-   size_t cf_data_size = sizeof(cf_data);
-   ret = read_all(fd, &cf_data, cf_data_size);
-   if (ret == -1)
-      goto fail;
-
-   /* Load the actual cache data. */
-   size_t cache_data_size =
-      sb.st_size - cf_data_size - ck_size - cache_item_md_size;
-   ret = read_all(fd, data, cache_data_size);
-   if (ret == -1)
-      goto fail;
-
-   /* Uncompress the cache data */
-   uncompressed_data = malloc(cf_data.uncompressed_size);
-   if (!inflate_cache_data(data, cache_data_size, uncompressed_data,
-                           cf_data.uncompressed_size))
-      goto fail;
-
-   /* Check the data for corruption */
-   if (cf_data.crc32 != util_hash_crc32(uncompressed_data,
-                                        cf_data.uncompressed_size))
-      goto fail;
-
-   free(data);
-   free(filename);
-   free(file_header);
-   close(fd);
-
-   if (size)
-      *size = cf_data.uncompressed_size;
-
-   return uncompressed_data;
-
- fail:
    if (data)
       free(data);
-   if (uncompressed_data)
-      free(uncompressed_data);
    if (filename)
       free(filename);
-   if (file_header)
-      free(file_header);
    if (fd != -1)
       close(fd);
 
-   return NULL;
+   return uncompressed_data;
 }
 
 void
@@ -1280,4 +1677,12 @@ disk_cache_set_callbacks(struct disk_cache *cache, disk_cache_put_cb put,
    cache->blob_get_cb = get;
 }
 
+void
+disk_cache_get_stats(struct disk_cache *cache, struct disk_cache_stats *stats)
+{
+   mtx_lock(&cache->mem_lock);
+   *stats = cache->stats;
+   mtx_unlock(&cache->mem_lock);
+}
+
 #endif /* ENABLE_SHADER_CACHE */
@@ -32,6 +32,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include <sys/stat.h>
 #include "util/mesa-sha1.h"
 
@@ -76,6 +77,22 @@ struct cache_item_metadata {
 
 struct disk_cache;
 
+/* Counters of the in-memory cache in front of the disk. */
+struct disk_cache_stats {
+   /* Lookups served from memory, and the bytes they returned. */
+   uint64_t mem_hits;
+   uint64_t mem_hit_bytes;
+
+   /* Lookups that went on to the disk, and how many of those found the
+    * item there.
+    */
+   uint64_t mem_misses;
+   uint64_t disk_hits;
+
+   /* Bytes currently held in memory. */
+   uint64_t mem_size;
+};
+
 static inline char *
 disk_cache_format_hex_id(char *buf, const uint8_t *hex_id, unsigned size)
 {
@@ -246,6 +263,12 @@ void
 disk_cache_set_callbacks(struct disk_cache *cache, disk_cache_put_cb put,
                          disk_cache_get_cb get);
 
+/**
+ * Return the counters of the in-memory cache.
+ */
+void
+disk_cache_get_stats(struct disk_cache *cache, struct disk_cache_stats *stats);
+
 #else
 
 static inline struct disk_cache *
@@ -306,6 +329,12 @@ disk_cache_set_callbacks(struct disk_cache *cache, disk_cache_put_cb put,
    return;
 }
 
+static inline void
+disk_cache_get_stats(struct disk_cache *cache, struct disk_cache_stats *stats)
+{
+   memset(stats, 0, sizeof(*stats));
+}
+
 #endif /* ENABLE_SHADER_CACHE */
 
 #ifdef __cplusplus
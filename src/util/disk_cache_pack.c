@@ -0,0 +1,1019 @@
+/*
+ * Copyright © 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Single-file backend of the shader cache.
+ *
+ * Records are appended to the "pack" file of the cache directory and found
+ * through the hash table in "pack.idx", which every process maps shared.
+ *
+ * Readers never lock: they probe the index, check the key and the bounds of
+ * the record against the committed end of the pack and hand out a pointer
+ * into their mapping of it. Writers serialize on a flock of the index file
+ * (and on a mutex within the process), append with pwrite and only then
+ * publish the record in the index and move the committed end past it.
+ *
+ * Eviction is done by compaction: the most recently used records are copied
+ * to a new pack which is renamed over the old one, and the generation in
+ * the index is bumped so that other processes remap. Files other processes
+ * may be reading are never truncated or rewritten in place, only replaced
+ * by renaming a new file over them.
+ *
+ * A mapping covers the size of the pack when it was made, with some room
+ * to grow, and is replaced by a larger one when the committed end moves
+ * past it. Replaced mappings are unmapped once no pointer handed out by
+ * disk_cache_pack_get() is held any more.
+ */
+
+#ifdef ENABLE_SHADER_CACHE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "c11/threads.h"
+#include "util/crc32.h"
+#include "util/macros.h"
+#include "util/u_atomic.h"
+#include "util/u_math.h"
+
+#include "disk_cache_pack.h"
+
+#define PACK_MAGIC 0x4b41504d /* "MPAK" */
+
+/* Bump whenever the layout of the pack or the index changes. */
+#define PACK_VERSION 1
+
+/* Offsets are 32-bit. Keep the pack smaller on 32-bit platforms, where the
+ * address space is short.
+ */
+#define PACK_MAX_SIZE \
+   (sizeof(void *) == 8 ? 0xfffff000ull : 256ull * 1024 * 1024)
+
+/* Smallest mapping, so that a small pack isn't remapped on every append. */
+#define PACK_MIN_MAP_SIZE (1024 * 1024)
+
+#define PACK_RECORD_ALIGN 8
+
+/* Number of slots in the index, must be a power of two. */
+#define PACK_INDEX_SLOTS (1 << 16)
+
+/* Compact once this many slots are taken, to keep probe sequences short. */
+#define PACK_INDEX_MAX_ENTRIES (PACK_INDEX_SLOTS / 4 * 3)
+
+/* Longest probe sequence. Lookups give up after it, inserts compact. */
+#define PACK_INDEX_MAX_PROBES 64
+
+/* Slot offsets that can't be the offset of a record. */
+#define PACK_SLOT_EMPTY 0
+#define PACK_SLOT_REMOVED 1
+
+struct pack_header {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t generation;
+   uint32_t pad;
+};
+
+/* Followed by the data, then by padding up to PACK_RECORD_ALIGN. */
+struct pack_record {
+   uint8_t key[CACHE_KEY_SIZE];
+   uint32_t size;
+   uint32_t crc32;
+   uint32_t pad;
+};
+
+struct pack_slot {
+   /* First word of the key, to skip mismatches without touching the pack. */
+   uint32_t hint;
+
+   /* Offset of the record in the pack, or one of PACK_SLOT_*. */
+   uint32_t offset;
+
+   /* Access clock at the last hit, for picking what to evict. */
+   uint32_t stamp;
+};
+
+struct pack_index {
+   uint32_t magic;
+   uint32_t version;
+
+   /* Generation of the pack file that the slots refer to. */
+   uint32_t generation;
+
+   /* End of the committed records in the pack. */
+   uint32_t end;
+
+   /* Number of slots that aren't empty, removed ones included. */
+   uint32_t nr_entries;
+
+   uint32_t clock;
+   uint32_t pad[2];
+
+   struct pack_slot slots[PACK_INDEX_SLOTS];
+};
+
+struct pack_map {
+   const uint8_t *data;
+   size_t size;
+   uint32_t generation;
+
+   /* Next replaced mapping waiting to be unmapped. */
+   struct pack_map *next;
+};
+
+struct disk_cache_pack {
+   char *pack_path;
+   char *tmp_path;
+
+   int index_fd;
+   struct pack_index *index;
+
+   /* The pack file the current mapping is of. */
+   int fd;
+   struct pack_map *map;
+
+   /* Replaced mappings, and the number of pointers handed out by
+    * disk_cache_pack_get() that may still point into them.
+    */
+   struct pack_map *retired;
+   unsigned readers;
+
+   uint32_t max_size;
+
+   /* Serializes writers and remapping within the process, the flock of
+    * index_fd does the same between processes.
+    */
+   mtx_t mutex;
+};
+
+static uint32_t
+pack_key_hint(const uint8_t *key)
+{
+   uint32_t hint;
+
+   memcpy(&hint, key, sizeof(hint));
+   return hint;
+}
+
+static uint32_t
+pack_record_size(size_t size)
+{
+   return ALIGN_POT(sizeof(struct pack_record) + size, PACK_RECORD_ALIGN);
+}
+
+/* Returns the record at offset if it lies entirely before end. */
+static const struct pack_record *
+pack_record_at(const struct pack_map *map, uint32_t offset, uint32_t end)
+{
+   const struct pack_record *rec;
+
+   if (offset < sizeof(struct pack_header) || offset % PACK_RECORD_ALIGN ||
+       (uint64_t)offset + sizeof(*rec) > end)
+      return NULL;
+
+   rec = (const struct pack_record *)(map->data + offset);
+   if ((uint64_t)offset + sizeof(*rec) + rec->size > end)
+      return NULL;
+
+   return rec;
+}
+
+/* Returns how far records in the mapping can be read, or 0 if the index has
+ * moved on to another generation of the pack or the mapping needs to grow.
+ *
+ * Compaction resets the end before bumping the generation, so seeing the
+ * same generation on both sides of reading the end guarantees it belongs to
+ * the file that is mapped.
+ */
+static uint32_t
+pack_committed_end(struct disk_cache_pack *pack, const struct pack_map *map)
+{
+   uint32_t generation = p_atomic_read(&pack->index->generation);
+   uint32_t end = p_atomic_read(&pack->index->end);
+
+   if (generation != map->generation ||
+       p_atomic_read(&pack->index->generation) != generation)
+      return 0;
+
+   /* Processes with a larger maximum size may append past ours. */
+   if (end > map->size && map->size < pack->max_size)
+      return 0;
+
+   return MIN2(end, map->size);
+}
+
+static struct pack_slot *
+pack_lookup(struct disk_cache_pack *pack, const struct pack_map *map,
+            uint32_t end, const uint8_t *key,
+            const struct pack_record **out_rec)
+{
+   uint32_t hint = pack_key_hint(key);
+
+   for (unsigned i = 0; i < PACK_INDEX_MAX_PROBES; i++) {
+      struct pack_slot *slot =
+         &pack->index->slots[(hint + i) & (PACK_INDEX_SLOTS - 1)];
+      uint32_t offset = p_atomic_read(&slot->offset);
+
+      if (offset == PACK_SLOT_EMPTY)
+         break;
+
+      if (p_atomic_read(&slot->hint) != hint)
+         continue;
+
+      /* The slot may be rewritten under us, the key check catches it. */
+      const struct pack_record *rec = pack_record_at(map, offset, end);
+      if (rec && memcmp(rec->key, key, CACHE_KEY_SIZE) == 0) {
+         *out_rec = rec;
+         return slot;
+      }
+   }
+
+   return NULL;
+}
+
+/* Returns the slot holding key, or else the first free one along its probe
+ * sequence. Called with the locks held.
+ */
+static struct pack_slot *
+pack_find_slot_locked(struct disk_cache_pack *pack, const uint8_t *key,
+                      uint32_t end)
+{
+   uint32_t hint = pack_key_hint(key);
+   struct pack_slot *free_slot = NULL;
+
+   for (unsigned i = 0; i < PACK_INDEX_MAX_PROBES; i++) {
+      struct pack_slot *slot =
+         &pack->index->slots[(hint + i) & (PACK_INDEX_SLOTS - 1)];
+
+      if (slot->offset == PACK_SLOT_EMPTY)
+         return free_slot ? free_slot : slot;
+
+      if (slot->offset == PACK_SLOT_REMOVED) {
+         if (!free_slot)
+            free_slot = slot;
+         continue;
+      }
+
+      const struct pack_record *rec =
+         pack_record_at(pack->map, slot->offset, end);
+      if (slot->hint == hint && rec &&
+          memcmp(rec->key, key, CACHE_KEY_SIZE) == 0)
+         return slot;
+   }
+
+   return free_slot;
+}
+
+static void
+pack_set_slot_locked(struct disk_cache_pack *pack, struct pack_slot *slot,
+                     const uint8_t *key, uint32_t offset, uint32_t stamp)
+{
+   if (slot->offset == PACK_SLOT_EMPTY)
+      pack->index->nr_entries++;
+
+   p_atomic_set(&slot->hint, pack_key_hint(key));
+   p_atomic_set(&slot->stamp, stamp);
+   p_atomic_set(&slot->offset, offset);
+}
+
+static bool
+pack_write_at(int fd, const void *buf, size_t count, off_t offset)
+{
+   const uint8_t *out = buf;
+   ssize_t written;
+
+   for (; count; count -= written) {
+      written = pwrite(fd, out, count, offset);
+      if (written == -1)
+         return false;
+
+      out += written;
+      offset += written;
+   }
+
+   return true;
+}
+
+/* Unmaps the replaced mappings if no pointer into them is held. Called with
+ * the mutex held.
+ *
+ * A lookup counts itself in readers before it loads the current mapping, and
+ * mappings are retired after the current one is replaced, so a lookup that
+ * starts after the check can only get the new mapping.
+ */
+static void
+pack_reclaim_locked(struct disk_cache_pack *pack)
+{
+   struct pack_map *map = pack->retired;
+
+   if (!map || p_atomic_cmpxchg(&pack->readers, 0, 0) != 0)
+      return;
+
+   p_atomic_set(&pack->retired, NULL);
+
+   while (map) {
+      struct pack_map *next = map->next;
+
+      munmap((void *)map->data, map->size);
+      free(map);
+      map = next;
+   }
+}
+
+/* Makes a mapping of fd the current one. Called with the locks held. */
+static bool
+pack_map_install(struct disk_cache_pack *pack, int fd, uint32_t generation)
+{
+   struct pack_map *map, *old;
+   uint64_t size;
+   struct stat sb;
+
+   if (fstat(fd, &sb) == -1)
+      return false;
+
+   /* Leave room to append without remapping every time. Nothing past the
+    * committed end is ever read.
+    */
+   size = MAX2(util_next_power_of_two64(sb.st_size), PACK_MIN_MAP_SIZE);
+   size = MIN2(size, pack->max_size);
+
+   map = malloc(sizeof(*map));
+   if (!map)
+      return false;
+
+   void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+   if (data == MAP_FAILED) {
+      free(map);
+      return false;
+   }
+
+   map->data = data;
+   map->size = size;
+   map->generation = generation;
+   map->next = NULL;
+
+   if (pack->fd != -1 && pack->fd != fd)
+      close(pack->fd);
+   pack->fd = fd;
+
+   old = p_atomic_xchg(&pack->map, map);
+   if (old) {
+      old->next = pack->retired;
+      p_atomic_set(&pack->retired, old);
+      pack_reclaim_locked(pack);
+   }
+
+   return true;
+}
+
+/* Writes a pack holding only a header to the temporary file, and returns
+ * it open. Called with the locks held.
+ */
+static int
+pack_create_locked(struct disk_cache_pack *pack, uint32_t generation)
+{
+   struct pack_header header = {
+      .magic = PACK_MAGIC,
+      .version = PACK_VERSION,
+      .generation = generation,
+   };
+   int fd;
+
+   fd = open(pack->tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (fd == -1)
+      return -1;
+
+   if (!pack_write_at(fd, &header, sizeof(header), 0)) {
+      unlink(pack->tmp_path);
+      close(fd);
+      return -1;
+   }
+
+   return fd;
+}
+
+/* Starts the index over with the records of the current mapping, dropping
+ * whatever follows the last intact one. This is how an index that is new,
+ * or was left behind by a writer that died, gets back in sync with the
+ * pack. Called with the locks held.
+ */
+static void
+pack_rebuild_index_locked(struct disk_cache_pack *pack)
+{
+   struct pack_index *index = pack->index;
+   const struct pack_map *map = pack->map;
+   uint32_t end = sizeof(struct pack_header);
+   uint64_t file_size = 0;
+   struct stat sb;
+
+   if (fstat(pack->fd, &sb) == 0)
+      file_size = sb.st_size;
+
+   uint32_t size = MIN2(file_size, map->size);
+
+   p_atomic_set(&index->end, sizeof(struct pack_header));
+   p_atomic_set(&index->generation, map->generation);
+   memset(index->slots, 0, sizeof(index->slots));
+   index->nr_entries = 0;
+
+   for (;;) {
+      const struct pack_record *rec = pack_record_at(map, end, size);
+      if (!rec || util_hash_crc32(rec + 1, rec->size) != rec->crc32)
+         break;
+
+      struct pack_slot *slot = pack_find_slot_locked(pack, rec->key, end);
+      if (!slot || index->nr_entries >= PACK_INDEX_MAX_ENTRIES)
+         break;
+
+      pack_set_slot_locked(pack, slot, rec->key, end, 0);
+      end += pack_record_size(rec->size);
+   }
+
+   /* Drop a record that was cut short. Records we can't map may be fine
+    * for processes with a larger maximum size, leave them alone.
+    */
+   if (end < file_size && file_size <= map->size &&
+       ftruncate(pack->fd, end) == -1)
+      end = sizeof(struct pack_header);
+
+   p_atomic_set(&index->end, end);
+}
+
+/* Makes sure the current mapping is of the pack that the index refers to.
+ * Called with the locks held.
+ */
+static bool
+pack_sync_locked(struct disk_cache_pack *pack)
+{
+   struct pack_header header;
+   int fd;
+
+   if (pack->map && pack->map->generation == pack->index->generation) {
+      if (pack->map->size >= pack->index->end ||
+          pack->map->size == pack->max_size)
+         return true;
+
+      /* Same file, grown past the mapping. */
+      return pack_map_install(pack, pack->fd, pack->map->generation);
+   }
+
+   fd = open(pack->pack_path, O_RDWR | O_CLOEXEC);
+   if (fd == -1 && errno != ENOENT)
+      return false;
+
+   if (fd == -1 ||
+       pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+       header.magic != PACK_MAGIC || header.version != PACK_VERSION) {
+      /* New or unusable pack, start an empty one. Processes of another
+       * version may be reading the old one, so it is replaced rather than
+       * truncated. Its generation differs from the index's, so the index
+       * gets rebuilt below.
+       */
+      if (fd != -1)
+         close(fd);
+
+      header.generation = pack->index->generation + 1;
+      fd = pack_create_locked(pack, header.generation);
+      if (fd == -1)
+         return false;
+
+      if (rename(pack->tmp_path, pack->pack_path) == -1) {
+         unlink(pack->tmp_path);
+         close(fd);
+         return false;
+      }
+   }
+
+   if (!pack_map_install(pack, fd, header.generation)) {
+      close(fd);
+      return false;
+   }
+
+   if (header.generation != pack->index->generation)
+      pack_rebuild_index_locked(pack);
+
+   return true;
+}
+
+static bool
+pack_lock(struct disk_cache_pack *pack)
+{
+   mtx_lock(&pack->mutex);
+
+   if (flock(pack->index_fd, LOCK_EX) == -1) {
+      mtx_unlock(&pack->mutex);
+      return false;
+   }
+
+   if (!pack_sync_locked(pack)) {
+      flock(pack->index_fd, LOCK_UN);
+      mtx_unlock(&pack->mutex);
+      return false;
+   }
+
+   return true;
+}
+
+static void
+pack_unlock(struct disk_cache_pack *pack)
+{
+   flock(pack->index_fd, LOCK_UN);
+   mtx_unlock(&pack->mutex);
+}
+
+struct pack_live_record {
+   uint32_t offset;
+   uint32_t size;
+   uint32_t stamp;
+};
+
+static int
+compare_live_records(const void *a, const void *b)
+{
+   const struct pack_live_record *ra = a, *rb = b;
+
+   /* Most recently used first */
+   if (ra->stamp != rb->stamp)
+      return ra->stamp > rb->stamp ? -1 : 1;
+
+   return ra->offset > rb->offset ? -1 : ra->offset < rb->offset;
+}
+
+/* Returns how many bytes of records a compaction keeps to make room for size
+ * more. At most half of the pack is kept so that compactions don't follow
+ * each other closely.
+ */
+static uint32_t
+pack_budget(struct disk_cache_pack *pack, size_t size)
+{
+   uint32_t avail = pack->max_size - sizeof(struct pack_header);
+
+   if (size >= avail)
+      return 0;
+
+   return MIN2(avail / 2, avail - size);
+}
+
+/* Copies the most recently used records that fit in budget to a new pack,
+ * renames it over the old one and rebuilds the index for it. Called with
+ * the locks held.
+ */
+static bool
+pack_compact_locked(struct disk_cache_pack *pack, uint32_t budget)
+{
+   struct pack_index *index = pack->index;
+   const struct pack_map *map = pack->map;
+   uint32_t end = MIN2(index->end, map->size);
+   struct pack_live_record *live;
+   unsigned nr_live = 0, nr_kept = 0;
+   bool ret = false;
+
+   live = malloc(MAX2(index->nr_entries, 1) * sizeof(*live));
+   if (!live)
+      return false;
+
+   for (unsigned i = 0; i < PACK_INDEX_SLOTS && nr_live < index->nr_entries;
+        i++) {
+      const struct pack_slot *slot = &index->slots[i];
+      const struct pack_record *rec = pack_record_at(map, slot->offset, end);
+      if (!rec)
+         continue;
+
+      live[nr_live].offset = slot->offset;
+      live[nr_live].size = pack_record_size(rec->size);
+      live[nr_live].stamp = slot->stamp;
+      nr_live++;
+   }
+
+   qsort(live, nr_live, sizeof(*live), compare_live_records);
+
+   uint32_t generation = index->generation + 1;
+   int fd = pack_create_locked(pack, generation);
+   if (fd == -1)
+      goto out;
+
+   uint32_t new_end = sizeof(struct pack_header);
+   for (unsigned i = 0; i < nr_live; i++) {
+      if (new_end - sizeof(struct pack_header) + live[i].size > budget)
+         continue;
+
+      if (!pack_write_at(fd, map->data + live[i].offset, live[i].size,
+                         new_end))
+         goto fail;
+
+      live[nr_kept].offset = new_end;
+      live[nr_kept].stamp = live[i].stamp;
+      nr_kept++;
+
+      new_end += live[i].size;
+   }
+
+   if (rename(pack->tmp_path, pack->pack_path) == -1)
+      goto fail;
+
+   /* From here on the old records are gone for everyone. Hide them before
+    * switching generations, see pack_committed_end().
+    */
+   p_atomic_set(&index->end, sizeof(struct pack_header));
+   p_atomic_set(&index->generation, generation);
+   memset(index->slots, 0, sizeof(index->slots));
+   index->nr_entries = 0;
+
+   if (!pack_map_install(pack, fd, generation)) {
+      /* The index is now empty and of a pack we couldn't map, the next
+       * pack_sync_locked() retries.
+       */
+      close(fd);
+      goto out;
+   }
+
+   for (unsigned i = 0; i < nr_kept; i++) {
+      const struct pack_record *rec =
+         pack_record_at(pack->map, live[i].offset, new_end);
+      struct pack_slot *slot = pack_find_slot_locked(pack, rec->key, new_end);
+
+      if (slot)
+         pack_set_slot_locked(pack, slot, rec->key, live[i].offset,
+                              live[i].stamp);
+   }
+
+   p_atomic_set(&index->end, new_end);
+   ret = true;
+   goto out;
+
+ fail:
+   unlink(pack->tmp_path);
+   close(fd);
+ out:
+   free(live);
+   return ret;
+}
+
+/* Creates an empty index and renames it over path, returning it open and
+ * locked. Called with the old index locked.
+ */
+static int
+pack_replace_index(const char *path)
+{
+   /* The magic and version lead the index, the rest starts out zero. */
+   const uint32_t header[2] = { PACK_MAGIC, PACK_VERSION };
+   char *tmp_path;
+   int fd;
+
+   if (asprintf(&tmp_path, "%s.XXXXXX", path) == -1)
+      return -1;
+
+   fd = mkstemp(tmp_path);
+   if (fd == -1) {
+      free(tmp_path);
+      return -1;
+   }
+
+   if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+       fchmod(fd, 0644) == -1 ||
+       flock(fd, LOCK_EX) == -1 ||
+       ftruncate(fd, sizeof(struct pack_index)) == -1 ||
+       !pack_write_at(fd, header, sizeof(header), 0) ||
+       rename(tmp_path, path) == -1) {
+      unlink(tmp_path);
+      close(fd);
+      fd = -1;
+   }
+
+   free(tmp_path);
+   return fd;
+}
+
+/* Opens, locks and maps the index at path. Other processes read it without
+ * locking, so one of another version or a different layout is replaced
+ * rather than reset in place.
+ */
+static bool
+pack_open_index(struct disk_cache_pack *pack, const char *path)
+{
+   struct stat sb, path_sb;
+
+   for (;;) {
+      pack->index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (pack->index_fd == -1)
+         return false;
+
+      if (flock(pack->index_fd, LOCK_EX) == -1 ||
+          fstat(pack->index_fd, &sb) == -1 || stat(path, &path_sb) == -1)
+         return false;
+
+      /* Replaced while we were waiting for the lock. */
+      if (sb.st_dev == path_sb.st_dev && sb.st_ino == path_sb.st_ino)
+         break;
+
+      close(pack->index_fd);
+   }
+
+   /* Nobody maps an index before it has its full size, so a new one can
+    * be set up in place.
+    */
+   if (sb.st_size == 0) {
+      if (ftruncate(pack->index_fd, sizeof(struct pack_index)) == -1)
+         return false;
+      sb.st_size = sizeof(struct pack_index);
+   }
+
+   if (sb.st_size == sizeof(struct pack_index)) {
+      pack->index = mmap(NULL, sizeof(struct pack_index),
+                         PROT_READ | PROT_WRITE, MAP_SHARED,
+                         pack->index_fd, 0);
+      if (pack->index == MAP_FAILED) {
+         pack->index = NULL;
+         return false;
+      }
+
+      if (pack->index->magic == PACK_MAGIC &&
+          pack->index->version == PACK_VERSION)
+         return true;
+
+      /* Fresh from the truncate above. No pack has generation 0, so this
+       * gets rebuilt from the pack.
+       */
+      if (pack->index->magic == 0 && pack->index->version == 0 &&
+          pack->index->generation == 0) {
+         pack->index->magic = PACK_MAGIC;
+         pack->index->version = PACK_VERSION;
+         return true;
+      }
+
+      munmap(pack->index, sizeof(struct pack_index));
+      pack->index = NULL;
+   }
+
+   int fd = pack_replace_index(path);
+   if (fd == -1)
+      return false;
+
+   close(pack->index_fd);
+   pack->index_fd = fd;
+
+   pack->index = mmap(NULL, sizeof(struct pack_index),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, pack->index_fd, 0);
+   if (pack->index == MAP_FAILED) {
+      pack->index = NULL;
+      return false;
+   }
+
+   return true;
+}
+
+struct disk_cache_pack *
+disk_cache_pack_open(const char *path, uint64_t max_size)
+{
+   struct disk_cache_pack *pack;
+   char *index_path;
+   bool opened;
+
+   pack = calloc(1, sizeof(*pack));
+   if (!pack)
+      return NULL;
+
+   mtx_init(&pack->mutex, mtx_plain);
+   pack->index_fd = -1;
+   pack->fd = -1;
+   pack->max_size = MIN2(max_size, PACK_MAX_SIZE);
+
+   if (pack->max_size <= sizeof(struct pack_header))
+      goto fail;
+
+   if (asprintf(&pack->pack_path, "%s/pack", path) == -1) {
+      pack->pack_path = NULL;
+      goto fail;
+   }
+
+   if (asprintf(&pack->tmp_path, "%s/pack.tmp", path) == -1) {
+      pack->tmp_path = NULL;
+      goto fail;
+   }
+
+   if (asprintf(&index_path, "%s/pack.idx", path) == -1)
+      goto fail;
+
+   opened = pack_open_index(pack, index_path);
+   free(index_path);
+
+   if (!opened || !pack_sync_locked(pack)) {
+      if (pack->index_fd != -1)
+         flock(pack->index_fd, LOCK_UN);
+      goto fail;
+   }
+
+   flock(pack->index_fd, LOCK_UN);
+
+   return pack;
+
+ fail:
+   disk_cache_pack_close(pack);
+
+   return NULL;
+}
+
+void
+disk_cache_pack_close(struct disk_cache_pack *pack)
+{
+   struct pack_map *map = pack->map;
+
+   assert(pack->readers == 0);
+
+   if (map)
+      map->next = pack->retired;
+   else
+      map = pack->retired;
+
+   while (map) {
+      struct pack_map *next = map->next;
+
+      munmap((void *)map->data, map->size);
+      free(map);
+      map = next;
+   }
+
+   if (pack->fd != -1)
+      close(pack->fd);
+   if (pack->index)
+      munmap(pack->index, sizeof(*pack->index));
+   if (pack->index_fd != -1)
+      close(pack->index_fd);
+
+   mtx_destroy(&pack->mutex);
+   free(pack->pack_path);
+   free(pack->tmp_path);
+   free(pack);
+}
+
+const void *
+disk_cache_pack_get(struct disk_cache_pack *pack, const cache_key key,
+                    size_t *size)
+{
+   const struct pack_record *rec;
+   struct pack_map *map;
+   struct pack_slot *slot;
+   uint32_t end;
+
+   /* Keep the mapping from being unmapped, see pack_reclaim_locked(). */
+   p_atomic_inc(&pack->readers);
+   map = p_atomic_read(&pack->map);
+
+   end = pack_committed_end(pack, map);
+   if (!end) {
+      /* Another process compacted or grew the pack. */
+      if (!pack_lock(pack))
+         goto fail;
+      map = pack->map;
+      pack_unlock(pack);
+
+      end = pack_committed_end(pack, map);
+      if (!end)
+         goto fail;
+   }
+
+   slot = pack_lookup(pack, map, end, key, &rec);
+   if (!slot)
+      goto fail;
+
+   p_atomic_set(&slot->stamp, p_atomic_inc_return(&pack->index->clock));
+
+   *size = rec->size;
+   return rec + 1;
+
+ fail:
+   disk_cache_pack_release(pack);
+   return NULL;
+}
+
+void
+disk_cache_pack_release(struct disk_cache_pack *pack)
+{
+   if (p_atomic_dec_zero(&pack->readers) && p_atomic_read(&pack->retired)) {
+      mtx_lock(&pack->mutex);
+      pack_reclaim_locked(pack);
+      mtx_unlock(&pack->mutex);
+   }
+}
+
+bool
+disk_cache_pack_put(struct disk_cache_pack *pack, const cache_key key,
+                    const void *data, size_t size)
+{
+   static const uint8_t zero[PACK_RECORD_ALIGN];
+   struct pack_index *index = pack->index;
+   struct pack_record rec;
+   struct pack_slot *slot;
+   uint32_t record_size, end;
+   bool ret = false;
+
+   if ((uint64_t)size + sizeof(struct pack_header) + sizeof(rec) +
+       PACK_RECORD_ALIGN > pack->max_size)
+      return false;
+
+   record_size = pack_record_size(size);
+
+   if (!pack_lock(pack))
+      return false;
+
+   end = index->end;
+   slot = pack_find_slot_locked(pack, key, end);
+
+   if (!slot || (uint64_t)end + record_size > pack->max_size ||
+       index->nr_entries >= PACK_INDEX_MAX_ENTRIES) {
+      if (!pack_compact_locked(pack, pack_budget(pack, record_size)))
+         goto out;
+
+      end = index->end;
+      slot = pack_find_slot_locked(pack, key, end);
+      if (!slot || (uint64_t)end + record_size > pack->max_size)
+         goto out;
+   }
+
+   memcpy(rec.key, key, CACHE_KEY_SIZE);
+   rec.size = size;
+   rec.crc32 = util_hash_crc32(data, size);
+   rec.pad = 0;
+
+   if (!pack_write_at(pack->fd, &rec, sizeof(rec), end) ||
+       !pack_write_at(pack->fd, data, size, end + sizeof(rec)) ||
+       !pack_write_at(pack->fd, zero, record_size - sizeof(rec) - size,
+                      end + sizeof(rec) + size))
+      goto out;
+
+   /* The slot points past the committed end until the end moves, so
+    * readers can't see the record before it's complete.
+    */
+   pack_set_slot_locked(pack, slot, key, end,
+                        p_atomic_inc_return(&index->clock));
+   p_atomic_set(&index->end, end + record_size);
+   ret = true;
+
+ out:
+   pack_unlock(pack);
+   return ret;
+}
+
+void
+disk_cache_pack_remove(struct disk_cache_pack *pack, const cache_key key)
+{
+   const struct pack_record *rec;
+   struct pack_slot *slot;
+
+   if (!pack_lock(pack))
+      return;
+
+   slot = pack_lookup(pack, pack->map, pack_committed_end(pack, pack->map),
+                      key, &rec);
+   if (slot)
+      p_atomic_set(&slot->offset, PACK_SLOT_REMOVED);
+
+   pack_unlock(pack);
+}
+
+void
+disk_cache_pack_evict(struct disk_cache_pack *pack, size_t size)
+{
+   if (!pack_lock(pack))
+      return;
+
+   pack_compact_locked(pack, pack_budget(pack, size));
+
+   pack_unlock(pack);
+}
+
+uint64_t
+disk_cache_pack_size(struct disk_cache_pack *pack)
+{
+   return p_atomic_read(&pack->index->end) - sizeof(struct pack_header);
+}
+
+#endif /* ENABLE_SHADER_CACHE */
@@ -0,0 +1,104 @@
+/*
+ * Copyright © 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef DISK_CACHE_PACK_H
+#define DISK_CACHE_PACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "disk_cache.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Single-file storage for the shader cache: entries are appended to one
+ * pack file and found through a memory-mapped hash index, both shared by
+ * every process using the cache directory.
+ */
+struct disk_cache_pack;
+
+/**
+ * Open (creating them if needed) the pack and index files in the directory
+ * \p path. The pack never grows past \p max_size bytes.
+ *
+ * Returns NULL on failure.
+ */
+struct disk_cache_pack *
+disk_cache_pack_open(const char *path, uint64_t max_size);
+
+void
+disk_cache_pack_close(struct disk_cache_pack *pack);
+
+/**
+ * Look up the entry stored for \p key.
+ *
+ * This takes no lock and makes no system call in the common case. The
+ * returned pointer is into the pack mapping and stays valid until
+ * disk_cache_pack_release() is called, even if the entry is evicted
+ * meanwhile.
+ *
+ * Returns NULL if there is no such entry.
+ */
+const void *
+disk_cache_pack_get(struct disk_cache_pack *pack, const cache_key key,
+                    size_t *size);
+
+/**
+ * Give up the pointer returned by a successful disk_cache_pack_get().
+ */
+void
+disk_cache_pack_release(struct disk_cache_pack *pack);
+
+/**
+ * Append an entry for \p key, replacing any previous one. Compacts the pack
+ * first if the entry doesn't fit.
+ */
+bool
+disk_cache_pack_put(struct disk_cache_pack *pack, const cache_key key,
+                    const void *data, size_t size);
+
+void
+disk_cache_pack_remove(struct disk_cache_pack *pack, const cache_key key);
+
+/**
+ * Compact the pack, keeping the most recently used entries, so that \p size
+ * more bytes fit within the maximum size.
+ */
+void
+disk_cache_pack_evict(struct disk_cache_pack *pack, size_t size);
+
+/**
+ * Return the number of bytes used by records in the pack, including those of
+ * removed or replaced entries that the next compaction will drop.
+ */
+uint64_t
+disk_cache_pack_size(struct disk_cache_pack *pack);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DISK_CACHE_PACK_H */
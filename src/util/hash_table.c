@@ -45,6 +45,7 @@
 #include <assert.h>
 
 #include "hash_table.h"
+#include "swiss_table.h"
 #include "ralloc.h"
 #include "macros.h"
 #include "main/hash.h"
@@ -550,28 +551,12 @@ _mesa_key_pointer_equal(const void *a, const void *b)
 /**
  * Hash table wrapper which supports 64-bit keys.
  *
+ * The keys are stored inline in a swiss_table_u64, so any value can be used
+ * as a key and inserting doesn't allocate per entry.
+ *
  * TODO: unify all hash table implementations.
  */
 
-struct hash_key_u64 {
-   uint64_t value;
-};
-
-static uint32_t
-key_u64_hash(const void *key)
-{
-   return _mesa_hash_data(key, sizeof(struct hash_key_u64));
-}
-
-static bool
-key_u64_equals(const void *a, const void *b)
-{
-   const struct hash_key_u64 *aa = a;
-   const struct hash_key_u64 *bb = b;
-
-   return aa->value == bb->value;
-}
-
 struct hash_table_u64 *
 _mesa_hash_table_u64_create(void *mem_ctx)
 {
@@ -581,20 +566,19 @@ _mesa_hash_table_u64_create(void *mem_ctx)
    if (!ht)
       return NULL;
 
-   if (sizeof(void *) == 8) {
-      ht->table = _mesa_hash_table_create(mem_ctx, _mesa_hash_pointer,
-                                          _mesa_key_pointer_equal);
-   } else {
-      ht->table = _mesa_hash_table_create(mem_ctx, key_u64_hash,
-                                          key_u64_equals);
+   ht->table = _mesa_swiss_table_u64_create(mem_ctx);
+   if (!ht->table) {
+      free(ht);
+      return NULL;
    }
 
-   if (ht->table)
-      _mesa_hash_table_set_deleted_key(ht->table, uint_key(DELETED_KEY_VALUE));
-
    return ht;
 }
 
+/**
+ * Frees the table.  The entries passed to delete_function have the key cast
+ * to a pointer, and no hash.
+ */
 void
 _mesa_hash_table_u64_destroy(struct hash_table_u64 *ht,
                              void (*delete_function)(struct hash_entry *entry))
@@ -602,22 +586,18 @@ _mesa_hash_table_u64_destroy(struct hash_table_u64 *ht,
    if (!ht)
       return;
 
-   if (ht->deleted_key_data) {
-      if (delete_function) {
-         struct hash_table *table = ht->table;
-         struct hash_entry deleted_entry;
-
-         /* Create a fake entry for the delete function. */
-         deleted_entry.hash = table->key_hash_function(table->deleted_key);
-         deleted_entry.key = table->deleted_key;
-         deleted_entry.data = ht->deleted_key_data;
+   if (delete_function) {
+      swiss_table_u64_foreach(ht->table, u64_entry) {
+         struct hash_entry entry = {
+            .key = (void *)(uintptr_t)u64_entry->key,
+            .data = u64_entry->data,
+         };
 
-         delete_function(&deleted_entry);
+         delete_function(&entry);
       }
-      ht->deleted_key_data = NULL;
    }
 
-   _mesa_hash_table_destroy(ht->table, delete_function);
+   _mesa_swiss_table_u64_destroy(ht->table);
    free(ht);
 }
 
@@ -625,44 +605,15 @@ void
 _mesa_hash_table_u64_insert(struct hash_table_u64 *ht, uint64_t key,
                             void *data)
 {
-   if (key == DELETED_KEY_VALUE) {
-      ht->deleted_key_data = data;
-      return;
-   }
-
-   if (sizeof(void *) == 8) {
-      _mesa_hash_table_insert(ht->table, (void *)(uintptr_t)key, data);
-   } else {
-      struct hash_key_u64 *_key = CALLOC_STRUCT(hash_key_u64);
-
-      if (!_key)
-         return;
-      _key->value = key;
-
-      _mesa_hash_table_insert(ht->table, _key, data);
-   }
-}
-
-static struct hash_entry *
-hash_table_u64_search(struct hash_table_u64 *ht, uint64_t key)
-{
-   if (sizeof(void *) == 8) {
-      return _mesa_hash_table_search(ht->table, (void *)(uintptr_t)key);
-   } else {
-      struct hash_key_u64 _key = { .value = key };
-      return _mesa_hash_table_search(ht->table, &_key);
-   }
+   _mesa_swiss_table_u64_insert(ht->table, key, data);
 }
 
 void *
 _mesa_hash_table_u64_search(struct hash_table_u64 *ht, uint64_t key)
 {
-   struct hash_entry *entry;
+   struct swiss_entry_u64 *entry;
 
-   if (key == DELETED_KEY_VALUE)
-      return ht->deleted_key_data;
-
-   entry = hash_table_u64_search(ht, key);
+   entry = _mesa_swiss_table_u64_search(ht->table, key);
    if (!entry)
       return NULL;
 
@@ -672,23 +623,6 @@ _mesa_hash_table_u64_search(struct hash_table_u64 *ht, uint64_t key)
 void
 _mesa_hash_table_u64_remove(struct hash_table_u64 *ht, uint64_t key)
 {
-   struct hash_entry *entry;
-
-   if (key == DELETED_KEY_VALUE) {
-      ht->deleted_key_data = NULL;
-      return;
-   }
-
-   entry = hash_table_u64_search(ht, key);
-   if (!entry)
-      return;
-
-   if (sizeof(void *) == 8) {
-      _mesa_hash_table_remove(ht->table, entry);
-   } else {
-      struct hash_key *_key = (struct hash_key *)entry->key;
-
-      _mesa_hash_table_remove(ht->table, entry);
-      free(_key);
-   }
+   _mesa_swiss_table_u64_remove(ht->table,
+                                _mesa_swiss_table_u64_search(ht->table, key));
 }
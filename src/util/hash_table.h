@@ -167,8 +167,7 @@ hash_table_call_foreach(struct hash_table *ht,
  * Hash table wrapper which supports 64-bit keys.
  */
 struct hash_table_u64 {
-   struct hash_table *table;
-   void *deleted_key_data;
+   struct swiss_table_u64 *table;
 };
 
 struct hash_table_u64 *
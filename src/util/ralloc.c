@@ -35,6 +35,8 @@ _CRTIMP int _vscprintf(const char *format, va_list argptr);
 #endif
 
 #include "ralloc.h"
+#include "os_memory.h"
+#include "swiss_table.h"
 
 #ifndef va_copy
 #ifdef __va_copy
@@ -61,11 +63,6 @@ struct
 #endif
    ralloc_header
 {
-#ifndef NDEBUG
-   /* A canary value used to determine whether a pointer is ralloc'd. */
-   unsigned canary;
-#endif
-
    struct ralloc_header *parent;
 
    /* The first child (head of a linked list) */
@@ -76,6 +73,13 @@ struct
    struct ralloc_header *next;
 
    void (*destructor)(void *);
+
+   /* A canary value used to determine whether a pointer is ralloc'd.  It is
+    * the last word before the allocation and it is even, which is how
+    * allocations from an arena, whose header ends with an odd word, are
+    * told apart.
+    */
+   uintptr_t canary;
 };
 
 typedef struct ralloc_header ralloc_header;
@@ -107,6 +111,431 @@ add_child(ralloc_header *parent, ralloc_header *info)
    }
 }
 
+/***************************************************************************
+ * Arena contexts
+ ***************************************************************************
+ *
+ * Allocations under an arena context are bump-allocated from 64K chunks and
+ * only have a two-word header: the parent and the size.  Chunks are aligned
+ * to their size, so the arena an allocation comes from is found by masking
+ * its address.  The size is stored shifted left with the low bit set, which
+ * tells the header apart from a ralloc_header, whose last word is the even
+ * canary.
+ *
+ * No memory goes back to the system before the whole arena is released.
+ * Destructors live in a hash table rather than in every header, and run
+ * either when the allocation is freed or when the arena context is.
+ *
+ * An allocation stolen out of its arena gets a small proxy allocation under
+ * its new parent.  The proxy keeps the arena alive, and freeing it stands
+ * for freeing the allocation.
+ */
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_LARGE_SIZE (ARENA_CHUNK_SIZE / 4)
+
+/* Flags in the low bits of arena_header::parent. */
+#define ARENA_STOLEN     0x1 /* the parent is a proxy */
+#define ARENA_DESTRUCTOR 0x2 /* there is an entry in arena->destructors */
+#define ARENA_FLAGS      0x3
+
+struct arena_header {
+   uintptr_t parent;
+   uintptr_t size;
+};
+
+struct arena_chunk {
+   struct ralloc_arena *arena;
+   struct arena_chunk *next;
+};
+
+struct ralloc_arena {
+   struct arena_chunk *chunks;
+   char *next;
+   char *end;
+
+   /* One for the context plus one per proxy. */
+   unsigned refcount;
+   unsigned num_stolen;
+
+   struct swiss_table *destructors;
+
+   /* Heap allocations stolen under arena allocations are kept in heap_ctx
+    * until the arena is released.  heap_parents maps them to the allocation
+    * ralloc_parent() should return.
+    */
+   void *heap_ctx;
+   struct swiss_table *heap_parents;
+};
+
+struct arena_proxy {
+   void *block;
+};
+
+#define ARENA_HEADER(ptr) ((struct arena_header *) (ptr) - 1)
+#define ARENA_PARENT(info) ((void *) ((info)->parent & ~(uintptr_t) ARENA_FLAGS))
+
+static void arena_context_destroy(void *ptr);
+
+static inline bool
+is_arena_block(const void *ptr)
+{
+   return ((const uintptr_t *) ptr)[-1] & 1;
+}
+
+static inline struct ralloc_arena *
+arena_of_block(const void *ptr)
+{
+   uintptr_t chunk = (uintptr_t) ptr & ~(uintptr_t) (ARENA_CHUNK_SIZE - 1);
+   return ((struct arena_chunk *) chunk)->arena;
+}
+
+/* Returns the arena that allocations under ctx come from, if any. */
+static inline struct ralloc_arena *
+ctx_arena(const void *ctx)
+{
+   if (is_arena_block(ctx))
+      return arena_of_block(ctx);
+
+   if (get_header(ctx)->destructor == arena_context_destroy)
+      return *(struct ralloc_arena **) ctx;
+
+   return NULL;
+}
+
+static struct arena_header *
+arena_new_chunk(struct ralloc_arena *arena, size_t full_size)
+{
+   bool large = full_size > ARENA_LARGE_SIZE;
+   struct arena_chunk *chunk;
+
+   /* Large allocations get a chunk of their own, which doesn't replace the
+    * one we are allocating from.
+    */
+   chunk = os_malloc_aligned(large ? sizeof(*chunk) + full_size :
+                                     ARENA_CHUNK_SIZE,
+                             ARENA_CHUNK_SIZE);
+   if (unlikely(chunk == NULL))
+      return NULL;
+
+   chunk->arena = arena;
+   chunk->next = arena->chunks;
+   arena->chunks = chunk;
+
+   if (!large) {
+      arena->next = (char *) (chunk + 1) + full_size;
+      arena->end = (char *) chunk + ARENA_CHUNK_SIZE;
+   }
+
+   return (struct arena_header *) (chunk + 1);
+}
+
+static void *
+arena_alloc(struct ralloc_arena *arena, const void *parent, size_t size)
+{
+   struct arena_header *info;
+   size_t full_size;
+
+   if (unlikely(size > SIZE_MAX / 2 - ARENA_CHUNK_SIZE))
+      return NULL;
+
+   full_size = ALIGN_POT(size, sizeof(*info)) + sizeof(*info);
+
+   if (likely(full_size < (size_t) (arena->end - arena->next))) {
+      info = (struct arena_header *) arena->next;
+      arena->next += full_size;
+   } else {
+      info = arena_new_chunk(arena, full_size);
+      if (unlikely(info == NULL))
+         return NULL;
+   }
+
+   info->parent = (uintptr_t) parent;
+   info->size = (uintptr_t) size << 1 | 1;
+   return info + 1;
+}
+
+static void
+arena_release(struct ralloc_arena *arena)
+{
+   struct arena_chunk *chunk, *next;
+
+   /* Whatever is left belonged to allocations that were stolen out. */
+   if (arena->destructors) {
+      swiss_table_foreach(arena->destructors, entry) {
+         void (*destructor)(void *) = (void (*)(void *)) entry->data;
+         void *ptr = (void *) entry->key;
+
+         _mesa_swiss_table_remove(arena->destructors, entry);
+         destructor(ptr);
+      }
+      _mesa_swiss_table_destroy(arena->destructors, NULL);
+   }
+
+   if (arena->heap_ctx) {
+      ralloc_free(arena->heap_ctx);
+      _mesa_swiss_table_destroy(arena->heap_parents, NULL);
+   }
+
+   for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+      next = chunk->next;
+      os_free_aligned(chunk);
+   }
+
+   free(arena);
+}
+
+static void
+arena_unref(struct ralloc_arena *arena)
+{
+   if (--arena->refcount == 0)
+      arena_release(arena);
+}
+
+static void
+arena_call_destructor(struct ralloc_arena *arena, void *ptr)
+{
+   struct arena_header *info = ARENA_HEADER(ptr);
+   struct hash_entry *entry;
+   void (*destructor)(void *);
+
+   if (!(info->parent & ARENA_DESTRUCTOR))
+      return;
+
+   entry = _mesa_swiss_table_search(arena->destructors, ptr);
+   destructor = (void (*)(void *)) entry->data;
+   _mesa_swiss_table_remove(arena->destructors, entry);
+   info->parent &= ~(uintptr_t) ARENA_DESTRUCTOR;
+
+   destructor(ptr);
+}
+
+static void
+arena_set_destructor(void *ptr, void (*destructor)(void *))
+{
+   struct arena_header *info = ARENA_HEADER(ptr);
+   struct ralloc_arena *arena = arena_of_block(ptr);
+
+   if (destructor == NULL) {
+      if (info->parent & ARENA_DESTRUCTOR) {
+         _mesa_swiss_table_remove_key(arena->destructors, ptr);
+         info->parent &= ~(uintptr_t) ARENA_DESTRUCTOR;
+      }
+      return;
+   }
+
+   if (arena->destructors == NULL) {
+      arena->destructors = _mesa_swiss_table_create(NULL, _mesa_hash_pointer,
+                                                    _mesa_key_pointer_equal);
+      if (unlikely(arena->destructors == NULL))
+         return;
+   }
+
+   if (likely(_mesa_swiss_table_insert(arena->destructors, ptr,
+                                       (void *) destructor)))
+      info->parent |= ARENA_DESTRUCTOR;
+}
+
+/* Whether ptr is under an allocation that was stolen out of the arena. */
+static bool
+arena_is_stolen(void *ptr)
+{
+   for (;;) {
+      struct arena_header *info = ARENA_HEADER(ptr);
+
+      if (info->parent & ARENA_STOLEN)
+         return true;
+
+      ptr = ARENA_PARENT(info);
+      if (!is_arena_block(ptr))
+         return false;
+   }
+}
+
+static void
+arena_context_destroy(void *ptr)
+{
+   struct ralloc_arena *arena = *(struct ralloc_arena **) ptr;
+
+   if (arena->destructors) {
+      swiss_table_foreach(arena->destructors, entry) {
+         void *block = (void *) entry->key;
+
+         if (arena->num_stolen == 0 || !arena_is_stolen(block))
+            arena_call_destructor(arena, block);
+      }
+   }
+
+   arena_unref(arena);
+}
+
+static void
+arena_proxy_destroy(void *ptr)
+{
+   void *block = ((struct arena_proxy *) ptr)->block;
+   struct ralloc_arena *arena = arena_of_block(block);
+
+   /* ARENA_STOLEN stays set, so that what is under the block isn't taken
+    * for something under the context any more.
+    */
+   arena_call_destructor(arena, block);
+   arena->num_stolen--;
+   arena_unref(arena);
+}
+
+/* Marks the context that holds heap allocations stolen under the arena. */
+static void
+arena_heap_ctx_destroy(void *ptr)
+{
+   (void) ptr;
+}
+
+static void
+arena_free(void *ptr)
+{
+   struct arena_header *info = ARENA_HEADER(ptr);
+
+   if (info->parent & ARENA_STOLEN)
+      ralloc_free(ARENA_PARENT(info));
+   else
+      arena_call_destructor(arena_of_block(ptr), ptr);
+}
+
+static void
+arena_steal(const void *new_ctx, void *ptr)
+{
+   struct arena_header *info = ARENA_HEADER(ptr);
+   struct ralloc_arena *arena = arena_of_block(ptr);
+   uintptr_t flags = info->parent & ARENA_DESTRUCTOR;
+   struct arena_proxy *proxy;
+
+   if (new_ctx != NULL && ctx_arena(new_ctx) == arena) {
+      /* Moving within the arena, maybe back from somewhere else. */
+      if (info->parent & ARENA_STOLEN) {
+         ralloc_set_destructor(ARENA_PARENT(info), NULL);
+         ralloc_free(ARENA_PARENT(info));
+         arena->num_stolen--;
+         arena_unref(arena);
+      }
+      info->parent = (uintptr_t) new_ctx | flags;
+      return;
+   }
+
+   if (info->parent & ARENA_STOLEN) {
+      ralloc_steal(new_ctx, ARENA_PARENT(info));
+      return;
+   }
+
+   proxy = ralloc_size(new_ctx, sizeof(*proxy));
+   if (unlikely(proxy == NULL))
+      return;
+
+   proxy->block = ptr;
+   ralloc_set_destructor(proxy, arena_proxy_destroy);
+   info->parent = (uintptr_t) proxy | ARENA_STOLEN | flags;
+   arena->refcount++;
+   arena->num_stolen++;
+}
+
+/* Parents a heap allocation, already unlinked, to an arena allocation. */
+static void
+arena_adopt_heap_block(const void *new_ctx, ralloc_header *info)
+{
+   struct ralloc_arena *arena = arena_of_block(new_ctx);
+
+   if (arena->heap_ctx == NULL) {
+      void *heap_ctx = ralloc_size(NULL, sizeof(arena));
+
+      if (unlikely(heap_ctx == NULL))
+         return;
+
+      arena->heap_parents = _mesa_swiss_table_create(NULL, _mesa_hash_pointer,
+                                                     _mesa_key_pointer_equal);
+      if (unlikely(arena->heap_parents == NULL)) {
+         ralloc_free(heap_ctx);
+         return;
+      }
+
+      *(struct ralloc_arena **) heap_ctx = arena;
+      get_header(heap_ctx)->destructor = arena_heap_ctx_destroy;
+      arena->heap_ctx = heap_ctx;
+   }
+
+   if (likely(_mesa_swiss_table_insert(arena->heap_parents,
+                                       PTR_FROM_HEADER(info),
+                                       (void *) new_ctx)))
+      add_child(get_header(arena->heap_ctx), info);
+}
+
+static void *
+arena_resize(void *ptr, size_t size)
+{
+   struct arena_header *info = ARENA_HEADER(ptr);
+   struct ralloc_arena *arena = arena_of_block(ptr);
+   size_t old_size = info->size >> 1;
+   void *new_ptr;
+
+   if (unlikely(size > SIZE_MAX / 2 - ARENA_CHUNK_SIZE))
+      return NULL;
+
+   /* The last allocation can grow or shrink in place. */
+   if ((char *) ptr + ALIGN_POT(old_size, sizeof(*info)) == arena->next &&
+       ALIGN_POT(size, sizeof(*info)) < (size_t) (arena->end - (char *) ptr)) {
+      arena->next = (char *) ptr + ALIGN_POT(size, sizeof(*info));
+      info->size = (uintptr_t) size << 1 | 1;
+      return ptr;
+   }
+
+   if (size <= old_size) {
+      info->size = (uintptr_t) size << 1 | 1;
+      return ptr;
+   }
+
+   new_ptr = arena_alloc(arena, NULL, size);
+   if (unlikely(new_ptr == NULL))
+      return NULL;
+
+   memcpy(new_ptr, ptr, old_size);
+   ARENA_HEADER(new_ptr)->parent = info->parent;
+
+   if (info->parent & ARENA_STOLEN)
+      ((struct arena_proxy *) ARENA_PARENT(info))->block = new_ptr;
+
+   if (info->parent & ARENA_DESTRUCTOR) {
+      struct hash_entry *entry =
+         _mesa_swiss_table_search(arena->destructors, ptr);
+      void *destructor = entry->data;
+
+      _mesa_swiss_table_remove(arena->destructors, entry);
+      _mesa_swiss_table_insert(arena->destructors, new_ptr, destructor);
+   }
+
+   return new_ptr;
+}
+
+void *
+ralloc_arena_context(const void *ctx)
+{
+   struct ralloc_arena *arena = calloc(1, sizeof(*arena));
+   void *ptr;
+
+   if (unlikely(arena == NULL))
+      return NULL;
+
+   ptr = ralloc_size(NULL, sizeof(arena));
+   if (unlikely(ptr == NULL)) {
+      free(arena);
+      return NULL;
+   }
+
+   arena->refcount = 1;
+   *(struct ralloc_arena **) ptr = arena;
+   get_header(ptr)->destructor = arena_context_destroy;
+
+   ralloc_steal(ctx, ptr);
+   return ptr;
+}
+
 void *
 ralloc_context(const void *ctx)
 {
@@ -116,10 +545,18 @@ ralloc_context(const void *ctx)
 void *
 ralloc_size(const void *ctx, size_t size)
 {
-   void *block = malloc(size + sizeof(ralloc_header));
+   void *block;
    ralloc_header *info;
    ralloc_header *parent;
 
+   if (ctx != NULL) {
+      struct ralloc_arena *arena = ctx_arena(ctx);
+
+      if (arena != NULL)
+         return arena_alloc(arena, ctx, size);
+   }
+
+   block = malloc(size + sizeof(ralloc_header));
    if (unlikely(block == NULL))
       return NULL;
 
@@ -138,9 +575,7 @@ ralloc_size(const void *ctx, size_t size)
 
    add_child(parent, info);
 
-#ifndef NDEBUG
    info->canary = CANARY;
-#endif
 
    return PTR_FROM_HEADER(info);
 }
@@ -162,6 +597,9 @@ resize(void *ptr, size_t size)
 {
    ralloc_header *child, *old, *info;
 
+   if (is_arena_block(ptr))
+      return arena_resize(ptr, size);
+
    old = get_header(ptr);
    info = realloc(old, size + sizeof(ralloc_header));
 
@@ -232,6 +670,11 @@ ralloc_free(void *ptr)
    if (ptr == NULL)
       return;
 
+   if (is_arena_block(ptr)) {
+      arena_free(ptr);
+      return;
+   }
+
    info = get_header(ptr);
    unlink_block(info);
    unsafe_free(info);
@@ -282,11 +725,20 @@ ralloc_steal(const void *new_ctx, void *ptr)
    if (unlikely(ptr == NULL))
       return;
 
-   info = get_header(ptr);
-   parent = new_ctx ? get_header(new_ctx) : NULL;
+   if (is_arena_block(ptr)) {
+      arena_steal(new_ctx, ptr);
+      return;
+   }
 
+   info = get_header(ptr);
    unlink_block(info);
 
+   if (new_ctx != NULL && is_arena_block(new_ctx)) {
+      arena_adopt_heap_block(new_ctx, info);
+      return;
+   }
+
+   parent = new_ctx ? get_header(new_ctx) : NULL;
    add_child(parent, info);
 }
 
@@ -298,13 +750,23 @@ ralloc_adopt(const void *new_ctx, void *old_ctx)
    if (unlikely(old_ctx == NULL))
       return;
 
+   /* Allocations in an arena don't keep track of their children. */
+   assert(!is_arena_block(old_ctx) && !ctx_arena(old_ctx));
+
    old_info = get_header(old_ctx);
-   new_info = get_header(new_ctx);
 
    /* If there are no children, bail. */
    if (unlikely(old_info->child == NULL))
       return;
 
+   if (is_arena_block(new_ctx)) {
+      while (old_info->child != NULL)
+         ralloc_steal(new_ctx, PTR_FROM_HEADER(old_info->child));
+      return;
+   }
+
+   new_info = get_header(new_ctx);
+
    /* Set all the children's parent to new_ctx; get a pointer to the last child. */
    for (child = old_info->child; child->next != NULL; child = child->next) {
       child->parent = new_info;
@@ -327,14 +789,39 @@ ralloc_parent(const void *ptr)
    if (unlikely(ptr == NULL))
       return NULL;
 
+   if (is_arena_block(ptr)) {
+      struct arena_header *arena_info = ARENA_HEADER(ptr);
+
+      if (arena_info->parent & ARENA_STOLEN)
+         return ralloc_parent(ARENA_PARENT(arena_info));
+      return ARENA_PARENT(arena_info);
+   }
+
    info = get_header(ptr);
-   return info->parent ? PTR_FROM_HEADER(info->parent) : NULL;
+   if (info->parent == NULL)
+      return NULL;
+
+   if (info->parent->destructor == arena_heap_ctx_destroy) {
+      struct ralloc_arena *arena =
+         *(struct ralloc_arena **) PTR_FROM_HEADER(info->parent);
+      return _mesa_swiss_table_search(arena->heap_parents, ptr)->data;
+   }
+
+   return PTR_FROM_HEADER(info->parent);
 }
 
 void
 ralloc_set_destructor(const void *ptr, void(*destructor)(void *))
 {
-   ralloc_header *info = get_header(ptr);
+   ralloc_header *info;
+
+   if (is_arena_block(ptr)) {
+      arena_set_destructor((void *) ptr, destructor);
+      return;
+   }
+
+   info = get_header(ptr);
+   assert(info->destructor != arena_context_destroy);
    info->destructor = destructor;
 }
 
@@ -91,6 +91,32 @@ extern "C" {
  */
 void *ralloc_context(const void *ctx);
 
+/**
+ * Allocate a new ralloc context whose descendants come from an arena.
+ *
+ * Allocations under an arena context are carved out of large chunks and
+ * have a much smaller header than other ralloc allocations.  Freeing the
+ * context frees them all at once, in time proportional to the number of
+ * chunks.  All of the API works on them as usual, with a few differences:
+ *
+ * - ralloc_free() on one of them runs its destructor, but the memory, and
+ *   anything allocated under it, is only released with the arena.  The
+ *   destructors of its children run when the arena context is freed.
+ *
+ * - They can be stolen out of the arena.  The arena then stays alive until
+ *   they are freed too.
+ *
+ * - A resized allocation (reralloc, ralloc_strcat, ...) may move, so it
+ *   must not have children.
+ *
+ * - ralloc_adopt() can't take the children of an arena allocation or
+ *   context.
+ *
+ * It's meant for things like compiler IR, which is made of many small
+ * allocations that all go away together.
+ */
+void *ralloc_arena_context(const void *ctx);
+
 /**
  * Allocate memory chained off of the given context.
  *
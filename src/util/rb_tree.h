@@ -60,16 +60,40 @@ rb_node_parent(struct rb_node *n)
 
 /** A red-black tree
  *
- * This struct represents the red-black tree itself.  It is just a pointer
- * to the root node with no other metadata.
+ * This struct represents the red-black tree itself.  It is a pointer to the
+ * root node and an optional augment callback.
  */
 struct rb_tree {
     struct rb_node *root;
+
+    /** Recomputes data a node keeps about its subtree, or NULL
+     *
+     * Augmented trees cache something about each subtree in its root node,
+     * such as the largest key in it, to prune searches.  This is called on
+     * a node, after its children, whenever the tree changes below it.
+     */
+    void (*augment)(struct rb_node *node);
 };
 
 /** Initialize a red-black tree */
 void rb_tree_init(struct rb_tree *T);
 
+/** Initialize an augmented red-black tree
+ *
+ * \param   T       The red-black tree to initialize
+ *
+ * \param   augment Recomputes the subtree data of a node from its children
+ */
+void rb_tree_init_augmented(struct rb_tree *T,
+                            void (*augment)(struct rb_node *node));
+
+/** Recompute the subtree data of a node and its ancestors
+ *
+ * Call this after changing what a node in an augmented tree contributes
+ * to its subtree, without moving it.
+ */
+void rb_tree_update_augmented(struct rb_tree *T, struct rb_node *node);
+
 /** Returns true if the red-black tree is empty */
 static inline bool
 rb_tree_is_empty(const struct rb_tree *T)
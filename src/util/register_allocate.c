@@ -80,6 +80,15 @@
 
 #define NO_REG ~0U
 
+/* Graphs with more nodes than this don't get an adjacency bitset, which
+ * would be quadratic in size, and look up edges in the adjacency lists
+ * instead.
+ */
+#define RA_MAX_DENSE_ADJACENCY_NODES 4096
+
+/* How much more an access is assumed to cost for each loop around it. */
+#define RA_LOOP_SPILL_WEIGHT 10.0f
+
 struct ra_reg {
    BITSET_WORD *conflicts;
    unsigned int *conflict_list;
@@ -125,6 +134,9 @@ struct ra_node {
     *
     * List of which nodes this node interferes with.  This should be
     * symmetric with the other node.
+    *
+    * The adjacency bitset is NULL in graphs larger than
+    * RA_MAX_DENSE_ADJACENCY_NODES.
     */
    BITSET_WORD *adjacency;
    unsigned int *adjacency_list;
@@ -151,12 +163,36 @@ struct ra_node {
     */
    unsigned int q_total;
 
+   /* Index in ra_simplify()'s heap, or NO_REG if it isn't there. */
+   unsigned int heap_index;
+
+   /**
+    * The node this one was coalesced into, or NO_REG.  A coalesced node is
+    * left in the stack for good, and its edges are added to the node it
+    * was coalesced into, so the rest of the allocator can ignore it.
+    */
+   unsigned int alias;
+
+   /* Number of moves involving this node that may still be coalesced. */
+   unsigned int num_moves;
+
    /* For an implementation that needs register spilling, this is the
     * approximate cost of spilling this node.
     */
    float spill_cost;
 };
 
+/* A copy between two nodes, which coalescing may remove. */
+struct ra_move {
+   unsigned int n1, n2;
+
+   /* Cleared once the move is coalesced or can't be anymore. */
+   bool active;
+
+   /* Set while it's in ra_simplify()'s list of moves to try. */
+   bool queued;
+};
+
 struct ra_graph {
    struct ra_regs *regs;
    /**
@@ -168,6 +204,10 @@ struct ra_graph {
    unsigned int *stack;
    unsigned int stack_count;
 
+   struct ra_move *moves;
+   unsigned int moves_count;
+   unsigned int moves_size;
+
    /**
     * Tracks the start of the set of optimistically-colored registers in the
     * stack.
@@ -390,10 +430,32 @@ ra_set_finalize(struct ra_regs *regs, unsigned int **q_values)
    }
 }
 
+static bool
+ra_nodes_interfere(struct ra_graph *g, unsigned int n1, unsigned int n2)
+{
+   if (g->nodes[n1].adjacency)
+      return BITSET_TEST(g->nodes[n1].adjacency, n2);
+
+   /* The edges are symmetric, so only walk the shorter list. */
+   if (g->nodes[n1].adjacency_count > g->nodes[n2].adjacency_count) {
+      unsigned int tmp = n1;
+      n1 = n2;
+      n2 = tmp;
+   }
+
+   for (unsigned int i = 0; i < g->nodes[n1].adjacency_count; i++) {
+      if (g->nodes[n1].adjacency_list[i] == n2)
+         return true;
+   }
+
+   return false;
+}
+
 static void
 ra_add_node_adjacency(struct ra_graph *g, unsigned int n1, unsigned int n2)
 {
-   BITSET_SET(g->nodes[n1].adjacency, n2);
+   if (g->nodes[n1].adjacency)
+      BITSET_SET(g->nodes[n1].adjacency, n2);
 
    assert(n1 != n2);
 
@@ -427,8 +489,10 @@ ra_alloc_interference_graph(struct ra_regs *regs, unsigned int count)
    g->stack = rzalloc_array(g, unsigned int, count);
 
    for (i = 0; i < count; i++) {
-      int bitset_count = BITSET_WORDS(count);
-      g->nodes[i].adjacency = rzalloc_array(g, BITSET_WORD, bitset_count);
+      if (count <= RA_MAX_DENSE_ADJACENCY_NODES) {
+         int bitset_count = BITSET_WORDS(count);
+         g->nodes[i].adjacency = rzalloc_array(g, BITSET_WORD, bitset_count);
+      }
 
       g->nodes[i].adjacency_list_size = 4;
       g->nodes[i].adjacency_list =
@@ -437,6 +501,7 @@ ra_alloc_interference_graph(struct ra_regs *regs, unsigned int count)
       g->nodes[i].q_total = 0;
 
       g->nodes[i].reg = NO_REG;
+      g->nodes[i].alias = NO_REG;
    }
 
    return g;
@@ -463,12 +528,40 @@ void
 ra_add_node_interference(struct ra_graph *g,
                          unsigned int n1, unsigned int n2)
 {
-   if (n1 != n2 && !BITSET_TEST(g->nodes[n1].adjacency, n2)) {
+   if (n1 != n2 && !ra_nodes_interfere(g, n1, n2)) {
       ra_add_node_adjacency(g, n1, n2);
       ra_add_node_adjacency(g, n2, n1);
    }
 }
 
+/**
+ * Records that n1 and n2 are the two sides of a copy.  ra_allocate() then
+ * tries to give them the same register, so that the copy can be dropped,
+ * as long as that can't make the graph harder to color.
+ *
+ * Only nodes of the same class without a fixed register are coalesced.
+ * Moves must be added after the interference edges.
+ */
+void
+ra_add_node_move(struct ra_graph *g, unsigned int n1, unsigned int n2)
+{
+   if (n1 == n2)
+      return;
+
+   if (g->moves_count >= g->moves_size) {
+      g->moves_size = MAX2(g->moves_size * 2, 16);
+      g->moves = reralloc(g, g->moves, struct ra_move, g->moves_size);
+   }
+
+   g->moves[g->moves_count].n1 = n1;
+   g->moves[g->moves_count].n2 = n2;
+   g->moves[g->moves_count].active = true;
+   g->moves_count++;
+
+   g->nodes[n1].num_moves++;
+   g->nodes[n2].num_moves++;
+}
+
 static bool
 pq_test(struct ra_graph *g, unsigned int n)
 {
@@ -477,8 +570,241 @@ pq_test(struct ra_graph *g, unsigned int n)
    return g->nodes[n].q_total < g->regs->classes[n_class]->p;
 }
 
+/**
+ * State for ra_simplify().
+ *
+ * Nodes that pass the pq test are marked in the worklist to be pushed on
+ * the stack.  The others are kept in the heap, and move to the worklist as
+ * soon as removing their neighbors makes them pass.  The heap is only
+ * ordered by q_total once an optimistic candidate is first needed, so that
+ * the best one is then found without scanning the graph.  Graphs that color
+ * without optimism never pay for the ordering.
+ *
+ * Nodes that pass the pq test but may still be coalesced wait in the freeze
+ * list instead of being pushed, as in George and Appel's "Iterated Register
+ * Coalescing".
+ */
+struct ra_simplify_state {
+   BITSET_WORD *worklist;
+   unsigned int worklist_count;
+
+   BITSET_WORD *freeze;
+   unsigned int freeze_count;
+
+   unsigned int *heap;
+   unsigned int heap_count;
+   bool heap_ordered;
+
+   /* Moves to try coalescing.  The others wait until one of their nodes
+    * or the nodes' neighbors stop being significant, since the tests can't
+    * pass before that.
+    */
+   unsigned int *moves;
+   unsigned int moves_count;
+
+   /* The moves of each node, moves_of[moves_start[n]...moves_start[n+1]]. */
+   unsigned int *moves_start;
+   unsigned int *moves_of;
+
+   /* Circular list of the nodes coalesced together. */
+   unsigned int *next_coalesced;
+
+   /* Scratch space for the coalescing tests. */
+   unsigned int *mark;
+   unsigned int mark_gen;
+};
+
+/* Ties go to the highest-numbered node, which the former linear scan used
+ * to pick.
+ */
+static bool
+ra_heap_less(struct ra_graph *g, unsigned int n1, unsigned int n2)
+{
+   if (g->nodes[n1].q_total != g->nodes[n2].q_total)
+      return g->nodes[n1].q_total < g->nodes[n2].q_total;
+   return n1 > n2;
+}
+
 static void
-decrement_q(struct ra_graph *g, unsigned int n)
+ra_heap_set(struct ra_graph *g, struct ra_simplify_state *s,
+            unsigned int i, unsigned int n)
+{
+   s->heap[i] = n;
+   g->nodes[n].heap_index = i;
+}
+
+static void
+ra_heap_sift_up(struct ra_graph *g, struct ra_simplify_state *s,
+                unsigned int i)
+{
+   unsigned int n = s->heap[i];
+
+   while (i > 0) {
+      unsigned int parent = (i - 1) / 2;
+
+      if (!ra_heap_less(g, n, s->heap[parent]))
+         break;
+
+      ra_heap_set(g, s, i, s->heap[parent]);
+      i = parent;
+   }
+   ra_heap_set(g, s, i, n);
+}
+
+static void
+ra_heap_sift_down(struct ra_graph *g, struct ra_simplify_state *s,
+                  unsigned int i)
+{
+   unsigned int n = s->heap[i];
+
+   while (true) {
+      unsigned int child = 2 * i + 1;
+
+      if (child >= s->heap_count)
+         break;
+      if (child + 1 < s->heap_count &&
+          ra_heap_less(g, s->heap[child + 1], s->heap[child]))
+         child++;
+      if (!ra_heap_less(g, s->heap[child], n))
+         break;
+
+      ra_heap_set(g, s, i, s->heap[child]);
+      i = child;
+   }
+   ra_heap_set(g, s, i, n);
+}
+
+static void
+ra_heap_remove(struct ra_graph *g, struct ra_simplify_state *s,
+               unsigned int n)
+{
+   unsigned int i = g->nodes[n].heap_index;
+   unsigned int last = s->heap[--s->heap_count];
+
+   g->nodes[n].heap_index = NO_REG;
+   if (last == n)
+      return;
+
+   ra_heap_set(g, s, i, last);
+   if (s->heap_ordered) {
+      ra_heap_sift_up(g, s, i);
+      ra_heap_sift_down(g, s, g->nodes[last].heap_index);
+   }
+}
+
+static unsigned int
+ra_get_alias(struct ra_graph *g, unsigned int n)
+{
+   while (g->nodes[n].alias != NO_REG)
+      n = g->nodes[n].alias;
+   return n;
+}
+
+/* Nodes that aren't in the stack and weren't coalesced away. */
+static bool
+ra_node_is_live(struct ra_graph *g, unsigned int n)
+{
+   return !g->nodes[n].in_stack && g->nodes[n].alias == NO_REG;
+}
+
+/* Queues the moves of n, and of the nodes coalesced into it, to be tried. */
+static void
+ra_enable_moves(struct ra_graph *g, struct ra_simplify_state *s,
+                unsigned int n)
+{
+   unsigned int m = n;
+
+   if (!g->nodes[n].num_moves)
+      return;
+
+   do {
+      for (unsigned int i = s->moves_start[m]; i < s->moves_start[m + 1]; i++) {
+         struct ra_move *move = &g->moves[s->moves_of[i]];
+
+         if (move->active && !move->queued) {
+            move->queued = true;
+            s->moves[s->moves_count++] = s->moves_of[i];
+         }
+      }
+      m = s->next_coalesced[m];
+   } while (m != n);
+}
+
+/* Called when n starts passing the pq test, which may let the moves of n
+ * or its neighbors pass the coalescing tests.
+ */
+static void
+ra_became_insignificant(struct ra_graph *g, struct ra_simplify_state *s,
+                        unsigned int n)
+{
+   if (!g->moves_count)
+      return;
+
+   ra_enable_moves(g, s, n);
+   for (unsigned int i = 0; i < g->nodes[n].adjacency_count; i++) {
+      unsigned int t = g->nodes[n].adjacency_list[i];
+
+      if (ra_node_is_live(g, t))
+         ra_enable_moves(g, s, t);
+   }
+}
+
+static void
+ra_heap_insert(struct ra_graph *g, struct ra_simplify_state *s,
+               unsigned int n)
+{
+   ra_heap_set(g, s, s->heap_count++, n);
+   if (s->heap_ordered)
+      ra_heap_sift_up(g, s, g->nodes[n].heap_index);
+}
+
+static void
+ra_worklist_add(struct ra_simplify_state *s, unsigned int n)
+{
+   BITSET_SET(s->worklist, n);
+   s->worklist_count++;
+}
+
+/* Takes a node out of whichever list ra_simplify() has it in. */
+static void
+ra_simplify_remove(struct ra_graph *g, struct ra_simplify_state *s,
+                   unsigned int n)
+{
+   if (g->nodes[n].heap_index != NO_REG) {
+      ra_heap_remove(g, s, n);
+   } else if (BITSET_TEST(s->worklist, n)) {
+      BITSET_CLEAR(s->worklist, n);
+      s->worklist_count--;
+   } else if (BITSET_TEST(s->freeze, n)) {
+      BITSET_CLEAR(s->freeze, n);
+      s->freeze_count--;
+   }
+}
+
+/* Moves a node between the lists after its q_total changed. */
+static void
+ra_simplify_update(struct ra_graph *g, struct ra_simplify_state *s,
+                   unsigned int n)
+{
+   bool in_heap = g->nodes[n].heap_index != NO_REG;
+
+   if (in_heap == !pq_test(g, n)) {
+      if (in_heap && s->heap_ordered)
+         ra_heap_sift_up(g, s, g->nodes[n].heap_index);
+      return;
+   }
+
+   ra_simplify_remove(g, s, n);
+   if (in_heap) {
+      ra_worklist_add(s, n);
+      ra_became_insignificant(g, s, n);
+   } else {
+      ra_heap_insert(g, s, n);
+   }
+}
+
+static void
+decrement_q(struct ra_graph *g, struct ra_simplify_state *s, unsigned int n)
 {
    unsigned int i;
    int n_class = g->nodes[n].class;
@@ -490,10 +816,255 @@ decrement_q(struct ra_graph *g, unsigned int n)
       if (!g->nodes[n2].in_stack) {
          assert(g->nodes[n2].q_total >= g->regs->classes[n2_class]->q[n_class]);
          g->nodes[n2].q_total -= g->regs->classes[n2_class]->q[n_class];
+
+         if (g->nodes[n2].heap_index != NO_REG) {
+            if (pq_test(g, n2)) {
+               ra_heap_remove(g, s, n2);
+               ra_worklist_add(s, n2);
+               ra_became_insignificant(g, s, n2);
+            } else if (s->heap_ordered) {
+               ra_heap_sift_up(g, s, g->nodes[n2].heap_index);
+            }
+         }
       }
    }
 }
 
+static void
+ra_push_node(struct ra_graph *g, struct ra_simplify_state *s, unsigned int n)
+{
+   decrement_q(g, s, n);
+   g->stack[g->stack_count] = n;
+   g->stack_count++;
+   g->nodes[n].in_stack = true;
+}
+
+static void
+ra_move_deactivate(struct ra_graph *g, struct ra_move *move)
+{
+   move->active = false;
+   g->nodes[ra_get_alias(g, move->n1)].num_moves--;
+   g->nodes[ra_get_alias(g, move->n2)].num_moves--;
+}
+
+/* Gives up on coalescing any move involving n. */
+static void
+ra_freeze_moves(struct ra_graph *g, struct ra_simplify_state *s,
+                unsigned int n)
+{
+   unsigned int m = n;
+
+   do {
+      for (unsigned int i = s->moves_start[m]; i < s->moves_start[m + 1]; i++) {
+         struct ra_move *move = &g->moves[s->moves_of[i]];
+
+         if (move->active)
+            ra_move_deactivate(g, move);
+      }
+      m = s->next_coalesced[m];
+   } while (m != n && g->nodes[n].num_moves);
+}
+
+/* Lets the frozen nodes that have no moves left be pushed. */
+static void
+ra_release_frozen(struct ra_graph *g, struct ra_simplify_state *s)
+{
+   for (unsigned int i = 0; s->freeze_count && i < BITSET_WORDS(g->count);
+        i++) {
+      BITSET_WORD word = s->freeze[i];
+
+      while (word) {
+         unsigned int n = i * BITSET_WORDBITS + u_bit_scan(&word);
+
+         if (!g->nodes[n].num_moves) {
+            BITSET_CLEAR(s->freeze, n);
+            s->freeze_count--;
+            ra_worklist_add(s, n);
+         }
+      }
+   }
+}
+
+/* Whether a neighbor may keep a coalesced node from passing the pq test.
+ * Nodes with a fixed register never leave the graph, so they always may.
+ */
+static bool
+ra_is_significant(struct ra_graph *g, unsigned int n, unsigned int q_total)
+{
+   return g->nodes[n].reg != NO_REG ||
+          q_total >= g->regs->classes[g->nodes[n].class]->p;
+}
+
+/**
+ * Briggs' test, with the pq test in place of degrees: coalescing u and v is
+ * safe if the neighbors of the result that wouldn't trivially pass the pq
+ * test add up to less than p.  The result then passes it once the others
+ * are simplified.
+ */
+static bool
+ra_briggs_test(struct ra_graph *g, struct ra_simplify_state *s,
+               unsigned int u, unsigned int v)
+{
+   unsigned int c = g->nodes[u].class;
+   struct ra_class *class = g->regs->classes[c];
+   unsigned int only_u = ++s->mark_gen;
+   unsigned int seen = ++s->mark_gen;
+   unsigned int q_total = 0;
+
+   for (unsigned int i = 0; i < g->nodes[u].adjacency_count; i++) {
+      unsigned int t = g->nodes[u].adjacency_list[i];
+
+      if (ra_node_is_live(g, t))
+         s->mark[t] = only_u;
+   }
+
+   for (unsigned int i = 0; i < g->nodes[v].adjacency_count; i++) {
+      unsigned int t = g->nodes[v].adjacency_list[i];
+      unsigned int t_q_total = g->nodes[t].q_total;
+      unsigned int t_class = g->nodes[t].class;
+
+      if (!ra_node_is_live(g, t))
+         continue;
+
+      /* Neighbors of both lose one of their edges. */
+      if (s->mark[t] == only_u)
+         t_q_total -= g->regs->classes[t_class]->q[c];
+      s->mark[t] = seen;
+
+      if (ra_is_significant(g, t, t_q_total))
+         q_total += class->q[t_class];
+   }
+
+   for (unsigned int i = 0; i < g->nodes[u].adjacency_count; i++) {
+      unsigned int t = g->nodes[u].adjacency_list[i];
+
+      if (s->mark[t] == only_u &&
+          ra_is_significant(g, t, g->nodes[t].q_total))
+         q_total += class->q[g->nodes[t].class];
+      if (q_total >= class->p)
+         return false;
+   }
+
+   return q_total < class->p;
+}
+
+/**
+ * George's test: v can be coalesced into u if each of its neighbors
+ * already interferes with u or isn't significant.
+ */
+static bool
+ra_george_test(struct ra_graph *g, unsigned int u, unsigned int v)
+{
+   for (unsigned int i = 0; i < g->nodes[v].adjacency_count; i++) {
+      unsigned int t = g->nodes[v].adjacency_list[i];
+
+      if (ra_node_is_live(g, t) &&
+          ra_is_significant(g, t, g->nodes[t].q_total) &&
+          !ra_nodes_interfere(g, t, u))
+         return false;
+   }
+
+   return true;
+}
+
+/* Merges v into u. */
+static void
+ra_combine(struct ra_graph *g, struct ra_simplify_state *s,
+           unsigned int u, unsigned int v)
+{
+   struct ra_node *node_u = &g->nodes[u];
+   struct ra_node *node_v = &g->nodes[v];
+
+   ra_simplify_remove(g, s, v);
+   node_v->alias = u;
+   node_v->in_stack = true;
+
+   unsigned int next = s->next_coalesced[u];
+   s->next_coalesced[u] = s->next_coalesced[v];
+   s->next_coalesced[v] = next;
+
+   node_u->num_moves += node_v->num_moves;
+   /* Spilling one spills both, so it's only possible if both allow it. */
+   if (node_u->spill_cost > 0.0f && node_v->spill_cost > 0.0f)
+      node_u->spill_cost += node_v->spill_cost;
+   else
+      node_u->spill_cost = 0.0f;
+
+   for (unsigned int i = 0; i < node_v->adjacency_count; i++) {
+      unsigned int t = node_v->adjacency_list[i];
+      unsigned int t_class = g->nodes[t].class;
+      bool live = ra_node_is_live(g, t);
+
+      if (g->nodes[t].alias != NO_REG)
+         continue;
+
+      if (live)
+         g->nodes[t].q_total -= g->regs->classes[t_class]->q[node_v->class];
+
+      /* Nodes already in the stack still need the edge to pick a
+       * different register than u, but u doesn't count them.
+       */
+      if (!ra_nodes_interfere(g, u, t)) {
+         ra_add_node_adjacency(g, u, t);
+         ra_add_node_adjacency(g, t, u);
+         if (!live)
+            node_u->q_total -= g->regs->classes[node_u->class]->q[t_class];
+      }
+
+      if (live && g->nodes[t].reg == NO_REG)
+         ra_simplify_update(g, s, t);
+   }
+
+   ra_simplify_update(g, s, u);
+}
+
+/**
+ * Tries to coalesce the queued moves.  Returns whether any move was
+ * coalesced or given up on, which may let more nodes be simplified.
+ */
+static bool
+ra_coalesce(struct ra_graph *g, struct ra_simplify_state *s)
+{
+   bool progress = false;
+
+   while (s->moves_count) {
+      struct ra_move *move = &g->moves[s->moves[--s->moves_count]];
+
+      move->queued = false;
+      if (!move->active)
+         continue;
+
+      unsigned int u = ra_get_alias(g, move->n1);
+      unsigned int v = ra_get_alias(g, move->n2);
+
+      assert(!g->nodes[u].in_stack && !g->nodes[v].in_stack);
+
+      if (u == v) {
+         ra_move_deactivate(g, move);
+         progress = true;
+      } else if (g->nodes[u].reg != NO_REG || g->nodes[v].reg != NO_REG ||
+                 g->nodes[u].class != g->nodes[v].class ||
+                 ra_nodes_interfere(g, u, v)) {
+         /* Constrained: this one will never be coalesced. */
+         ra_move_deactivate(g, move);
+         progress = true;
+      } else if (ra_george_test(g, u, v) || ra_briggs_test(g, s, u, v)) {
+         ra_move_deactivate(g, move);
+         ra_combine(g, s, u, v);
+         progress = true;
+      } else if (ra_george_test(g, v, u)) {
+         ra_move_deactivate(g, move);
+         ra_combine(g, s, v, u);
+         progress = true;
+      }
+   }
+
+   if (progress)
+      ra_release_frozen(g, s);
+
+   return progress;
+}
+
 /**
  * Simplifies the interference graph by pushing all
  * trivially-colorable nodes into a stack of nodes to be colored,
@@ -503,51 +1074,149 @@ decrement_q(struct ra_graph *g, unsigned int n)
  * we optimistically choose a node and push it on the stack. We heuristically
  * push the node with the lowest total q value, since it has the fewest
  * neighbors and therefore is most likely to be allocated.
+ *
+ * Nodes connected by moves are held back from the stack while coalescing
+ * them may still succeed, which gets likelier as their neighbors are
+ * simplified.  Only conservative coalescing is done, so it never makes the
+ * graph harder to color.
  */
 static void
 ra_simplify(struct ra_graph *g)
 {
-   bool progress = true;
    unsigned int stack_optimistic_start = UINT_MAX;
+   struct ra_simplify_state s;
    int i;
 
-   while (progress) {
-      unsigned int best_optimistic_node = ~0;
-      unsigned int lowest_q_total = ~0;
-
-      progress = false;
-
-      for (i = g->count - 1; i >= 0; i--) {
-	 if (g->nodes[i].in_stack || g->nodes[i].reg != NO_REG)
-	    continue;
-
-	 if (pq_test(g, i)) {
-	    decrement_q(g, i);
-	    g->stack[g->stack_count] = i;
-	    g->stack_count++;
-	    g->nodes[i].in_stack = true;
-	    progress = true;
-	 } else {
-	    unsigned int new_q_total = g->nodes[i].q_total;
-	    if (new_q_total < lowest_q_total) {
-	       best_optimistic_node = i;
-	       lowest_q_total = new_q_total;
-	    }
-	 }
+   s.worklist = calloc(BITSET_WORDS(g->count), sizeof(BITSET_WORD));
+   s.worklist_count = 0;
+   s.freeze = calloc(BITSET_WORDS(g->count), sizeof(BITSET_WORD));
+   s.freeze_count = 0;
+   s.mark = NULL;
+   s.mark_gen = 0;
+   s.moves = NULL;
+   s.moves_count = 0;
+   s.moves_start = NULL;
+   s.moves_of = NULL;
+   s.next_coalesced = NULL;
+
+   if (g->moves_count) {
+      s.mark = calloc(g->count, sizeof(unsigned int));
+      s.moves = malloc(g->moves_count * sizeof(unsigned int));
+      s.moves_start = calloc(g->count + 1, sizeof(unsigned int));
+      s.moves_of = malloc(2 * g->moves_count * sizeof(unsigned int));
+      s.next_coalesced = malloc(g->count * sizeof(unsigned int));
+
+      /* Count the moves of each node, sum them up to where each node's
+       * list ends, and fill the lists backwards to where they start.
+       */
+      for (unsigned int m = 0; m < g->moves_count; m++) {
+         s.moves_start[g->moves[m].n1]++;
+         s.moves_start[g->moves[m].n2]++;
+      }
+      for (unsigned int n = 0; n < g->count; n++) {
+         if (n > 0)
+            s.moves_start[n] += s.moves_start[n - 1];
+         s.next_coalesced[n] = n;
+      }
+      s.moves_start[g->count] = 2 * g->moves_count;
+      for (int m = g->moves_count - 1; m >= 0; m--) {
+         s.moves_of[--s.moves_start[g->moves[m].n1]] = m;
+         s.moves_of[--s.moves_start[g->moves[m].n2]] = m;
+      }
+
+      /* Try them all once to begin with, in the order they were added. */
+      for (int m = g->moves_count - 1; m >= 0; m--) {
+         g->moves[m].queued = true;
+         s.moves[s.moves_count++] = m;
+      }
+   }
+   s.heap = malloc(g->count * sizeof(unsigned int));
+   s.heap_count = 0;
+   s.heap_ordered = false;
+
+   for (i = g->count - 1; i >= 0; i--) {
+      g->nodes[i].heap_index = NO_REG;
+
+      if (g->nodes[i].in_stack || g->nodes[i].reg != NO_REG)
+         continue;
+
+      if (pq_test(g, i))
+         ra_worklist_add(&s, i);
+      else
+         ra_heap_set(g, &s, s.heap_count++, i);
+   }
+
+   while (true) {
+      /* Push the worklist in passes from the highest-numbered node down,
+       * like the linear scan this replaced: the order matters for how well
+       * ra_select() packs the registers.
+       */
+      while (s.worklist_count) {
+         for (i = BITSET_WORDS(g->count) - 1; i >= 0; i--) {
+            while (s.worklist[i]) {
+               unsigned int n = i * BITSET_WORDBITS +
+                                util_last_bit(s.worklist[i]) - 1;
+
+               BITSET_CLEAR(s.worklist, n);
+               s.worklist_count--;
+
+               if (g->nodes[n].num_moves) {
+                  BITSET_SET(s.freeze, n);
+                  s.freeze_count++;
+               } else {
+                  ra_push_node(g, &s, n);
+               }
+            }
+         }
+      }
+
+      if (s.moves_count && ra_coalesce(g, &s))
+         continue;
+
+      /* Give up on coalescing one of the nodes that are otherwise ready. */
+      if (s.freeze_count) {
+         for (i = BITSET_WORDS(g->count) - 1; !s.freeze[i]; i--)
+            ;
+         unsigned int n = i * BITSET_WORDBITS +
+                          util_last_bit(s.freeze[i]) - 1;
+
+         BITSET_CLEAR(s.freeze, n);
+         s.freeze_count--;
+         ra_freeze_moves(g, &s, n);
+         ra_release_frozen(g, &s);
+         ra_push_node(g, &s, n);
+         continue;
       }
 
-      if (!progress && best_optimistic_node != ~0U) {
-         if (stack_optimistic_start == UINT_MAX)
-            stack_optimistic_start = g->stack_count;
+      if (!s.heap_count)
+         break;
+
+      if (stack_optimistic_start == UINT_MAX) {
+         stack_optimistic_start = g->stack_count;
+
+         for (i = (int)(s.heap_count / 2) - 1; i >= 0; i--)
+            ra_heap_sift_down(g, &s, i);
+         s.heap_ordered = true;
+      }
 
-	 decrement_q(g, best_optimistic_node);
-	 g->stack[g->stack_count] = best_optimistic_node;
-	 g->stack_count++;
-	 g->nodes[best_optimistic_node].in_stack = true;
-	 progress = true;
+      unsigned int best_optimistic_node = s.heap[0];
+      ra_heap_remove(g, &s, best_optimistic_node);
+      if (g->nodes[best_optimistic_node].num_moves) {
+         ra_freeze_moves(g, &s, best_optimistic_node);
+         ra_release_frozen(g, &s);
       }
+      ra_push_node(g, &s, best_optimistic_node);
    }
 
+   free(s.worklist);
+   free(s.freeze);
+   free(s.mark);
+   free(s.moves);
+   free(s.moves_start);
+   free(s.moves_of);
+   free(s.next_coalesced);
+   free(s.heap);
+
    g->stack_optimistic_start = stack_optimistic_start;
 }
 
@@ -683,10 +1352,14 @@ ra_allocate(struct ra_graph *g)
    return ra_select(g);
 }
 
+/**
+ * Returns the register of the node, which is shared with any node it was
+ * coalesced with.
+ */
 unsigned int
 ra_get_node_reg(struct ra_graph *g, unsigned int n)
 {
-   return g->nodes[n].reg;
+   return g->nodes[ra_get_alias(g, n)].reg;
 }
 
 /**
@@ -724,6 +1397,11 @@ ra_get_spill_benefit(struct ra_graph *g, unsigned int n)
    for (j = 0; j < g->nodes[n].adjacency_count; j++) {
       unsigned int n2 = g->nodes[n].adjacency_list[j];
       unsigned int n2_class = g->nodes[n2].class;
+
+      /* Its edges were moved to the node it was coalesced into. */
+      if (g->nodes[n2].alias != NO_REG)
+         continue;
+
       benefit += ((float)g->regs->classes[n_class]->q[n2_class] /
                   g->regs->classes[n_class]->p);
    }
@@ -732,14 +1410,19 @@ ra_get_spill_benefit(struct ra_graph *g, unsigned int n)
 }
 
 /**
- * Returns a node number to be spilled according to the cost/benefit using
- * the pq test, or -1 if there are no spillable nodes.
+ * Fills nodes with up to max_nodes nodes to be spilled, best first,
+ * according to the cost/benefit using the pq test.  Returns how many were
+ * found.
+ *
+ * Spilling several nodes per failed allocation saves rebuilding the graph
+ * for each of them, but nodes past the first may not have been needed.
  */
-int
-ra_get_best_spill_node(struct ra_graph *g)
+unsigned int
+ra_get_best_spill_nodes(struct ra_graph *g, unsigned int *nodes,
+                        unsigned int max_nodes)
 {
-   unsigned int best_node = -1;
-   float best_benefit = 0.0;
+   float *benefits = malloc(max_nodes * sizeof(float));
+   unsigned int count = 0;
    unsigned int n;
 
    /* Consider any nodes that we colored successfully or the node we failed to
@@ -750,6 +1433,7 @@ ra_get_best_spill_node(struct ra_graph *g)
    for (n = 0; n < g->count; n++) {
       float cost = g->nodes[n].spill_cost;
       float benefit;
+      unsigned int i;
 
       if (cost <= 0.0f)
 	 continue;
@@ -757,15 +1441,41 @@ ra_get_best_spill_node(struct ra_graph *g)
       if (g->nodes[n].in_stack)
          continue;
 
-      benefit = ra_get_spill_benefit(g, n);
+      benefit = ra_get_spill_benefit(g, n) / cost;
+      if (benefit <= 0.0f)
+         continue;
 
-      if (benefit / cost > best_benefit) {
-	 best_benefit = benefit / cost;
-	 best_node = n;
+      /* Insert it in the sorted list, dropping the worst if it's full. */
+      for (i = count; i > 0 && benefits[i - 1] < benefit; i--) {
+         if (i < max_nodes) {
+            benefits[i] = benefits[i - 1];
+            nodes[i] = nodes[i - 1];
+         }
+      }
+      if (i < max_nodes) {
+         benefits[i] = benefit;
+         nodes[i] = n;
+         count = MIN2(count + 1, max_nodes);
       }
    }
 
-   return best_node;
+   free(benefits);
+   return count;
+}
+
+/**
+ * Returns a node number to be spilled according to the cost/benefit using
+ * the pq test, or -1 if there are no spillable nodes.
+ */
+int
+ra_get_best_spill_node(struct ra_graph *g)
+{
+   unsigned int node;
+
+   if (!ra_get_best_spill_nodes(g, &node, 1))
+      return -1;
+
+   return node;
 }
 
 /**
@@ -777,3 +1487,18 @@ ra_set_node_spill_cost(struct ra_graph *g, unsigned int n, float cost)
 {
    g->nodes[n].spill_cost = cost;
 }
+
+/**
+ * Adds the cost of an access to node n, at loop_depth loops deep, to its
+ * spill cost.  Accesses in loops count for more, as spilling there adds
+ * memory traffic on each iteration.
+ */
+void
+ra_add_node_spill_cost(struct ra_graph *g, unsigned int n, float cost,
+                       unsigned int loop_depth)
+{
+   for (unsigned int i = 0; i < loop_depth; i++)
+      cost *= RA_LOOP_SPILL_WEIGHT;
+
+   g->nodes[n].spill_cost += cost;
+}
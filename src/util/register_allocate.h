@@ -82,6 +82,7 @@ void ra_set_select_reg_callback(struct ra_graph *g,
                                 void *data);
 void ra_add_node_interference(struct ra_graph *g,
 			      unsigned int n1, unsigned int n2);
+void ra_add_node_move(struct ra_graph *g, unsigned int n1, unsigned int n2);
 /** @} */
 
 /** @{ Graph-coloring register allocation */
@@ -90,7 +91,11 @@ bool ra_allocate(struct ra_graph *g);
 unsigned int ra_get_node_reg(struct ra_graph *g, unsigned int n);
 void ra_set_node_reg(struct ra_graph * g, unsigned int n, unsigned int reg);
 void ra_set_node_spill_cost(struct ra_graph *g, unsigned int n, float cost);
+void ra_add_node_spill_cost(struct ra_graph *g, unsigned int n, float cost,
+                            unsigned int loop_depth);
 int ra_get_best_spill_node(struct ra_graph *g);
+unsigned int ra_get_best_spill_nodes(struct ra_graph *g, unsigned int *nodes,
+                                     unsigned int max_nodes);
 /** @} */
 
 
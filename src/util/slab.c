@@ -39,17 +39,18 @@
 #define CHECK_MAGIC(element, value)
 #endif
 
+/* A child pool keeps up to this many fully free pages, or a quarter of its
+ * pages if that is more, instead of freeing them.
+ */
+#define SLAB_MIN_EMPTY_PAGES 2
+
 /* One array element within a big buffer. */
 struct slab_element_header {
-   /* The next element in the free or migrated list. */
+   /* The next element in a free, migrated or magazine list. */
    struct slab_element_header *next;
 
-   /* This is either
-    * - a pointer to the child pool to which this element belongs, or
-    * - a pointer to the orphaned page of the element, with the least
-    *   significant bit set to 1.
-    */
-   intptr_t owner;
+   /* The page this element is in. */
+   struct slab_page_header *page;
 
 #ifdef DEBUG
    intptr_t magic;
@@ -58,13 +59,24 @@ struct slab_element_header {
 
 /* The page is an array of allocations in one block. */
 struct slab_page_header {
-   union {
-      /* Next page in the same child pool. */
-      struct slab_page_header *next;
+   /* The child pool to which this page belongs, or NULL when the page is
+    * orphaned (i.e. the owning child pool has been destroyed).
+    */
+   struct slab_child_pool *owner;
+
+   /* Link in the owner's list of pages. */
+   struct list_head link;
+
+   /* Link in the owner's list of pages with free elements. */
+   struct list_head partial_link;
+
+   /* Free elements in this page. */
+   struct slab_element_header *free;
+   unsigned num_free;
+
+   /* Number of remaining, non-freed elements (for orphaned pages). */
+   unsigned num_remaining;
 
-      /* Number of remaining, non-freed elements (for orphaned pages). */
-      unsigned num_remaining;
-   } u;
    /* Memory after the last member is dedicated to the page itself.
     * The allocated size is always larger than this structure.
     */
@@ -79,20 +91,58 @@ slab_get_element(struct slab_parent_pool *parent,
           ((uint8_t*)&page[1] + (parent->element_size * index));
 }
 
-/* The given object/element belongs to an orphaned page (i.e. the owning child
- * pool has been destroyed). Mark the element as freed and free the whole page
- * when no elements are left in it.
+static void
+slab_release_page(struct slab_parent_pool *parent,
+                  struct slab_page_header *page)
+{
+   free(page);
+   p_atomic_inc(&parent->num_pages_released);
+}
+
+/* The given object/element belongs to an orphaned page. Mark the element as
+ * freed and free the whole page when no elements are left in it.
+ *
+ * Must be called with the parent mutex held.
  */
 static void
-slab_free_orphaned(struct slab_element_header *elt)
+slab_free_orphaned(struct slab_parent_pool *parent,
+                   struct slab_element_header *elt)
 {
-   struct slab_page_header *page;
+   struct slab_page_header *page = elt->page;
 
-   assert(elt->owner & 1);
+   assert(!page->owner);
 
-   page = (struct slab_page_header *)(elt->owner & ~(intptr_t)1);
-   if (!p_atomic_dec_return(&page->u.num_remaining))
-      free(page);
+   if (!--page->num_remaining)
+      slab_release_page(parent, page);
+}
+
+/* Hand the elements in the magazine of the pool back to their owners.
+ *
+ * Must be called with the parent mutex held.
+ */
+static void
+slab_flush_magazine_locked(struct slab_child_pool *pool)
+{
+   if (!pool->magazine)
+      return;
+
+   while (pool->magazine) {
+      struct slab_element_header *elt = pool->magazine;
+      struct slab_child_pool *owner = p_atomic_read(&elt->page->owner);
+
+      pool->magazine = elt->next;
+
+      if (owner) {
+         elt->next = owner->migrated;
+         owner->migrated = elt;
+      } else {
+         slab_free_orphaned(pool->parent, elt);
+      }
+   }
+
+   pool->parent->num_migrated += pool->num_magazine;
+   pool->parent->num_flushes++;
+   pool->num_magazine = 0;
 }
 
 /**
@@ -110,6 +160,10 @@ slab_create_parent(struct slab_parent_pool *parent,
    parent->element_size = ALIGN_POT(sizeof(struct slab_element_header) + item_size,
                                     sizeof(intptr_t));
    parent->num_elements = num_items;
+   parent->num_pages_allocated = 0;
+   parent->num_pages_released = 0;
+   parent->num_migrated = 0;
+   parent->num_flushes = 0;
 }
 
 void
@@ -118,6 +172,21 @@ slab_destroy_parent(struct slab_parent_pool *parent)
    mtx_destroy(&parent->mutex);
 }
 
+/**
+ * Return the page and migration statistics of the parent pool.
+ */
+void
+slab_get_stats(struct slab_parent_pool *parent, struct slab_stats *stats)
+{
+   mtx_lock(&parent->mutex);
+   stats->num_pages_allocated = p_atomic_read(&parent->num_pages_allocated);
+   stats->num_pages_released = p_atomic_read(&parent->num_pages_released);
+   stats->num_pages = stats->num_pages_allocated - stats->num_pages_released;
+   stats->num_migrated = parent->num_migrated;
+   stats->num_flushes = parent->num_flushes;
+   mtx_unlock(&parent->mutex);
+}
+
 /**
  * Create a child pool linked to the given parent.
  */
@@ -125,9 +194,13 @@ void slab_create_child(struct slab_child_pool *pool,
                        struct slab_parent_pool *parent)
 {
    pool->parent = parent;
-   pool->pages = NULL;
-   pool->free = NULL;
+   list_inithead(&pool->pages);
+   list_inithead(&pool->partial);
+   pool->num_pages = 0;
+   pool->num_empty_pages = 0;
    pool->migrated = NULL;
+   pool->magazine = NULL;
+   pool->num_magazine = 0;
 }
 
 /**
@@ -138,35 +211,30 @@ void slab_create_child(struct slab_child_pool *pool,
  */
 void slab_destroy_child(struct slab_child_pool *pool)
 {
-   if (!pool->parent)
+   struct slab_parent_pool *parent = pool->parent;
+
+   if (!parent)
       return; /* the slab probably wasn't even created */
 
-   mtx_lock(&pool->parent->mutex);
+   mtx_lock(&parent->mutex);
 
-   while (pool->pages) {
-      struct slab_page_header *page = pool->pages;
-      pool->pages = page->u.next;
-      p_atomic_set(&page->u.num_remaining, pool->parent->num_elements);
+   slab_flush_magazine_locked(pool);
 
-      for (unsigned i = 0; i < pool->parent->num_elements; ++i) {
-         struct slab_element_header *elt = slab_get_element(pool->parent, page, i);
-         p_atomic_set(&elt->owner, (intptr_t)page | 1);
-      }
+   list_for_each_entry_safe(struct slab_page_header, page, &pool->pages,
+                            link) {
+      p_atomic_set(&page->owner, NULL);
+      page->num_remaining = parent->num_elements - page->num_free;
+      if (!page->num_remaining)
+         slab_release_page(parent, page);
    }
 
    while (pool->migrated) {
       struct slab_element_header *elt = pool->migrated;
       pool->migrated = elt->next;
-      slab_free_orphaned(elt);
+      slab_free_orphaned(parent, elt);
    }
 
-   mtx_unlock(&pool->parent->mutex);
-
-   while (pool->free) {
-      struct slab_element_header *elt = pool->free;
-      pool->free = elt->next;
-      slab_free_orphaned(elt);
-   }
+   mtx_unlock(&parent->mutex);
 
    /* Guard against use-after-free. */
    pool->parent = NULL;
@@ -181,22 +249,64 @@ slab_add_new_page(struct slab_child_pool *pool)
    if (!page)
       return false;
 
-   for (unsigned i = 0; i < pool->parent->num_elements; ++i) {
-      struct slab_element_header *elt = slab_get_element(pool->parent, page, i);
-      elt->owner = (intptr_t)pool;
-      assert(!(elt->owner & 1));
+   page->owner = pool;
+   page->free = NULL;
+   page->num_free = pool->parent->num_elements;
 
-      elt->next = pool->free;
-      pool->free = elt;
+   for (unsigned i = pool->parent->num_elements; i-- > 0;) {
+      struct slab_element_header *elt = slab_get_element(pool->parent, page, i);
+      elt->page = page;
+      elt->next = page->free;
+      page->free = elt;
       SET_MAGIC(elt, SLAB_MAGIC_FREE);
    }
 
-   page->u.next = pool->pages;
-   pool->pages = page;
+   list_add(&page->link, &pool->pages);
+   list_add(&page->partial_link, &pool->partial);
+   pool->num_pages++;
+   pool->num_empty_pages++;
+   p_atomic_inc(&pool->parent->num_pages_allocated);
 
    return true;
 }
 
+/* Put an element back on the free list of its page, which is owned by the
+ * pool.
+ *
+ * Pages with all of their elements free are moved to the end of the partial
+ * list, so that allocations fill the other pages first, and freed from there
+ * when there are too many of them.
+ */
+static void
+slab_free_local(struct slab_child_pool *pool, struct slab_element_header *elt)
+{
+   struct slab_page_header *page = elt->page;
+
+   elt->next = page->free;
+   page->free = elt;
+
+   if (page->num_free++ == 0)
+      list_add(&page->partial_link, &pool->partial);
+
+   if (page->num_free < pool->parent->num_elements)
+      return;
+
+   list_del(&page->partial_link);
+   list_addtail(&page->partial_link, &pool->partial);
+   pool->num_empty_pages++;
+
+   while (pool->num_empty_pages > MAX2(SLAB_MIN_EMPTY_PAGES,
+                                       pool->num_pages / 4)) {
+      page = list_last_entry(&pool->partial, struct slab_page_header,
+                             partial_link);
+      list_del(&page->partial_link);
+      list_del(&page->link);
+      pool->num_empty_pages--;
+      pool->num_pages--;
+      slab_release_page(pool->parent, page);
+   }
+}
+
 /**
  * Allocate an object from the child pool. Single-threaded (i.e. the caller
  * must ensure that no operation happens on the same child pool in another
@@ -205,24 +315,42 @@ slab_add_new_page(struct slab_child_pool *pool)
 void *
 slab_alloc(struct slab_child_pool *pool)
 {
+   struct slab_page_header *page;
    struct slab_element_header *elt;
 
-   if (!pool->free) {
+   if (list_empty(&pool->partial)) {
+      struct slab_element_header *migrated;
+
       /* First, collect elements that belong to us but were freed from a
-       * different child pool.
+       * different child pool, and hand back those we hold for others while
+       * we have the lock.
        */
       mtx_lock(&pool->parent->mutex);
-      pool->free = pool->migrated;
+      migrated = pool->migrated;
       pool->migrated = NULL;
+      slab_flush_magazine_locked(pool);
       mtx_unlock(&pool->parent->mutex);
 
+      while (migrated) {
+         elt = migrated;
+         migrated = elt->next;
+         slab_free_local(pool, elt);
+      }
+
       /* Now allocate a new page. */
-      if (!pool->free && !slab_add_new_page(pool))
+      if (list_empty(&pool->partial) && !slab_add_new_page(pool))
          return NULL;
    }
 
-   elt = pool->free;
-   pool->free = elt->next;
+   page = list_first_entry(&pool->partial, struct slab_page_header,
+                           partial_link);
+   elt = page->free;
+   page->free = elt->next;
+
+   if (page->num_free-- == pool->parent->num_elements)
+      pool->num_empty_pages--;
+   if (!page->free)
+      list_del(&page->partial_link);
 
    CHECK_MAGIC(elt, SLAB_MAGIC_FREE);
    SET_MAGIC(elt, SLAB_MAGIC_ALLOCATED);
@@ -242,37 +370,31 @@ slab_alloc(struct slab_child_pool *pool)
 void slab_free(struct slab_child_pool *pool, void *ptr)
 {
    struct slab_element_header *elt = ((struct slab_element_header*)ptr - 1);
-   intptr_t owner_int;
 
    CHECK_MAGIC(elt, SLAB_MAGIC_ALLOCATED);
    SET_MAGIC(elt, SLAB_MAGIC_FREE);
 
-   if (p_atomic_read(&elt->owner) == (intptr_t)pool) {
+   if (p_atomic_read(&elt->page->owner) == pool) {
       /* This is the simple case: The caller guarantees that we can safely
        * access the free list.
        */
-      elt->next = pool->free;
-      pool->free = elt;
+      slab_free_local(pool, elt);
       return;
    }
 
-   /* The slow case: migration or an orphaned page. */
-   mtx_lock(&pool->parent->mutex);
-
-   /* Note: we _must_ re-read elt->owner here because the owning child pool
+   /* The slow case: migration or an orphaned page. Keep the element until
+    * the magazine is full, then hand all of them back under one lock.
+    *
+    * The owner is read again at that point because the owning child pool
     * may have been destroyed by another thread in the meantime.
     */
-   owner_int = p_atomic_read(&elt->owner);
+   elt->next = pool->magazine;
+   pool->magazine = elt;
 
-   if (!(owner_int & 1)) {
-      struct slab_child_pool *owner = (struct slab_child_pool *)owner_int;
-      elt->next = owner->migrated;
-      owner->migrated = elt;
-      mtx_unlock(&pool->parent->mutex);
-   } else {
+   if (++pool->num_magazine >= SLAB_MAGAZINE_SIZE) {
+      mtx_lock(&pool->parent->mutex);
+      slab_flush_magazine_locked(pool);
       mtx_unlock(&pool->parent->mutex);
-
-      slab_free_orphaned(elt);
    }
 }
 
@@ -32,8 +32,13 @@
  *
  * Allocations obtained from one child pool should usually be freed in the
  * same child pool. Freeing an allocation in a different child pool associated
- * to the same parent is allowed (and requires no locking by the caller), but
- * it is discouraged because it implies a performance penalty.
+ * to the same parent is allowed (and requires no locking by the caller). Such
+ * allocations are collected in a small magazine in the freeing pool and
+ * handed back to their owners in batches, so that the parent mutex is only
+ * taken once per batch.
+ *
+ * Pages whose elements have all been freed are given back to the system,
+ * except for a few per child pool, which are kept to avoid thrashing.
  *
  * For convenience and to ease the transition, there is also a set of wrapper
  * functions around a single parent-child pair.
@@ -42,24 +47,45 @@
 #ifndef SLAB_H
 #define SLAB_H
 
+#include <stdint.h>
+
 #include "c11/threads.h"
+#include "list.h"
 
 struct slab_element_header;
 struct slab_page_header;
 
+/* Maximum number of elements freed into a child pool that doesn't own them
+ * before they are handed back to their owners.
+ */
+#define SLAB_MAGAZINE_SIZE 64
+
 struct slab_parent_pool {
    mtx_t mutex;
    unsigned element_size;
    unsigned num_elements;
+
+   /* Statistics, see slab_get_stats(). */
+   unsigned num_pages_allocated;
+   unsigned num_pages_released;
+
+   /* These are protected by the mutex. */
+   uint64_t num_migrated;
+   uint64_t num_flushes;
 };
 
 struct slab_child_pool {
    struct slab_parent_pool *parent;
 
-   struct slab_page_header *pages;
+   /* All pages owned by this pool. */
+   struct list_head pages;
 
-   /* Free elements. */
-   struct slab_element_header *free;
+   /* Pages with free elements, the one to allocate from first. */
+   struct list_head partial;
+
+   /* Number of pages, and of those with all of their elements free. */
+   unsigned num_pages;
+   unsigned num_empty_pages;
 
    /* Elements that are owned by this pool but were freed with a different
     * pool as the argument to slab_free.
@@ -67,12 +93,36 @@ struct slab_child_pool {
     * This list is protected by the parent mutex.
     */
    struct slab_element_header *migrated;
+
+   /* Elements owned by other pools that were freed with this pool as the
+    * argument to slab_free, waiting to be handed back to their owners.
+    */
+   struct slab_element_header *magazine;
+   unsigned num_magazine;
+};
+
+struct slab_stats {
+   /* Pages currently allocated. */
+   unsigned num_pages;
+
+   /* Pages allocated and given back to the system since the parent pool was
+    * created.
+    */
+   unsigned num_pages_allocated;
+   unsigned num_pages_released;
+
+   /* Elements freed in a child pool that doesn't own them, and the number of
+    * times those were handed back to their owners.
+    */
+   uint64_t num_migrated;
+   uint64_t num_flushes;
 };
 
 void slab_create_parent(struct slab_parent_pool *parent,
                         unsigned item_size,
                         unsigned num_items);
 void slab_destroy_parent(struct slab_parent_pool *parent);
+void slab_get_stats(struct slab_parent_pool *parent, struct slab_stats *stats);
 void slab_create_child(struct slab_child_pool *pool,
                        struct slab_parent_pool *parent);
 void slab_destroy_child(struct slab_child_pool *pool);
@@ -0,0 +1,780 @@
+/*
+ * Copyright © 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * Implements open-addressing hash tables probed a group of slots at a time.
+ *
+ * Next to the entries is an array of control bytes, one per slot: EMPTY,
+ * DELETED, or the low 7 bits of the (mixed) hash for a used slot.  The other
+ * bits of the hash select the first group to look at, and groups are then
+ * probed quadratically.  A lookup loads the control bytes of a group, matches
+ * all of them against the 7 bits it is looking for at once, compares keys
+ * only for the matches, and stops at the first group with an EMPTY slot.
+ *
+ * The first GROUP_WIDTH control bytes are mirrored after the last one, so
+ * that a group can start at any slot.
+ */
+
+#include <string.h>
+#include <assert.h>
+
+#include "swiss_table.h"
+#include "bitscan.h"
+#include "ralloc.h"
+#include "macros.h"
+#include "u_math.h"
+
+#if defined(__SSE2__) || (defined(_MSC_VER) && (defined(_M_AMD64) || defined(_M_X64)))
+#include <emmintrin.h>
+#define SWISS_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SWISS_NEON
+#endif
+
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+#define MIN_SIZE 16
+
+/* A group_mask has one bit set for each matching slot of a group, the
+ * lowest one for the first slot.  MASK_SHIFT converts a bit number into a
+ * slot index.
+ */
+#if defined(SWISS_SSE2)
+
+#define GROUP_WIDTH 16
+#define MASK_SHIFT 0
+typedef uint32_t group_mask;
+
+static inline group_mask
+group_match(const int8_t *ctrl, int8_t h2)
+{
+   __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+   return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(h2)));
+}
+
+static inline group_mask
+group_match_empty(const int8_t *ctrl)
+{
+   return group_match(ctrl, CTRL_EMPTY);
+}
+
+static inline group_mask
+group_match_empty_or_deleted(const int8_t *ctrl)
+{
+   __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+   return _mm_movemask_epi8(_mm_cmplt_epi8(group, _mm_set1_epi8(-1)));
+}
+
+static inline unsigned
+mask_first(group_mask mask)
+{
+   return ffs(mask) - 1;
+}
+
+#elif defined(SWISS_NEON)
+
+/* NEON has no movemask, but narrowing the comparison result by 4 bits
+ * leaves a nibble per slot.
+ */
+#define GROUP_WIDTH 16
+#define MASK_SHIFT 2
+typedef uint64_t group_mask;
+
+static inline group_mask
+neon_mask(uint8x16_t cmp)
+{
+   uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4);
+   return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0) &
+          0x8888888888888888ull;
+}
+
+static inline group_mask
+group_match(const int8_t *ctrl, int8_t h2)
+{
+   int8x16_t group = vld1q_s8(ctrl);
+   return neon_mask(vceqq_s8(group, vdupq_n_s8(h2)));
+}
+
+static inline group_mask
+group_match_empty(const int8_t *ctrl)
+{
+   return group_match(ctrl, CTRL_EMPTY);
+}
+
+static inline group_mask
+group_match_empty_or_deleted(const int8_t *ctrl)
+{
+   int8x16_t group = vld1q_s8(ctrl);
+   return neon_mask(vcltq_s8(group, vdupq_n_s8(-1)));
+}
+
+static inline unsigned
+mask_first(group_mask mask)
+{
+   return (ffsll(mask) - 1) >> MASK_SHIFT;
+}
+
+#else
+
+/* Portable fallback working on 8 control bytes in a uint64_t.  group_match()
+ * may report a slot right after a real match whose byte differs from h2 in
+ * the lowest bit, which only costs a key comparison.
+ */
+#define GROUP_WIDTH 8
+#define MASK_SHIFT 3
+typedef uint64_t group_mask;
+
+#define LSBS 0x0101010101010101ull
+#define MSBS 0x8080808080808080ull
+
+static inline uint64_t
+group_load(const int8_t *ctrl)
+{
+   uint64_t group;
+
+   memcpy(&group, ctrl, sizeof(group));
+   return util_le64_to_cpu(group);
+}
+
+static inline group_mask
+group_match(const int8_t *ctrl, int8_t h2)
+{
+   uint64_t x = group_load(ctrl) ^ (LSBS * (uint8_t)h2);
+   return (x - LSBS) & ~x & MSBS;
+}
+
+/* EMPTY is the only control byte with the top bit set and bit 1 clear. */
+static inline group_mask
+group_match_empty(const int8_t *ctrl)
+{
+   uint64_t group = group_load(ctrl);
+   return group & ~(group << 6) & MSBS;
+}
+
+/* EMPTY and DELETED are the only ones with the top bit set and bit 0 clear. */
+static inline group_mask
+group_match_empty_or_deleted(const int8_t *ctrl)
+{
+   uint64_t group = group_load(ctrl);
+   return group & ~(group << 7) & MSBS;
+}
+
+static inline unsigned
+mask_first(group_mask mask)
+{
+   return (ffsll(mask) - 1) >> MASK_SHIFT;
+}
+
+#endif
+
+/* Clears the lowest matching slot. */
+static inline group_mask
+mask_next(group_mask mask)
+{
+   return mask & (mask - 1);
+}
+
+/* Weak hashes like _mesa_hash_pointer() leave patterns in the low bits, which
+ * a power-of-two table would pick up directly, so mix them first.
+ */
+static inline uint32_t
+mix_hash(uint32_t hash)
+{
+   hash ^= hash >> 16;
+   hash *= 0x85ebca6b;
+   hash ^= hash >> 13;
+   return hash;
+}
+
+static inline int8_t
+hash_h2(uint32_t mixed)
+{
+   return mixed & 0x7f;
+}
+
+static inline uint32_t
+hash_h1(uint32_t mixed)
+{
+   return mixed >> 7;
+}
+
+static inline void
+set_ctrl(int8_t *ctrl, uint32_t size, uint32_t i, int8_t value)
+{
+   ctrl[i] = value;
+   /* Writes the mirror for the first GROUP_WIDTH slots, and slot i again for
+    * the others.
+    */
+   ctrl[((i - GROUP_WIDTH) & (size - 1)) + GROUP_WIDTH] = value;
+}
+
+/* Tables are kept at most 7/8 full, counting deleted slots, so that there's
+ * always an EMPTY slot to end a search.
+ */
+static inline uint32_t
+max_entries_for_size(uint32_t size)
+{
+   return size - size / 8;
+}
+
+/* Returns the first EMPTY or DELETED slot on the probe sequence of mixed. */
+static uint32_t
+find_free_slot(const int8_t *ctrl, uint32_t size, uint32_t mixed)
+{
+   uint32_t pos = hash_h1(mixed) & (size - 1);
+   uint32_t stride = 0;
+
+   while (true) {
+      group_mask free_slots = group_match_empty_or_deleted(ctrl + pos);
+
+      if (free_slots)
+         return (pos + mask_first(free_slots)) & (size - 1);
+
+      stride += GROUP_WIDTH;
+      pos = (pos + stride) & (size - 1);
+   }
+}
+
+/* Allocates the entries and control bytes of a table of the given size in
+ * one block, with every slot EMPTY.
+ */
+static void *
+alloc_slots(void *mem_ctx, uint32_t size, size_t entry_size, int8_t **ctrl)
+{
+   char *table = ralloc_size(mem_ctx, size * entry_size + size + GROUP_WIDTH);
+
+   if (table == NULL)
+      return NULL;
+
+   *ctrl = (int8_t *)(table + size * entry_size);
+   memset(*ctrl, CTRL_EMPTY, size + GROUP_WIDTH);
+   return table;
+}
+
+/* Rehashing is either doubling the size when the table is at least half full
+ * of live entries, or dropping the deleted slots at the same size.
+ */
+static uint32_t
+rehash_size(uint32_t size, uint32_t entries)
+{
+   if (entries >= max_entries_for_size(size) / 2)
+      return size * 2;
+
+   return size;
+}
+
+bool
+_mesa_swiss_table_init(struct swiss_table *ht,
+                       void *mem_ctx,
+                       uint32_t (*key_hash_function)(const void *key),
+                       bool (*key_equals_function)(const void *a,
+                                                   const void *b))
+{
+   ht->size = MIN_SIZE;
+   ht->max_entries = max_entries_for_size(ht->size);
+   ht->key_hash_function = key_hash_function;
+   ht->key_equals_function = key_equals_function;
+   ht->table = alloc_slots(mem_ctx, ht->size, sizeof(struct hash_entry),
+                           &ht->ctrl);
+   ht->entries = 0;
+   ht->deleted_entries = 0;
+
+   return ht->table != NULL;
+}
+
+struct swiss_table *
+_mesa_swiss_table_create(void *mem_ctx,
+                         uint32_t (*key_hash_function)(const void *key),
+                         bool (*key_equals_function)(const void *a,
+                                                     const void *b))
+{
+   struct swiss_table *ht;
+
+   ht = ralloc(mem_ctx, struct swiss_table);
+   if (ht == NULL)
+      return NULL;
+
+   if (!_mesa_swiss_table_init(ht, ht, key_hash_function,
+                               key_equals_function)) {
+      ralloc_free(ht);
+      return NULL;
+   }
+
+   return ht;
+}
+
+struct swiss_table *
+_mesa_swiss_table_clone(struct swiss_table *src, void *dst_mem_ctx)
+{
+   struct swiss_table *ht;
+   size_t slots_size = src->size * (sizeof(struct hash_entry) + 1) +
+                       GROUP_WIDTH;
+
+   ht = ralloc(dst_mem_ctx, struct swiss_table);
+   if (ht == NULL)
+      return NULL;
+
+   memcpy(ht, src, sizeof(struct swiss_table));
+
+   ht->table = ralloc_size(ht, slots_size);
+   if (ht->table == NULL) {
+      ralloc_free(ht);
+      return NULL;
+   }
+
+   memcpy(ht->table, src->table, slots_size);
+   ht->ctrl = (int8_t *)(ht->table + ht->size);
+
+   return ht;
+}
+
+/**
+ * Frees the given hash table.
+ *
+ * If delete_function is passed, it gets called on each entry present before
+ * freeing.
+ */
+void
+_mesa_swiss_table_destroy(struct swiss_table *ht,
+                          void (*delete_function)(struct hash_entry *entry))
+{
+   if (!ht)
+      return;
+
+   if (delete_function) {
+      swiss_table_foreach(ht, entry) {
+         delete_function(entry);
+      }
+   }
+   ralloc_free(ht);
+}
+
+/**
+ * Deletes all entries of the given hash table without deleting the table
+ * itself or changing its size.
+ *
+ * If delete_function is passed, it gets called on each entry present.
+ */
+void
+_mesa_swiss_table_clear(struct swiss_table *ht,
+                        void (*delete_function)(struct hash_entry *entry))
+{
+   if (delete_function) {
+      swiss_table_foreach(ht, entry) {
+         delete_function(entry);
+      }
+   }
+
+   memset(ht->ctrl, CTRL_EMPTY, ht->size + GROUP_WIDTH);
+   ht->entries = 0;
+   ht->deleted_entries = 0;
+}
+
+static struct hash_entry *
+swiss_table_search(struct swiss_table *ht, uint32_t hash, const void *key)
+{
+   uint32_t mixed = mix_hash(hash);
+   uint32_t pos = hash_h1(mixed) & (ht->size - 1);
+   uint32_t stride = 0;
+
+   while (true) {
+      const int8_t *group = ht->ctrl + pos;
+      group_mask match = group_match(group, hash_h2(mixed));
+
+      for (; match; match = mask_next(match)) {
+         struct hash_entry *entry =
+            ht->table + ((pos + mask_first(match)) & (ht->size - 1));
+
+         if (entry->hash == hash && ht->key_equals_function(key, entry->key))
+            return entry;
+      }
+
+      if (group_match_empty(group))
+         return NULL;
+
+      stride += GROUP_WIDTH;
+      pos = (pos + stride) & (ht->size - 1);
+   }
+}
+
+/**
+ * Finds a hash table entry with the given key.
+ *
+ * Returns NULL if no entry is found.  Note that the data pointer may be
+ * modified by the user.
+ */
+struct hash_entry *
+_mesa_swiss_table_search(struct swiss_table *ht, const void *key)
+{
+   assert(ht->key_hash_function);
+   return swiss_table_search(ht, ht->key_hash_function(key), key);
+}
+
+struct hash_entry *
+_mesa_swiss_table_search_pre_hashed(struct swiss_table *ht, uint32_t hash,
+                                    const void *key)
+{
+   assert(ht->key_hash_function == NULL || hash == ht->key_hash_function(key));
+   return swiss_table_search(ht, hash, key);
+}
+
+static bool
+swiss_table_rehash(struct swiss_table *ht, uint32_t new_size)
+{
+   struct hash_entry *old_table = ht->table;
+   int8_t *old_ctrl = ht->ctrl;
+   uint32_t old_size = ht->size;
+   struct hash_entry *table;
+   int8_t *ctrl;
+
+   table = alloc_slots(ralloc_parent(ht->table), new_size,
+                       sizeof(struct hash_entry), &ctrl);
+   if (table == NULL)
+      return false;
+
+   for (uint32_t i = 0; i < old_size; i++) {
+      if (old_ctrl[i] < 0)
+         continue;
+
+      uint32_t mixed = mix_hash(old_table[i].hash);
+      uint32_t slot = find_free_slot(ctrl, new_size, mixed);
+
+      set_ctrl(ctrl, new_size, slot, hash_h2(mixed));
+      table[slot] = old_table[i];
+   }
+
+   ht->table = table;
+   ht->ctrl = ctrl;
+   ht->size = new_size;
+   ht->max_entries = max_entries_for_size(new_size);
+   ht->deleted_entries = 0;
+
+   ralloc_free(old_table);
+   return true;
+}
+
+static struct hash_entry *
+swiss_table_insert(struct swiss_table *ht, uint32_t hash,
+                   const void *key, void *data)
+{
+   struct hash_entry *entry;
+   uint32_t mixed, slot;
+
+   /* Implement replacement when another insert happens with a matching key,
+    * like _mesa_hash_table_insert() does.
+    */
+   entry = swiss_table_search(ht, hash, key);
+   if (entry) {
+      entry->key = key;
+      entry->data = data;
+      return entry;
+   }
+
+   if (ht->entries + ht->deleted_entries >= ht->max_entries &&
+       !swiss_table_rehash(ht, rehash_size(ht->size, ht->entries))) {
+      /* Keep going as long as there is an EMPTY slot left. */
+      if (ht->entries + ht->deleted_entries + 1 >= ht->size)
+         return NULL;
+   }
+
+   mixed = mix_hash(hash);
+   slot = find_free_slot(ht->ctrl, ht->size, mixed);
+   if (ht->ctrl[slot] == CTRL_DELETED)
+      ht->deleted_entries--;
+
+   set_ctrl(ht->ctrl, ht->size, slot, hash_h2(mixed));
+   entry = ht->table + slot;
+   entry->hash = hash;
+   entry->key = key;
+   entry->data = data;
+   ht->entries++;
+
+   return entry;
+}
+
+/**
+ * Inserts the key into the table, replacing the entry with an equal key if
+ * there is one.
+ *
+ * Note that insertion may rearrange the table on a resize or rehash,
+ * so previously found hash_entries are no longer valid after this function.
+ */
+struct hash_entry *
+_mesa_swiss_table_insert(struct swiss_table *ht, const void *key, void *data)
+{
+   assert(ht->key_hash_function);
+   return swiss_table_insert(ht, ht->key_hash_function(key), key, data);
+}
+
+struct hash_entry *
+_mesa_swiss_table_insert_pre_hashed(struct swiss_table *ht, uint32_t hash,
+                                    const void *key, void *data)
+{
+   assert(ht->key_hash_function == NULL || hash == ht->key_hash_function(key));
+   return swiss_table_insert(ht, hash, key, data);
+}
+
+/**
+ * This function deletes the given hash table entry.
+ *
+ * Note that deletion doesn't otherwise modify the table, so an iteration over
+ * the table deleting entries is safe.
+ */
+void
+_mesa_swiss_table_remove(struct swiss_table *ht,
+                         struct hash_entry *entry)
+{
+   if (!entry)
+      return;
+
+   set_ctrl(ht->ctrl, ht->size, entry - ht->table, CTRL_DELETED);
+   ht->entries--;
+   ht->deleted_entries++;
+}
+
+/**
+ * Removes the entry with the corresponding key, if exists.
+ */
+void
+_mesa_swiss_table_remove_key(struct swiss_table *ht, const void *key)
+{
+   _mesa_swiss_table_remove(ht, _mesa_swiss_table_search(ht, key));
+}
+
+/**
+ * This function is an iterator over the hash table.
+ *
+ * Pass in NULL for the first entry, as in the start of a for loop.  Only the
+ * control bytes are scanned, but it is still O(table_size).
+ */
+struct hash_entry *
+_mesa_swiss_table_next_entry(struct swiss_table *ht,
+                             struct hash_entry *entry)
+{
+   uint32_t i = entry ? entry - ht->table + 1 : 0;
+
+   for (; i < ht->size; i++) {
+      if (ht->ctrl[i] >= 0)
+         return ht->table + i;
+   }
+
+   return NULL;
+}
+
+/**
+ * Returns a random entry from the hash table, see
+ * _mesa_hash_table_random_entry().
+ */
+struct hash_entry *
+_mesa_swiss_table_random_entry(struct swiss_table *ht,
+                               bool (*predicate)(struct hash_entry *entry))
+{
+   uint32_t start = rand() & (ht->size - 1);
+
+   if (ht->entries == 0)
+      return NULL;
+
+   for (uint32_t n = 0; n < ht->size; n++) {
+      uint32_t i = (start + n) & (ht->size - 1);
+
+      if (ht->ctrl[i] >= 0 && (!predicate || predicate(&ht->table[i])))
+         return &ht->table[i];
+   }
+
+   return NULL;
+}
+
+/**
+ * Swiss table with inline 64-bit keys.
+ */
+
+static inline uint32_t
+hash_u64(uint64_t key)
+{
+   key ^= key >> 33;
+   key *= 0xff51afd7ed558ccdull;
+   key ^= key >> 33;
+   return key;
+}
+
+struct swiss_table_u64 *
+_mesa_swiss_table_u64_create(void *mem_ctx)
+{
+   struct swiss_table_u64 *ht;
+
+   ht = ralloc(mem_ctx, struct swiss_table_u64);
+   if (ht == NULL)
+      return NULL;
+
+   ht->size = MIN_SIZE;
+   ht->max_entries = max_entries_for_size(ht->size);
+   ht->entries = 0;
+   ht->deleted_entries = 0;
+   ht->table = alloc_slots(ht, ht->size, sizeof(struct swiss_entry_u64),
+                           &ht->ctrl);
+   if (ht->table == NULL) {
+      ralloc_free(ht);
+      return NULL;
+   }
+
+   return ht;
+}
+
+void
+_mesa_swiss_table_u64_destroy(struct swiss_table_u64 *ht)
+{
+   ralloc_free(ht);
+}
+
+void
+_mesa_swiss_table_u64_clear(struct swiss_table_u64 *ht)
+{
+   memset(ht->ctrl, CTRL_EMPTY, ht->size + GROUP_WIDTH);
+   ht->entries = 0;
+   ht->deleted_entries = 0;
+}
+
+struct swiss_entry_u64 *
+_mesa_swiss_table_u64_search(struct swiss_table_u64 *ht, uint64_t key)
+{
+   uint32_t mixed = hash_u64(key);
+   uint32_t pos = hash_h1(mixed) & (ht->size - 1);
+   uint32_t stride = 0;
+
+   while (true) {
+      const int8_t *group = ht->ctrl + pos;
+      group_mask match = group_match(group, hash_h2(mixed));
+
+      for (; match; match = mask_next(match)) {
+         struct swiss_entry_u64 *entry =
+            ht->table + ((pos + mask_first(match)) & (ht->size - 1));
+
+         if (entry->key == key)
+            return entry;
+      }
+
+      if (group_match_empty(group))
+         return NULL;
+
+      stride += GROUP_WIDTH;
+      pos = (pos + stride) & (ht->size - 1);
+   }
+}
+
+static bool
+swiss_table_u64_rehash(struct swiss_table_u64 *ht, uint32_t new_size)
+{
+   struct swiss_entry_u64 *old_table = ht->table;
+   int8_t *old_ctrl = ht->ctrl;
+   uint32_t old_size = ht->size;
+   struct swiss_entry_u64 *table;
+   int8_t *ctrl;
+
+   table = alloc_slots(ht, new_size, sizeof(struct swiss_entry_u64), &ctrl);
+   if (table == NULL)
+      return false;
+
+   for (uint32_t i = 0; i < old_size; i++) {
+      if (old_ctrl[i] < 0)
+         continue;
+
+      uint32_t mixed = hash_u64(old_table[i].key);
+      uint32_t slot = find_free_slot(ctrl, new_size, mixed);
+
+      set_ctrl(ctrl, new_size, slot, hash_h2(mixed));
+      table[slot] = old_table[i];
+   }
+
+   ht->table = table;
+   ht->ctrl = ctrl;
+   ht->size = new_size;
+   ht->max_entries = max_entries_for_size(new_size);
+   ht->deleted_entries = 0;
+
+   ralloc_free(old_table);
+   return true;
+}
+
+/**
+ * Inserts the key, replacing the data of an existing entry for it.
+ */
+struct swiss_entry_u64 *
+_mesa_swiss_table_u64_insert(struct swiss_table_u64 *ht, uint64_t key,
+                             void *data)
+{
+   struct swiss_entry_u64 *entry;
+   uint32_t mixed, slot;
+
+   entry = _mesa_swiss_table_u64_search(ht, key);
+   if (entry) {
+      entry->data = data;
+      return entry;
+   }
+
+   if (ht->entries + ht->deleted_entries >= ht->max_entries &&
+       !swiss_table_u64_rehash(ht, rehash_size(ht->size, ht->entries))) {
+      if (ht->entries + ht->deleted_entries + 1 >= ht->size)
+         return NULL;
+   }
+
+   mixed = hash_u64(key);
+   slot = find_free_slot(ht->ctrl, ht->size, mixed);
+   if (ht->ctrl[slot] == CTRL_DELETED)
+      ht->deleted_entries--;
+
+   set_ctrl(ht->ctrl, ht->size, slot, hash_h2(mixed));
+   entry = ht->table + slot;
+   entry->key = key;
+   entry->data = data;
+   ht->entries++;
+
+   return entry;
+}
+
+void
+_mesa_swiss_table_u64_remove(struct swiss_table_u64 *ht,
+                             struct swiss_entry_u64 *entry)
+{
+   if (!entry)
+      return;
+
+   set_ctrl(ht->ctrl, ht->size, entry - ht->table, CTRL_DELETED);
+   ht->entries--;
+   ht->deleted_entries++;
+}
+
+struct swiss_entry_u64 *
+_mesa_swiss_table_u64_next_entry(struct swiss_table_u64 *ht,
+                                 struct swiss_entry_u64 *entry)
+{
+   uint32_t i = entry ? entry - ht->table + 1 : 0;
+
+   for (; i < ht->size; i++) {
+      if (ht->ctrl[i] >= 0)
+         return ht->table + i;
+   }
+
+   return NULL;
+}
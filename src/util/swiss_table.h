@@ -0,0 +1,198 @@
+/*
+ * Copyright © 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef _SWISS_TABLE_H
+#define _SWISS_TABLE_H
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "hash_table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Open-addressing hash tables with a power-of-two size and one control byte
+ * per slot.
+ *
+ * The control byte of a used slot holds 7 bits of the hash, so a lookup
+ * compares a whole group of control bytes at once (with SSE2 or NEON where
+ * available) and only touches the entries whose bits match.  Apart from
+ * swiss_table_set_deleted_key(), which isn't needed, the API is the same as
+ * the one of struct hash_table, and so are the guarantees about iterating
+ * while removing entries.
+ *
+ * The u64 and u32 variants store their keys inline, next to the data.
+ */
+struct swiss_table {
+   struct hash_entry *table;
+   int8_t *ctrl;
+   uint32_t (*key_hash_function)(const void *key);
+   bool (*key_equals_function)(const void *a, const void *b);
+   uint32_t size;
+   uint32_t max_entries;
+   uint32_t entries;
+   uint32_t deleted_entries;
+};
+
+struct swiss_table *
+_mesa_swiss_table_create(void *mem_ctx,
+                         uint32_t (*key_hash_function)(const void *key),
+                         bool (*key_equals_function)(const void *a,
+                                                     const void *b));
+
+bool
+_mesa_swiss_table_init(struct swiss_table *ht,
+                       void *mem_ctx,
+                       uint32_t (*key_hash_function)(const void *key),
+                       bool (*key_equals_function)(const void *a,
+                                                   const void *b));
+
+struct swiss_table *
+_mesa_swiss_table_clone(struct swiss_table *src, void *dst_mem_ctx);
+void _mesa_swiss_table_destroy(struct swiss_table *ht,
+                               void (*delete_function)(struct hash_entry *entry));
+void _mesa_swiss_table_clear(struct swiss_table *ht,
+                             void (*delete_function)(struct hash_entry *entry));
+
+static inline uint32_t _mesa_swiss_table_num_entries(struct swiss_table *ht)
+{
+   return ht->entries;
+}
+
+struct hash_entry *
+_mesa_swiss_table_insert(struct swiss_table *ht, const void *key, void *data);
+struct hash_entry *
+_mesa_swiss_table_insert_pre_hashed(struct swiss_table *ht, uint32_t hash,
+                                    const void *key, void *data);
+struct hash_entry *
+_mesa_swiss_table_search(struct swiss_table *ht, const void *key);
+struct hash_entry *
+_mesa_swiss_table_search_pre_hashed(struct swiss_table *ht, uint32_t hash,
+                                    const void *key);
+void _mesa_swiss_table_remove(struct swiss_table *ht,
+                              struct hash_entry *entry);
+void _mesa_swiss_table_remove_key(struct swiss_table *ht,
+                                  const void *key);
+
+struct hash_entry *_mesa_swiss_table_next_entry(struct swiss_table *ht,
+                                                struct hash_entry *entry);
+struct hash_entry *
+_mesa_swiss_table_random_entry(struct swiss_table *ht,
+                               bool (*predicate)(struct hash_entry *entry));
+
+/**
+ * This foreach function is safe against deletion, but not against insertion
+ * (which may rehash the table, making entry a dangling pointer).
+ */
+#define swiss_table_foreach(ht, entry)                                     \
+   for (struct hash_entry *entry = _mesa_swiss_table_next_entry(ht, NULL); \
+        entry != NULL;                                                     \
+        entry = _mesa_swiss_table_next_entry(ht, entry))
+
+/**
+ * Swiss table with inline 64-bit keys.  Every key value is valid, including
+ * 0, and no separate allocation is made per entry.
+ */
+struct swiss_entry_u64 {
+   uint64_t key;
+   void *data;
+};
+
+struct swiss_table_u64 {
+   struct swiss_entry_u64 *table;
+   int8_t *ctrl;
+   uint32_t size;
+   uint32_t max_entries;
+   uint32_t entries;
+   uint32_t deleted_entries;
+};
+
+struct swiss_table_u64 *
+_mesa_swiss_table_u64_create(void *mem_ctx);
+
+void
+_mesa_swiss_table_u64_destroy(struct swiss_table_u64 *ht);
+
+void
+_mesa_swiss_table_u64_clear(struct swiss_table_u64 *ht);
+
+static inline uint32_t
+_mesa_swiss_table_u64_num_entries(struct swiss_table_u64 *ht)
+{
+   return ht->entries;
+}
+
+struct swiss_entry_u64 *
+_mesa_swiss_table_u64_insert(struct swiss_table_u64 *ht, uint64_t key,
+                             void *data);
+
+struct swiss_entry_u64 *
+_mesa_swiss_table_u64_search(struct swiss_table_u64 *ht, uint64_t key);
+
+void
+_mesa_swiss_table_u64_remove(struct swiss_table_u64 *ht,
+                             struct swiss_entry_u64 *entry);
+
+struct swiss_entry_u64 *
+_mesa_swiss_table_u64_next_entry(struct swiss_table_u64 *ht,
+                                 struct swiss_entry_u64 *entry);
+
+#define swiss_table_u64_foreach(ht, entry)                                  \
+   for (struct swiss_entry_u64 *entry =                                     \
+           _mesa_swiss_table_u64_next_entry(ht, NULL);                      \
+        entry != NULL;                                                      \
+        entry = _mesa_swiss_table_u64_next_entry(ht, entry))
+
+/**
+ * 32-bit keys use the u64 table: on 64-bit builds an entry takes 16 bytes
+ * either way.
+ */
+static inline void *
+_mesa_swiss_table_u32_search(struct swiss_table_u64 *ht, uint32_t key)
+{
+   struct swiss_entry_u64 *entry = _mesa_swiss_table_u64_search(ht, key);
+   return entry ? entry->data : NULL;
+}
+
+static inline void
+_mesa_swiss_table_u32_insert(struct swiss_table_u64 *ht, uint32_t key,
+                             void *data)
+{
+   _mesa_swiss_table_u64_insert(ht, key, data);
+}
+
+static inline void
+_mesa_swiss_table_u32_remove(struct swiss_table_u64 *ht, uint32_t key)
+{
+   _mesa_swiss_table_u64_remove(ht, _mesa_swiss_table_u64_search(ht, key));
+}
+
+#ifdef __cplusplus
+} /* extern C */
+#endif
+
+#endif /* _SWISS_TABLE_H */
@@ -0,0 +1,304 @@
+/*
+ * Copyright © 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Checks that swiss_table behaves like hash_table over a random sequence of
+ * operations, checks the inline u64 keys, and prints how long both take to
+ * insert and look up a million pointers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hash_table.h"
+#include "os_time.h"
+#include "swiss_table.h"
+
+#define NUM_OPS 200000
+#define KEY_RANGE 5000
+#define BENCH_SIZE (1 << 20)
+
+static bool
+test_against_hash_table(void)
+{
+   static uint32_t keys[KEY_RANGE];
+   struct hash_table *ht;
+   struct swiss_table *st;
+   unsigned count;
+   bool pass = true;
+
+   ht = _mesa_hash_table_create(NULL, _mesa_hash_pointer,
+                                _mesa_key_pointer_equal);
+   st = _mesa_swiss_table_create(NULL, _mesa_hash_pointer,
+                                 _mesa_key_pointer_equal);
+
+   srand(0);
+   for (unsigned i = 0; i < NUM_OPS && pass; i++) {
+      uint32_t *key = &keys[rand() % KEY_RANGE];
+      void *data = (void *)(uintptr_t)(i + 1);
+      struct hash_entry *a, *b;
+
+      switch (rand() % 3) {
+      case 0:
+         _mesa_hash_table_insert(ht, key, data);
+         _mesa_swiss_table_insert(st, key, data);
+         break;
+      case 1:
+         _mesa_hash_table_remove_key(ht, key);
+         _mesa_swiss_table_remove_key(st, key);
+         break;
+      default:
+         a = _mesa_hash_table_search(ht, key);
+         b = _mesa_swiss_table_search(st, key);
+         if (!a != !b || (a && a->data != b->data)) {
+            fprintf(stderr, "op %u: lookups differ\n", i);
+            pass = false;
+         }
+         break;
+      }
+
+      if (ht->entries != st->entries) {
+         fprintf(stderr, "op %u: %u entries instead of %u\n", i,
+                 st->entries, ht->entries);
+         pass = false;
+      }
+   }
+
+   count = 0;
+   swiss_table_foreach(st, entry) {
+      struct hash_entry *a = _mesa_hash_table_search(ht, entry->key);
+
+      if (!a || a->data != entry->data) {
+         fprintf(stderr, "iteration found an unknown entry\n");
+         pass = false;
+      }
+      count++;
+   }
+   if (count != st->entries) {
+      fprintf(stderr, "iteration found %u of %u entries\n", count,
+              st->entries);
+      pass = false;
+   }
+
+   /* Removing while iterating is allowed. */
+   swiss_table_foreach(st, entry)
+      _mesa_swiss_table_remove(st, entry);
+   if (st->entries != 0 || _mesa_swiss_table_next_entry(st, NULL)) {
+      fprintf(stderr, "table not empty after removing everything\n");
+      pass = false;
+   }
+
+   _mesa_hash_table_destroy(ht, NULL);
+   _mesa_swiss_table_destroy(st, NULL);
+   return pass;
+}
+
+static bool
+test_u64(void)
+{
+   struct swiss_table_u64 *st = _mesa_swiss_table_u64_create(NULL);
+   struct hash_table_u64 *ht = _mesa_hash_table_u64_create(NULL);
+   static const uint64_t special[] = { 0, 1, UINT64_MAX, 1ull << 32 };
+   bool pass = true;
+
+   for (unsigned i = 0; i < ARRAY_SIZE(special); i++) {
+      _mesa_swiss_table_u64_insert(st, special[i], (void *)(uintptr_t)(i + 1));
+      _mesa_hash_table_u64_insert(ht, special[i], (void *)(uintptr_t)(i + 1));
+   }
+
+   for (uint64_t key = 2; key < 100000; key++) {
+      _mesa_swiss_table_u64_insert(st, key << 20 | 3,
+                                   (void *)(uintptr_t)key);
+   }
+   for (uint64_t key = 2; key < 100000; key += 2) {
+      struct swiss_entry_u64 *entry =
+         _mesa_swiss_table_u64_search(st, key << 20 | 3);
+
+      _mesa_swiss_table_u64_remove(st, entry);
+   }
+
+   for (unsigned i = 0; i < ARRAY_SIZE(special); i++) {
+      struct swiss_entry_u64 *entry =
+         _mesa_swiss_table_u64_search(st, special[i]);
+
+      if (!entry || entry->data != (void *)(uintptr_t)(i + 1) ||
+          _mesa_hash_table_u64_search(ht, special[i]) != entry->data) {
+         fprintf(stderr, "u64: key %" PRIx64 " lost\n", special[i]);
+         pass = false;
+      }
+   }
+
+   for (uint64_t key = 2; key < 100000; key++) {
+      struct swiss_entry_u64 *entry =
+         _mesa_swiss_table_u64_search(st, key << 20 | 3);
+
+      if ((key & 1) != (entry != NULL) ||
+          (entry && entry->data != (void *)(uintptr_t)key)) {
+         fprintf(stderr, "u64: wrong result for key %" PRIx64 "\n", key);
+         pass = false;
+         break;
+      }
+   }
+
+   if (st->entries != ARRAY_SIZE(special) + 49999) {
+      fprintf(stderr, "u64: %u entries\n", st->entries);
+      pass = false;
+   }
+
+   _mesa_hash_table_u64_remove(ht, 0);
+   if (_mesa_hash_table_u64_search(ht, 0) ||
+       !_mesa_hash_table_u64_search(ht, 1)) {
+      fprintf(stderr, "u64: remove failed\n");
+      pass = false;
+   }
+
+   _mesa_swiss_table_u64_destroy(st);
+   _mesa_hash_table_u64_destroy(ht, NULL);
+   return pass;
+}
+
+static void
+print_time(const char *name, int64_t start, int64_t end)
+{
+   printf("%-32s %8.2f ns/op\n", name, (double)(end - start) / BENCH_SIZE);
+}
+
+static void
+bench_pointers(void **keys)
+{
+   struct hash_table *ht;
+   struct swiss_table *st;
+   unsigned found = 0;
+   int64_t t0, t1, t2, t3;
+
+   ht = _mesa_hash_table_create(NULL, _mesa_hash_pointer,
+                                _mesa_key_pointer_equal);
+   t0 = os_time_get_nano();
+   for (unsigned i = 0; i < BENCH_SIZE; i++)
+      _mesa_hash_table_insert(ht, keys[i], NULL);
+   t1 = os_time_get_nano();
+   for (unsigned i = 0; i < BENCH_SIZE; i++)
+      found += _mesa_hash_table_search(ht, keys[i]) != NULL;
+   t2 = os_time_get_nano();
+   for (unsigned i = 0; i < BENCH_SIZE; i++)
+      found += _mesa_hash_table_search(ht, keys[BENCH_SIZE + i]) != NULL;
+   t3 = os_time_get_nano();
+   print_time("hash_table insert", t0, t1);
+   print_time("hash_table search", t1, t2);
+   print_time("hash_table search (missing)", t2, t3);
+   _mesa_hash_table_destroy(ht, NULL);
+
+   st = _mesa_swiss_table_create(NULL, _mesa_hash_pointer,
+                                 _mesa_key_pointer_equal);
+   t0 = os_time_get_nano();
+   for (unsigned i = 0; i < BENCH_SIZE; i++)
+      _mesa_swiss_table_insert(st, keys[i], NULL);
+   t1 = os_time_get_nano();
+   for (unsigned i = 0; i < BENCH_SIZE; i++)
+      found += _mesa_swiss_table_search(st, keys[i]) != NULL;
+   t2 = os_time_get_nano();
+   for (unsigned i = 0; i < BENCH_SIZE; i++)
+      found += _mesa_swiss_table_search(st, keys[BENCH_SIZE + i]) != NULL;
+   t3 = os_time_get_nano();
+   print_time("swiss_table insert", t0, t1);
+   print_time("swiss_table search", t1, t2);
+   print_time("swiss_table search (missing)", t2, t3);
+   _mesa_swiss_table_destroy(st, NULL);
+
+   if (found != 2 * BENCH_SIZE)
+      fprintf(stderr, "bench: found %u keys\n", found);
+}
+
+static void
+bench_u64(void)
+{
+   struct hash_table *ht;
+   struct swiss_table_u64 *st;
+   uint64_t *keys = malloc(BENCH_SIZE * sizeof(*keys));
+   unsigned found = 0;
+   int64_t t0, t1, t2;
+
+   srand(1);
+   for (unsigned i = 0; i < BENCH_SIZE; i++)
+      keys[i] = ((uint64_t)rand() << 32 | rand()) | 2;
+
+   /* What hash_table_u64 used to do on 64-bit builds. */
+   ht = _mesa_hash_table_create(NULL, _mesa_hash_pointer,
+                                _mesa_key_pointer_equal);
+   t0 = os_time_get_nano();
+   for (unsigned i = 0; i < BENCH_SIZE; i++)
+      _mesa_hash_table_insert(ht, (void *)(uintptr_t)keys[i], NULL);
+   t1 = os_time_get_nano();
+   for (unsigned i = 0; i < BENCH_SIZE; i++)
+      found += _mesa_hash_table_search(ht, (void *)(uintptr_t)keys[i]) != NULL;
+   t2 = os_time_get_nano();
+   print_time("hash_table u64 insert", t0, t1);
+   print_time("hash_table u64 search", t1, t2);
+   _mesa_hash_table_destroy(ht, NULL);
+
+   st = _mesa_swiss_table_u64_create(NULL);
+   t0 = os_time_get_nano();
+   for (unsigned i = 0; i < BENCH_SIZE; i++)
+      _mesa_swiss_table_u64_insert(st, keys[i], NULL);
+   t1 = os_time_get_nano();
+   for (unsigned i = 0; i < BENCH_SIZE; i++)
+      found += _mesa_swiss_table_u64_search(st, keys[i]) != NULL;
+   t2 = os_time_get_nano();
+   print_time("swiss_table_u64 insert", t0, t1);
+   print_time("swiss_table_u64 search", t1, t2);
+   _mesa_swiss_table_u64_destroy(st);
+
+   (void) found;
+   free(keys);
+}
+
+int
+main(int argc, char **argv)
+{
+   uint32_t *values = malloc(2 * BENCH_SIZE * sizeof(*values));
+   void **keys = malloc(2 * BENCH_SIZE * sizeof(*keys));
+   bool pass = true;
+
+   (void) argc;
+   (void) argv;
+
+   pass &= test_against_hash_table();
+   pass &= test_u64();
+
+   /* Shuffled, so that consecutive keys aren't next to each other in memory
+    * as they would rarely be in a compiler.
+    */
+   srand(2);
+   for (unsigned i = 0; i < 2 * BENCH_SIZE; i++) {
+      unsigned j = rand() % (i + 1);
+
+      keys[i] = keys[j];
+      keys[j] = &values[i];
+   }
+
+   bench_pointers(keys);
+   bench_u64();
+
+   free(keys);
+   free(values);
+   return pass ? 0 : 1;
+}
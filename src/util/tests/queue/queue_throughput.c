@@ -0,0 +1,222 @@
+/*
+ * Copyright © 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Checks that every job added to a util_queue runs, in the priority order
+ * asked for, and prints how many small jobs per second each mode gets
+ * through.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/os_time.h"
+#include "util/u_atomic.h"
+#include "util/u_queue.h"
+
+#define NUM_JOBS 100000
+#define BATCH_SIZE 64
+#define NUM_THREADS 4
+
+static int num_executed;
+
+static void
+count_execute(void *data, int thread_index)
+{
+   unsigned *value = data;
+
+   /* A little bit of work, so that this isn't only measuring the locks. */
+   for (unsigned i = 0; i < 64; i++)
+      *value = *value * 1664525 + 1013904223;
+
+   p_atomic_inc(&num_executed);
+}
+
+static bool
+run_throughput(const char *name, unsigned flags, unsigned batch_size)
+{
+   struct util_queue queue;
+   struct util_queue_fence *fences;
+   struct util_queue_fence **fence_ptrs;
+   unsigned *values;
+   void **jobs;
+   int64_t start, end;
+   bool pass = true;
+
+   fences = calloc(NUM_JOBS, sizeof(*fences));
+   fence_ptrs = calloc(NUM_JOBS, sizeof(*fence_ptrs));
+   values = calloc(NUM_JOBS, sizeof(*values));
+   jobs = calloc(NUM_JOBS, sizeof(*jobs));
+   if (!fences || !fence_ptrs || !values || !jobs ||
+       !util_queue_init(&queue, "bench", 32, NUM_THREADS, flags)) {
+      fprintf(stderr, "%s: initialization failed\n", name);
+      return false;
+   }
+
+   for (unsigned i = 0; i < NUM_JOBS; i++) {
+      util_queue_fence_init(&fences[i]);
+      fence_ptrs[i] = &fences[i];
+      values[i] = i;
+      jobs[i] = &values[i];
+   }
+
+   num_executed = 0;
+   start = os_time_get_nano();
+
+   for (unsigned i = 0; i < NUM_JOBS; i += batch_size) {
+      unsigned n = MIN2(batch_size, NUM_JOBS - i);
+
+      if (n == 1) {
+         util_queue_add_job(&queue, jobs[i], fence_ptrs[i], count_execute,
+                            NULL);
+      } else {
+         util_queue_add_jobs(&queue, n, &jobs[i], &fence_ptrs[i],
+                             count_execute, NULL, UTIL_QUEUE_PRIORITY_NORMAL);
+      }
+   }
+   util_queue_finish(&queue);
+
+   end = os_time_get_nano();
+
+   if (p_atomic_read(&num_executed) != NUM_JOBS) {
+      fprintf(stderr, "%s: %d of %d jobs executed\n", name,
+              p_atomic_read(&num_executed), NUM_JOBS);
+      pass = false;
+   }
+
+   for (unsigned i = 0; i < NUM_JOBS; i++) {
+      if (!util_queue_fence_is_signalled(&fences[i])) {
+         fprintf(stderr, "%s: job %u not signalled\n", name, i);
+         pass = false;
+         break;
+      }
+   }
+
+   printf("%-24s %8.2f Mjobs/s\n", name,
+          NUM_JOBS * 1000.0 / MAX2(end - start, 1));
+
+   util_queue_destroy(&queue);
+   for (unsigned i = 0; i < NUM_JOBS; i++)
+      util_queue_fence_destroy(&fences[i]);
+   free(fences);
+   free(fence_ptrs);
+   free(values);
+   free(jobs);
+   return pass;
+}
+
+static struct util_queue_fence release_fence;
+static unsigned order[3];
+static unsigned num_ordered;
+
+static void
+block_execute(void *data, int thread_index)
+{
+   util_queue_fence_wait(&release_fence);
+}
+
+static void
+order_execute(void *data, int thread_index)
+{
+   order[num_ordered++] = *(unsigned *)data;
+}
+
+static bool
+run_priorities(const char *name, unsigned flags)
+{
+   static const enum util_queue_priority priorities[3] = {
+      UTIL_QUEUE_PRIORITY_LOW,
+      UTIL_QUEUE_PRIORITY_NORMAL,
+      UTIL_QUEUE_PRIORITY_HIGH,
+   };
+   struct util_queue queue;
+   struct util_queue_fence block, fences[3], dropped;
+   unsigned values[3], dropped_value = 0;
+   bool pass = true;
+
+   if (!util_queue_init(&queue, "prio", 4, 1, flags))
+      return false;
+
+   /* Keep the only thread busy while the jobs are queued. */
+   util_queue_fence_init(&release_fence);
+   util_queue_fence_reset(&release_fence);
+   util_queue_fence_init(&block);
+   util_queue_add_job(&queue, &block, &block, block_execute, NULL);
+
+   num_ordered = 0;
+   for (unsigned i = 0; i < 3; i++) {
+      values[i] = priorities[i];
+      util_queue_fence_init(&fences[i]);
+      util_queue_add_job_with_priority(&queue, &values[i], &fences[i],
+                                       order_execute, NULL, priorities[i]);
+   }
+
+   util_queue_fence_init(&dropped);
+   util_queue_add_job(&queue, &dropped_value, &dropped, count_execute, NULL);
+   util_queue_drop_job(&queue, &dropped);
+
+   util_queue_fence_signal(&release_fence);
+   util_queue_finish(&queue);
+
+   if (num_ordered != 3 || order[0] != UTIL_QUEUE_PRIORITY_HIGH ||
+       order[1] != UTIL_QUEUE_PRIORITY_NORMAL ||
+       order[2] != UTIL_QUEUE_PRIORITY_LOW) {
+      fprintf(stderr, "%s: jobs executed out of priority order\n", name);
+      pass = false;
+   }
+   if (dropped_value != 0) {
+      fprintf(stderr, "%s: dropped job executed\n", name);
+      pass = false;
+   }
+
+   util_queue_destroy(&queue);
+   for (unsigned i = 0; i < 3; i++)
+      util_queue_fence_destroy(&fences[i]);
+   util_queue_fence_destroy(&dropped);
+   util_queue_fence_destroy(&block);
+   util_queue_fence_destroy(&release_fence);
+   return pass;
+}
+
+int
+main(int argc, char **argv)
+{
+   bool pass = true;
+
+   (void) argc;
+   (void) argv;
+
+   pass &= run_priorities("shared", 0);
+   pass &= run_priorities("work stealing", UTIL_QUEUE_INIT_WORK_STEALING);
+
+   pass &= run_throughput("shared", 0, 1);
+   pass &= run_throughput("shared, batched", 0, BATCH_SIZE);
+   pass &= run_throughput("resizable", UTIL_QUEUE_INIT_RESIZE_IF_FULL, 1);
+   pass &= run_throughput("resizable, batched",
+                          UTIL_QUEUE_INIT_RESIZE_IF_FULL, BATCH_SIZE);
+   pass &= run_throughput("work stealing", UTIL_QUEUE_INIT_WORK_STEALING, 1);
+   pass &= run_throughput("work stealing, batched",
+                          UTIL_QUEUE_INIT_WORK_STEALING, BATCH_SIZE);
+
+   return pass ? 0 : 1;
+}
@@ -0,0 +1,305 @@
+/*
+ * Copyright © 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Checks that allocations under an arena context behave like other ralloc
+ * allocations, including when they are stolen in and out of the arena, and
+ * prints how long it takes to build and free a tree of small nodes with and
+ * without an arena.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/os_time.h"
+#include "util/ralloc.h"
+
+#define BENCH_NODES (1 << 20)
+
+static unsigned destroyed[8];
+
+static void
+destroy(void *ptr)
+{
+   destroyed[*(unsigned *) ptr]++;
+}
+
+static unsigned *
+alloc_tracked(const void *ctx, unsigned id)
+{
+   unsigned *ptr = ralloc(ctx, unsigned);
+
+   *ptr = id;
+   ralloc_set_destructor(ptr, destroy);
+   return ptr;
+}
+
+static bool
+check_destroyed(const char *what, const unsigned *expected)
+{
+   bool pass = true;
+
+   for (unsigned i = 0; i < ARRAY_SIZE(destroyed); i++) {
+      if (destroyed[i] != expected[i]) {
+         fprintf(stderr, "%s: destructor %u ran %u times instead of %u\n",
+                 what, i, destroyed[i], expected[i]);
+         pass = false;
+      }
+   }
+   return pass;
+}
+
+static bool
+test_basic(void)
+{
+   void *ctx = ralloc_context(NULL);
+   void *arena = ralloc_arena_context(ctx);
+   void *sub = ralloc_context(arena);
+   uint32_t *zeros, *array, *large;
+   char *str;
+   bool pass = true;
+
+   if (ralloc_parent(arena) != ctx || ralloc_parent(sub) != arena) {
+      fprintf(stderr, "basic: wrong parents\n");
+      pass = false;
+   }
+
+   zeros = rzalloc_array(sub, uint32_t, 100);
+   for (unsigned i = 0; i < 100; i++)
+      pass &= zeros[i] == 0;
+
+   /* Grows in place first, then has to move once something follows it. */
+   array = ralloc_array(sub, uint32_t, 4);
+   for (unsigned i = 0; i < 4; i++)
+      array[i] = i;
+   array = reralloc(sub, array, uint32_t, 64);
+   for (unsigned i = 4; i < 64; i++)
+      array[i] = i;
+   ralloc(sub, uint64_t);
+   array = reralloc(sub, array, uint32_t, 1000);
+   for (unsigned i = 0; i < 64; i++)
+      pass &= array[i] == i;
+   if (ralloc_parent(array) != sub) {
+      fprintf(stderr, "basic: reralloc lost the parent\n");
+      pass = false;
+   }
+
+   str = ralloc_strdup(sub, "arena");
+   ralloc_strcat(&str, " strings");
+   ralloc_asprintf_append(&str, " %d", 42);
+   if (strcmp(str, "arena strings 42") != 0) {
+      fprintf(stderr, "basic: got \"%s\"\n", str);
+      pass = false;
+   }
+
+   large = ralloc_array(sub, uint32_t, 100000);
+   memset(large, 0xff, 100000 * sizeof(uint32_t));
+   if ((uintptr_t) large % sizeof(void *) != 0 ||
+       (uintptr_t) ralloc(sub, char) % sizeof(void *) != 0) {
+      fprintf(stderr, "basic: misaligned allocation\n");
+      pass = false;
+   }
+
+   /* Freeing things individually is allowed, freeing the context frees
+    * everything.
+    */
+   ralloc_free(zeros);
+   ralloc_free(sub);
+   ralloc_free(ctx);
+   return pass;
+}
+
+static bool
+test_destructors(void)
+{
+   void *arena = ralloc_arena_context(NULL);
+   unsigned *a = alloc_tracked(arena, 0);
+   unsigned *b = alloc_tracked(a, 1);
+   unsigned *c = alloc_tracked(arena, 2);
+   unsigned expected[8] = { 0 };
+   bool pass = true;
+
+   alloc_tracked(c, 3);
+   ralloc_set_destructor(b, NULL);
+
+   /* The children's destructors wait for the arena. */
+   ralloc_free(c);
+   expected[2] = 1;
+   pass &= check_destroyed("destructors", expected);
+
+   ralloc_free(arena);
+   expected[0] = expected[3] = 1;
+   pass &= check_destroyed("destructors", expected);
+
+   memset(destroyed, 0, sizeof(destroyed));
+   return pass;
+}
+
+static bool
+test_steal(void)
+{
+   void *ctx = ralloc_context(NULL);
+   void *arena = ralloc_arena_context(NULL);
+   unsigned *a = alloc_tracked(arena, 0);
+   unsigned *b = alloc_tracked(a, 1);
+   unsigned *c = alloc_tracked(arena, 2);
+   unsigned *d = alloc_tracked(arena, 3);
+   unsigned *heap = alloc_tracked(NULL, 4);
+   unsigned expected[8] = { 0 };
+   bool pass = true;
+
+   /* Out of the arena and back. */
+   ralloc_steal(ctx, c);
+   ralloc_steal(a, c);
+   if (ralloc_parent(c) != a) {
+      fprintf(stderr, "steal: c didn't come back\n");
+      pass = false;
+   }
+
+   /* Out of the arena for good, taking its child along. */
+   ralloc_steal(ctx, a);
+   ralloc_steal(NULL, d);
+   ralloc_steal(ctx, d);
+   if (ralloc_parent(a) != ctx || ralloc_parent(b) != a ||
+       ralloc_parent(d) != ctx) {
+      fprintf(stderr, "steal: wrong parents after stealing out\n");
+      pass = false;
+   }
+
+   /* A heap allocation under an arena allocation. */
+   ralloc_steal(b, heap);
+   if (ralloc_parent(heap) != b) {
+      fprintf(stderr, "steal: wrong parent for a heap allocation\n");
+      pass = false;
+   }
+
+   ralloc_free(arena);
+   pass &= check_destroyed("steal", expected);
+   if (*a != 0 || *b != 1 || *d != 3) {
+      fprintf(stderr, "steal: stolen allocations freed with the arena\n");
+      pass = false;
+   }
+
+   ralloc_free(d);
+   expected[3] = 1;
+   pass &= check_destroyed("steal", expected);
+
+   /* Releases the arena, and everything left with it. */
+   ralloc_free(ctx);
+   expected[0] = expected[1] = expected[2] = expected[4] = 1;
+   pass &= check_destroyed("steal", expected);
+
+   memset(destroyed, 0, sizeof(destroyed));
+   return pass;
+}
+
+static bool
+test_nesting(void)
+{
+   void *outer = ralloc_arena_context(NULL);
+   void *node = ralloc_size(outer, 24);
+   void *inner = ralloc_arena_context(node);
+   void *linear, *other;
+   unsigned expected[8] = { 0 };
+   char *str;
+   bool pass = true;
+
+   alloc_tracked(inner, 5);
+   if (ralloc_parent(inner) != node) {
+      fprintf(stderr, "nesting: wrong parent for the inner arena\n");
+      pass = false;
+   }
+
+   /* An allocation moving between two arenas. */
+   other = ralloc_size(inner, 8);
+   ralloc_steal(node, other);
+   if (ralloc_parent(other) != node) {
+      fprintf(stderr, "nesting: wrong parent after changing arenas\n");
+      pass = false;
+   }
+
+   linear = linear_alloc_parent(inner, 16);
+   str = linear_strdup(linear, "linear");
+   for (unsigned i = 0; i < 1000; i++)
+      linear_strcat(linear, &str, "!");
+   if (strlen(str) != 1006) {
+      fprintf(stderr, "nesting: linear string has the wrong length\n");
+      pass = false;
+   }
+   linear_free_parent(linear);
+
+   ralloc_free(outer);
+   expected[5] = 1;
+   pass &= check_destroyed("nesting", expected);
+
+   memset(destroyed, 0, sizeof(destroyed));
+   return pass;
+}
+
+struct node {
+   struct node *parent;
+   uint32_t data[4];
+};
+
+static void
+bench_tree(const char *name, bool arena)
+{
+   void *ctx = arena ? ralloc_arena_context(NULL) : ralloc_context(NULL);
+   struct node **nodes = malloc(BENCH_NODES * sizeof(*nodes));
+   int64_t t0, t1, t2;
+
+   t0 = os_time_get_nano();
+   for (unsigned i = 0; i < BENCH_NODES; i++) {
+      void *parent = i < 16 ? ctx : nodes[i / 16];
+
+      nodes[i] = ralloc(parent, struct node);
+      nodes[i]->parent = parent;
+   }
+   t1 = os_time_get_nano();
+   ralloc_free(ctx);
+   t2 = os_time_get_nano();
+
+   printf("%-8s allocate %6.2f ns/node, free %7.2f ms\n", name,
+          (double) (t1 - t0) / BENCH_NODES, (t2 - t1) / 1000000.0);
+   free(nodes);
+}
+
+int
+main(int argc, char **argv)
+{
+   bool pass = true;
+
+   (void) argc;
+   (void) argv;
+
+   pass &= test_basic();
+   pass &= test_destructors();
+   pass &= test_steal();
+   pass &= test_nesting();
+
+   bench_tree("ralloc", false);
+   bench_tree("arena", true);
+
+   return pass ? 0 : 1;
+}
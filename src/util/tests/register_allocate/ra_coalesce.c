@@ -0,0 +1,225 @@
+/*
+ * Copyright © 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Checks move coalescing and the choice of spill candidates. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util/ralloc.h"
+#include "util/register_allocate.h"
+
+#define NUM_REGS 16
+
+static struct ra_regs *
+create_reg_set(void *mem_ctx, unsigned num_regs)
+{
+   struct ra_regs *regs = ra_alloc_reg_set(mem_ctx, num_regs, true);
+   unsigned c = ra_alloc_reg_class(regs);
+
+   for (unsigned i = 0; i < num_regs; i++)
+      ra_class_add_reg(regs, c, i);
+
+   ra_set_finalize(regs, NULL);
+   return regs;
+}
+
+/* A chain of copies a -> b -> c, each with a neighbor of its own, should
+ * end up in one register.  A copy between interfering nodes can't.
+ */
+static bool
+test_chain(struct ra_regs *regs)
+{
+   struct ra_graph *g = ra_alloc_interference_graph(regs, 6);
+   bool pass = true;
+
+   for (unsigned i = 0; i < 6; i++)
+      ra_set_node_class(g, i, 0);
+
+   ra_add_node_interference(g, 0, 3);
+   ra_add_node_interference(g, 1, 4);
+   ra_add_node_interference(g, 2, 5);
+   ra_add_node_interference(g, 4, 5);
+   ra_add_node_move(g, 0, 1);
+   ra_add_node_move(g, 1, 2);
+   ra_add_node_move(g, 4, 5);
+
+   if (!ra_allocate(g)) {
+      fprintf(stderr, "chain: allocation failed\n");
+      pass = false;
+   } else {
+      if (ra_get_node_reg(g, 0) != ra_get_node_reg(g, 1) ||
+          ra_get_node_reg(g, 1) != ra_get_node_reg(g, 2)) {
+         fprintf(stderr, "chain: copies not coalesced\n");
+         pass = false;
+      }
+      if (ra_get_node_reg(g, 4) == ra_get_node_reg(g, 5)) {
+         fprintf(stderr, "chain: interfering nodes coalesced\n");
+         pass = false;
+      }
+      if (ra_get_node_reg(g, 0) == ra_get_node_reg(g, 3) ||
+          ra_get_node_reg(g, 1) == ra_get_node_reg(g, 4) ||
+          ra_get_node_reg(g, 2) == ra_get_node_reg(g, 5)) {
+         fprintf(stderr, "chain: interference ignored\n");
+         pass = false;
+      }
+   }
+
+   ralloc_free(g);
+   return pass;
+}
+
+/* Random live ranges where most values start as a copy of one that just
+ * died.  The coloring must stay valid, and the copies should mostly go.
+ */
+static bool
+test_random(struct ra_regs *regs, unsigned count, unsigned max_length)
+{
+   struct ra_graph *g = ra_alloc_interference_graph(regs, count);
+   unsigned *start = malloc(count * sizeof(unsigned));
+   unsigned *end = malloc(count * sizeof(unsigned));
+   unsigned *copy_of = malloc(count * sizeof(unsigned));
+   unsigned num_moves = 0, num_coalesced = 0;
+   bool pass = true;
+
+   srand(count);
+   for (unsigned i = 0; i < count; i++) {
+      start[i] = i;
+      end[i] = i + 1 + rand() % max_length;
+      ra_set_node_class(g, i, 0);
+   }
+
+   for (unsigned i = 0; i < count; i++) {
+      for (unsigned j = i + 1; j < count && start[j] < end[i]; j++)
+         ra_add_node_interference(g, i, j);
+   }
+
+   for (unsigned i = 0; i < count; i++) {
+      copy_of[i] = ~0u;
+      for (unsigned j = i > max_length ? i - max_length : 0; j < i; j++) {
+         if (end[j] == start[i]) {
+            copy_of[i] = j;
+            ra_add_node_move(g, i, j);
+            num_moves++;
+            break;
+         }
+      }
+   }
+
+   if (!ra_allocate(g)) {
+      fprintf(stderr, "random: allocation failed\n");
+      pass = false;
+      goto done;
+   }
+
+   for (unsigned i = 0; i < count; i++) {
+      for (unsigned j = i + 1; j < count && start[j] < end[i]; j++) {
+         if (ra_get_node_reg(g, i) == ra_get_node_reg(g, j)) {
+            fprintf(stderr, "random: nodes %u and %u share reg %u\n",
+                    i, j, ra_get_node_reg(g, i));
+            pass = false;
+         }
+      }
+
+      if (copy_of[i] != ~0u &&
+          ra_get_node_reg(g, i) == ra_get_node_reg(g, copy_of[i]))
+         num_coalesced++;
+   }
+
+   printf("random: %u of %u copies coalesced\n", num_coalesced, num_moves);
+   if (num_coalesced < num_moves / 2) {
+      fprintf(stderr, "random: too few copies coalesced\n");
+      pass = false;
+   }
+
+done:
+   free(start);
+   free(end);
+   free(copy_of);
+   ralloc_free(g);
+   return pass;
+}
+
+/* Four nodes that all interfere, with room for three.  The node accessed
+ * in a loop is the most expensive to spill.
+ */
+static bool
+test_spill_cost(void *mem_ctx)
+{
+   struct ra_regs *regs = create_reg_set(mem_ctx, 3);
+   struct ra_graph *g = ra_alloc_interference_graph(regs, 4);
+   unsigned nodes[4];
+   unsigned count;
+   bool pass = true;
+
+   for (unsigned i = 0; i < 4; i++) {
+      ra_set_node_class(g, i, 0);
+      for (unsigned j = 0; j < i; j++)
+         ra_add_node_interference(g, i, j);
+   }
+
+   ra_add_node_spill_cost(g, 0, 1.0f, 1);
+   ra_add_node_spill_cost(g, 1, 1.0f, 0);
+   ra_add_node_spill_cost(g, 1, 1.0f, 0);
+   ra_add_node_spill_cost(g, 2, 1.0f, 0);
+   /* Node 3 can't be spilled. */
+
+   if (ra_allocate(g)) {
+      fprintf(stderr, "spill: allocation should fail\n");
+      pass = false;
+   }
+
+   count = ra_get_best_spill_nodes(g, nodes, 4);
+   if (count != 3 || nodes[0] != 2 || nodes[1] != 1 || nodes[2] != 0) {
+      fprintf(stderr, "spill: wrong spill candidates\n");
+      pass = false;
+   }
+   if (ra_get_best_spill_node(g) != 2) {
+      fprintf(stderr, "spill: wrong best spill node\n");
+      pass = false;
+   }
+
+   ralloc_free(g);
+   return pass;
+}
+
+int
+main(int argc, char **argv)
+{
+   void *mem_ctx = ralloc_context(NULL);
+   struct ra_regs *regs = create_reg_set(mem_ctx, NUM_REGS);
+   bool pass = true;
+
+   (void) argc;
+   (void) argv;
+
+   pass &= test_chain(regs);
+   pass &= test_random(regs, 1000, NUM_REGS / 2);
+   pass &= test_random(regs, 20000, NUM_REGS / 2);
+   pass &= test_random(regs, 20000, NUM_REGS);
+   pass &= test_spill_cost(mem_ctx);
+
+   ralloc_free(mem_ctx);
+
+   return pass ? 0 : 1;
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright © 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Allocates synthetic interference graphs of up to 100k nodes, checks that
+ * the result is a valid coloring, and prints how long it took.
+ *
+ * The graphs come from random live ranges over a straight-line program, with
+ * a mix of single registers and aligned register pairs, which is roughly
+ * what the backends build for large shaders.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util/os_time.h"
+#include "util/ralloc.h"
+#include "util/register_allocate.h"
+
+#define NUM_REGS 64
+
+struct live_range {
+   unsigned start, end;
+};
+
+static unsigned reg_class, pair_class;
+
+static struct ra_regs *
+create_reg_set(void *mem_ctx)
+{
+   struct ra_regs *regs = ra_alloc_reg_set(mem_ctx, NUM_REGS + NUM_REGS / 2,
+                                           true);
+
+   reg_class = ra_alloc_reg_class(regs);
+   pair_class = ra_alloc_reg_class(regs);
+
+   for (unsigned i = 0; i < NUM_REGS; i++)
+      ra_class_add_reg(regs, reg_class, i);
+
+   for (unsigned i = 0; i < NUM_REGS / 2; i++) {
+      unsigned pair = NUM_REGS + i;
+
+      ra_class_add_reg(regs, pair_class, pair);
+      ra_add_transitive_reg_conflict(regs, 2 * i, pair);
+      ra_add_transitive_reg_conflict(regs, 2 * i + 1, pair);
+   }
+
+   ra_set_finalize(regs, NULL);
+   return regs;
+}
+
+static bool
+run_graph(struct ra_regs *regs, unsigned count, unsigned max_length)
+{
+   struct live_range *ranges = malloc(count * sizeof(*ranges));
+   struct ra_graph *g;
+   int64_t start, built, end;
+   unsigned num_edges = 0;
+   bool allocated, pass = true;
+
+   srand(count);
+   for (unsigned i = 0; i < count; i++) {
+      ranges[i].start = i;
+      ranges[i].end = i + 1 + rand() % max_length;
+   }
+
+   start = os_time_get_nano();
+
+   g = ra_alloc_interference_graph(regs, count);
+   for (unsigned i = 0; i < count; i++)
+      ra_set_node_class(g, i, i % 4 == 0 ? pair_class : reg_class);
+
+   for (unsigned i = 0; i < count; i++) {
+      for (unsigned j = i + 1; j < count && ranges[j].start < ranges[i].end;
+           j++) {
+         ra_add_node_interference(g, i, j);
+         /* Duplicates must be ignored. */
+         ra_add_node_interference(g, j, i);
+         num_edges++;
+      }
+   }
+
+   built = os_time_get_nano();
+
+   allocated = ra_allocate(g);
+
+   end = os_time_get_nano();
+
+   if (allocated) {
+      for (unsigned i = 0; i < count; i++) {
+         unsigned r1 = ra_get_node_reg(g, i);
+
+         for (unsigned j = i + 1;
+              j < count && ranges[j].start < ranges[i].end; j++) {
+            unsigned r2 = ra_get_node_reg(g, j);
+            bool conflict = r1 == r2;
+
+            /* A pair conflicts with both of its halves. */
+            if (r1 >= NUM_REGS && r2 < NUM_REGS)
+               conflict |= (r1 - NUM_REGS) == r2 / 2;
+            if (r2 >= NUM_REGS && r1 < NUM_REGS)
+               conflict |= (r2 - NUM_REGS) == r1 / 2;
+
+            if (conflict) {
+               fprintf(stderr, "%u nodes: nodes %u and %u both got reg "
+                       "%u/%u\n", count, i, j, r1, r2);
+               pass = false;
+            }
+         }
+      }
+   } else {
+      for (unsigned i = 0; i < count; i++)
+         ra_set_node_spill_cost(g, i, 1.0f);
+
+      if (ra_get_best_spill_node(g) < 0) {
+         fprintf(stderr, "%u nodes: allocation failed without a spill "
+                 "candidate\n", count);
+         pass = false;
+      }
+   }
+
+   printf("%6u nodes %8u edges: build %7.2f ms, allocate %7.2f ms%s\n",
+          count, num_edges, (built - start) / 1000000.0,
+          (end - built) / 1000000.0, allocated ? "" : " (spilling)");
+
+   ralloc_free(g);
+   free(ranges);
+   return pass;
+}
+
+int
+main(int argc, char **argv)
+{
+   void *mem_ctx = ralloc_context(NULL);
+   struct ra_regs *regs = create_reg_set(mem_ctx);
+   bool pass = true;
+
+   (void) argc;
+   (void) argv;
+
+   /* Small enough to use the adjacency bitsets. */
+   pass &= run_graph(regs, 2000, 40);
+
+   pass &= run_graph(regs, 10000, 40);
+   pass &= run_graph(regs, 50000, 40);
+   pass &= run_graph(regs, 100000, 40);
+
+   /* Too many live values at once, so some need to be spilled. */
+   pass &= run_graph(regs, 50000, 100);
+
+   ralloc_free(mem_ctx);
+
+   return pass ? 0 : 1;
+}
@@ -0,0 +1,429 @@
+/*
+ * Copyright © 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Checks concurrent_map_u64 against swiss_table_u64 on one thread, then
+ * looks keys up while other threads insert and remove, checks that churning
+ * keys through the map doesn't grow its memory, and prints how many lookups
+ * per second several readers get compared to a hash table behind a mutex.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+#include "c11/threads.h"
+#include "util/concurrent_set.h"
+#include "util/hash_table.h"
+#include "util/os_time.h"
+#include "util/swiss_table.h"
+
+#define NUM_OPS 200000
+#define KEY_RANGE 5000
+
+#define NUM_WRITERS 4
+#define NUM_READERS 4
+#define NUM_STABLE 1000
+#define NUM_CHURN 20000
+
+/* Insert and remove pairs per writer, with nothing but the stable keys left
+ * in the map in between.
+ */
+#define CHURN_WARMUP 50000
+#define CHURN_PAIRS 250000
+#define CHURN_MAX_GROWTH_KB 8192
+
+#define BENCH_KEYS (1 << 16)
+#define BENCH_LOOKUPS (1 << 22)
+#define MAX_BENCH_THREADS 8
+
+#define DATA(x) ((void *) (uintptr_t) ((x) + 1))
+
+static uint64_t
+make_key(unsigned i)
+{
+   /* Spread over all 64 bits, with 0 and ~0 in there too. */
+   return i == 0 ? 0 : i == 1 ? UINT64_MAX : (uint64_t) i * 0x9e3779b97f4a7c15ull;
+}
+
+static bool
+test_single_thread(void)
+{
+   struct concurrent_map_u64 *map = _mesa_concurrent_map_u64_create(NULL);
+   struct swiss_table_u64 *ref = _mesa_swiss_table_u64_create(NULL);
+   struct concurrent_set_u64 *set = _mesa_concurrent_set_u64_create(NULL);
+   bool pass = true;
+
+   srand(0);
+   for (unsigned i = 0; i < NUM_OPS && pass; i++) {
+      uint64_t key = make_key(rand() % KEY_RANGE);
+      struct swiss_entry_u64 *entry = _mesa_swiss_table_u64_search(ref, key);
+      void *expected = entry ? entry->data : NULL;
+      void *data;
+
+      switch (rand() % 4) {
+      case 0:
+         data = _mesa_concurrent_map_u64_insert(map, key, DATA(i));
+         if (!entry)
+            _mesa_swiss_table_u64_insert(ref, key, expected = DATA(i));
+         if (data != expected) {
+            fprintf(stderr, "op %u: insert returned the wrong data\n", i);
+            pass = false;
+         }
+         break;
+      case 1:
+         _mesa_concurrent_map_u64_replace(map, key, DATA(i));
+         _mesa_swiss_table_u64_insert(ref, key, DATA(i));
+         break;
+      case 2:
+         data = _mesa_concurrent_map_u64_remove(map, key);
+         _mesa_swiss_table_u64_remove(ref, entry);
+         if (data != expected) {
+            fprintf(stderr, "op %u: remove returned the wrong data\n", i);
+            pass = false;
+         }
+         break;
+      default:
+         if (_mesa_concurrent_map_u64_search(map, key) != expected) {
+            fprintf(stderr, "op %u: lookups differ\n", i);
+            pass = false;
+         }
+         break;
+      }
+
+      if (_mesa_concurrent_map_u64_num_entries(map) != ref->entries) {
+         fprintf(stderr, "op %u: %u entries instead of %u\n", i,
+                 _mesa_concurrent_map_u64_num_entries(map), ref->entries);
+         pass = false;
+      }
+   }
+
+   for (unsigned i = 0; i < KEY_RANGE; i += 2)
+      _mesa_concurrent_set_u64_add(set, make_key(i));
+   for (unsigned i = 0; i < KEY_RANGE; i += 3)
+      _mesa_concurrent_set_u64_remove(set, make_key(i));
+   for (unsigned i = 0; i < KEY_RANGE; i++) {
+      if (_mesa_concurrent_set_u64_contains(set, make_key(i)) !=
+          (i % 2 == 0 && i % 3 != 0)) {
+         fprintf(stderr, "set: wrong result for %u\n", i);
+         pass = false;
+      }
+   }
+
+   _mesa_concurrent_map_u64_destroy(map, NULL);
+   _mesa_swiss_table_u64_destroy(ref);
+   _mesa_concurrent_set_u64_destroy(set);
+   return pass;
+}
+
+struct stress_state {
+   struct concurrent_map_u64 *map;
+   unsigned num_running;
+   bool failed;
+};
+
+struct stress_thread {
+   struct stress_state *state;
+   unsigned index;
+   void *won[NUM_CHURN];
+};
+
+/* Keys past NUM_STABLE are inserted by every writer with its own data; only
+ * one may win.  Every other one is removed again by the writer that put it
+ * there, and the table grows several times along the way.
+ */
+static int
+writer_func(void *arg)
+{
+   struct stress_thread *thread = arg;
+   struct concurrent_map_u64 *map = thread->state->map;
+
+   for (unsigned i = 0; i < NUM_CHURN; i++) {
+      uint64_t key = make_key(NUM_STABLE + i);
+      void *data = DATA(thread->index << 24 | i);
+
+      thread->won[i] = _mesa_concurrent_map_u64_insert(map, key, data);
+      if (i % 2 && thread->won[i] == data)
+         _mesa_concurrent_map_u64_remove(map, key);
+   }
+
+   p_atomic_dec(&thread->state->num_running);
+   return 0;
+}
+
+static int
+reader_func(void *arg)
+{
+   struct stress_thread *thread = arg;
+   struct stress_state *state = thread->state;
+
+   while (p_atomic_read(&state->num_running) > 0) {
+      for (unsigned i = 0; i < NUM_STABLE; i++) {
+         if (_mesa_concurrent_map_u64_search(state->map, make_key(i)) !=
+             DATA(i)) {
+            state->failed = true;
+            return 0;
+         }
+      }
+   }
+   return 0;
+}
+
+static bool
+test_threads(void)
+{
+   static struct stress_thread threads[NUM_WRITERS + NUM_READERS];
+   thrd_t thrds[NUM_WRITERS + NUM_READERS];
+   struct stress_state state;
+   bool pass = true;
+
+   state.map = _mesa_concurrent_map_u64_create(NULL);
+   state.num_running = NUM_WRITERS;
+   state.failed = false;
+
+   for (unsigned i = 0; i < NUM_STABLE; i++)
+      _mesa_concurrent_map_u64_insert(state.map, make_key(i), DATA(i));
+
+   for (unsigned i = 0; i < NUM_WRITERS + NUM_READERS; i++) {
+      threads[i].state = &state;
+      threads[i].index = i;
+      thrd_create(&thrds[i], i < NUM_WRITERS ? writer_func : reader_func,
+                  &threads[i]);
+   }
+   for (unsigned i = 0; i < NUM_WRITERS + NUM_READERS; i++)
+      thrd_join(thrds[i], NULL);
+
+   if (state.failed) {
+      fprintf(stderr, "threads: a reader missed a key\n");
+      pass = false;
+   }
+
+   /* Even keys were never removed, so everybody saw the same winner. */
+   for (unsigned i = 0; i < NUM_CHURN; i += 2) {
+      void *data = _mesa_concurrent_map_u64_search(state.map,
+                                                   make_key(NUM_STABLE + i));
+
+      for (unsigned t = 0; t < NUM_WRITERS; t++) {
+         if (threads[t].won[i] != data) {
+            fprintf(stderr, "threads: writers disagree on key %u\n", i);
+            pass = false;
+            t = NUM_WRITERS;
+            i = NUM_CHURN;
+         }
+      }
+   }
+
+   _mesa_concurrent_map_u64_destroy(state.map, NULL);
+   return pass;
+}
+
+static int
+churn_func(void *arg)
+{
+   struct stress_thread *thread = arg;
+   struct concurrent_map_u64 *map = thread->state->map;
+
+   for (unsigned i = 0; i < CHURN_PAIRS; i++) {
+      uint64_t key = make_key(NUM_STABLE + (thread->index << 24 | i));
+
+      _mesa_concurrent_map_u64_insert(map, key, DATA(i));
+      _mesa_concurrent_map_u64_remove(map, key);
+   }
+
+   p_atomic_dec(&thread->state->num_running);
+   return 0;
+}
+
+static long
+max_rss_kb(void)
+{
+#ifdef __linux__
+   struct rusage usage;
+
+   if (getrusage(RUSAGE_SELF, &usage) == 0)
+      return usage.ru_maxrss;
+#endif
+   return 0;
+}
+
+/* Every removal leaves a tombstone, so the table keeps running out of room
+ * while the number of live entries stays the same.  That must not cost more
+ * memory, and readers must keep finding the stable keys meanwhile.
+ */
+static bool
+test_churn(void)
+{
+   static struct stress_thread threads[NUM_WRITERS + NUM_READERS];
+   thrd_t thrds[NUM_WRITERS + NUM_READERS];
+   struct stress_state state;
+   bool pass = true;
+   long before;
+
+   state.map = _mesa_concurrent_map_u64_create(NULL);
+   state.num_running = NUM_WRITERS;
+   state.failed = false;
+
+   for (unsigned i = 0; i < NUM_STABLE; i++)
+      _mesa_concurrent_map_u64_insert(state.map, make_key(i), DATA(i));
+
+   /* Let the table reach its final size first. */
+   for (unsigned i = 0; i < CHURN_WARMUP; i++) {
+      uint64_t key = make_key(NUM_STABLE + i);
+
+      _mesa_concurrent_map_u64_insert(state.map, key, DATA(i));
+      _mesa_concurrent_map_u64_remove(state.map, key);
+   }
+
+   before = max_rss_kb();
+
+   for (unsigned i = 0; i < NUM_WRITERS + NUM_READERS; i++) {
+      threads[i].state = &state;
+      threads[i].index = i + 1;
+      thrd_create(&thrds[i], i < NUM_WRITERS ? churn_func : reader_func,
+                  &threads[i]);
+   }
+   for (unsigned i = 0; i < NUM_WRITERS + NUM_READERS; i++)
+      thrd_join(thrds[i], NULL);
+
+   if (state.failed) {
+      fprintf(stderr, "churn: a reader missed a key\n");
+      pass = false;
+   }
+
+   if (_mesa_concurrent_map_u64_num_entries(state.map) != NUM_STABLE) {
+      fprintf(stderr, "churn: %u entries left instead of %u\n",
+              _mesa_concurrent_map_u64_num_entries(state.map), NUM_STABLE);
+      pass = false;
+   }
+
+   if (max_rss_kb() - before > CHURN_MAX_GROWTH_KB) {
+      fprintf(stderr, "churn: memory grew by %ld KB\n",
+              max_rss_kb() - before);
+      pass = false;
+   }
+
+   _mesa_concurrent_map_u64_destroy(state.map, NULL);
+   return pass;
+}
+
+struct bench_thread {
+   struct concurrent_map_u64 *map;
+   struct hash_table_u64 *ht;
+   mtx_t *lock;
+   unsigned seed;
+   unsigned found;
+};
+
+static int
+bench_concurrent_func(void *arg)
+{
+   struct bench_thread *thread = arg;
+
+   for (unsigned i = 0; i < BENCH_LOOKUPS; i++) {
+      thread->seed = thread->seed * 1103515245 + 12345;
+      thread->found += _mesa_concurrent_map_u64_search(
+         thread->map, make_key(thread->seed % BENCH_KEYS)) != NULL;
+   }
+   return 0;
+}
+
+static int
+bench_locked_func(void *arg)
+{
+   struct bench_thread *thread = arg;
+
+   for (unsigned i = 0; i < BENCH_LOOKUPS; i++) {
+      thread->seed = thread->seed * 1103515245 + 12345;
+      mtx_lock(thread->lock);
+      thread->found += _mesa_hash_table_u64_search(
+         thread->ht, make_key(thread->seed % BENCH_KEYS)) != NULL;
+      mtx_unlock(thread->lock);
+   }
+   return 0;
+}
+
+static void
+bench(void)
+{
+   struct concurrent_map_u64 *map = _mesa_concurrent_map_u64_create(NULL);
+   struct hash_table_u64 *ht = _mesa_hash_table_u64_create(NULL);
+   struct bench_thread threads[MAX_BENCH_THREADS];
+   thrd_t thrds[MAX_BENCH_THREADS];
+   mtx_t lock;
+
+   mtx_init(&lock, mtx_plain);
+   for (unsigned i = 0; i < BENCH_KEYS; i++) {
+      _mesa_concurrent_map_u64_insert(map, make_key(i), DATA(i));
+      _mesa_hash_table_u64_insert(ht, make_key(i), DATA(i));
+   }
+
+   for (unsigned n = 1; n <= MAX_BENCH_THREADS; n *= 2) {
+      double rate[2];
+
+      for (unsigned locked = 0; locked < 2; locked++) {
+         int64_t start = os_time_get_nano();
+
+         for (unsigned i = 0; i < n; i++) {
+            threads[i].map = map;
+            threads[i].ht = ht;
+            threads[i].lock = &lock;
+            threads[i].seed = i;
+            threads[i].found = 0;
+            thrd_create(&thrds[i],
+                        locked ? bench_locked_func : bench_concurrent_func,
+                        &threads[i]);
+         }
+         for (unsigned i = 0; i < n; i++)
+            thrd_join(thrds[i], NULL);
+
+         rate[locked] = (double) n * BENCH_LOOKUPS /
+                        (os_time_get_nano() - start) * 1000.0;
+      }
+
+      printf("%u reader(s): concurrent_map %7.1f Mlookups/s, "
+             "mutex + hash_table_u64 %7.1f Mlookups/s\n", n, rate[0], rate[1]);
+   }
+
+   mtx_destroy(&lock);
+   _mesa_concurrent_map_u64_destroy(map, NULL);
+   _mesa_hash_table_u64_destroy(ht, NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+   bool pass = true;
+
+   (void) argc;
+   (void) argv;
+
+   pass &= test_single_thread();
+   pass &= test_threads();
+   pass &= test_churn();
+
+   bench();
+
+   return pass ? 0 : 1;
+}
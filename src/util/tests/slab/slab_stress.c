@@ -0,0 +1,293 @@
+/*
+ * Copyright © 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Allocates objects on several threads and frees most of them on another
+ * thread, which is what u_threaded_context does with transfers.  Checks that
+ * no object is handed out twice, that every page is eventually given back,
+ * and prints how many allocations per second that sustains.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "c11/threads.h"
+#include "util/macros.h"
+#include "util/os_time.h"
+#include "util/u_atomic.h"
+#include "util/slab.h"
+
+#define NUM_THREADS 4
+#define NUM_ROUNDS 20000
+#define BATCH_SIZE 32
+#define NUM_LIVE 256
+#define INBOX_SIZE 1024
+#define PAGE_ELEMENTS 64
+
+struct object {
+   unsigned thread;
+   unsigned seq;
+   uint64_t pattern;
+   char pad[32];
+};
+
+struct thread_state {
+   struct slab_child_pool pool;
+   struct thread_state *next;
+   unsigned index;
+   bool fail;
+
+   /* Objects allocated by the previous thread, to be freed by this one. */
+   mtx_t lock;
+   struct object *inbox[INBOX_SIZE];
+   unsigned num_inbox;
+};
+
+static struct slab_parent_pool parent;
+static struct thread_state threads[NUM_THREADS];
+static int num_finished;
+
+static uint64_t
+object_pattern(unsigned thread, unsigned seq)
+{
+   return ((uint64_t)thread << 32 | seq) * 0x9e3779b97f4a7c15ull;
+}
+
+static bool
+check_object(struct object *obj)
+{
+   bool ok = obj->pattern == object_pattern(obj->thread, obj->seq);
+
+   /* Catch double frees and objects handed out twice. */
+   obj->pattern = 0;
+   return ok;
+}
+
+static bool
+send_object(struct thread_state *next, struct object *obj)
+{
+   bool sent = false;
+
+   mtx_lock(&next->lock);
+   if (next->num_inbox < INBOX_SIZE) {
+      next->inbox[next->num_inbox++] = obj;
+      sent = true;
+   }
+   mtx_unlock(&next->lock);
+
+   return sent;
+}
+
+static void
+drain_inbox(struct thread_state *state)
+{
+   struct object *received[INBOX_SIZE];
+   unsigned num_received;
+
+   mtx_lock(&state->lock);
+   num_received = state->num_inbox;
+   memcpy(received, state->inbox, num_received * sizeof(received[0]));
+   state->num_inbox = 0;
+   mtx_unlock(&state->lock);
+
+   for (unsigned i = 0; i < num_received; i++) {
+      state->fail |= !check_object(received[i]);
+      slab_free(&state->pool, received[i]);
+   }
+}
+
+static int
+thread_func(void *data)
+{
+   struct thread_state *state = data;
+   struct object *live[NUM_LIVE] = { NULL };
+   unsigned seq = 0, next_live = 0;
+
+   for (unsigned round = 0; round < NUM_ROUNDS; round++) {
+      for (unsigned i = 0; i < BATCH_SIZE; i++) {
+         struct object *obj = slab_alloc(&state->pool);
+
+         if (!obj) {
+            state->fail = true;
+            return 0;
+         }
+
+         obj->thread = state->index;
+         obj->seq = seq++;
+         obj->pattern = object_pattern(obj->thread, obj->seq);
+
+         if (i & 1) {
+            /* Keep it for a while, then free it locally. */
+            if (live[next_live]) {
+               state->fail |= !check_object(live[next_live]);
+               slab_free(&state->pool, live[next_live]);
+            }
+            live[next_live] = obj;
+            next_live = (next_live + 1) % NUM_LIVE;
+         } else {
+            /* Hand it to the next thread, waiting for room if needed. */
+            while (!send_object(state->next, obj)) {
+               drain_inbox(state);
+               thrd_yield();
+            }
+         }
+      }
+
+      drain_inbox(state);
+   }
+
+   for (unsigned i = 0; i < NUM_LIVE; i++) {
+      if (live[i]) {
+         state->fail |= !check_object(live[i]);
+         slab_free(&state->pool, live[i]);
+      }
+   }
+
+   /* Keep freeing what the previous thread sends until it is done too. */
+   p_atomic_inc(&num_finished);
+   while (p_atomic_read(&num_finished) < NUM_THREADS) {
+      drain_inbox(state);
+      thrd_yield();
+   }
+
+   return 0;
+}
+
+static bool
+check_pages_released(const char *name, unsigned max_pages)
+{
+   struct slab_stats stats;
+
+   slab_get_stats(&parent, &stats);
+   printf("%s: %u pages allocated, %u released, %" PRIu64 " migrated "
+          "objects in %" PRIu64 " batches\n", name,
+          stats.num_pages_allocated, stats.num_pages_released,
+          stats.num_migrated, stats.num_flushes);
+
+   if (stats.num_pages > max_pages) {
+      fprintf(stderr, "%s: %u pages still allocated\n", name, stats.num_pages);
+      return false;
+   }
+   return true;
+}
+
+/* Freeing everything gives all but a couple of pages back. */
+static bool
+test_single_thread(void)
+{
+   static struct object *objects[PAGE_ELEMENTS * 100];
+   struct slab_child_pool pool;
+   bool pass = true;
+
+   slab_create_parent(&parent, sizeof(struct object), PAGE_ELEMENTS);
+   slab_create_child(&pool, &parent);
+
+   for (unsigned i = 0; i < ARRAY_SIZE(objects); i++)
+      objects[i] = slab_alloc(&pool);
+   for (unsigned i = 0; i < ARRAY_SIZE(objects); i++)
+      slab_free(&pool, objects[i]);
+
+   pass &= check_pages_released("single thread", 2);
+
+   slab_destroy_child(&pool);
+   pass &= check_pages_released("single thread, destroyed", 0);
+   slab_destroy_parent(&parent);
+   return pass;
+}
+
+static bool
+test_threads(void)
+{
+   struct slab_child_pool pool;
+   thrd_t thrds[NUM_THREADS];
+   int64_t start, end;
+   bool pass = true;
+
+   slab_create_parent(&parent, sizeof(struct object), PAGE_ELEMENTS);
+
+   for (unsigned i = 0; i < NUM_THREADS; i++) {
+      threads[i].index = i;
+      threads[i].next = &threads[(i + 1) % NUM_THREADS];
+      threads[i].fail = false;
+      threads[i].num_inbox = 0;
+      mtx_init(&threads[i].lock, mtx_plain);
+      slab_create_child(&threads[i].pool, &parent);
+   }
+
+   num_finished = 0;
+   start = os_time_get_nano();
+   for (unsigned i = 0; i < NUM_THREADS; i++)
+      thrd_create(&thrds[i], thread_func, &threads[i]);
+   for (unsigned i = 0; i < NUM_THREADS; i++)
+      thrd_join(thrds[i], NULL);
+   end = os_time_get_nano();
+
+   printf("%u threads: %.2f Mallocs/s\n", NUM_THREADS,
+          (double)NUM_THREADS * NUM_ROUNDS * BATCH_SIZE * 1000.0 /
+          MAX2(end - start, 1));
+
+   for (unsigned i = 0; i < NUM_THREADS; i++) {
+      if (threads[i].fail) {
+         fprintf(stderr, "thread %u: corrupted object\n", i);
+         pass = false;
+      }
+   }
+
+   /* Destroy the pools while objects in the inboxes are still allocated,
+    * then free those from yet another pool.
+    */
+   for (unsigned i = 0; i < NUM_THREADS; i++)
+      slab_destroy_child(&threads[i].pool);
+
+   slab_create_child(&pool, &parent);
+   for (unsigned i = 0; i < NUM_THREADS; i++) {
+      for (unsigned j = 0; j < threads[i].num_inbox; j++) {
+         if (!check_object(threads[i].inbox[j])) {
+            fprintf(stderr, "corrupted object in inbox %u\n", i);
+            pass = false;
+         }
+         slab_free(&pool, threads[i].inbox[j]);
+      }
+      mtx_destroy(&threads[i].lock);
+   }
+   slab_destroy_child(&pool);
+
+   pass &= check_pages_released("threads", 0);
+   slab_destroy_parent(&parent);
+   return pass;
+}
+
+int
+main(int argc, char **argv)
+{
+   bool pass = true;
+
+   (void) argc;
+   (void) argv;
+
+   pass &= test_single_thread();
+   pass &= test_threads();
+
+   return pass ? 0 : 1;
+}
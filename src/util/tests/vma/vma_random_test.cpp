@@ -64,10 +64,16 @@ struct random_test {
    static const uint64_t MEM_SIZE = 0xfffffffffffff000;
    static const uint64_t MEM_PAGES = MEM_SIZE / MEM_PAGE_SIZE;
 
-   random_test(uint_fast32_t seed)
+   random_test(uint_fast32_t seed, enum util_vma_heap_fit fit)
       : heap_holes{allocation{MEM_START_PAGE, MEM_PAGES}}, rand{seed}
    {
       util_vma_heap_init(&heap, MEM_START_PAGE * MEM_PAGE_SIZE, MEM_SIZE);
+      heap.fit = fit;
+   }
+
+   ~random_test()
+   {
+      util_vma_heap_finish(&heap);
    }
 
    void test(unsigned long count)
@@ -79,7 +85,25 @@ struct random_test {
          else if (action == 2)     empty();
          else if (action < 374)    dealloc();
          else                      alloc();
+         check_stats();
+      }
+   }
+
+   void check_stats()
+   {
+      struct util_vma_heap_stats stats;
+      uint64_t free_pages = 0, largest_pages = 0;
+
+      for (const auto& hole : heap_holes) {
+         free_pages += hole.num_pages;
+         largest_pages = std::max(largest_pages, hole.num_pages);
       }
+
+      util_vma_heap_get_stats(&heap, &stats);
+      assert(stats.num_holes == heap_holes.size());
+      assert(stats.free_size == free_pages * MEM_PAGE_SIZE);
+      assert(stats.largest_hole == largest_pages * MEM_PAGE_SIZE);
+      assert(stats.fragmentation >= 0.0 && stats.fragmentation < 1.0);
    }
 
    bool alloc(uint64_t size_order=52, uint64_t align_order=52)
@@ -236,8 +260,11 @@ int main(int argc, char **argv)
       errx(1, "USAGE: %s seed iter_count\n", argv[0]);
    }
 
-   random_test r{(uint_fast32_t)seed};
-   r.test(count);
+   random_test first_fit{(uint_fast32_t)seed, UTIL_VMA_HEAP_FIRST_FIT};
+   first_fit.test(count);
+
+   random_test best_fit{(uint_fast32_t)seed, UTIL_VMA_HEAP_BEST_FIT};
+   best_fit.test(count);
 
    printf("ok\n");
    return 0;
@@ -0,0 +1,138 @@
+/*
+ * Copyright © 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Keeps a number of buffers allocated from a 48-bit heap and replaces a
+ * random one at a time, which is roughly what a driver does with its BO
+ * addresses.  Prints the time per free/alloc cycle and how fragmented the
+ * heap ends up with each fit policy.
+ *
+ * Usage: vma_stress [cycles [max live buffers]]
+ *
+ * The defaults keep debug builds, which validate the whole heap on every
+ * operation, quick.  For timing, use an -DNDEBUG build and something like
+ * 200000 cycles and 100000 live buffers.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util/os_time.h"
+#include "util/vma.h"
+
+#define PAGE_SIZE 4096ull
+#define HEAP_START PAGE_SIZE
+#define HEAP_SIZE ((1ull << 48) - HEAP_START)
+#define DEFAULT_CYCLES 20000
+#define DEFAULT_MAX_LIVE 10000
+
+struct buffer {
+   uint64_t offset;
+   uint64_t size;
+};
+
+static uint64_t
+random_size(void)
+{
+   /* Mostly small buffers, with the odd big one. */
+   unsigned order = rand() % 100 < 90 ? rand() % 5 : 5 + rand() % 10;
+
+   return (1 + rand() % (1u << order)) * PAGE_SIZE;
+}
+
+static bool
+alloc_buffer(struct util_vma_heap *heap, struct buffer *buf)
+{
+   uint64_t alignment = rand() % 8 == 0 ? 64 * 1024 : PAGE_SIZE;
+
+   buf->size = random_size();
+   buf->offset = util_vma_heap_alloc(heap, buf->size, alignment);
+   return buf->offset != 0 && buf->offset % alignment == 0;
+}
+
+static bool
+run(unsigned num_cycles, unsigned num_live, enum util_vma_heap_fit fit)
+{
+   struct buffer *bufs = malloc(num_live * sizeof(*bufs));
+   struct util_vma_heap_stats stats;
+   struct util_vma_heap heap;
+   int64_t start, end;
+   bool pass = true;
+
+   srand(num_live);
+   util_vma_heap_init(&heap, HEAP_START, HEAP_SIZE);
+   heap.fit = fit;
+
+   for (unsigned i = 0; i < num_live; i++)
+      pass &= alloc_buffer(&heap, &bufs[i]);
+
+   start = os_time_get_nano();
+   for (unsigned i = 0; i < num_cycles; i++) {
+      struct buffer *buf = &bufs[rand() % num_live];
+
+      util_vma_heap_free(&heap, buf->offset, buf->size);
+      pass &= alloc_buffer(&heap, buf);
+   }
+   end = os_time_get_nano();
+
+   util_vma_heap_get_stats(&heap, &stats);
+   printf("%6u live, %s: %6.1f ns/cycle, %6u holes, fragmentation %.6f\n",
+          num_live, fit == UTIL_VMA_HEAP_BEST_FIT ? "best fit " : "first fit",
+          (double) (end - start) / num_cycles, stats.num_holes,
+          stats.fragmentation);
+
+   for (unsigned i = 0; i < num_live; i++)
+      util_vma_heap_free(&heap, bufs[i].offset, bufs[i].size);
+
+   util_vma_heap_get_stats(&heap, &stats);
+   if (stats.num_holes != 1 || stats.free_size != HEAP_SIZE) {
+      fprintf(stderr, "%u live: heap not whole again after freeing "
+              "everything\n", num_live);
+      pass = false;
+   }
+
+   util_vma_heap_finish(&heap);
+   free(bufs);
+   return pass;
+}
+
+int
+main(int argc, char **argv)
+{
+   unsigned num_cycles = argc > 1 ? strtoul(argv[1], NULL, 0) : DEFAULT_CYCLES;
+   unsigned max_live = argc > 2 ? strtoul(argv[2], NULL, 0) : DEFAULT_MAX_LIVE;
+   bool pass = true;
+
+   if (num_cycles == 0 || max_live < 1000) {
+      fprintf(stderr, "usage: %s [cycles [max live buffers >= 1000]]\n",
+              argv[0]);
+      return 1;
+   }
+
+   for (unsigned num_live = 1000; num_live <= max_live; num_live *= 10) {
+      pass &= run(num_cycles, num_live, UTIL_VMA_HEAP_FIRST_FIT);
+      pass &= run(num_cycles, num_live, UTIL_VMA_HEAP_BEST_FIT);
+   }
+
+   return pass ? 0 : 1;
+}
@@ -226,11 +226,216 @@ util_queue_fence_destroy(struct util_queue_fence *fence)
  * util_queue implementation
  */
 
+/* Rings are grown geometrically and only ever shrink when the queue is
+ * destroyed.
+ */
+static bool
+util_queue_ring_grow(struct util_queue_ring *ring, unsigned min_size)
+{
+   unsigned new_size = MAX2(ring->size, 8);
+
+   while (new_size < min_size)
+      new_size *= 2;
+   if (new_size == ring->size)
+      new_size *= 2;
+
+   struct util_queue_job *jobs =
+      (struct util_queue_job*)calloc(new_size, sizeof(struct util_queue_job));
+   if (!jobs)
+      return false;
+
+   /* Copy all queued jobs into the new list, in order. */
+   for (unsigned i = 0; i < ring->num_queued; i++)
+      jobs[i] = ring->jobs[(ring->read_idx + i) % ring->size];
+
+   free(ring->jobs);
+   ring->jobs = jobs;
+   ring->read_idx = 0;
+   ring->write_idx = ring->num_queued;
+   ring->size = new_size;
+   return true;
+}
+
+static void
+util_queue_ring_push(struct util_queue_ring *ring, void *job,
+                     struct util_queue_fence *fence,
+                     util_queue_execute_func execute,
+                     util_queue_execute_func cleanup)
+{
+   struct util_queue_job *ptr;
+
+   if (ring->num_queued == ring->size) {
+      MAYBE_UNUSED bool grown = util_queue_ring_grow(ring, ring->size + 1);
+      assert(grown);
+   }
+
+   ptr = &ring->jobs[ring->write_idx];
+   assert(ptr->job == NULL);
+   ptr->job = job;
+   ptr->fence = fence;
+   ptr->execute = execute;
+   ptr->cleanup = cleanup;
+   ring->write_idx = (ring->write_idx + 1) % ring->size;
+   ring->num_queued++;
+}
+
+/* Pop the oldest job of the highest priority. */
+static bool
+util_queue_rings_pop(struct util_queue_ring *rings, struct util_queue_job *job)
+{
+   for (unsigned p = 0; p < UTIL_QUEUE_NUM_PRIORITIES; p++) {
+      struct util_queue_ring *ring = &rings[p];
+
+      if (!ring->num_queued)
+         continue;
+
+      *job = ring->jobs[ring->read_idx];
+      memset(&ring->jobs[ring->read_idx], 0, sizeof(struct util_queue_job));
+      ring->read_idx = (ring->read_idx + 1) % ring->size;
+      ring->num_queued--;
+      return true;
+   }
+   return false;
+}
+
+/* Signal the fences of all jobs that will never be executed. */
+static void
+util_queue_rings_signal_all(struct util_queue_ring *rings)
+{
+   struct util_queue_job job;
+
+   while (util_queue_rings_pop(rings, &job)) {
+      if (job.job)
+         util_queue_fence_signal(job.fence);
+   }
+}
+
+/* Turn the job owning the fence into a no-op. */
+static bool
+util_queue_rings_drop(struct util_queue_ring *rings,
+                      struct util_queue_fence *fence)
+{
+   for (unsigned p = 0; p < UTIL_QUEUE_NUM_PRIORITIES; p++) {
+      struct util_queue_ring *ring = &rings[p];
+
+      for (unsigned n = 0; n < ring->num_queued; n++) {
+         struct util_queue_job *job =
+            &ring->jobs[(ring->read_idx + n) % ring->size];
+
+         if (job->fence == fence) {
+            if (job->cleanup)
+               job->cleanup(job->job, -1);
+
+            /* Just clear it. The threads will treat as a no-op job. */
+            memset(job, 0, sizeof(*job));
+            return true;
+         }
+      }
+   }
+   return false;
+}
+
+static void
+util_queue_rings_free(struct util_queue_ring *rings)
+{
+   for (unsigned p = 0; p < UTIL_QUEUE_NUM_PRIORITIES; p++)
+      free(rings[p].jobs);
+}
+
+/* Take the next job from our own list, or from another thread's. */
+static bool
+util_queue_steal_job(struct util_queue *queue, int thread_index,
+                     struct util_queue_job *job)
+{
+   unsigned num_locals = p_atomic_read(&queue->num_locals);
+
+   for (unsigned i = 0; i < num_locals; i++) {
+      struct util_queue_local *local =
+         &queue->locals[(thread_index + i) % num_locals];
+      bool found;
+
+      /* Racy, but a miss only costs another pass. */
+      if (!p_atomic_read(&local->num_queued))
+         continue;
+
+      mtx_lock(&local->lock);
+      found = util_queue_rings_pop(local->rings, job);
+      if (found)
+         local->num_queued--;
+      mtx_unlock(&local->lock);
+
+      if (found) {
+         p_atomic_dec(&queue->num_queued);
+         return true;
+      }
+   }
+   return false;
+}
+
+static void
+util_queue_locals_signal_all(struct util_queue *queue)
+{
+   for (unsigned i = 0; i < queue->num_locals; i++) {
+      struct util_queue_local *local = &queue->locals[i];
+
+      mtx_lock(&local->lock);
+      p_atomic_add(&queue->num_queued, -local->num_queued);
+      local->num_queued = 0;
+      util_queue_rings_signal_all(local->rings);
+      mtx_unlock(&local->lock);
+   }
+}
+
 struct thread_input {
    struct util_queue *queue;
    int thread_index;
 };
 
+static bool
+util_queue_get_job(struct util_queue *queue, int thread_index,
+                   struct util_queue_job *job)
+{
+   if (queue->locals) {
+      while (1) {
+         if (p_atomic_read(&queue->kill_threads))
+            return false;
+
+         if (util_queue_steal_job(queue, thread_index, job))
+            return true;
+
+         /* Submitters check num_sleeping under the lock after adding jobs,
+          * so checking num_queued here under the lock can't miss them.
+          */
+         mtx_lock(&queue->lock);
+         queue->num_sleeping++;
+         while (!queue->kill_threads && p_atomic_read(&queue->num_queued) == 0)
+            cnd_wait(&queue->has_queued_cond, &queue->lock);
+         queue->num_sleeping--;
+         mtx_unlock(&queue->lock);
+      }
+   }
+
+   mtx_lock(&queue->lock);
+   assert(queue->num_queued >= 0 && queue->num_queued <= queue->max_jobs);
+
+   /* wait if the queue is empty */
+   while (!queue->kill_threads && queue->num_queued == 0)
+      cnd_wait(&queue->has_queued_cond, &queue->lock);
+
+   if (queue->kill_threads) {
+      mtx_unlock(&queue->lock);
+      return false;
+   }
+
+   MAYBE_UNUSED bool found = util_queue_rings_pop(queue->rings, job);
+   assert(found);
+
+   queue->num_queued--;
+   cnd_signal(&queue->has_space_cond);
+   mtx_unlock(&queue->lock);
+   return true;
+}
+
 static int
 util_queue_thread_func(void *input)
 {
@@ -262,25 +467,8 @@ util_queue_thread_func(void *input)
    while (1) {
       struct util_queue_job job;
 
-      mtx_lock(&queue->lock);
-      assert(queue->num_queued >= 0 && queue->num_queued <= queue->max_jobs);
-
-      /* wait if the queue is empty */
-      while (!queue->kill_threads && queue->num_queued == 0)
-         cnd_wait(&queue->has_queued_cond, &queue->lock);
-
-      if (queue->kill_threads) {
-         mtx_unlock(&queue->lock);
+      if (!util_queue_get_job(queue, thread_index, &job))
          break;
-      }
-
-      job = queue->jobs[queue->read_idx];
-      memset(&queue->jobs[queue->read_idx], 0, sizeof(struct util_queue_job));
-      queue->read_idx = (queue->read_idx + 1) % queue->max_jobs;
-
-      queue->num_queued--;
-      cnd_signal(&queue->has_space_cond);
-      mtx_unlock(&queue->lock);
 
       if (job.job) {
          job.execute(job.job, thread_index);
@@ -291,20 +479,30 @@ util_queue_thread_func(void *input)
    }
 
    /* signal remaining jobs before terminating */
-   mtx_lock(&queue->lock);
-   for (unsigned i = queue->read_idx; i != queue->write_idx;
-        i = (i + 1) % queue->max_jobs) {
-      if (queue->jobs[i].job) {
-         util_queue_fence_signal(queue->jobs[i].fence);
-         queue->jobs[i].job = NULL;
-      }
+   if (queue->locals) {
+      util_queue_locals_signal_all(queue);
+   } else {
+      mtx_lock(&queue->lock);
+      util_queue_rings_signal_all(queue->rings);
+      queue->num_queued = 0;
+      mtx_unlock(&queue->lock);
    }
-   queue->read_idx = queue->write_idx;
-   queue->num_queued = 0;
-   mtx_unlock(&queue->lock);
    return 0;
 }
 
+static void
+util_queue_free_jobs(struct util_queue *queue)
+{
+   if (queue->locals) {
+      for (unsigned i = 0; i < queue->num_locals; i++) {
+         mtx_destroy(&queue->locals[i].lock);
+         util_queue_rings_free(queue->locals[i].rings);
+      }
+      free(queue->locals);
+   }
+   util_queue_rings_free(queue->rings);
+}
+
 bool
 util_queue_init(struct util_queue *queue,
                 const char *name,
@@ -342,15 +540,13 @@ util_queue_init(struct util_queue *queue,
       util_snprintf(queue->name, sizeof(queue->name), "%s", name);
    }
 
+   if (flags & UTIL_QUEUE_INIT_WORK_STEALING)
+      flags |= UTIL_QUEUE_INIT_RESIZE_IF_FULL;
+
    queue->flags = flags;
    queue->num_threads = num_threads;
    queue->max_jobs = max_jobs;
 
-   queue->jobs = (struct util_queue_job*)
-                 calloc(max_jobs, sizeof(struct util_queue_job));
-   if (!queue->jobs)
-      goto fail;
-
    (void) mtx_init(&queue->lock, mtx_plain);
    (void) mtx_init(&queue->finish_lock, mtx_plain);
 
@@ -358,6 +554,27 @@ util_queue_init(struct util_queue *queue,
    cnd_init(&queue->has_queued_cond);
    cnd_init(&queue->has_space_cond);
 
+   if (flags & UTIL_QUEUE_INIT_WORK_STEALING) {
+      queue->locals = (struct util_queue_local*)
+                      calloc(num_threads, sizeof(struct util_queue_local));
+      if (!queue->locals)
+         goto fail;
+
+      queue->num_locals = num_threads;
+      for (i = 0; i < num_threads; i++) {
+         struct util_queue_local *local = &queue->locals[i];
+
+         (void) mtx_init(&local->lock, mtx_plain);
+         if (!util_queue_ring_grow(&local->rings[UTIL_QUEUE_PRIORITY_NORMAL],
+                                   DIV_ROUND_UP(max_jobs, num_threads)))
+            goto fail;
+      }
+   } else {
+      if (!util_queue_ring_grow(&queue->rings[UTIL_QUEUE_PRIORITY_NORMAL],
+                                max_jobs))
+         goto fail;
+   }
+
    queue->threads = (thrd_t*) calloc(num_threads, sizeof(thrd_t));
    if (!queue->threads)
       goto fail;
@@ -380,6 +597,9 @@ util_queue_init(struct util_queue *queue,
          } else {
             /* at least one thread created, so use it */
             queue->num_threads = i;
+            /* Nothing has been queued yet, so the extra lists are empty. */
+            if (queue->locals)
+               p_atomic_set(&queue->num_locals, i);
             break;
          }
       }
@@ -404,13 +624,12 @@ util_queue_init(struct util_queue *queue,
 
 fail:
    free(queue->threads);
+   util_queue_free_jobs(queue);
+   cnd_destroy(&queue->has_space_cond);
+   cnd_destroy(&queue->has_queued_cond);
+   mtx_destroy(&queue->finish_lock);
+   mtx_destroy(&queue->lock);
 
-   if (queue->jobs) {
-      cnd_destroy(&queue->has_space_cond);
-      cnd_destroy(&queue->has_queued_cond);
-      mtx_destroy(&queue->lock);
-      free(queue->jobs);
-   }
    /* also util_queue_is_initialized can be used to check for success */
    memset(queue, 0, sizeof(*queue));
    return false;
@@ -423,7 +642,7 @@ util_queue_killall_and_wait(struct util_queue *queue)
 
    /* Signal all threads to terminate. */
    mtx_lock(&queue->lock);
-   queue->kill_threads = 1;
+   p_atomic_set(&queue->kill_threads, 1);
    cnd_broadcast(&queue->has_queued_cond);
    mtx_unlock(&queue->lock);
 
@@ -442,79 +661,149 @@ util_queue_destroy(struct util_queue *queue)
    cnd_destroy(&queue->has_queued_cond);
    mtx_destroy(&queue->finish_lock);
    mtx_destroy(&queue->lock);
-   free(queue->jobs);
+   util_queue_free_jobs(queue);
    free(queue->threads);
 }
 
-void
-util_queue_add_job(struct util_queue *queue,
-                   void *job,
-                   struct util_queue_fence *fence,
-                   util_queue_execute_func execute,
-                   util_queue_execute_func cleanup)
+/* Wake up threads for num_jobs new jobs. The queue lock must be held. */
+static void
+util_queue_wake(struct util_queue *queue, unsigned num_jobs)
 {
-   struct util_queue_job *ptr;
+   if (num_jobs == 1)
+      cnd_signal(&queue->has_queued_cond);
+   else if (num_jobs)
+      cnd_broadcast(&queue->has_queued_cond);
+}
+
+static void
+util_queue_add_jobs_stealing(struct util_queue *queue,
+                             unsigned num_jobs,
+                             void **jobs,
+                             struct util_queue_fence **fences,
+                             util_queue_execute_func execute,
+                             util_queue_execute_func cleanup,
+                             enum util_queue_priority priority)
+{
+   unsigned num_locals = p_atomic_read(&queue->num_locals);
+   unsigned chunk = DIV_ROUND_UP(num_jobs, num_locals);
+   unsigned l = p_atomic_inc_return(&queue->next_local);
+   bool killed;
+
+   /* Spread the jobs over the threads, one lock per thread. */
+   for (unsigned i = 0; i < num_jobs; i += chunk, l++) {
+      struct util_queue_local *local = &queue->locals[l % num_locals];
+      unsigned n = MIN2(chunk, num_jobs - i);
+
+      mtx_lock(&local->lock);
+      for (unsigned j = i; j < i + n; j++) {
+         util_queue_ring_push(&local->rings[priority], jobs[j], fences[j],
+                              execute, cleanup);
+      }
+      local->num_queued += n;
+      mtx_unlock(&local->lock);
+      p_atomic_add(&queue->num_queued, n);
+   }
 
    mtx_lock(&queue->lock);
-   if (queue->kill_threads) {
-      mtx_unlock(&queue->lock);
+   killed = queue->kill_threads;
+   if (queue->num_sleeping)
+      util_queue_wake(queue, num_jobs);
+   mtx_unlock(&queue->lock);
+
+   /* The threads may have exited before seeing our jobs. */
+   if (killed)
+      util_queue_locals_signal_all(queue);
+}
+
+void
+util_queue_add_jobs(struct util_queue *queue,
+                    unsigned num_jobs,
+                    void **jobs,
+                    struct util_queue_fence **fences,
+                    util_queue_execute_func execute,
+                    util_queue_execute_func cleanup,
+                    enum util_queue_priority priority)
+{
+   unsigned num_added = 0;
+
+   assert(priority < UTIL_QUEUE_NUM_PRIORITIES);
+
+   if (p_atomic_read(&queue->kill_threads) || !num_jobs) {
       /* well no good option here, but any leaks will be
        * short-lived as things are shutting down..
        */
       return;
    }
 
-   util_queue_fence_reset(fence);
+   for (unsigned i = 0; i < num_jobs; i++)
+      util_queue_fence_reset(fences[i]);
 
-   assert(queue->num_queued >= 0 && queue->num_queued <= queue->max_jobs);
+   if (queue->locals) {
+      util_queue_add_jobs_stealing(queue, num_jobs, jobs, fences, execute,
+                                   cleanup, priority);
+      return;
+   }
 
-   if (queue->num_queued == queue->max_jobs) {
-      if (queue->flags & UTIL_QUEUE_INIT_RESIZE_IF_FULL) {
-         /* If the queue is full, make it larger to avoid waiting for a free
-          * slot.
-          */
-         unsigned new_max_jobs = queue->max_jobs + 8;
-         struct util_queue_job *jobs =
-            (struct util_queue_job*)calloc(new_max_jobs,
-                                           sizeof(struct util_queue_job));
-         assert(jobs);
-
-         /* Copy all queued jobs into the new list. */
-         unsigned num_jobs = 0;
-         unsigned i = queue->read_idx;
-
-         do {
-            jobs[num_jobs++] = queue->jobs[i];
-            i = (i + 1) % queue->max_jobs;
-         } while (i != queue->write_idx);
-
-         assert(num_jobs == queue->num_queued);
-
-         free(queue->jobs);
-         queue->jobs = jobs;
-         queue->read_idx = 0;
-         queue->write_idx = num_jobs;
-         queue->max_jobs = new_max_jobs;
-      } else {
-         /* Wait until there is a free slot. */
-         while (queue->num_queued == queue->max_jobs)
-            cnd_wait(&queue->has_space_cond, &queue->lock);
-      }
+   mtx_lock(&queue->lock);
+   if (queue->kill_threads) {
+      mtx_unlock(&queue->lock);
+      for (unsigned i = 0; i < num_jobs; i++)
+         util_queue_fence_signal(fences[i]);
+      return;
    }
 
-   ptr = &queue->jobs[queue->write_idx];
-   assert(ptr->job == NULL);
-   ptr->job = job;
-   ptr->fence = fence;
-   ptr->execute = execute;
-   ptr->cleanup = cleanup;
-   queue->write_idx = (queue->write_idx + 1) % queue->max_jobs;
+   for (unsigned i = 0; i < num_jobs; i++) {
+      assert(queue->num_queued >= 0 && queue->num_queued <= queue->max_jobs);
 
-   queue->num_queued++;
-   cnd_signal(&queue->has_queued_cond);
+      if (queue->num_queued == queue->max_jobs) {
+         if (queue->flags & UTIL_QUEUE_INIT_RESIZE_IF_FULL) {
+            /* If the queue is full, make it larger to avoid waiting for a
+             * free slot.
+             */
+            queue->max_jobs *= 2;
+         } else {
+            /* Wait until there is a free slot, letting the threads start on
+             * what we've added so far.
+             */
+            util_queue_wake(queue, num_added);
+            num_added = 0;
+            while (queue->num_queued == queue->max_jobs)
+               cnd_wait(&queue->has_space_cond, &queue->lock);
+         }
+      }
+
+      util_queue_ring_push(&queue->rings[priority], jobs[i], fences[i],
+                           execute, cleanup);
+      queue->num_queued++;
+      num_added++;
+   }
+
+   util_queue_wake(queue, num_added);
    mtx_unlock(&queue->lock);
 }
 
+void
+util_queue_add_job_with_priority(struct util_queue *queue,
+                                 void *job,
+                                 struct util_queue_fence *fence,
+                                 util_queue_execute_func execute,
+                                 util_queue_execute_func cleanup,
+                                 enum util_queue_priority priority)
+{
+   util_queue_add_jobs(queue, 1, &job, &fence, execute, cleanup, priority);
+}
+
+void
+util_queue_add_job(struct util_queue *queue,
+                   void *job,
+                   struct util_queue_fence *fence,
+                   util_queue_execute_func execute,
+                   util_queue_execute_func cleanup)
+{
+   util_queue_add_jobs(queue, 1, &job, &fence, execute, cleanup,
+                       UTIL_QUEUE_PRIORITY_NORMAL);
+}
+
 /**
  * Remove a queued job. If the job hasn't started execution, it's removed from
  * the queue. If the job has started execution, the function waits for it to
@@ -533,20 +822,17 @@ util_queue_drop_job(struct util_queue *queue, struct util_queue_fence *fence)
    if (util_queue_fence_is_signalled(fence))
       return;
 
-   mtx_lock(&queue->lock);
-   for (unsigned i = queue->read_idx; i != queue->write_idx;
-        i = (i + 1) % queue->max_jobs) {
-      if (queue->jobs[i].fence == fence) {
-         if (queue->jobs[i].cleanup)
-            queue->jobs[i].cleanup(queue->jobs[i].job, -1);
-
-         /* Just clear it. The threads will treat as a no-op job. */
-         memset(&queue->jobs[i], 0, sizeof(queue->jobs[i]));
-         removed = true;
-         break;
+   if (queue->locals) {
+      for (unsigned i = 0; i < queue->num_locals && !removed; i++) {
+         mtx_lock(&queue->locals[i].lock);
+         removed = util_queue_rings_drop(queue->locals[i].rings, fence);
+         mtx_unlock(&queue->locals[i].lock);
       }
+   } else {
+      mtx_lock(&queue->lock);
+      removed = util_queue_rings_drop(queue->rings, fence);
+      mtx_unlock(&queue->lock);
    }
-   mtx_unlock(&queue->lock);
 
    if (removed)
       util_queue_fence_signal(fence);
@@ -568,8 +854,17 @@ void
 util_queue_finish(struct util_queue *queue)
 {
    util_barrier barrier;
-   struct util_queue_fence *fences = malloc(queue->num_threads * sizeof(*fences));
+   struct util_queue_fence *fences;
+   bool killed = false;
 
+   /* Like util_queue_add_jobs, don't queue anything for threads that are
+    * going away.  The work stealing path below queues directly, so it
+    * wouldn't be caught there.
+    */
+   if (p_atomic_read(&queue->kill_threads))
+      return;
+
+   fences = malloc(queue->num_threads * sizeof(*fences));
    util_barrier_init(&barrier, queue->num_threads);
 
    /* If 2 threads were adding jobs for 2 different barries at the same time,
@@ -578,11 +873,43 @@ util_queue_finish(struct util_queue *queue)
     */
    mtx_lock(&queue->finish_lock);
 
+   /* The barrier jobs have the lowest priority, so that they are only
+    * started once all earlier jobs have been. With work stealing, each
+    * thread's list needs one.
+    */
    for (unsigned i = 0; i < queue->num_threads; ++i) {
       util_queue_fence_init(&fences[i]);
-      util_queue_add_job(queue, &barrier, &fences[i], util_queue_finish_execute, NULL);
+
+      if (queue->locals) {
+         struct util_queue_local *local = &queue->locals[i];
+
+         util_queue_fence_reset(&fences[i]);
+         mtx_lock(&local->lock);
+         util_queue_ring_push(&local->rings[UTIL_QUEUE_PRIORITY_LOW],
+                              &barrier, &fences[i],
+                              util_queue_finish_execute, NULL);
+         local->num_queued++;
+         mtx_unlock(&local->lock);
+         p_atomic_inc(&queue->num_queued);
+      } else {
+         util_queue_add_job_with_priority(queue, &barrier, &fences[i],
+                                          util_queue_finish_execute, NULL,
+                                          UTIL_QUEUE_PRIORITY_LOW);
+      }
+   }
+
+   if (queue->locals) {
+      mtx_lock(&queue->lock);
+      killed = queue->kill_threads;
+      if (queue->num_sleeping)
+         util_queue_wake(queue, queue->num_threads);
+      mtx_unlock(&queue->lock);
    }
 
+   /* The threads may have exited before seeing the barrier jobs. */
+   if (killed)
+      util_queue_locals_signal_all(queue);
+
    for (unsigned i = 0; i < queue->num_threads; ++i) {
       util_queue_fence_wait(&fences[i]);
       util_queue_fence_destroy(&fences[i]);
@@ -49,6 +49,12 @@ extern "C" {
 #define UTIL_QUEUE_INIT_USE_MINIMUM_PRIORITY      (1 << 0)
 #define UTIL_QUEUE_INIT_RESIZE_IF_FULL            (1 << 1)
 #define UTIL_QUEUE_INIT_SET_FULL_THREAD_AFFINITY  (1 << 2)
+/* Give each thread its own list of jobs, which idle threads steal from,
+ * instead of having all threads contend on one. Implies RESIZE_IF_FULL.
+ * Opt-in, and no queue in the tree uses it yet; see queue_throughput for
+ * how it compares.
+ */
+#define UTIL_QUEUE_INIT_WORK_STEALING             (1 << 3)
 
 #if defined(__GNUC__) && defined(HAVE_LINUX_FUTEX_H)
 #define UTIL_QUEUE_FENCE_FUTEX
@@ -191,6 +197,19 @@ util_queue_fence_wait_timeout(struct util_queue_fence *fence,
 
 typedef void (*util_queue_execute_func)(void *job, int thread_index);
 
+/* Queued jobs of higher priority are started first. Jobs of the same
+ * priority are started in the order they were added.
+ *
+ * With UTIL_QUEUE_INIT_WORK_STEALING, this only holds among the jobs handed
+ * to the same thread.
+ */
+enum util_queue_priority {
+   UTIL_QUEUE_PRIORITY_HIGH,
+   UTIL_QUEUE_PRIORITY_NORMAL,
+   UTIL_QUEUE_PRIORITY_LOW,
+   UTIL_QUEUE_NUM_PRIORITIES,
+};
+
 struct util_queue_job {
    void *job;
    struct util_queue_fence *fence;
@@ -198,6 +217,23 @@ struct util_queue_job {
    util_queue_execute_func cleanup;
 };
 
+/* FIFO of jobs that doubles in size when full. */
+struct util_queue_ring {
+   struct util_queue_job *jobs;
+   unsigned size;
+   unsigned num_queued;
+   unsigned write_idx, read_idx;
+};
+
+/* Jobs handed to one thread with UTIL_QUEUE_INIT_WORK_STEALING. Other
+ * threads take from them when they run out of their own.
+ */
+struct util_queue_local {
+   mtx_t lock;
+   int num_queued;
+   struct util_queue_ring rings[UTIL_QUEUE_NUM_PRIORITIES];
+};
+
 /* Put this into your context. */
 struct util_queue {
    char name[14]; /* 13 characters = the thread name without the index */
@@ -211,8 +247,15 @@ struct util_queue {
    unsigned num_threads;
    int kill_threads;
    int max_jobs;
-   int write_idx, read_idx; /* ring buffer pointers */
-   struct util_queue_job *jobs;
+   struct util_queue_ring rings[UTIL_QUEUE_NUM_PRIORITIES];
+
+   /* UTIL_QUEUE_INIT_WORK_STEALING only. num_queued is then updated
+    * atomically, and lock only protects the sleeping threads.
+    */
+   struct util_queue_local *locals;
+   unsigned num_locals;
+   unsigned next_local;
+   int num_sleeping;
 
    /* for cleanup at exit(), protected by exit_mutex */
    struct list_head head;
@@ -231,6 +274,23 @@ void util_queue_add_job(struct util_queue *queue,
                         struct util_queue_fence *fence,
                         util_queue_execute_func execute,
                         util_queue_execute_func cleanup);
+void util_queue_add_job_with_priority(struct util_queue *queue,
+                                      void *job,
+                                      struct util_queue_fence *fence,
+                                      util_queue_execute_func execute,
+                                      util_queue_execute_func cleanup,
+                                      enum util_queue_priority priority);
+
+/* Add num_jobs jobs that share the same callbacks, taking the queue lock
+ * once for all of them.
+ */
+void util_queue_add_jobs(struct util_queue *queue,
+                         unsigned num_jobs,
+                         void **jobs,
+                         struct util_queue_fence **fences,
+                         util_queue_execute_func execute,
+                         util_queue_execute_func cleanup,
+                         enum util_queue_priority priority);
 void util_queue_drop_job(struct util_queue *queue,
                          struct util_queue_fence *fence);
 
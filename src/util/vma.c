@@ -28,21 +28,112 @@
 
 struct util_vma_hole {
    struct list_head link;
+   struct rb_node offset_node;
+   struct rb_node size_node;
    uint64_t offset;
    uint64_t size;
+
+   /* The largest hole in this hole's subtree of the offset tree. */
+   uint64_t max_size;
 };
 
+#define util_vma_hole_by_offset(_node) \
+   rb_node_data(struct util_vma_hole, _node, offset_node)
+
+#define util_vma_hole_by_size(_node) \
+   rb_node_data(struct util_vma_hole, _node, size_node)
+
+/* The list is sorted from high to low. */
 #define util_vma_foreach_hole(_hole, _heap) \
    list_for_each_entry(struct util_vma_hole, _hole, &(_heap)->holes, link)
 
 #define util_vma_foreach_hole_safe(_hole, _heap) \
    list_for_each_entry_safe(struct util_vma_hole, _hole, &(_heap)->holes, link)
 
+static int
+util_vma_hole_offset_cmp(const struct rb_node *a, const struct rb_node *b)
+{
+   uint64_t a_offset = util_vma_hole_by_offset(a)->offset;
+   uint64_t b_offset = util_vma_hole_by_offset(b)->offset;
+
+   return a_offset < b_offset ? -1 : a_offset > b_offset;
+}
+
+static void
+util_vma_hole_augment(struct rb_node *node)
+{
+   struct util_vma_hole *hole = util_vma_hole_by_offset(node);
+   uint64_t max_size = hole->size;
+
+   if (node->left)
+      max_size = MAX2(max_size, util_vma_hole_by_offset(node->left)->max_size);
+   if (node->right)
+      max_size = MAX2(max_size, util_vma_hole_by_offset(node->right)->max_size);
+
+   hole->max_size = max_size;
+}
+
+/* Sorts by size, then from high to low so that best fit also prefers the
+ * top of the heap.
+ */
+static int
+util_vma_hole_size_cmp(const struct rb_node *a, const struct rb_node *b)
+{
+   const struct util_vma_hole *a_hole = util_vma_hole_by_size(a);
+   const struct util_vma_hole *b_hole = util_vma_hole_by_size(b);
+
+   if (a_hole->size != b_hole->size)
+      return a_hole->size < b_hole->size ? -1 : 1;
+
+   return a_hole->offset > b_hole->offset ? -1 : a_hole->offset < b_hole->offset;
+}
+
+/* Adds a hole to the trees, the caller puts it in the list. */
+static void
+util_vma_hole_insert(struct util_vma_heap *heap, struct util_vma_hole *hole)
+{
+   rb_tree_insert(&heap->holes_by_offset, &hole->offset_node,
+                  util_vma_hole_offset_cmp);
+   rb_tree_insert(&heap->holes_by_size, &hole->size_node,
+                  util_vma_hole_size_cmp);
+   heap->num_holes++;
+}
+
+static void
+util_vma_hole_remove(struct util_vma_heap *heap, struct util_vma_hole *hole)
+{
+   list_del(&hole->link);
+   rb_tree_remove(&heap->holes_by_offset, &hole->offset_node);
+   rb_tree_remove(&heap->holes_by_size, &hole->size_node);
+   heap->num_holes--;
+   free(hole);
+}
+
+/* Changes the bounds of a hole without moving it past its neighbors, so
+ * only its place in the size tree changes.
+ */
+static void
+util_vma_hole_resize(struct util_vma_heap *heap, struct util_vma_hole *hole,
+                     uint64_t offset, uint64_t size)
+{
+   rb_tree_remove(&heap->holes_by_size, &hole->size_node);
+   hole->offset = offset;
+   hole->size = size;
+   rb_tree_insert(&heap->holes_by_size, &hole->size_node,
+                  util_vma_hole_size_cmp);
+   rb_tree_update_augmented(&heap->holes_by_offset, &hole->offset_node);
+}
+
 void
 util_vma_heap_init(struct util_vma_heap *heap,
                    uint64_t start, uint64_t size)
 {
    list_inithead(&heap->holes);
+   rb_tree_init_augmented(&heap->holes_by_offset, util_vma_hole_augment);
+   rb_tree_init(&heap->holes_by_size);
+   heap->fit = UTIL_VMA_HEAP_FIRST_FIT;
+   heap->free_size = 0;
+   heap->num_holes = 0;
    util_vma_heap_free(heap, start, size);
 }
 
@@ -57,7 +148,8 @@ util_vma_heap_finish(struct util_vma_heap *heap)
 static void
 util_vma_heap_validate(struct util_vma_heap *heap)
 {
-   uint64_t prev_offset = 0;
+   uint64_t prev_offset = 0, free_size = 0;
+   uint32_t num_holes = 0;
    util_vma_foreach_hole(hole, heap) {
       assert(hole->offset > 0);
       assert(hole->size > 0);
@@ -78,12 +170,121 @@ util_vma_heap_validate(struct util_vma_heap *heap)
                 hole->size + hole->offset < prev_offset);
       }
       prev_offset = hole->offset;
+      free_size += hole->size;
+      num_holes++;
+
+      uint64_t max_size = hole->size;
+      if (hole->offset_node.left)
+         max_size = MAX2(max_size, util_vma_hole_by_offset(hole->offset_node.left)->max_size);
+      if (hole->offset_node.right)
+         max_size = MAX2(max_size, util_vma_hole_by_offset(hole->offset_node.right)->max_size);
+      assert(hole->max_size == max_size);
    }
+
+   assert(heap->free_size == free_size);
+   assert(heap->num_holes == num_holes);
 }
 #else
 #define util_vma_heap_validate(heap)
 #endif
 
+/* Returns the highest offset where an allocation fits in the hole, or 0. */
+static uint64_t
+util_vma_hole_fit(const struct util_vma_hole *hole,
+                  uint64_t size, uint64_t alignment)
+{
+   if (size > hole->size)
+      return 0;
+
+   /* Compute the offset as the highest address where a chunk of the given
+    * size can be without going over the top of the hole.
+    *
+    * This calculation is known to not overflow because we know that
+    * hole->size + hole->offset can only overflow to 0 and size > 0.
+    */
+   uint64_t offset = (hole->size - size) + hole->offset;
+
+   /* Align the offset.  We align down and not up because we are allocating
+    * from the top of the hole and not the bottom.
+    */
+   offset = (offset / alignment) * alignment;
+
+   return offset >= hole->offset ? offset : 0;
+}
+
+/* The smallest hole with at least the given size. */
+static struct util_vma_hole *
+util_vma_smallest_hole(struct util_vma_heap *heap, uint64_t size)
+{
+   struct rb_node *node = heap->holes_by_size.root;
+   struct util_vma_hole *best = NULL;
+
+   while (node != NULL) {
+      struct util_vma_hole *hole = util_vma_hole_by_size(node);
+
+      if (hole->size >= size) {
+         best = hole;
+         node = node->left;
+      } else {
+         node = node->right;
+      }
+   }
+
+   return best;
+}
+
+/* The highest hole in the subtree where the allocation fits.  Subtrees with
+ * no hole large enough are skipped, so unless alignment rules out the first
+ * candidates, this is logarithmic.
+ */
+static struct util_vma_hole *
+util_vma_highest_fit(struct rb_node *node, uint64_t size,
+                     uint64_t alignment, uint64_t *offset)
+{
+   if (node == NULL || util_vma_hole_by_offset(node)->max_size < size)
+      return NULL;
+
+   struct util_vma_hole *hole =
+      util_vma_highest_fit(node->right, size, alignment, offset);
+   if (hole != NULL)
+      return hole;
+
+   hole = util_vma_hole_by_offset(node);
+   *offset = util_vma_hole_fit(hole, size, alignment);
+   if (*offset != 0)
+      return hole;
+
+   return util_vma_highest_fit(node->left, size, alignment, offset);
+}
+
+static struct util_vma_hole *
+util_vma_find_hole(struct util_vma_heap *heap, uint64_t size,
+                   uint64_t alignment, uint64_t *offset)
+{
+   if (heap->fit == UTIL_VMA_HEAP_BEST_FIT) {
+      /* Alignment may rule out the first candidates, but every larger hole
+       * comes after them.
+       */
+      struct util_vma_hole *hole = util_vma_smallest_hole(heap, size);
+
+      while (hole != NULL) {
+         struct rb_node *next;
+
+         *offset = util_vma_hole_fit(hole, size, alignment);
+         if (*offset != 0)
+            return hole;
+
+         next = rb_node_next(&hole->size_node);
+         hole = next ? util_vma_hole_by_size(next) : NULL;
+      }
+   } else {
+      return util_vma_highest_fit(heap->holes_by_offset.root, size,
+                                  alignment, offset);
+   }
+
+   return NULL;
+}
+
 uint64_t
 util_vma_heap_alloc(struct util_vma_heap *heap,
                     uint64_t size, uint64_t alignment)
@@ -94,75 +295,81 @@ util_vma_heap_alloc(struct util_vma_heap *heap,
 
    util_vma_heap_validate(heap);
 
-   util_vma_foreach_hole_safe(hole, heap) {
-      if (size > hole->size)
-         continue;
+   uint64_t offset;
+   struct util_vma_hole *hole =
+      util_vma_find_hole(heap, size, alignment, &offset);
 
-      /* Compute the offset as the highest address where a chunk of the given
-       * size can be without going over the top of the hole.
-       *
-       * This calculation is known to not overflow because we know that
-       * hole->size + hole->offset can only overflow to 0 and size > 0.
-       */
-      uint64_t offset = (hole->size - size) + hole->offset;
+   /* Failed to allocate */
+   if (hole == NULL)
+      return 0;
 
-      /* Align the offset.  We align down and not up because we are allocating
-       * from the top of the hole and not the bottom.
-       */
-      offset = (offset / alignment) * alignment;
+   heap->free_size -= size;
 
-      if (offset < hole->offset)
-         continue;
+   if (offset == hole->offset && size == hole->size) {
+      /* Just get rid of the hole. */
+      util_vma_hole_remove(heap, hole);
+      util_vma_heap_validate(heap);
+      return offset;
+   }
 
-      if (offset == hole->offset && size == hole->size) {
-         /* Just get rid of the hole. */
-         list_del(&hole->link);
-         free(hole);
-         util_vma_heap_validate(heap);
-         return offset;
-      }
+   assert(offset - hole->offset <= hole->size - size);
+   uint64_t waste = (hole->size - size) - (offset - hole->offset);
+   if (waste == 0) {
+      /* We allocated at the top.  Shrink the hole down. */
+      util_vma_hole_resize(heap, hole, hole->offset, hole->size - size);
+      util_vma_heap_validate(heap);
+      return offset;
+   }
 
-      assert(offset - hole->offset <= hole->size - size);
-      uint64_t waste = (hole->size - size) - (offset - hole->offset);
-      if (waste == 0) {
-         /* We allocated at the top.  Shrink the hole down. */
-         hole->size -= size;
-         util_vma_heap_validate(heap);
-         return offset;
-      }
+   if (offset == hole->offset) {
+      /* We allocated at the bottom. Shrink the hole up. */
+      util_vma_hole_resize(heap, hole, hole->offset + size, hole->size - size);
+      util_vma_heap_validate(heap);
+      return offset;
+   }
 
-      if (offset == hole->offset) {
-         /* We allocated at the bottom. Shrink the hole up. */
-         hole->offset += size;
-         hole->size -= size;
-         util_vma_heap_validate(heap);
-         return offset;
-      }
+   /* We allocated in the middle.  We need to split the old hole into two
+    * holes, one high and one low.
+    */
+   struct util_vma_hole *high_hole = calloc(1, sizeof(*hole));
+   high_hole->offset = offset + size;
+   high_hole->size = waste;
 
-      /* We allocated in the middle.  We need to split the old hole into two
-       * holes, one high and one low.
-       */
-      struct util_vma_hole *high_hole = calloc(1, sizeof(*hole));
-      high_hole->offset = offset + size;
-      high_hole->size = waste;
+   /* Adjust the hole to be the amount of space left at he bottom of the
+    * original hole.
+    */
+   util_vma_hole_resize(heap, hole, hole->offset, offset - hole->offset);
 
-      /* Adjust the hole to be the amount of space left at he bottom of the
-       * original hole.
-       */
-      hole->size = offset - hole->offset;
+   /* Place the new hole before the old hole so that the list is in order
+    * from high to low.
+    */
+   list_addtail(&high_hole->link, &hole->link);
+   util_vma_hole_insert(heap, high_hole);
 
-      /* Place the new hole before the old hole so that the list is in order
-       * from high to low.
-       */
-      list_addtail(&high_hole->link, &hole->link);
+   util_vma_heap_validate(heap);
 
-      util_vma_heap_validate(heap);
+   return offset;
+}
 
-      return offset;
+/* The highest hole starting at or below offset. */
+static struct util_vma_hole *
+util_vma_hole_below(struct util_vma_heap *heap, uint64_t offset)
+{
+   struct rb_node *node = heap->holes_by_offset.root;
+   struct util_vma_hole *below = NULL;
+
+   while (node != NULL) {
+      struct util_vma_hole *hole = util_vma_hole_by_offset(node);
+
+      if (hole->offset <= offset) {
+         below = hole;
+         node = node->right;
+      } else {
+         node = node->left;
+      }
    }
 
-   /* Failed to allocate */
-   return 0;
+   return below;
 }
 
 void
@@ -185,14 +392,13 @@ util_vma_heap_free(struct util_vma_heap *heap,
    util_vma_heap_validate(heap);
 
    /* Find immediately higher and lower holes if they exist. */
-   struct util_vma_hole *high_hole = NULL, *low_hole = NULL;
-   util_vma_foreach_hole(hole, heap) {
-      if (hole->offset <= offset) {
-         low_hole = hole;
-         break;
-      }
-      high_hole = hole;
-   }
+   struct util_vma_hole *high_hole, *low_hole;
+   struct rb_node *high_node;
+
+   low_hole = util_vma_hole_below(heap, offset);
+   high_node = low_hole ? rb_node_next(&low_hole->offset_node) :
+                          rb_tree_first(&heap->holes_by_offset);
+   high_hole = high_node ? util_vma_hole_by_offset(high_node) : NULL;
 
    if (high_hole)
       assert(offset + size <= high_hole->offset);
@@ -204,18 +410,22 @@ util_vma_heap_free(struct util_vma_heap *heap,
    }
    bool low_adjacent = low_hole && low_hole->offset + low_hole->size == offset;
 
+   heap->free_size += size;
+
    if (low_adjacent && high_adjacent) {
       /* Merge the two holes */
-      low_hole->size += size + high_hole->size;
-      list_del(&high_hole->link);
-      free(high_hole);
+      uint64_t high_size = high_hole->size;
+
+      util_vma_hole_remove(heap, high_hole);
+      util_vma_hole_resize(heap, low_hole, low_hole->offset,
+                           low_hole->size + size + high_size);
    } else if (low_adjacent) {
       /* Merge into the low hole */
-      low_hole->size += size;
+      util_vma_hole_resize(heap, low_hole, low_hole->offset,
+                           low_hole->size + size);
    } else if (high_adjacent) {
       /* Merge into the high hole */
-      high_hole->offset = offset;
-      high_hole->size += size;
+      util_vma_hole_resize(heap, high_hole, offset, high_hole->size + size);
    } else {
       /* Neither hole is adjacent; make a new one */
       struct util_vma_hole *hole = calloc(1, sizeof(*hole));
@@ -228,7 +438,21 @@ util_vma_heap_free(struct util_vma_heap *heap,
          list_add(&hole->link, &high_hole->link);
       else
          list_add(&hole->link, &heap->holes);
+      util_vma_hole_insert(heap, hole);
    }
 
    util_vma_heap_validate(heap);
 }
+
+void
+util_vma_heap_get_stats(struct util_vma_heap *heap,
+                        struct util_vma_heap_stats *stats)
+{
+   struct rb_node *largest = rb_tree_last(&heap->holes_by_size);
+
+   stats->free_size = heap->free_size;
+   stats->num_holes = heap->num_holes;
+   stats->largest_hole = largest ? util_vma_hole_by_size(largest)->size : 0;
+   stats->fragmentation = heap->free_size == 0 ? 0.0 :
+      1.0 - (double) stats->largest_hole / heap->free_size;
+}
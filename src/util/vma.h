@@ -27,13 +27,50 @@
 #include <stdint.h>
 
 #include "list.h"
+#include "rb_tree.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+enum util_vma_heap_fit {
+   /* Take the highest hole that fits.  This is the default. */
+   UTIL_VMA_HEAP_FIRST_FIT,
+
+   /* Take the smallest hole that fits, which keeps large holes around for
+    * large allocations.
+    */
+   UTIL_VMA_HEAP_BEST_FIT,
+};
+
 struct util_vma_heap {
+   /* Holes, sorted from high to low offset.  The trees index the same
+    * holes by offset and by size, and the offset tree tracks the largest
+    * hole under each node for first fit.
+    */
    struct list_head holes;
+   struct rb_tree holes_by_offset;
+   struct rb_tree holes_by_size;
+
+   /* How util_vma_heap_alloc() picks a hole, can be changed at any time. */
+   enum util_vma_heap_fit fit;
+
+   uint64_t free_size;
+   uint32_t num_holes;
+};
+
+struct util_vma_heap_stats {
+   /* Free space, and how many holes it is split in. */
+   uint64_t free_size;
+   uint32_t num_holes;
+
+   uint64_t largest_hole;
+
+   /* 1 - largest_hole / free_size: 0 when all the free space is in one
+    * hole, close to 1 when no allocation much bigger than the average hole
+    * can succeed.
+    */
+   double fragmentation;
 };
 
 void util_vma_heap_init(struct util_vma_heap *heap,
@@ -46,6 +83,9 @@ uint64_t util_vma_heap_alloc(struct util_vma_heap *heap,
 void util_vma_heap_free(struct util_vma_heap *heap,
                         uint64_t offset, uint64_t size);
 
+void util_vma_heap_get_stats(struct util_vma_heap *heap,
+                             struct util_vma_heap_stats *stats);
+
 #ifdef __cplusplus
 } /* extern C */
 #endif